@@ -0,0 +1,136 @@
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+
+#include <string.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include "libavutil/mem.h"
+
+#include "audiofifo.h"
+
+
+int audio_frame_adapter_init(AudioFrameAdapter *adapter, const AVCodecContext *encodeContext) {
+    int ret;
+
+    memset(adapter, 0, sizeof(*adapter));
+    adapter->format = encodeContext->sample_fmt;
+    adapter->sampleRate = encodeContext->sample_rate;
+    adapter->nextPts = AV_NOPTS_VALUE;
+
+    if (!(encodeContext->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        adapter->frameSize = encodeContext->frame_size;
+    adapter->smallLastFrame = !!(encodeContext->codec->capabilities & AV_CODEC_CAP_SMALL_LAST_FRAME);
+
+    if ((ret = av_channel_layout_copy(&adapter->layout, &encodeContext->ch_layout)) < 0)
+        return ret;
+
+    if (adapter->frameSize <= 0) {
+        adapter->frameSize = 0;
+        return 0;
+    }
+
+    adapter->fifo = av_audio_fifo_alloc(adapter->format, adapter->layout.nb_channels, adapter->frameSize * 2);
+    adapter->outputFrame = av_frame_alloc();
+    if (!adapter->fifo || !adapter->outputFrame)
+        return AVERROR(ENOMEM);
+
+    adapter->outputFrame->format = adapter->format;
+    adapter->outputFrame->sample_rate = adapter->sampleRate;
+    adapter->outputFrame->nb_samples = adapter->frameSize;
+    if ((ret = av_channel_layout_copy(&adapter->outputFrame->ch_layout, &adapter->layout)) < 0)
+        return ret;
+
+    av_log(NULL, AV_LOG_INFO, "Re-chunking audio into %d sample frames\n", adapter->frameSize);
+    return av_frame_get_buffer(adapter->outputFrame, 0);
+}
+
+
+int audio_frame_adapter_send(AudioFrameAdapter *adapter, AVFrame *input) {
+    int ret;
+
+    if (!input) {
+        adapter->flushing = 1;
+        return 0;
+    }
+
+    if (adapter->pendingFrame)
+        return AVERROR(EAGAIN);
+
+    /* Already the right size and nothing queued ahead of it: no copy needed. */
+    if (!adapter->frameSize ||
+        (input->nb_samples == adapter->frameSize && av_audio_fifo_size(adapter->fifo) == 0)) {
+        adapter->pendingFrame = input;
+        return 0;
+    }
+
+    if (av_audio_fifo_size(adapter->fifo) == 0)
+        adapter->nextPts = input->pts;
+
+    ret = av_audio_fifo_write(adapter->fifo, (void **)input->extended_data, input->nb_samples);
+    if (ret < input->nb_samples) {
+        av_log(NULL, AV_LOG_ERROR, "Could not queue audio samples\n");
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+int audio_frame_adapter_receive(AudioFrameAdapter *adapter, AVFrame **output) {
+    AVFrame *frame = adapter->outputFrame;
+    int available;
+    int samples;
+    int ret;
+
+    *output = NULL;
+
+    if (adapter->pendingFrame) {
+        *output = adapter->pendingFrame;
+        adapter->pendingFrame = NULL;
+        return 0;
+    }
+
+    available = adapter->fifo ? av_audio_fifo_size(adapter->fifo) : 0;
+    if (available >= adapter->frameSize && available > 0) {
+        samples = adapter->frameSize;
+    } else if (adapter->flushing && available > 0) {
+        samples = available;
+    } else {
+        return adapter->flushing ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+
+    /* The encoder may still hold a reference to the previous chunk. */
+    frame->nb_samples = adapter->frameSize;
+    if ((ret = av_frame_make_writable(frame)) < 0)
+        return ret;
+
+    ret = av_audio_fifo_read(adapter->fifo, (void **)frame->extended_data, samples);
+    if (ret < samples) {
+        av_log(NULL, AV_LOG_ERROR, "Could not read audio samples from the FIFO\n");
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+
+    if (samples < adapter->frameSize && !adapter->smallLastFrame) {
+        av_samples_set_silence(frame->extended_data, samples, adapter->frameSize - samples,
+                               adapter->layout.nb_channels, adapter->format);
+    } else {
+        frame->nb_samples = samples;
+    }
+
+    frame->pts = adapter->nextPts;
+    if (adapter->nextPts != AV_NOPTS_VALUE)
+        adapter->nextPts += samples;
+
+    *output = frame;
+    return 0;
+}
+
+
+void audio_frame_adapter_uninit(AudioFrameAdapter *adapter) {
+    av_audio_fifo_free(adapter->fifo);
+    adapter->fifo = NULL;
+    av_frame_free(&adapter->outputFrame);
+    av_channel_layout_uninit(&adapter->layout);
+    adapter->pendingFrame = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef AUDIOFIFO_H
+#define AUDIOFIFO_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+
+/*
+ * Re-chunks audio into the fixed frame size an encoder asks for (1024 samples
+ * for AAC).
+ *
+ * Frames that already have the right size while nothing is buffered are handed
+ * straight back without touching the FIFO. Everything else is queued and read
+ * out in frame_size pieces into one preallocated frame. Timestamps are in
+ * samples (the encoder time base): the FIFO head takes the pts of the first
+ * frame queued into an empty FIFO and counts on from there. Encoders with a
+ * variable frame size get every frame passed through unchanged.
+ */
+
+typedef struct AudioFrameAdapter {
+    AVAudioFifo *fifo;
+    AVFrame *outputFrame;
+    AVFrame *pendingFrame;
+    int frameSize;
+    int smallLastFrame;
+    int flushing;
+
+    enum AVSampleFormat format;
+    AVChannelLayout layout;
+    int sampleRate;
+    int64_t nextPts;
+} AudioFrameAdapter;
+
+int audio_frame_adapter_init(AudioFrameAdapter *adapter, const AVCodecContext *encodeContext);
+int audio_frame_adapter_send(AudioFrameAdapter *adapter, AVFrame *input);
+int audio_frame_adapter_receive(AudioFrameAdapter *adapter, AVFrame **output);
+void audio_frame_adapter_uninit(AudioFrameAdapter *adapter);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef AVHANDLE_H
+#define AVHANDLE_H
+
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+
+/*
+ * Scope-bound owners for packets, frames, codec contexts, format contexts and
+ * filter graphs.
+ *
+ * In C, a local declared with one of the OWNED_* markers is freed with the
+ * matching libav function when it goes out of scope, on every return path.
+ * TAKE_OWNERSHIP(pointer) moves it out, for storing in a longer-lived struct or
+ * queue, and leaves NULL behind so nothing is freed twice:
+ *
+ *   OWNED_FRAME AVFrame *frame = av_frame_alloc();
+ *   if (!frame || (ret = av_frame_get_buffer(frame, 0)) < 0)
+ *       return ret;
+ *   context->frame = TAKE_OWNERSHIP(frame);
+ *
+ * This relies on the cleanup attribute of GCC and Clang, the compilers the
+ * rest of the tree already assumes.
+ */
+
+#if !defined(__GNUC__)
+#error "avhandle.h needs the cleanup attribute of GCC or Clang"
+#endif
+
+/* The close functions for output contexts only take the pointer, and don't close the IO context. */
+static inline void free_output_context(AVFormatContext **formatContext) {
+    if (!*formatContext)
+        return;
+    if ((*formatContext)->oformat && !((*formatContext)->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&(*formatContext)->pb);
+    avformat_free_context(*formatContext);
+    *formatContext = NULL;
+}
+
+#define OWNED_PACKET __attribute__((cleanup(av_packet_free)))
+#define OWNED_FRAME __attribute__((cleanup(av_frame_free)))
+#define OWNED_CODEC_CONTEXT __attribute__((cleanup(avcodec_free_context)))
+#define OWNED_INPUT_CONTEXT __attribute__((cleanup(avformat_close_input)))
+#define OWNED_OUTPUT_CONTEXT __attribute__((cleanup(free_output_context)))
+#define OWNED_FILTER_GRAPH __attribute__((cleanup(avfilter_graph_free)))
+#define OWNED_FILTER_INOUT __attribute__((cleanup(avfilter_inout_free)))
+
+#define TAKE_OWNERSHIP(pointer) ({ __typeof__(pointer) taken_ = (pointer); (pointer) = NULL; taken_; })
+
+#endif
@@ -0,0 +1,462 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libavutil/timestamp.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "ratecontrol.h"
+#include "interleave.h"
+#include "checkpoint.h"
+
+
+int checkpoint_segment_name(const Checkpoint *checkpoint, int index, char *name, int nameSize) {
+    return snprintf(name, nameSize, "%s.seg%04d.mkv", checkpoint->outputFilename, index);
+}
+
+
+static int checkpoint_load(Checkpoint *checkpoint) {
+    FILE *file = fopen(checkpoint->path, "r");
+    char line[256];
+    char key[64] = "";
+    int segments = -1;
+    long long resumeTime = AV_NOPTS_VALUE;
+
+    if (!file)
+        return 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        sscanf(line, "key=%63s", key);
+        sscanf(line, "segments=%d", &segments);
+        sscanf(line, "resume=%lld", &resumeTime);
+    }
+    fclose(file);
+
+    if (strcmp(key, checkpoint->key) != 0 || segments <= 0 || resumeTime == AV_NOPTS_VALUE) {
+        av_log(NULL, AV_LOG_WARNING, "Ignoring checkpoint %s, it belongs to a different job\n", checkpoint->path);
+        return 0;
+    }
+
+    checkpoint->segmentIndex = segments;
+    checkpoint->resumeTime = resumeTime;
+    return 1;
+}
+
+
+int checkpoint_init(Checkpoint *checkpoint, StreamingContext *decoder, const StreamingParams *streamParameters,
+                    const char *outputFilename) {
+    char contentKey[33];
+    int ret;
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    snprintf(checkpoint->outputFilename, sizeof(checkpoint->outputFilename), "%s", outputFilename);
+    snprintf(checkpoint->path, sizeof(checkpoint->path), "%s.checkpoint", outputFilename);
+    checkpoint->interval = (int64_t)streamParameters->checkpointInterval * AV_TIME_BASE;
+    checkpoint->resumeTime = AV_NOPTS_VALUE;
+    checkpoint->nextBoundary = AV_NOPTS_VALUE;
+
+    /* The first pass cache key covers the input and the encoder settings; the bitrate or quality target is added on top. */
+    if ((ret = rate_control_cache_key(decoder, streamParameters, contentKey, sizeof(contentKey))) < 0)
+        return ret;
+    snprintf(checkpoint->key, sizeof(checkpoint->key), "%s-%d-%d", contentKey, streamParameters->outputBitRate,
+             streamParameters->videoCrf);
+
+    ret = checkpoint_load(checkpoint);
+    if (ret > 0)
+        av_log(NULL, AV_LOG_INFO, "Resuming from checkpoint: %d segments done, continuing at %s\n",
+               checkpoint->segmentIndex, av_ts2timestr(checkpoint->resumeTime, &AV_TIME_BASE_Q));
+    return ret;
+}
+
+
+/* Flush a file, or with O_DIRECTORY a directory's entries, to the disk. */
+static int sync_path(const char *path, int flags) {
+    int fd = open(path, O_RDONLY | flags);
+    int ret = 0;
+
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fsync(fd) < 0)
+        ret = AVERROR(errno);
+    close(fd);
+    return ret;
+}
+
+
+static int sync_parent_directory(const char *path) {
+    char directory[1024];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash)
+        snprintf(directory, sizeof(directory), ".");
+    else if (slash == path)
+        snprintf(directory, sizeof(directory), "/");
+    else
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+    return sync_path(directory, O_DIRECTORY);
+}
+
+
+/*
+ * The temporary file is synced before it's renamed over the checkpoint, and the directory after, so a power loss leaves
+ * either the old checkpoint or the complete new one, never an empty or missing file.
+ */
+int checkpoint_save(const Checkpoint *checkpoint) {
+    char temporaryPath[1040];
+    FILE *file;
+    int ret;
+
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.temp", checkpoint->path);
+    file = fopen(temporaryPath, "w");
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write checkpoint %s\n", temporaryPath);
+        return AVERROR(errno);
+    }
+
+    fprintf(file, "key=%s\nsegments=%d\nresume=%" PRId64 "\n",
+            checkpoint->key, checkpoint->segmentIndex, checkpoint->resumeTime);
+
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write checkpoint %s: %s\n", temporaryPath, strerror(errno));
+        fclose(file);
+        return AVERROR(EIO);
+    }
+    if (fclose(file) != 0 || rename(temporaryPath, checkpoint->path) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write checkpoint %s\n", checkpoint->path);
+        return AVERROR(EIO);
+    }
+    if ((ret = sync_parent_directory(checkpoint->path)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not sync the directory of checkpoint %s: %s\n", checkpoint->path, av_err2str(ret));
+        return ret;
+    }
+    return 0;
+}
+
+
+int checkpoint_seek_input(Checkpoint *checkpoint, StreamingContext *decoder) {
+    int ret;
+
+    if (checkpoint->resumeTime == AV_NOPTS_VALUE)
+        return 0;
+
+    ret = av_seek_frame(decoder->formatContext, -1, checkpoint->resumeTime, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not seek to the checkpoint: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    /* The seek lands on the keyframe at or before the boundary; what decodes before it is dropped. */
+    decoder->resuming = 1;
+    decoder->skipBefore = checkpoint->resumeTime;
+    return 0;
+}
+
+
+/* Start the next segment with the same streams as the encoder's current muxer. */
+int checkpoint_open_segment(Checkpoint *checkpoint, StreamingContext *encoder) {
+    AVFormatContext *previous = encoder->formatContext;
+    AVFormatContext *formatContext = NULL;
+    char name[1100];
+    int ret;
+
+    checkpoint_segment_name(checkpoint, checkpoint->segmentIndex, name, sizeof(name));
+    if ((ret = avformat_alloc_output_context2(&formatContext, NULL, CHECKPOINT_SEGMENT_FORMAT, name)) < 0)
+        return ret;
+
+    for (int i = 0; i < previous->nb_streams; i++) {
+        AVStream *stream = avformat_new_stream(formatContext, NULL);
+        if (!stream) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        if ((ret = avcodec_parameters_copy(stream->codecpar, previous->streams[i]->codecpar)) < 0)
+            goto fail;
+        stream->time_base = previous->streams[i]->time_base;
+    }
+
+    if ((ret = avio_open(&formatContext->pb, name, AVIO_FLAG_WRITE)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open segment %s\n", name);
+        goto fail;
+    }
+
+    if ((ret = avformat_write_header(formatContext, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write the header of segment %s\n", name);
+        goto fail;
+    }
+
+    encoder->formatContext = formatContext;
+    if (encoder->videoStream)
+        encoder->videoStream = formatContext->streams[encoder->videoStream->index];
+    for (int i = 0; i < encoder->nbAudioStreams; i++)
+        encoder->audioTracks[i] = formatContext->streams[encoder->audioTracks[i]->index];
+    if (encoder->audioStream)
+        encoder->audioStream = formatContext->streams[encoder->audioStream->index];
+    avformat_free_context(previous);
+
+    if (encoder->interleaver)
+        return packet_interleaver_set_output(encoder->interleaver, formatContext);
+    return 0;
+
+    fail:
+    avio_closep(&formatContext->pb);
+    avformat_free_context(formatContext);
+    return ret;
+}
+
+
+int checkpoint_close_segment(StreamingContext *encoder) {
+    int ret;
+
+    if (encoder->interleaver && (ret = packet_interleaver_flush(encoder->interleaver)) < 0)
+        return ret;
+    if ((ret = av_write_trailer(encoder->formatContext)) < 0)
+        return ret;
+    return avio_closep(&encoder->formatContext->pb);
+}
+
+
+int checkpoint_rollover(Checkpoint *checkpoint, StreamingContext *encoder, AVPacket *packet) {
+    AVRational previousTimeBase = encoder->videoStream->time_base;
+    char name[1100];
+    int64_t time;
+    int ret;
+
+    if (packet->stream_index != encoder->videoStream->index || !(packet->flags & AV_PKT_FLAG_KEY) ||
+        packet->pts == AV_NOPTS_VALUE)
+        return 0;
+
+    time = av_rescale_q(packet->pts, previousTimeBase, AV_TIME_BASE_Q);
+    if (checkpoint->nextBoundary == AV_NOPTS_VALUE) {
+        checkpoint->nextBoundary = time + checkpoint->interval;
+        return 0;
+    }
+    if (time < checkpoint->nextBoundary)
+        return 0;
+
+    if ((ret = checkpoint_close_segment(encoder)) < 0)
+        return ret;
+    checkpoint_segment_name(checkpoint, checkpoint->segmentIndex, name, sizeof(name));
+    if ((ret = sync_path(name, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not sync checkpoint segment %s: %s\n", name, av_err2str(ret));
+        return ret;
+    }
+
+    /* Only now is everything before this keyframe on disk. */
+    checkpoint->segmentIndex++;
+    checkpoint->resumeTime = time;
+    if ((ret = checkpoint_save(checkpoint)) < 0)
+        return ret;
+
+    if ((ret = checkpoint_open_segment(checkpoint, encoder)) < 0)
+        return ret;
+
+    av_packet_rescale_ts(packet, previousTimeBase, encoder->videoStream->time_base);
+    checkpoint->nextBoundary = time + checkpoint->interval;
+
+    av_log(NULL, AV_LOG_INFO, "Checkpoint: segment %d starts at %s\n",
+           checkpoint->segmentIndex, av_ts2timestr(time, &AV_TIME_BASE_Q));
+    return 0;
+}
+
+
+int checkpoint_finish(Checkpoint *checkpoint) {
+    int count = checkpoint->segmentIndex + 1;
+    const char **segments;
+    char (*names)[1100];
+    int ret;
+
+    segments = av_calloc(count, sizeof(*segments));
+    names = av_calloc(count, sizeof(*names));
+    if (!segments || !names) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int i = 0; i < count; i++) {
+        checkpoint_segment_name(checkpoint, i, names[i], sizeof(names[i]));
+        segments[i] = names[i];
+    }
+
+    if ((ret = concat_segments(segments, count, checkpoint->outputFilename)) < 0)
+        goto end;
+
+    for (int i = 0; i < count; i++)
+        remove(names[i]);
+    remove(checkpoint->path);
+
+    end:
+    av_free(segments);
+    av_free(names);
+    return ret;
+}
+
+
+int concat_segments(const char **segments, int count, const char *outputFilename) {
+    AVFormatContext *outputContext = NULL;
+    AVFormatContext *inputContext = NULL;
+    AVPacket *packet = NULL;
+    int64_t *lastDts = NULL;
+    int ret = 0;
+
+    packet = av_packet_alloc();
+    if (!packet)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < count; i++) {
+        if ((ret = open_media(&inputContext, segments[i])) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not open segment %s\n", segments[i]);
+            goto end;
+        }
+
+        if (!outputContext) {
+            if ((ret = avformat_alloc_output_context2(&outputContext, NULL, NULL, outputFilename)) < 0)
+                goto end;
+
+            for (int j = 0; j < inputContext->nb_streams; j++) {
+                AVStream *stream = avformat_new_stream(outputContext, NULL);
+                if (!stream) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                if ((ret = avcodec_parameters_copy(stream->codecpar, inputContext->streams[j]->codecpar)) < 0)
+                    goto end;
+                stream->codecpar->codec_tag = 0;
+                stream->time_base = inputContext->streams[j]->time_base;
+            }
+
+            lastDts = av_malloc_array(outputContext->nb_streams, sizeof(*lastDts));
+            if (!lastDts) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            for (int j = 0; j < outputContext->nb_streams; j++)
+                lastDts[j] = INT64_MIN;
+
+            if (!(outputContext->oformat->flags & AVFMT_NOFILE) &&
+                (ret = avio_open(&outputContext->pb, outputFilename, AVIO_FLAG_WRITE)) < 0)
+                goto end;
+            if ((ret = avformat_write_header(outputContext, NULL)) < 0)
+                goto end;
+        }
+
+        while ((ret = av_read_frame(inputContext, packet)) >= 0) {
+            AVStream *inputStream = inputContext->streams[packet->stream_index];
+            int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+            if (packet->stream_index >= outputContext->nb_streams) {
+                av_packet_unref(packet);
+                continue;
+            }
+
+            /* Segments may overlap by the audio that was queued when they were cut; keep the first copy. */
+            if (dts != AV_NOPTS_VALUE) {
+                dts = av_rescale_q(dts, inputStream->time_base, AV_TIME_BASE_Q);
+                if (dts <= lastDts[packet->stream_index]) {
+                    av_packet_unref(packet);
+                    continue;
+                }
+                lastDts[packet->stream_index] = dts;
+            }
+
+            av_packet_rescale_ts(packet, inputStream->time_base, outputContext->streams[packet->stream_index]->time_base);
+            packet->pos = -1;
+            if ((ret = av_interleaved_write_frame(outputContext, packet)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Error while joining segment %s: %s\n", segments[i], av_err2str(ret));
+                goto end;
+            }
+        }
+        if (ret != AVERROR_EOF)
+            goto end;
+        ret = 0;
+
+        avformat_close_input(&inputContext);
+    }
+
+    if (outputContext)
+        ret = av_write_trailer(outputContext);
+
+    end:
+    av_packet_free(&packet);
+    av_free(lastDts);
+    avformat_close_input(&inputContext);
+    if (outputContext && !(outputContext->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&outputContext->pb);
+    avformat_free_context(outputContext);
+    return ret;
+}
+
+
+static int next_video_packet(AVFormatContext *formatContext, int videoIndex, AVPacket *packet) {
+    int ret;
+
+    while ((ret = av_read_frame(formatContext, packet)) >= 0) {
+        if (packet->stream_index == videoIndex)
+            return 0;
+        av_packet_unref(packet);
+    }
+    return ret;
+}
+
+
+int compare_video_packets(const char *firstFilename, const char *secondFilename) {
+    AVFormatContext *first = NULL;
+    AVFormatContext *second = NULL;
+    AVPacket *firstPacket = av_packet_alloc();
+    AVPacket *secondPacket = av_packet_alloc();
+    int firstIndex, secondIndex;
+    int64_t packets = 0;
+    int mismatches = 0;
+    int ret;
+
+    if (!firstPacket || !secondPacket) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = open_media(&first, firstFilename)) < 0 || (ret = open_media(&second, secondFilename)) < 0)
+        goto end;
+    if ((ret = firstIndex = av_find_best_stream(first, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0 ||
+        (ret = secondIndex = av_find_best_stream(second, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0)
+        goto end;
+
+    while (1) {
+        int firstRet = next_video_packet(first, firstIndex, firstPacket);
+        int secondRet = next_video_packet(second, secondIndex, secondPacket);
+
+        if (firstRet < 0 || secondRet < 0) {
+            /* Whatever is left in the longer file counts against it. */
+            if (firstRet >= 0 || secondRet >= 0) {
+                mismatches++;
+                av_log(NULL, AV_LOG_ERROR, "Video streams differ in length after %" PRId64 " packets\n", packets);
+            }
+            break;
+        }
+
+        if (firstPacket->size != secondPacket->size ||
+            memcmp(firstPacket->data, secondPacket->data, firstPacket->size) != 0) {
+            if (mismatches < 10)
+                av_log(NULL, AV_LOG_ERROR, "Video packet %" PRId64 " differs\n", packets);
+            mismatches++;
+        }
+        packets++;
+        av_packet_unref(firstPacket);
+        av_packet_unref(secondPacket);
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Compared %" PRId64 " video packets: %d differ\n", packets, mismatches);
+    ret = mismatches;
+
+    end:
+    av_packet_free(&firstPacket);
+    av_packet_free(&secondPacket);
+    avformat_close_input(&first);
+    avformat_close_input(&second);
+    return ret;
+}
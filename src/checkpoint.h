@@ -0,0 +1,57 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <libavformat/avformat.h>
+
+#include "testbed.h"
+
+/*
+ * Checkpoint and resume for long transcodes.
+ *
+ * With checkpointing on, the job writes a series of Matroska segments next to
+ * the output instead of the output itself. A new segment starts at the first
+ * video keyframe past each interval; the previous one is finished with its
+ * trailer first, so every segment on disk before the current one is complete.
+ * The finished segment is synced to disk, and the checkpoint file, written to a
+ * temporary file that is synced, renamed over the old one, and its directory
+ * synced in turn, then records how many segments are complete and the
+ * source time the next one starts at, together with the job key (input
+ * content, encoder settings and bitrate) it belongs to.
+ *
+ * A restarted job with the same key seeks the input to that time, drops
+ * decoded frames before it, and writes segments from there on. At the end
+ * the segments are stream copied into the real output and removed.
+ *
+ * Encoders restart from a clean state at the boundary. Only for intra-only
+ * video, such as the default AVC-Intra settings, is a resumed output identical
+ * to an uninterrupted run, which compare_video_packets() checks packet by
+ * packet. With longer GOPs every segment still starts on a keyframe and plays
+ * through, but the GOP structure and rate control around each resume point
+ * differ from an uninterrupted run's.
+ */
+
+#define CHECKPOINT_SEGMENT_FORMAT "matroska"
+
+typedef struct Checkpoint {
+    char path[1024];
+    char outputFilename[1024];
+    char key[64];
+    int segmentIndex;
+    int64_t resumeTime;
+    int64_t interval;
+    int64_t nextBoundary;
+} Checkpoint;
+
+int checkpoint_init(Checkpoint *checkpoint, StreamingContext *decoder, const StreamingParams *streamParameters,
+                    const char *outputFilename);
+int checkpoint_segment_name(const Checkpoint *checkpoint, int index, char *name, int nameSize);
+int checkpoint_save(const Checkpoint *checkpoint);
+int checkpoint_seek_input(Checkpoint *checkpoint, StreamingContext *decoder);
+int checkpoint_open_segment(Checkpoint *checkpoint, StreamingContext *encoder);
+int checkpoint_close_segment(StreamingContext *encoder);
+int checkpoint_rollover(Checkpoint *checkpoint, StreamingContext *encoder, AVPacket *packet);
+int checkpoint_finish(Checkpoint *checkpoint);
+int concat_segments(const char **segments, int count, const char *outputFilename);
+int compare_video_packets(const char *firstFilename, const char *secondFilename);
+
+#endif
@@ -0,0 +1,323 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "complexity.h"
+
+/* The probe encodes at 1/COMPLEXITY_PROBE_SCALE of the output width and height. */
+#define COMPLEXITY_PROBE_SCALE 4
+#define COMPLEXITY_DEFAULT_SEGMENTS 8
+#define COMPLEXITY_DEFAULT_SEGMENT_FRAMES 12
+
+
+typedef struct ComplexityProbe {
+    AVFormatContext *formatContext;
+    AVCodecContext *decoderContext;
+    AVCodecContext *probeContext;
+    struct SwsContext *scaler;
+    AVFrame *scaledFrame;
+    AVPacket *probePacket;
+    int videoIndex;
+    int segmentStart;
+    int64_t nextPts;
+    int64_t totalBits;
+    int encodedFrames;
+} ComplexityProbe;
+
+
+static int encode_probe_frame(ComplexityProbe *probe, AVFrame *frame) {
+    int response = avcodec_send_frame(probe->probeContext, frame);
+
+    while (response >= 0) {
+        response = avcodec_receive_packet(probe->probeContext, probe->probePacket);
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            return 0;
+        } else if (response < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while receiving packet from probe encoder: %s\n", av_err2str(response));
+            return response;
+        }
+
+        probe->totalBits += 8 * (int64_t)probe->probePacket->size;
+        probe->encodedFrames++;
+        av_packet_unref(probe->probePacket);
+    }
+    return response;
+}
+
+
+static int probe_decoded_frame(ComplexityProbe *probe, AVFrame *decodedFrame) {
+    int ret;
+
+    probe->scaler = sws_getCachedContext(probe->scaler,
+                                         decodedFrame->width, decodedFrame->height, decodedFrame->format,
+                                         probe->probeContext->width, probe->probeContext->height, probe->probeContext->pix_fmt,
+                                         SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (!probe->scaler) {
+        av_log(NULL, AV_LOG_ERROR, "Could not create scaler for complexity probe\n");
+        return AVERROR(EINVAL);
+    }
+
+    if ((ret = av_frame_make_writable(probe->scaledFrame)) < 0)
+        return ret;
+
+    sws_scale(probe->scaler, (const uint8_t * const *)decodedFrame->data, decodedFrame->linesize,
+              0, decodedFrame->height, probe->scaledFrame->data, probe->scaledFrame->linesize);
+
+    probe->scaledFrame->pts = probe->nextPts++;
+    probe->scaledFrame->pict_type = probe->segmentStart ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    probe->segmentStart = 0;
+
+    return encode_probe_frame(probe, probe->scaledFrame);
+}
+
+
+static int decode_segment(ComplexityProbe *probe, AVPacket *packet, AVFrame *frame, int maxFrames) {
+    int decodedFrames = 0;
+    int ret = 0;
+
+    probe->segmentStart = 1;
+
+    while (decodedFrames < maxFrames && (ret = av_read_frame(probe->formatContext, packet)) >= 0) {
+        if (packet->stream_index != probe->videoIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        ret = avcodec_send_packet(probe->decoderContext, packet);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while sending packet to complexity decoder: %s\n", av_err2str(ret));
+            return ret;
+        }
+
+        while (decodedFrames < maxFrames) {
+            ret = avcodec_receive_frame(probe->decoderContext, frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
+            } else if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Error while receiving frame from complexity decoder: %s\n", av_err2str(ret));
+                return ret;
+            }
+
+            ret = probe_decoded_frame(probe, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                return ret;
+            decodedFrames++;
+        }
+    }
+
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        return ret;
+
+    return decodedFrames;
+}
+
+
+static int open_probe_encoder(ComplexityProbe *probe, int width, int height, AVRational frameRate, int segmentFrames) {
+    const AVCodec *probeCodec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    int ret;
+
+    if (!probeCodec) {
+        av_log(NULL, AV_LOG_ERROR, "Complexity analysis needs an H.264 encoder\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    probe->probeContext = avcodec_alloc_context3(probeCodec);
+    if (!probe->probeContext)
+        return AVERROR(ENOMEM);
+
+    probe->probeContext->width = FFALIGN(FFMAX(width / COMPLEXITY_PROBE_SCALE, 16), 2);
+    probe->probeContext->height = FFALIGN(FFMAX(height / COMPLEXITY_PROBE_SCALE, 16), 2);
+    probe->probeContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    probe->probeContext->time_base = av_inv_q(frameRate);
+    probe->probeContext->framerate = frameRate;
+    probe->probeContext->gop_size = segmentFrames;
+    probe->probeContext->thread_count = 0;
+
+    if (probe->probeContext->priv_data) {
+        av_opt_set(probe->probeContext->priv_data, "preset", "ultrafast", 0);
+        av_opt_set_double(probe->probeContext->priv_data, "crf", COMPLEXITY_PROBE_CRF, 0);
+    }
+
+    if ((ret = avcodec_open2(probe->probeContext, probeCodec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open complexity probe encoder\n");
+        return ret;
+    }
+
+    probe->scaledFrame = av_frame_alloc();
+    probe->probePacket = av_packet_alloc();
+    if (!probe->scaledFrame || !probe->probePacket)
+        return AVERROR(ENOMEM);
+
+    probe->scaledFrame->width = probe->probeContext->width;
+    probe->scaledFrame->height = probe->probeContext->height;
+    probe->scaledFrame->format = probe->probeContext->pix_fmt;
+
+    return av_frame_get_buffer(probe->scaledFrame, 0);
+}
+
+
+int analyse_complexity(const char *inputFilename, const StreamingParams *streamParameters, ComplexityResult *result) {
+    ComplexityProbe probe = {0};
+    const AVCodec *decoderCodec = NULL;
+    AVStream *videoStream;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    AVRational frameRate;
+    int64_t analysisStart = av_gettime_relative();
+    int64_t startTime;
+    int segments = streamParameters->complexitySegments > 0 ? streamParameters->complexitySegments : COMPLEXITY_DEFAULT_SEGMENTS;
+    int segmentFrames = streamParameters->complexitySegmentFrames > 0 ? streamParameters->complexitySegmentFrames : COMPLEXITY_DEFAULT_SEGMENT_FRAMES;
+    int targetWidth, targetHeight;
+    double pixelRatio, estimatedBitRate;
+    int ret;
+
+    memset(result, 0, sizeof(*result));
+
+    if ((ret = open_media(&probe.formatContext, inputFilename)) < 0)
+        goto end;
+
+    if ((ret = av_find_best_stream(probe.formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &decoderCodec, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "No video stream to analyse in %s\n", inputFilename);
+        goto end;
+    }
+    probe.videoIndex = ret;
+    videoStream = probe.formatContext->streams[probe.videoIndex];
+
+    for (int i = 0; i < probe.formatContext->nb_streams; i++) {
+        if (i != probe.videoIndex)
+            probe.formatContext->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    probe.decoderContext = avcodec_alloc_context3(decoderCodec);
+    if (!probe.decoderContext) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = avcodec_parameters_to_context(probe.decoderContext, videoStream->codecpar)) < 0)
+        goto end;
+
+    /* Only an estimate is needed, so trade decode accuracy for speed wherever the decoder allows it. */
+    probe.decoderContext->lowres = FFMIN(decoderCodec->max_lowres, 2);
+    probe.decoderContext->skip_loop_filter = AVDISCARD_ALL;
+    probe.decoderContext->thread_count = 0;
+
+    if ((ret = avcodec_open2(probe.decoderContext, decoderCodec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open decoder for complexity analysis\n");
+        goto end;
+    }
+
+    frameRate = streamParameters->frameRate.num ? streamParameters->frameRate
+                                                : av_guess_frame_rate(probe.formatContext, videoStream, NULL);
+    targetWidth = streamParameters->frameWidth ? streamParameters->frameWidth : videoStream->codecpar->width;
+    targetHeight = streamParameters->frameHeight ? streamParameters->frameHeight : videoStream->codecpar->height;
+
+    if ((ret = open_probe_encoder(&probe, targetWidth, targetHeight, frameRate, segmentFrames)) < 0)
+        goto end;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    startTime = videoStream->start_time != AV_NOPTS_VALUE ? videoStream->start_time : 0;
+    if (probe.formatContext->duration > 0)
+        result->titleSeconds = probe.formatContext->duration / (double)AV_TIME_BASE;
+
+    for (int segment = 0; segment < segments; segment++) {
+        if (probe.formatContext->duration > 0) {
+            int64_t segmentOffset = probe.formatContext->duration * (2 * segment + 1) / (2 * segments);
+            int64_t segmentTime = startTime + av_rescale_q(segmentOffset, AV_TIME_BASE_Q, videoStream->time_base);
+
+            if (av_seek_frame(probe.formatContext, probe.videoIndex, segmentTime, AVSEEK_FLAG_BACKWARD) < 0)
+                av_log(NULL, AV_LOG_WARNING, "Could not seek to complexity segment %d, reading on\n", segment);
+            avcodec_flush_buffers(probe.decoderContext);
+        }
+
+        if ((ret = decode_segment(&probe, packet, frame, segmentFrames)) < 0)
+            goto end;
+        result->sampledFrames += ret;
+        if (ret < segmentFrames && probe.formatContext->duration <= 0)
+            break;
+    }
+
+    if ((ret = encode_probe_frame(&probe, NULL)) < 0)
+        goto end;
+
+    if (!probe.encodedFrames) {
+        av_log(NULL, AV_LOG_ERROR, "Complexity probe produced no frames\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    /* Bitrate grows roughly with the 3/4 power of the pixel count at equal quality. */
+    result->probeBitRate = (double)probe.totalBits / probe.encodedFrames * av_q2d(frameRate);
+    pixelRatio = (double)targetWidth * targetHeight / (probe.probeContext->width * probe.probeContext->height);
+    estimatedBitRate = result->probeBitRate * pow(pixelRatio, 0.75);
+
+    result->recommendedCrf = COMPLEXITY_PROBE_CRF;
+    result->recommendedBitRate = (int64_t)estimatedBitRate;
+
+    /*
+     * Every +6 CRF roughly halves the bitrate, so pick the CRF that fits under the ceiling. Easy content that stays
+     * under half the ceiling gets a lower CRF instead, spending up to that half, but no lower than COMPLEXITY_MIN_CRF.
+     */
+    if (streamParameters->maxBitRate > 0 && estimatedBitRate > streamParameters->maxBitRate) {
+        result->recommendedCrf = FFMIN(51, COMPLEXITY_PROBE_CRF + (int)ceil(6 * log2(estimatedBitRate / streamParameters->maxBitRate)));
+        result->recommendedBitRate = streamParameters->maxBitRate;
+    } else if (streamParameters->maxBitRate > 0 && estimatedBitRate > 0 &&
+               estimatedBitRate < streamParameters->maxBitRate / 2.0) {
+        result->recommendedCrf = FFMAX(COMPLEXITY_MIN_CRF,
+                                       COMPLEXITY_PROBE_CRF - (int)floor(6 * log2(streamParameters->maxBitRate / 2.0 / estimatedBitRate)));
+    }
+    if (streamParameters->minBitRate > 0 && result->recommendedBitRate < streamParameters->minBitRate)
+        result->recommendedBitRate = streamParameters->minBitRate;
+
+    ret = 0;
+
+    end:
+    result->analysisSeconds = (av_gettime_relative() - analysisStart) / 1000000.0;
+
+    if (ret == 0) {
+        av_log(NULL, AV_LOG_INFO,
+               "Complexity analysis: %d frames sampled, probe %.0f kb/s, recommended %" PRId64 " b/s or crf %d, "
+               "%.2fs for a %.2fs title (%.3fx realtime)\n",
+               result->sampledFrames, result->probeBitRate / 1000, result->recommendedBitRate, result->recommendedCrf,
+               result->analysisSeconds, result->titleSeconds,
+               result->titleSeconds > 0 ? result->analysisSeconds / result->titleSeconds : 0);
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    av_packet_free(&probe.probePacket);
+    av_frame_free(&probe.scaledFrame);
+    sws_freeContext(probe.scaler);
+    avcodec_free_context(&probe.probeContext);
+    avcodec_free_context(&probe.decoderContext);
+    avformat_close_input(&probe.formatContext);
+
+    return ret;
+}
+
+
+/* A bitrate target is replaced by the recommended bitrate, and a constant quality encode takes the recommended CRF. */
+void apply_complexity_result(StreamingParams *streamParameters, const ComplexityResult *result) {
+    if (streamParameters->outputBitRate > 0)
+        streamParameters->outputBitRate = result->recommendedBitRate;
+    else
+        streamParameters->videoCrf = result->recommendedCrf;
+}
@@ -0,0 +1,34 @@
+#ifndef COMPLEXITY_H
+#define COMPLEXITY_H
+
+#include "testbed.h"
+
+/*
+ * Per-title complexity analysis.
+ *
+ * Decodes evenly spaced segments of the title at reduced resolution (decoder
+ * lowres where supported, swscale downscale otherwise) and encodes them with a
+ * fast constant quality H.264 probe. The probe bitrate is scaled up to the
+ * output frame size to recommend a bitrate and a CRF. The CRF is the probe's
+ * unless StreamingParams.maxBitRate is set: it goes up when the bitrate would
+ * exceed the ceiling, and down, but not below COMPLEXITY_MIN_CRF, when it
+ * would stay under half of it. An encode with a bitrate target takes the bitrate,
+ * and a constant quality one, with outputBitRate 0, the CRF.
+ */
+
+#define COMPLEXITY_PROBE_CRF 23
+#define COMPLEXITY_MIN_CRF 18
+
+typedef struct ComplexityResult {
+    int sampledFrames;
+    double probeBitRate;
+    int64_t recommendedBitRate;
+    int recommendedCrf;
+    double titleSeconds;
+    double analysisSeconds;
+} ComplexityResult;
+
+int analyse_complexity(const char *inputFilename, const StreamingParams *streamParameters, ComplexityResult *result);
+void apply_complexity_result(StreamingParams *streamParameters, const ComplexityResult *result);
+
+#endif
@@ -0,0 +1,896 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/common.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "daemon.h"
+
+enum SettingType {
+    SETTING_INT,
+    SETTING_INT64,
+    SETTING_DOUBLE,
+    SETTING_STRING,
+    SETTING_RATIONAL,
+    SETTING_CODEC,
+    SETTING_PIXEL_FORMAT,
+    SETTING_SAMPLE_FORMAT,
+    SETTING_FIELD_ORDER,
+    SETTING_CHANNEL_LAYOUT,
+    SETTING_PRIORITY,
+};
+
+typedef struct DaemonSetting {
+    const char *name;
+    enum SettingType type;
+    size_t offset;
+} DaemonSetting;
+
+#define SETTING(field, type) { #field, type, offsetof(StreamingParams, field) }
+
+/* Everything a single job can change. Process-wide and multi-process settings stay with the daemon. */
+static const DaemonSetting daemon_settings[] = {
+    SETTING(copyVideo, SETTING_INT),
+    SETTING(copyAudio, SETTING_INT),
+    SETTING(muxerOptKey, SETTING_STRING),
+    SETTING(muxerOptValue, SETTING_STRING),
+    SETTING(videoCodec, SETTING_CODEC),
+    SETTING(audioCodec, SETTING_CODEC),
+    SETTING(audioStreams, SETTING_INT),
+    SETTING(audioChannels, SETTING_INT),
+    SETTING(audioSampleRate, SETTING_INT),
+    SETTING(audioSampleFormat, SETTING_SAMPLE_FORMAT),
+    SETTING(audioOutputBitRate, SETTING_INT),
+    SETTING(audioOutputChannelLayout, SETTING_CHANNEL_LAYOUT),
+    SETTING(codecPrivKey, SETTING_STRING),
+    SETTING(codecPrivValue, SETTING_STRING),
+    SETTING(videoPreset, SETTING_STRING),
+    SETTING(frameHeight, SETTING_INT),
+    SETTING(frameWidth, SETTING_INT),
+    SETTING(outputBitRate, SETTING_INT),
+    SETTING(videoCrf, SETTING_INT),
+    SETTING(bitstreamBufferSize, SETTING_INT),
+    SETTING(minBitRate, SETTING_INT),
+    SETTING(maxBitRate, SETTING_INT),
+    SETTING(pixelAspectRatio, SETTING_RATIONAL),
+    SETTING(frameRate, SETTING_RATIONAL),
+    SETTING(videoPixelFormat, SETTING_PIXEL_FORMAT),
+    SETTING(twoPass, SETTING_INT),
+    SETTING(statsCacheDir, SETTING_STRING),
+    SETTING(perTitleBitrate, SETTING_INT),
+    SETTING(complexitySegments, SETTING_INT),
+    SETTING(complexitySegmentFrames, SETTING_INT),
+    SETTING(outputFieldOrder, SETTING_FIELD_ORDER),
+    SETTING(deinterlacer, SETTING_STRING),
+    SETTING(filterThreads, SETTING_INT),
+    SETTING(fieldOrderSampleFrames, SETTING_INT),
+    SETTING(resampleQuality, SETTING_INT),
+    SETTING(maxInterleaveDelta, SETTING_INT64),
+    SETTING(interleaveBufferSize, SETTING_INT64),
+    SETTING(jobMemoryLimit, SETTING_INT64),
+    SETTING(admissionMaxWait, SETTING_INT),
+    SETTING(numaNode, SETTING_INT),
+    SETTING(checkpointInterval, SETTING_INT),
+    SETTING(chunkStart, SETTING_INT64),
+    SETTING(chunkEnd, SETTING_INT64),
+    SETTING(frameRing, SETTING_STRING),
+    SETTING(targetFps, SETTING_DOUBLE),
+    SETTING(speedMetricsFile, SETTING_STRING),
+    SETTING(playlist, SETTING_STRING),
+    SETTING(overlayAsset, SETTING_STRING),
+    SETTING(overlayX, SETTING_INT),
+    SETTING(overlayY, SETTING_INT),
+    SETTING(overlayPremultiplied, SETTING_INT),
+    SETTING(filterWorkers, SETTING_INT),
+    SETTING(schedulerStatsFile, SETTING_STRING),
+    SETTING(overlapStartup, SETTING_INT),
+    SETTING(startupProfileFile, SETTING_STRING),
+    SETTING(jobPriority, SETTING_PRIORITY),
+    SETTING(progressBoard, SETTING_STRING),
+    SETTING(progressFile, SETTING_STRING),
+    SETTING(progressInterval, SETTING_INT),
+};
+
+typedef struct DaemonConnection {
+    int fd;
+    char buffer[DAEMON_LINE_SIZE];
+    int length;
+    /* Held for every write, so lines from the worker and the reporter never interleave. */
+    pthread_mutex_t writeLock;
+    /* The rest of a notice the socket only took part of, sent before anything else. */
+    char pending[DAEMON_LINE_SIZE];
+    int pendingLength;
+    TestbedJob *job;
+    int64_t jobId;
+    int64_t lastProgress;
+    int hungUp;
+    int priority;
+    int state;
+    int64_t arrival;
+    int64_t queuedAt;
+    int preemptions;
+    int cancelled;
+} DaemonConnection;
+
+typedef struct DaemonClassStats {
+    int64_t jobs;
+    int64_t waitTime;
+    int64_t maxWait;
+    int64_t preemptions;
+    int64_t pausedTime;
+} DaemonClassStats;
+
+typedef struct DaemonWorker {
+    struct TestbedDaemon *daemon;
+    int slot;
+    pthread_t thread;
+} DaemonWorker;
+
+typedef struct TestbedDaemon {
+    const StreamingParams *defaults;
+    int listenFd;
+    int nbWorkers;
+    DaemonWorker workers[DAEMON_MAX_WORKERS];
+    /* A connection is here while its job is queued or runs, and then belongs to the reporter rather than its worker. */
+    DaemonConnection *active[DAEMON_MAX_WORKERS];
+    int nbSlots;
+    int running;
+    int64_t arrivals;
+    DaemonClassStats classes[TESTBED_PRIORITIES];
+    pthread_mutex_t lock;
+    pthread_cond_t scheduled;
+    atomic_int stopping;
+    atomic_int_fast64_t nextJobId;
+    int64_t jobsFinished;
+    int64_t jobsFailed;
+    int64_t jobsCancelled;
+} TestbedDaemon;
+
+static const char *priority_names[TESTBED_PRIORITIES] = { "low", "normal", "high" };
+
+static volatile sig_atomic_t daemon_stop_requested;
+
+
+static void request_stop(int signum) {
+    daemon_stop_requested = 1;
+}
+
+
+static int parse_field_order(const char *value, enum AVFieldOrder *fieldOrder) {
+    static const struct { const char *name; enum AVFieldOrder fieldOrder; } names[] = {
+        { "auto", AV_FIELD_UNKNOWN }, { "progressive", AV_FIELD_PROGRESSIVE },
+        { "tt", AV_FIELD_TT }, { "bb", AV_FIELD_BB }, { "tb", AV_FIELD_TB }, { "bt", AV_FIELD_BT },
+    };
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(names); i++) {
+        if (strcmp(value, names[i].name) == 0) {
+            *fieldOrder = names[i].fieldOrder;
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
+
+/* Set one field from "<name> <value>". Strings are copied into strings[], which must outlive the job. */
+static int apply_setting(StreamingParams *params, const char *line, char **strings, int *nbStrings) {
+    const DaemonSetting *setting = NULL;
+    size_t nameLength = strcspn(line, " ");
+    const char *value = line + nameLength;
+    char *field = (char *)params;
+    char *end = NULL;
+
+    if (*value == ' ')
+        value++;
+    for (int i = 0; i < FF_ARRAY_ELEMS(daemon_settings); i++) {
+        if (strlen(daemon_settings[i].name) == nameLength && strncmp(line, daemon_settings[i].name, nameLength) == 0)
+            setting = &daemon_settings[i];
+    }
+    if (!setting || !*value)
+        return AVERROR(EINVAL);
+    field += setting->offset;
+
+    switch (setting->type) {
+    case SETTING_INT: {
+        long number = strtol(value, &end, 10);
+        if (*end)
+            return AVERROR(EINVAL);
+        *(int *)field = number;
+        return 0;
+    }
+    case SETTING_INT64: {
+        long long number = strtoll(value, &end, 10);
+        if (*end)
+            return AVERROR(EINVAL);
+        *(int64_t *)field = number;
+        return 0;
+    }
+    case SETTING_DOUBLE: {
+        double number = strtod(value, &end);
+        if (*end)
+            return AVERROR(EINVAL);
+        *(double *)field = number;
+        return 0;
+    }
+    case SETTING_STRING:
+        if (*nbStrings >= DAEMON_MAX_STRINGS)
+            return AVERROR(ENOSPC);
+        if (!(strings[*nbStrings] = av_strdup(value)))
+            return AVERROR(ENOMEM);
+        *(char **)field = strings[(*nbStrings)++];
+        return 0;
+    case SETTING_RATIONAL: {
+        AVRational ratio;
+        int ret = av_parse_ratio(&ratio, value, 1000000, 0, NULL);
+        if (ret < 0)
+            return ret;
+        *(AVRational *)field = ratio;
+        return 0;
+    }
+    case SETTING_CODEC: {
+        const AVCodec *codec = avcodec_find_encoder_by_name(value);
+        if (!codec)
+            return AVERROR_ENCODER_NOT_FOUND;
+        *(enum AVCodecID *)field = codec->id;
+        return 0;
+    }
+    case SETTING_PIXEL_FORMAT: {
+        enum AVPixelFormat pixelFormat = av_get_pix_fmt(value);
+        if (pixelFormat == AV_PIX_FMT_NONE)
+            return AVERROR(EINVAL);
+        *(enum AVPixelFormat *)field = pixelFormat;
+        return 0;
+    }
+    case SETTING_SAMPLE_FORMAT: {
+        enum AVSampleFormat sampleFormat = av_get_sample_fmt(value);
+        if (sampleFormat == AV_SAMPLE_FMT_NONE)
+            return AVERROR(EINVAL);
+        *(enum AVSampleFormat *)field = sampleFormat;
+        return 0;
+    }
+    case SETTING_FIELD_ORDER:
+        return parse_field_order(value, (enum AVFieldOrder *)field);
+    case SETTING_CHANNEL_LAYOUT: {
+        AVChannelLayout layout = {0};
+        /* Only layouts that need no allocation, since job parameters are copied by value. */
+        if (av_channel_layout_from_string(&layout, value) < 0 || layout.order != AV_CHANNEL_ORDER_NATIVE) {
+            av_channel_layout_uninit(&layout);
+            return AVERROR(EINVAL);
+        }
+        *(AVChannelLayout *)field = layout;
+        return 0;
+    }
+    case SETTING_PRIORITY:
+        for (int i = 0; i < TESTBED_PRIORITIES; i++) {
+            if (strcmp(value, priority_names[i]) == 0) {
+                *(int *)field = i;
+                return 0;
+            }
+        }
+        return AVERROR(EINVAL);
+    }
+    return AVERROR(EINVAL);
+}
+
+
+/* Returns 1 with a line, 0 when none arrived within timeoutMs, or an error, AVERROR_EOF when the client hung up. */
+static int read_line(DaemonConnection *connection, char *line, int lineSize, int timeoutMs) {
+    while (1) {
+        char *newline = memchr(connection->buffer, '\n', connection->length);
+        struct pollfd pollFd = { connection->fd, POLLIN, 0 };
+        ssize_t received;
+
+        if (newline) {
+            int length = newline - connection->buffer;
+            if (length >= lineSize)
+                return AVERROR(EINVAL);
+            memcpy(line, connection->buffer, length);
+            line[length] = '\0';
+            if (length > 0 && line[length - 1] == '\r')
+                line[length - 1] = '\0';
+            connection->length -= length + 1;
+            memmove(connection->buffer, newline + 1, connection->length);
+            return 1;
+        }
+        if (connection->length == sizeof(connection->buffer))
+            return AVERROR(EINVAL);
+
+        if (poll(&pollFd, 1, timeoutMs) <= 0)
+            return 0;
+        received = recv(connection->fd, connection->buffer + connection->length,
+                        sizeof(connection->buffer) - connection->length, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0)
+            return AVERROR(errno);
+        if (received == 0)
+            return AVERROR_EOF;
+        connection->length += received;
+    }
+}
+
+
+/* Open and close each codec the default settings use, so the first job doesn't pay for their one-time setup. */
+static void warm_codecs(const StreamingParams *params) {
+    enum AVCodecID codecIds[] = { params->videoCodec, params->audioCodec };
+    int64_t start = av_gettime_relative();
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(codecIds); i++) {
+        const AVCodec *codecs[] = { avcodec_find_encoder(codecIds[i]), avcodec_find_decoder(codecIds[i]) };
+
+        for (int j = 0; j < FF_ARRAY_ELEMS(codecs); j++) {
+            AVCodecContext *context;
+
+            if (!codecs[j] || !(context = avcodec_alloc_context3(codecs[j])))
+                continue;
+            if (av_codec_is_encoder(codecs[j]) && codecs[j]->type == AVMEDIA_TYPE_VIDEO) {
+                context->width = params->frameWidth;
+                context->height = params->frameHeight;
+                context->pix_fmt = params->videoPixelFormat;
+                context->time_base = av_inv_q(params->frameRate);
+            } else if (av_codec_is_encoder(codecs[j])) {
+                context->sample_fmt = params->audioSampleFormat;
+                context->sample_rate = params->audioSampleRate;
+                context->time_base = (AVRational){1, params->audioSampleRate};
+                av_channel_layout_copy(&context->ch_layout, &params->audioOutputChannelLayout);
+            }
+            if (avcodec_open2(context, codecs[j], NULL) < 0)
+                av_log(NULL, AV_LOG_VERBOSE, "Could not warm up %s\n", codecs[j]->name);
+            avcodec_free_context(&context);
+        }
+    }
+    av_log(NULL, AV_LOG_INFO, "Daemon: codecs warmed up in %.1fms\n", (av_gettime_relative() - start) / 1000.0);
+}
+
+
+static const char *job_state_name(enum TestbedJobState state) {
+    switch (state) {
+    case TESTBED_JOB_PENDING:   return "pending";
+    case TESTBED_JOB_RUNNING:   return "running";
+    case TESTBED_JOB_FINISHED:  return "finished";
+    case TESTBED_JOB_FAILED:    return "failed";
+    case TESTBED_JOB_CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+
+/* Queued jobs and running jobs that have been preempted. */
+#define DAEMON_JOB_QUEUED  0
+#define DAEMON_JOB_RUNNING 1
+#define DAEMON_JOB_PAUSED  2
+
+/* Send what is left of a notice without waiting; returns 1 once nothing is left. Called with the write lock held. */
+static int flush_pending(DaemonConnection *connection) {
+    while (connection->pendingLength > 0) {
+        ssize_t sent = send(connection->fd, connection->pending, connection->pendingLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return 0;
+        connection->pendingLength -= sent;
+        memmove(connection->pending, connection->pending + sent, connection->pendingLength);
+    }
+    return 1;
+}
+
+
+/*
+ * Status lines the client didn't ask for are dropped rather than waited for, since they are sent under the
+ * daemon lock: when another thread is writing, when an earlier notice is still going out, or when the socket
+ * takes none of it. A notice the socket takes only part of is finished before the next line, never torn.
+ */
+static void send_notice(DaemonConnection *connection, const char *format, ...) {
+    char line[DAEMON_LINE_SIZE];
+    va_list args;
+    ssize_t sent;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length <= 0 || length >= sizeof(line) || pthread_mutex_trylock(&connection->writeLock) != 0)
+        return;
+
+    if (flush_pending(connection)) {
+        do {
+            sent = send(connection->fd, line, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        if (sent > 0 && sent < length) {
+            connection->pendingLength = length - sent;
+            memcpy(connection->pending, line + sent, connection->pendingLength);
+        }
+    }
+    pthread_mutex_unlock(&connection->writeLock);
+}
+
+
+/* Replies and the STARTED and DONE lines go out whole, after any notice still in progress. */
+static void send_reply(DaemonConnection *connection, const char *format, ...) {
+    char line[DAEMON_LINE_SIZE];
+    const char *p = line;
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length <= 0 || length >= sizeof(line))
+        return;
+
+    pthread_mutex_lock(&connection->writeLock);
+    while (connection->pendingLength > 0 || length > 0) {
+        const char *data = connection->pendingLength > 0 ? connection->pending : p;
+        int size = connection->pendingLength > 0 ? connection->pendingLength : length;
+        ssize_t sent = send(connection->fd, data, size, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            break;
+        if (connection->pendingLength > 0) {
+            connection->pendingLength -= sent;
+            memmove(connection->pending, connection->pending + sent, connection->pendingLength);
+        } else {
+            p += sent;
+            length -= sent;
+        }
+    }
+    pthread_mutex_unlock(&connection->writeLock);
+}
+
+
+/* Higher classes first, and first come first served within a class, so a preempted job resumes before newer ones. */
+static int runs_before(const DaemonConnection *a, const DaemonConnection *b) {
+    return a->priority > b->priority || (a->priority == b->priority && a->arrival < b->arrival);
+}
+
+
+/*
+ * Hand free slots to the waiting jobs that run first, queued or paused. When none is free, a waiting job
+ * preempts the running job of the lowest class below its own, the newest of them, which is paused at its
+ * next packet and waits again. Called with the lock held, whenever a job arrives or finishes.
+ */
+static void schedule_jobs(TestbedDaemon *daemon) {
+    while (1) {
+        DaemonConnection *next = NULL;
+        DaemonConnection *victim = NULL;
+
+        for (int i = 0; i < daemon->nbWorkers; i++) {
+            DaemonConnection *connection = daemon->active[i];
+            if (connection && connection->state != DAEMON_JOB_RUNNING && !connection->cancelled &&
+                (!next || runs_before(connection, next)))
+                next = connection;
+        }
+        if (!next)
+            return;
+
+        if (daemon->running >= daemon->nbSlots) {
+            for (int i = 0; i < daemon->nbWorkers; i++) {
+                DaemonConnection *connection = daemon->active[i];
+                if (connection && connection->state == DAEMON_JOB_RUNNING && connection->priority < next->priority &&
+                    (!victim || runs_before(victim, connection)))
+                    victim = connection;
+            }
+            if (!victim)
+                return;
+
+            av_log(NULL, AV_LOG_INFO, "Daemon: job %" PRId64 " (%s) preempts job %" PRId64 " (%s)\n", next->jobId,
+                   priority_names[next->priority], victim->jobId, priority_names[victim->priority]);
+            testbed_job_pause(victim->job);
+            victim->state = DAEMON_JOB_PAUSED;
+            victim->preemptions++;
+            daemon->classes[victim->priority].preemptions++;
+            daemon->running--;
+            send_notice(victim, "PAUSED %" PRId64 "\n", victim->jobId);
+        }
+
+        if (next->state == DAEMON_JOB_PAUSED) {
+            testbed_job_resume(next->job);
+            send_notice(next, "RESUMED %" PRId64 "\n", next->jobId);
+        }
+        next->state = DAEMON_JOB_RUNNING;
+        daemon->running++;
+        pthread_cond_broadcast(&daemon->scheduled);
+    }
+}
+
+
+static void run_daemon_job(TestbedDaemon *daemon, int slot, DaemonConnection *connection, const StreamingParams *params,
+                           const char *inputFilename, const char *outputFilename) {
+    TestbedJobStatus status;
+    struct stat outputStat;
+    TestbedJob *job = testbed_job_create(params, inputFilename, outputFilename);
+    int64_t id = atomic_fetch_add(&daemon->nextJobId, 1);
+    int64_t waitTime;
+    DaemonClassStats *stats;
+
+    if (!job) {
+        send_reply(connection, "ERROR out of memory\n");
+        return;
+    }
+    av_log(NULL, AV_LOG_INFO, "Daemon: job %" PRId64 " %s -> %s\n", id, inputFilename, outputFilename);
+
+    pthread_mutex_lock(&daemon->lock);
+    connection->job = job;
+    connection->jobId = id;
+    connection->priority = av_clip(params->jobPriority, 0, TESTBED_PRIORITIES - 1);
+    connection->state = DAEMON_JOB_QUEUED;
+    connection->arrival = daemon->arrivals++;
+    connection->queuedAt = av_gettime_relative();
+    connection->preemptions = 0;
+    connection->cancelled = 0;
+    stats = &daemon->classes[connection->priority];
+    daemon->active[slot] = connection;
+    schedule_jobs(daemon);
+    if (connection->state == DAEMON_JOB_QUEUED)
+        send_notice(connection, "QUEUED %" PRId64 " %s\n", id, priority_names[connection->priority]);
+    /* A job cancelled while queued is still run, and returns straight away. */
+    while (connection->state == DAEMON_JOB_QUEUED && !connection->cancelled)
+        pthread_cond_wait(&daemon->scheduled, &daemon->lock);
+    if (connection->state == DAEMON_JOB_QUEUED)
+        testbed_job_cancel(job);
+    waitTime = av_gettime_relative() - connection->queuedAt;
+    stats->waitTime += waitTime;
+    stats->maxWait = FFMAX(stats->maxWait, waitTime);
+    connection->lastProgress = av_gettime_relative();
+    pthread_mutex_unlock(&daemon->lock);
+
+    send_reply(connection, "STARTED %" PRId64 "\n", id);
+    testbed_job_run(job);
+
+    pthread_mutex_lock(&daemon->lock);
+    if (connection->state == DAEMON_JOB_RUNNING)
+        daemon->running--;
+    daemon->active[slot] = NULL;
+    connection->job = NULL;
+    testbed_job_poll(job, &status);
+    stats->jobs++;
+    stats->pausedTime += status.pausedTime;
+    if (status.state == TESTBED_JOB_FINISHED)
+        daemon->jobsFinished++;
+    else if (status.state == TESTBED_JOB_CANCELLED)
+        daemon->jobsCancelled++;
+    else
+        daemon->jobsFailed++;
+    schedule_jobs(daemon);
+    pthread_mutex_unlock(&daemon->lock);
+
+    send_reply(connection, "DONE %" PRId64 " %s %d %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %d\n", id,
+               job_state_name(status.state), status.result, status.elapsed, status.packetsRead,
+               stat(outputFilename, &outputStat) == 0 ? (int64_t)outputStat.st_size : (int64_t)-1,
+               waitTime, connection->preemptions);
+    testbed_job_free(&job);
+}
+
+
+/* One line per class: jobs finished, queued, running and paused now, wait and paused time, and preemptions. */
+static void send_class_stats(TestbedDaemon *daemon, DaemonConnection *connection) {
+    char lines[TESTBED_PRIORITIES][DAEMON_LINE_SIZE];
+
+    pthread_mutex_lock(&daemon->lock);
+    for (int i = 0; i < TESTBED_PRIORITIES; i++) {
+        const DaemonClassStats *stats = &daemon->classes[i];
+        int states[3] = {0};
+
+        for (int j = 0; j < daemon->nbWorkers; j++) {
+            if (daemon->active[j] && daemon->active[j]->priority == i)
+                states[daemon->active[j]->state]++;
+        }
+        snprintf(lines[i], sizeof(lines[i]), "CLASS %s %" PRId64 " %d %d %d %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                 priority_names[i], stats->jobs, states[DAEMON_JOB_QUEUED], states[DAEMON_JOB_RUNNING],
+                 states[DAEMON_JOB_PAUSED], stats->jobs ? stats->waitTime / stats->jobs : 0, stats->maxWait,
+                 stats->pausedTime, stats->preemptions);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    for (int i = 0; i < TESTBED_PRIORITIES; i++)
+        send_reply(connection, "%s", lines[i]);
+}
+
+
+static void log_class_stats(const TestbedDaemon *daemon) {
+    for (int i = 0; i < TESTBED_PRIORITIES; i++) {
+        const DaemonClassStats *stats = &daemon->classes[i];
+        if (!stats->jobs)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "Daemon: %s priority: %" PRId64 " jobs, waited %.2fs on average and %.2fs at most, "
+               "preempted %" PRId64 " times for %.2fs\n", priority_names[i], stats->jobs,
+               stats->waitTime / 1000000.0 / stats->jobs, stats->maxWait / 1000000.0, stats->preemptions,
+               stats->pausedTime / 1000000.0);
+    }
+}
+
+
+static void serve_connection(TestbedDaemon *daemon, int slot, int fd) {
+    DaemonConnection connection = { .fd = fd };
+    StreamingParams params = *daemon->defaults;
+    char *strings[DAEMON_MAX_STRINGS];
+    int nbStrings = 0;
+    char *inputFilename = NULL;
+    char *outputFilename = NULL;
+    char line[DAEMON_LINE_SIZE];
+    int ret;
+
+    pthread_mutex_init(&connection.writeLock, NULL);
+    while (!atomic_load(&daemon->stopping)) {
+        ret = read_line(&connection, line, sizeof(line), DAEMON_POLL_MS);
+        if (ret == 0)
+            continue;
+        if (ret < 0)
+            break;
+
+        if (strncmp(line, "SET ", 4) == 0) {
+            if ((ret = apply_setting(&params, line + 4, strings, &nbStrings)) < 0)
+                send_reply(&connection, "ERROR %s: %s\n", line + 4, av_err2str(ret));
+        } else if (strncmp(line, "INPUT ", 6) == 0) {
+            av_free(inputFilename);
+            inputFilename = av_strdup(line + 6);
+        } else if (strncmp(line, "OUTPUT ", 7) == 0) {
+            av_free(outputFilename);
+            outputFilename = av_strdup(line + 7);
+        } else if (strcmp(line, "RUN") == 0) {
+            if (inputFilename && outputFilename)
+                run_daemon_job(daemon, slot, &connection, &params, inputFilename, outputFilename);
+            else
+                send_reply(&connection, "ERROR RUN needs an INPUT and an OUTPUT\n");
+
+            params = *daemon->defaults;
+            for (int i = 0; i < nbStrings; i++)
+                av_freep(&strings[i]);
+            nbStrings = 0;
+            av_freep(&inputFilename);
+            av_freep(&outputFilename);
+        } else if (strcmp(line, "STATS") == 0) {
+            send_class_stats(daemon, &connection);
+        } else if (strcmp(line, "QUIT") == 0) {
+            break;
+        } else if (strcmp(line, "CANCEL") != 0) {
+            send_reply(&connection, "ERROR unknown request %s\n", line);
+        }
+    }
+
+    for (int i = 0; i < nbStrings; i++)
+        av_freep(&strings[i]);
+    av_freep(&inputFilename);
+    av_freep(&outputFilename);
+    pthread_mutex_destroy(&connection.writeLock);
+}
+
+
+static void *daemon_worker(void *opaque) {
+    DaemonWorker *worker = opaque;
+    TestbedDaemon *daemon = worker->daemon;
+
+    while (!atomic_load(&daemon->stopping)) {
+        struct pollfd pollFd = { daemon->listenFd, POLLIN, 0 };
+        int fd;
+
+        if (poll(&pollFd, 1, DAEMON_POLL_MS) <= 0)
+            continue;
+        /* The listening socket is non-blocking, so a worker that loses the race for a connection just polls again. */
+        if ((fd = accept(daemon->listenFd, NULL, NULL)) < 0)
+            continue;
+        serve_connection(daemon, worker->slot, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+/* Send progress for running jobs that are due, and pick up CANCEL requests and disconnects. */
+static void report_progress(TestbedDaemon *daemon, int intervalMs) {
+    char line[DAEMON_LINE_SIZE];
+    int64_t now = av_gettime_relative();
+
+    pthread_mutex_lock(&daemon->lock);
+    for (int i = 0; i < daemon->nbWorkers; i++) {
+        DaemonConnection *connection = daemon->active[i];
+        TestbedJobStatus status;
+        int ret;
+
+        if (!connection || connection->hungUp)
+            continue;
+
+        while ((ret = read_line(connection, line, sizeof(line), 0)) > 0) {
+            if (strcmp(line, "CANCEL") == 0) {
+                av_log(NULL, AV_LOG_INFO, "Daemon: cancelling job %" PRId64 "\n", connection->jobId);
+                testbed_job_cancel(connection->job);
+                connection->cancelled = 1;
+            } else {
+                send_notice(connection, "ERROR busy\n");
+            }
+        }
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Daemon: client of job %" PRId64 " went away, cancelling it\n", connection->jobId);
+            testbed_job_cancel(connection->job);
+            connection->cancelled = 1;
+            connection->hungUp = 1;
+        }
+        /* A queued job has to be woken to return, and a paused one holds no slot, so nothing else needs scheduling. */
+        if (connection->cancelled && connection->state == DAEMON_JOB_QUEUED)
+            pthread_cond_broadcast(&daemon->scheduled);
+        if (connection->hungUp || connection->state != DAEMON_JOB_RUNNING)
+            continue;
+
+        if (now - connection->lastProgress < intervalMs * 1000LL)
+            continue;
+        connection->lastProgress = now;
+        testbed_job_poll(connection->job, &status);
+        send_notice(connection, "PROGRESS %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                    connection->jobId, status.packetsRead, status.position, status.duration, status.elapsed);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+
+static int listen_on_path(const char *socketPath) {
+    struct sockaddr_un socketAddress = {0};
+    int fd;
+
+    socketAddress.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(socketAddress.sun_path))
+        return AVERROR(ENAMETOOLONG);
+    strcpy(socketAddress.sun_path, socketPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+    /* A socket file left behind by a daemon that didn't exit cleanly would make bind() fail. */
+    unlink(socketPath);
+    if (bind(fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int err = errno;
+        close(fd);
+        return AVERROR(err);
+    }
+    return fd;
+}
+
+
+int run_daemon(const char *socketPath, const StreamingParams *streamParameters) {
+    TestbedDaemon *daemon;
+    struct sigaction stopAction = {0};
+    int started = 0;
+    int ret = 0;
+
+    daemon = av_mallocz(sizeof(*daemon));
+    if (!daemon)
+        return AVERROR(ENOMEM);
+    daemon->defaults = streamParameters;
+    daemon->nbWorkers = av_clip(streamParameters->daemonWorkers, 1, DAEMON_MAX_WORKERS);
+    daemon->nbSlots = av_clip(streamParameters->daemonJobSlots, 1, daemon->nbWorkers);
+    atomic_init(&daemon->stopping, 0);
+    atomic_init(&daemon->nextJobId, 1);
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->scheduled, NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+    stopAction.sa_handler = request_stop;
+    sigaction(SIGINT, &stopAction, NULL);
+    sigaction(SIGTERM, &stopAction, NULL);
+
+    if ((daemon->listenFd = listen_on_path(socketPath)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not listen on %s\n", socketPath);
+        ret = daemon->listenFd;
+        goto end;
+    }
+
+    warm_codecs(streamParameters);
+
+    for (started = 0; started < daemon->nbWorkers; started++) {
+        daemon->workers[started].daemon = daemon;
+        daemon->workers[started].slot = started;
+        if (pthread_create(&daemon->workers[started].thread, NULL, daemon_worker, &daemon->workers[started]) != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start daemon worker %d\n", started);
+            ret = AVERROR(EAGAIN);
+            break;
+        }
+    }
+    av_log(NULL, AV_LOG_INFO, "Daemon: listening on %s with %d workers and %d job slots\n", socketPath, started,
+           daemon->nbSlots);
+
+    while (ret >= 0 && !daemon_stop_requested) {
+        report_progress(daemon, streamParameters->daemonProgressInterval);
+        av_usleep(DAEMON_POLL_MS * 1000);
+    }
+
+    /* Finish the running jobs, still reporting their progress, before the workers are joined. */
+    atomic_store(&daemon->stopping, 1);
+    av_log(NULL, AV_LOG_INFO, "Daemon: stopping\n");
+    while (1) {
+        int running = 0;
+
+        pthread_mutex_lock(&daemon->lock);
+        for (int i = 0; i < daemon->nbWorkers; i++)
+            running += daemon->active[i] != NULL;
+        pthread_mutex_unlock(&daemon->lock);
+        if (!running)
+            break;
+        report_progress(daemon, streamParameters->daemonProgressInterval);
+        av_usleep(DAEMON_POLL_MS * 1000);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(daemon->workers[i].thread, NULL);
+
+    av_log(NULL, AV_LOG_INFO, "Daemon: %" PRId64 " jobs finished, %" PRId64 " failed, %" PRId64 " cancelled\n",
+           daemon->jobsFinished, daemon->jobsFailed, daemon->jobsCancelled);
+    log_class_stats(daemon);
+
+    close(daemon->listenFd);
+    unlink(socketPath);
+end:
+    pthread_cond_destroy(&daemon->scheduled);
+    pthread_mutex_destroy(&daemon->lock);
+    av_free(daemon);
+    return ret;
+}
+
+
+/* Run one job on a daemon, with settings given as name=value, printing what the daemon sends back. */
+int run_daemon_client(const char *socketPath, const char *inputFilename, const char *outputFilename,
+                      char **settings, int nbSettings) {
+    struct sockaddr_un socketAddress = {0};
+    DaemonConnection connection = {0};
+    char line[DAEMON_LINE_SIZE];
+    int ret = AVERROR_EOF;
+
+    socketAddress.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(socketAddress.sun_path))
+        return AVERROR(ENAMETOOLONG);
+    strcpy(socketAddress.sun_path, socketPath);
+
+    signal(SIGPIPE, SIG_IGN);
+    connection.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection.fd < 0)
+        return AVERROR(errno);
+    if (connect(connection.fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not connect to the daemon on %s\n", socketPath);
+        close(connection.fd);
+        return ret;
+    }
+
+    for (int i = 0; i < nbSettings; i++) {
+        size_t nameLength = strcspn(settings[i], "=");
+        if (settings[i][nameLength] == '=')
+            dprintf(connection.fd, "SET %.*s %s\n", (int)nameLength, settings[i], settings[i] + nameLength + 1);
+    }
+    dprintf(connection.fd, "INPUT %s\nOUTPUT %s\nRUN\n", inputFilename, outputFilename);
+
+    while ((ret = read_line(&connection, line, sizeof(line), -1)) > 0) {
+        char state[32];
+        int status;
+
+        printf("%s\n", line);
+        fflush(stdout);
+        if (sscanf(line, "DONE %*d %31s %d", state, &status) == 2) {
+            ret = status;
+            break;
+        }
+    }
+    dprintf(connection.fd, "QUIT\n");
+    close(connection.fd);
+    return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "testbed.h"
+
+/*
+ * Warm daemon: a long-running process that takes transcode jobs over a Unix
+ * domain socket, so a stream of short jobs doesn't pay for process start,
+ * dynamic linking and codec initialisation every time.
+ *
+ * StreamingParams.daemonWorkers threads are started once and each serves one
+ * connection at a time; further connections wait in the listen backlog. Before
+ * the first connection, every codec the default settings use is opened and
+ * closed once, so its one-time table setup is done. A connection can run any
+ * number of jobs, one after another. The protocol is line based:
+ *
+ *   client: SET <setting> <value>   a StreamingParams field by name, over the daemon's defaults
+ *           INPUT <path>
+ *           OUTPUT <path>
+ *           RUN
+ *   daemon: QUEUED <id> <priority>  when no job slot is free
+ *           STARTED <id>
+ *           PROGRESS <id> <packets> <position us> <duration us> <elapsed us>
+ *           PAUSED <id>, RESUMED <id>
+ *           DONE <id> <state> <status> <elapsed us> <packets> <output bytes> <queued us> <preemptions>
+ *   client: CANCEL                  while the job is queued or runs
+ *           STATS                   between jobs
+ *   daemon: CLASS <priority> <jobs> <queued> <running> <paused> <mean wait us> <max wait us>
+ *                 <paused us> <preemptions>, one line per priority class
+ *   client: QUIT
+ *
+ * The daemon answers a request it can't accept with ERROR <reason>, and any
+ * request but CANCEL made while a job is queued or runs with ERROR busy.
+ * Settings, input and output are cleared after each RUN. Progress is sent
+ * every StreamingParams.daemonProgressInterval milliseconds, and dropped
+ * rather than waited for when the client isn't reading; a line is always sent
+ * whole, and STARTED and DONE are never dropped. A client that disconnects cancels
+ * its job. SIGINT or SIGTERM stops accepting connections and waits for the
+ * running jobs.
+ *
+ * Jobs run in StreamingParams.daemonJobSlots slots, fewer than the workers, so
+ * that there is something to schedule. A job's jobPriority setting (low,
+ * normal or high) orders the queue, and a waiting job preempts a running one of
+ * a lower class when every slot is taken: the running job is paused at its next
+ * packet, with its codecs open, and resumes first when a slot frees up. While
+ * paused, its admission reservation doesn't count against other jobs, so the
+ * job that preempted it isn't left waiting for its memory, and a CANCEL stops a
+ * job still waiting for admission. Its threads also run niced by class, as
+ * described for testbed_job_run(). Wait time, paused time and preemptions are
+ * counted per class, and logged when the daemon stops.
+ *
+ * Tracing is process wide, so it isn't a job setting: --trace ahead of
+ * --daemon records every job the daemon runs, written out when it stops.
+ */
+
+#define DAEMON_MAX_WORKERS 64
+#define DAEMON_LINE_SIZE 2048
+#define DAEMON_MAX_STRINGS 32
+#define DAEMON_POLL_MS 200
+
+int run_daemon(const char *socketPath, const StreamingParams *streamParameters);
+int run_daemon_client(const char *socketPath, const char *inputFilename, const char *outputFilename,
+                      char **settings, int nbSettings);
+
+#endif
@@ -0,0 +1,609 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "checkpoint.h"
+#include "distribute.h"
+
+#define CHUNK_PENDING 0
+#define CHUNK_RUNNING 1
+#define CHUNK_DONE    2
+
+#define MAX_WORKERS 64
+#define LINE_SIZE 2048
+#define COPY_BLOCK_SIZE 65536
+#define REAP_INTERVAL 1000
+
+typedef struct WorkerConnection {
+    int fd;
+    int id;
+    int ready;
+    int chunk;
+    char buffer[LINE_SIZE];
+    int length;
+    /* The segment being received after a DONE line, and how much of it is still to come. */
+    FILE *segment;
+    int64_t remaining;
+} WorkerConnection;
+
+
+static int send_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t written = send(fd, p, size, 0);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        p += written;
+        size -= written;
+    }
+    return 0;
+}
+
+
+static int send_line(int fd, const char *format, ...) {
+    char line[LINE_SIZE];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0 || length >= sizeof(line))
+        return AVERROR(EINVAL);
+    return send_all(fd, line, length);
+}
+
+
+/* Run this program again in a child, by /proc/self/exe where there is one, so a bare argv[0] still works. */
+static void exec_self(const char *program, char *const argv[]) {
+    execv("/proc/self/exe", argv);
+    execvp(program, argv);
+    _exit(127);
+}
+
+
+int split_at_keyframes(const char *inputFilename, int chunkSeconds, TranscodeChunk **chunks, int *nbChunks) {
+    AVFormatContext *formatContext = NULL;
+    AVPacket *packet = NULL;
+    AVStream *videoStream;
+    int64_t chunkLength = (int64_t)chunkSeconds * AV_TIME_BASE;
+    int64_t lastStart = AV_NOPTS_VALUE;
+    int videoIndex;
+    int capacity;
+    int ret;
+
+    *chunks = NULL;
+    *nbChunks = 0;
+
+    if ((ret = open_media(&formatContext, inputFilename)) < 0)
+        return ret;
+    if ((ret = videoIndex = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0)
+        goto end;
+    videoStream = formatContext->streams[videoIndex];
+
+    packet = av_packet_alloc();
+    capacity = formatContext->duration > 0 && chunkLength > 0 ? formatContext->duration / chunkLength + 2 : 1;
+    *chunks = av_calloc(capacity, sizeof(**chunks));
+    if (!packet || !*chunks) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* Find the first keyframe at or after each multiple of the chunk length, without reading the whole file. */
+    for (int i = 0; i < capacity; i++) {
+        int64_t target = (formatContext->start_time != AV_NOPTS_VALUE ? formatContext->start_time : 0) + i * chunkLength;
+        int64_t keyframe = AV_NOPTS_VALUE;
+
+        if (i > 0 && avformat_seek_file(formatContext, -1, target, target, INT64_MAX, 0) < 0)
+            break;
+
+        while (av_read_frame(formatContext, packet) >= 0) {
+            if (packet->stream_index == videoIndex && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+                keyframe = av_rescale_q(packet->pts, videoStream->time_base, AV_TIME_BASE_Q);
+                av_packet_unref(packet);
+                break;
+            }
+            av_packet_unref(packet);
+        }
+
+        if (keyframe == AV_NOPTS_VALUE)
+            break;
+        if (i > 0 && keyframe <= lastStart)
+            continue;
+
+        if (*nbChunks > 0)
+            (*chunks)[*nbChunks - 1].end = keyframe;
+        (*chunks)[*nbChunks].start = i == 0 ? AV_NOPTS_VALUE : keyframe;
+        (*chunks)[*nbChunks].end = INT64_MAX;
+        (*chunks)[*nbChunks].worker = -1;
+        (*chunks)[*nbChunks].failedWorker = -1;
+        (*nbChunks)++;
+        lastStart = keyframe;
+    }
+    ret = *nbChunks > 0 ? 0 : AVERROR_INVALIDDATA;
+
+    end:
+    av_packet_free(&packet);
+    avformat_close_input(&formatContext);
+    if (ret < 0)
+        av_freep(chunks);
+    return ret;
+}
+
+
+static int listen_on(const char *address, int port) {
+    struct sockaddr_in socketAddress = {0};
+    int reuse = 1;
+    int fd;
+
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &socketAddress.sin_addr) != 1)
+        return AVERROR(EINVAL);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0 || listen(fd, MAX_WORKERS) < 0) {
+        int err = errno;
+        close(fd);
+        return AVERROR(err);
+    }
+    return fd;
+}
+
+
+static int connect_to(const char *address, int port) {
+    struct sockaddr_in socketAddress = {0};
+    int fd;
+
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &socketAddress.sin_addr) != 1)
+        return AVERROR(EINVAL);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (connect(fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0) {
+        int err = errno;
+        close(fd);
+        return AVERROR(err);
+    }
+    return fd;
+}
+
+
+static void chunk_name(const char *outputFilename, int index, char *name, int nameSize) {
+    snprintf(name, nameSize, "%s.chunk%04d.mkv", outputFilename, index);
+}
+
+
+static int requeue_chunk(TranscodeChunk *chunks, int index, int workerId, int maxAttempts) {
+    TranscodeChunk *chunk = &chunks[index];
+
+    chunk->state = CHUNK_PENDING;
+    chunk->worker = -1;
+    chunk->failedWorker = workerId;
+    if (++chunk->attempts >= maxAttempts) {
+        av_log(NULL, AV_LOG_ERROR, "Chunk %d failed %d times, giving up\n", index, chunk->attempts);
+        return AVERROR_EXTERNAL;
+    }
+    av_log(NULL, AV_LOG_WARNING, "Chunk %d failed on worker %d, requeued\n", index, workerId);
+    return 0;
+}
+
+
+/* Pick a pending chunk for a worker, avoiding the one it last failed on unless nobody else can take it. */
+static int next_chunk(TranscodeChunk *chunks, int nbChunks, int workerId, int nbReady) {
+    int fallback = -1;
+
+    for (int i = 0; i < nbChunks; i++) {
+        if (chunks[i].state != CHUNK_PENDING)
+            continue;
+        if (chunks[i].failedWorker != workerId)
+            return i;
+        if (fallback < 0)
+            fallback = i;
+    }
+    return nbReady <= 1 ? fallback : -1;
+}
+
+
+static int begin_segment(WorkerConnection *worker, const char *filename, int64_t size) {
+    if (!(worker->segment = fopen(filename, "wb")))
+        return AVERROR(errno);
+    worker->remaining = size;
+    return 0;
+}
+
+
+/* Write out the segment bytes sitting in the line buffer; returns 1 once the whole segment is in. */
+static int receive_segment(WorkerConnection *worker) {
+    int buffered = FFMIN(worker->length, worker->remaining);
+    int ret;
+
+    if (buffered > 0 && fwrite(worker->buffer, 1, buffered, worker->segment) != buffered)
+        return AVERROR(EIO);
+    memmove(worker->buffer, worker->buffer + buffered, worker->length - buffered);
+    worker->length -= buffered;
+    worker->remaining -= buffered;
+    if (worker->remaining > 0)
+        return 0;
+
+    ret = fclose(worker->segment) == 0 ? 1 : AVERROR(EIO);
+    worker->segment = NULL;
+    return ret;
+}
+
+
+static void abandon_segment(WorkerConnection *worker, const char *filename) {
+    if (!worker->segment)
+        return;
+    fclose(worker->segment);
+    worker->segment = NULL;
+    remove(filename);
+}
+
+
+static void drop_worker(WorkerConnection *workers, int *nbWorkers, int index) {
+    if (workers[index].segment)
+        fclose(workers[index].segment);
+    close(workers[index].fd);
+    workers[index] = workers[--(*nbWorkers)];
+}
+
+
+int run_coordinator(const char *program, const char *inputFilename, const char *outputFilename,
+                    const StreamingParams *streamParameters) {
+    WorkerConnection workers[MAX_WORKERS];
+    struct pollfd pollFds[MAX_WORKERS + 1];
+    TranscodeChunk *chunks = NULL;
+    pid_t localPids[MAX_WORKERS];
+    const char **segments = NULL;
+    char (*names)[1100] = NULL;
+    char portString[16];
+    int nbChunks, nbWorkers = 0, nbLocal = 0, nbLocalRunning = 0, nextWorkerId = 0, done = 0;
+    int listenFd = -1;
+    int ret;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (streamParameters->twoPass) {
+        av_log(NULL, AV_LOG_ERROR, "Two-pass encodes can't be split into chunks\n");
+        return AVERROR(EINVAL);
+    }
+
+    if ((ret = split_at_keyframes(inputFilename, streamParameters->chunkSeconds, &chunks, &nbChunks)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not split %s at keyframes\n", inputFilename);
+        return ret;
+    }
+    av_log(NULL, AV_LOG_INFO, "Split %s into %d chunks\n", inputFilename, nbChunks);
+
+    if ((ret = listenFd = listen_on(streamParameters->coordinatorAddress, streamParameters->coordinatorPort)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not listen on %s:%d\n", streamParameters->coordinatorAddress, streamParameters->coordinatorPort);
+        goto end;
+    }
+
+    snprintf(portString, sizeof(portString), "%d", streamParameters->coordinatorPort);
+    for (int i = 0; i < FFMIN(streamParameters->localWorkers, MAX_WORKERS); i++) {
+        char *argv[] = { (char *)program, "--worker", "127.0.0.1", portString, NULL };
+        pid_t pid = fork();
+        if (pid == 0)
+            exec_self(program, argv);
+        if (pid > 0)
+            localPids[nbLocal++] = pid;
+    }
+    nbLocalRunning = nbLocal;
+
+    while (done < nbChunks) {
+        int nbReady = 0;
+
+        for (int i = 0; i < nbWorkers; i++)
+            nbReady += workers[i].ready && workers[i].chunk < 0;
+
+        for (int i = 0; i < nbWorkers; i++) {
+            WorkerConnection *worker = &workers[i];
+            int chunk;
+
+            if (!worker->ready || worker->chunk >= 0)
+                continue;
+            if ((chunk = next_chunk(chunks, nbChunks, worker->id, nbReady)) < 0)
+                continue;
+
+            if (send_line(worker->fd, "CHUNK %d %" PRId64 " %" PRId64 " %s\n",
+                          chunk, chunks[chunk].start, chunks[chunk].end, inputFilename) < 0)
+                continue;
+            chunks[chunk].state = CHUNK_RUNNING;
+            chunks[chunk].worker = worker->id;
+            worker->chunk = chunk;
+            nbReady--;
+        }
+
+        pollFds[0].fd = listenFd;
+        pollFds[0].events = POLLIN;
+        for (int i = 0; i < nbWorkers; i++) {
+            pollFds[i + 1].fd = workers[i].fd;
+            pollFds[i + 1].events = POLLIN;
+        }
+
+        if (poll(pollFds, nbWorkers + 1, REAP_INTERVAL) < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = AVERROR(errno);
+            goto end;
+        }
+
+        /* A local worker that dies before connecting, or after, is noticed here rather than waited on forever. */
+        for (int i = 0; i < nbLocal; i++) {
+            int status;
+
+            if (localPids[i] <= 0 || waitpid(localPids[i], &status, WNOHANG) != localPids[i])
+                continue;
+            av_log(NULL, AV_LOG_WARNING, "Local worker %d exited with status %d\n", (int)localPids[i],
+                   WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+            localPids[i] = 0;
+            nbLocalRunning--;
+        }
+        if (nbLocal > 0 && nbLocalRunning == 0 && nbWorkers == 0) {
+            av_log(NULL, AV_LOG_ERROR, "Every local worker has exited with %d of %d chunks left\n", nbChunks - done, nbChunks);
+            ret = AVERROR_EXTERNAL;
+            goto end;
+        }
+
+        for (int i = nbWorkers - 1; i >= 0; i--) {
+            WorkerConnection *worker = &workers[i];
+            ssize_t received;
+            char *newline;
+
+            if (!(pollFds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            if (worker->segment && worker->length == 0) {
+                char block[COPY_BLOCK_SIZE];
+
+                /* Segment bytes go straight to the file, a block per wakeup, so other workers are still served. */
+                received = recv(worker->fd, block, FFMIN(worker->remaining, sizeof(block)), 0);
+                if (received > 0 && fwrite(block, 1, received, worker->segment) != received)
+                    received = -1;
+                if (received > 0)
+                    worker->remaining -= received;
+            } else {
+                received = recv(worker->fd, worker->buffer + worker->length, sizeof(worker->buffer) - worker->length - 1, 0);
+                if (received > 0)
+                    worker->length += received;
+            }
+            if (received <= 0) {
+                char name[1100];
+
+                av_log(NULL, AV_LOG_WARNING, "Worker %d disconnected\n", worker->id);
+                chunk_name(outputFilename, worker->chunk, name, sizeof(name));
+                abandon_segment(worker, name);
+                if (worker->chunk >= 0 && (ret = requeue_chunk(chunks, worker->chunk, worker->id, streamParameters->chunkRetries)) < 0)
+                    goto end;
+                drop_worker(workers, &nbWorkers, i);
+                continue;
+            }
+
+            while (worker->segment || (worker->length > 0 && (newline = memchr(worker->buffer, '\n', worker->length)))) {
+                char line[LINE_SIZE];
+                int lineLength;
+                long long bytes;
+                int chunk, status;
+
+                if (worker->segment) {
+                    char name[1100];
+
+                    chunk = worker->chunk;
+                    if ((status = receive_segment(worker)) == 0)
+                        break;
+                    worker->chunk = -1;
+                    if (status < 0) {
+                        chunk_name(outputFilename, chunk, name, sizeof(name));
+                        abandon_segment(worker, name);
+                        if ((ret = requeue_chunk(chunks, chunk, worker->id, streamParameters->chunkRetries)) < 0)
+                            goto end;
+                        continue;
+                    }
+                    chunks[chunk].state = CHUNK_DONE;
+                    done++;
+                    av_log(NULL, AV_LOG_INFO, "Chunk %d done by worker %d (%d of %d)\n", chunk, worker->id, done, nbChunks);
+                    continue;
+                }
+
+                lineLength = newline - worker->buffer;
+
+                memcpy(line, worker->buffer, lineLength);
+                line[lineLength] = '\0';
+                memmove(worker->buffer, newline + 1, worker->length - lineLength - 1);
+                worker->length -= lineLength + 1;
+
+                if (strcmp(line, "HELLO") == 0) {
+                    worker->ready = 1;
+                } else if (sscanf(line, "DONE %d %lld", &chunk, &bytes) == 2 && chunk == worker->chunk) {
+                    char name[1100];
+                    chunk_name(outputFilename, chunk, name, sizeof(name));
+                    if (bytes < 0 || begin_segment(worker, name, bytes) < 0) {
+                        if ((ret = requeue_chunk(chunks, chunk, worker->id, streamParameters->chunkRetries)) < 0)
+                            goto end;
+                        worker->chunk = -1;
+                    }
+                } else if (sscanf(line, "FAIL %d %d", &chunk, &status) == 2 && chunk == worker->chunk) {
+                    if ((ret = requeue_chunk(chunks, chunk, worker->id, streamParameters->chunkRetries)) < 0)
+                        goto end;
+                    worker->chunk = -1;
+                }
+            }
+        }
+
+        if (pollFds[0].revents & POLLIN) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0 && nbWorkers < MAX_WORKERS) {
+                memset(&workers[nbWorkers], 0, sizeof(workers[nbWorkers]));
+                workers[nbWorkers].fd = fd;
+                workers[nbWorkers].id = nextWorkerId++;
+                workers[nbWorkers].chunk = -1;
+                nbWorkers++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    segments = av_calloc(nbChunks, sizeof(*segments));
+    names = av_calloc(nbChunks, sizeof(*names));
+    if (!segments || !names) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int i = 0; i < nbChunks; i++) {
+        chunk_name(outputFilename, i, names[i], sizeof(names[i]));
+        segments[i] = names[i];
+    }
+
+    if ((ret = concat_segments(segments, nbChunks, outputFilename)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not join the chunks into %s\n", outputFilename);
+        goto end;
+    }
+    for (int i = 0; i < nbChunks; i++)
+        remove(names[i]);
+    av_log(NULL, AV_LOG_INFO, "Joined %d chunks into %s\n", nbChunks, outputFilename);
+
+    end:
+    for (int i = 0; i < nbWorkers; i++) {
+        char name[1100];
+
+        send_line(workers[i].fd, "EXIT\n");
+        chunk_name(outputFilename, workers[i].chunk, name, sizeof(name));
+        abandon_segment(&workers[i], name);
+        close(workers[i].fd);
+    }
+    if (listenFd >= 0)
+        close(listenFd);
+    for (int i = 0; i < nbLocal; i++) {
+        if (localPids[i] > 0)
+            waitpid(localPids[i], NULL, 0);
+    }
+    av_free(segments);
+    av_free(names);
+    av_free(chunks);
+    return ret;
+}
+
+
+static int transcode_chunk(const char *program, int64_t start, int64_t end, const char *input, const char *output) {
+    char startString[32], endString[32];
+    int status;
+    pid_t pid;
+
+    snprintf(startString, sizeof(startString), "%" PRId64, start);
+    snprintf(endString, sizeof(endString), "%" PRId64, end);
+
+    pid = fork();
+    if (pid < 0)
+        return AVERROR(errno);
+    if (pid == 0) {
+        char *argv[] = { (char *)program, "--chunk", startString, endString, (char *)input, (char *)output, NULL };
+        exec_self(program, argv);
+    }
+
+    if (waitpid(pid, &status, 0) < 0)
+        return AVERROR(errno);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+static int send_segment(int fd, int chunk, const char *filename) {
+    char block[COPY_BLOCK_SIZE];
+    struct stat fileStat;
+    FILE *file;
+    size_t count;
+    int ret;
+
+    if (stat(filename, &fileStat) < 0 || !(file = fopen(filename, "rb")))
+        return AVERROR(errno);
+
+    if ((ret = send_line(fd, "DONE %d %lld\n", chunk, (long long)fileStat.st_size)) < 0) {
+        fclose(file);
+        return ret;
+    }
+    while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+        if ((ret = send_all(fd, block, count)) < 0)
+            break;
+    }
+    fclose(file);
+    return ret;
+}
+
+
+int run_worker(const char *program, const char *address, int port) {
+    char line[LINE_SIZE];
+    FILE *input;
+    int fd;
+    int ret;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((fd = connect_to(address, port)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not connect to coordinator %s:%d\n", address, port);
+        return fd;
+    }
+    input = fdopen(dup(fd), "r");
+    if (!input) {
+        close(fd);
+        return AVERROR(errno);
+    }
+
+    ret = send_line(fd, "HELLO\n");
+    while (ret >= 0 && fgets(line, sizeof(line), input)) {
+        char segment[] = "/tmp/testbed_chunk_XXXXXX.mkv";
+        long long start, end;
+        int chunk, offset = 0, status, segmentFd;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, "EXIT") == 0)
+            break;
+        if (sscanf(line, "CHUNK %d %lld %lld %n", &chunk, &start, &end, &offset) != 3 || !offset)
+            continue;
+
+        /* Created here, exclusively, so nobody else on the host can have a file or link waiting at that name. */
+        if ((segmentFd = mkstemps(segment, 4)) < 0) {
+            ret = send_line(fd, "FAIL %d %d\n", chunk, errno);
+            continue;
+        }
+        close(segmentFd);
+        status = transcode_chunk(program, start, end, line + offset, segment);
+        if (status == 0)
+            ret = send_segment(fd, chunk, segment);
+        else
+            ret = send_line(fd, "FAIL %d %d\n", chunk, status);
+        remove(segment);
+    }
+
+    fclose(input);
+    close(fd);
+    return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+#include <stdint.h>
+
+#include "testbed.h"
+
+/*
+ * Chunked transcoding across worker processes.
+ *
+ * The coordinator splits the input at video keyframes into chunks of at least
+ * StreamingParams.chunkSeconds, listens on a TCP port and hands chunks to
+ * whichever workers connect, on this host or others. The protocol is line
+ * based:
+ *
+ *   worker:      HELLO
+ *   coordinator: CHUNK <id> <start us> <end us> <input>
+ *   worker:      DONE <id> <bytes>   followed by the segment itself
+ *                FAIL <id> <status>
+ *   coordinator: EXIT
+ *
+ * Workers read the input by path, so remote workers need it on shared
+ * storage, and send the encoded segment back over the socket. Each chunk is
+ * encoded by a child process running "--chunk", so a crash only fails that
+ * chunk. A failed chunk goes back in the queue and is preferably retried on
+ * another worker; a worker that disconnects has its chunk requeued the same
+ * way. Segments are read a block at a time alongside the other workers'
+ * traffic. The coordinator reaps its local workers as they exit and fails the
+ * run once all of them are gone with no other worker connected. Once every
+ * chunk is back, the segments are joined into the output with
+ * concat_segments(). Two-pass encodes are refused: their first pass covers the
+ * whole input, not a chunk.
+ */
+
+typedef struct TranscodeChunk {
+    int64_t start;
+    int64_t end;
+    int state;
+    int attempts;
+    int worker;
+    int failedWorker;
+} TranscodeChunk;
+
+int split_at_keyframes(const char *inputFilename, int chunkSeconds, TranscodeChunk **chunks, int *nbChunks);
+int run_coordinator(const char *program, const char *inputFilename, const char *outputFilename,
+                    const StreamingParams *streamParameters);
+int run_worker(const char *program, const char *address, int port);
+
+#endif
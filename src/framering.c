@@ -0,0 +1,538 @@
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "framering.h"
+
+#define FRAME_RING_MAGIC 0x46524e47
+#define FRAME_RING_WAIT_MS 100
+
+typedef struct FrameRingSlot {
+    atomic_uint_fast64_t holders;
+    uint32_t sequence;
+    int64_t pts;
+    int64_t duration;
+    int keyFrame;
+    int interlacedFrame;
+    int topFieldFirst;
+} FrameRingSlot;
+
+typedef struct FrameRingConsumer {
+    atomic_uint position;
+    atomic_int pid;
+    uint32_t maxLag;
+} FrameRingConsumer;
+
+typedef struct FrameRingHeader {
+    uint32_t magic;
+    int slotCount;
+    int64_t slotSize;
+    int width;
+    int height;
+    int format;
+    AVRational timeBase;
+    /* Futex words: frames published so far, and slots freed so far. */
+    atomic_uint published;
+    atomic_uint released;
+    atomic_int finished;
+    atomic_uint_fast64_t activeConsumers;
+    FrameRingConsumer consumers[FRAME_RING_MAX_CONSUMERS];
+    FrameRingSlot slots[];
+} FrameRingHeader;
+
+typedef struct FrameRingReference {
+    FrameRing *ring;
+    int slot;
+} FrameRingReference;
+
+
+static void futex_wait(atomic_uint *word, uint32_t expected) {
+#ifdef __linux__
+    struct timespec timeout = { 0, FRAME_RING_WAIT_MS * 1000000L };
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+#else
+    if (atomic_load(word) == expected)
+        av_usleep(1000);
+#endif
+}
+
+
+static void futex_wake(atomic_uint *word) {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+
+static size_t header_size(int slotCount) {
+    size_t size = sizeof(FrameRingHeader) + slotCount * sizeof(FrameRingSlot);
+    return FFALIGN(size, 4096);
+}
+
+
+static uint8_t *slot_data(const FrameRing *ring, int slot) {
+    return ring->slotData + slot * ring->header->slotSize;
+}
+
+
+static void release_holder(FrameRing *ring, int slot, uint64_t bit) {
+    FrameRingHeader *header = ring->header;
+
+    if ((atomic_fetch_and(&header->slots[slot].holders, ~bit) & ~bit) == 0) {
+        atomic_fetch_add(&header->released, 1);
+        futex_wake(&header->released);
+    }
+}
+
+
+/* Detach consumers whose process has gone, releasing every slot they still hold. */
+static int reap_consumers(FrameRing *ring) {
+    FrameRingHeader *header = ring->header;
+    uint64_t active = atomic_load(&header->activeConsumers);
+    int reaped = 0;
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        int pid = atomic_load(&header->consumers[i].pid);
+
+        if (!(active & bit) || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+
+        av_log(NULL, AV_LOG_WARNING, "Frame ring consumer %d (pid %d) has gone, detaching it\n", i, pid);
+        atomic_fetch_and(&header->activeConsumers, ~bit);
+        for (int slot = 0; slot < header->slotCount; slot++) {
+            if (atomic_load(&header->slots[slot].holders) & bit)
+                release_holder(ring, slot, bit);
+        }
+        reaped++;
+    }
+    return reaped;
+}
+
+
+static int map_ring(FrameRing *ring, int fd, size_t size) {
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (mapping == MAP_FAILED)
+        return AVERROR(errno);
+    ring->header = mapping;
+    ring->mappedSize = size;
+    return 0;
+}
+
+
+int frame_ring_create(FrameRing *ring, const char *name, int slotCount, int width, int height,
+                      enum AVPixelFormat format, AVRational timeBase) {
+    int64_t slotSize = av_image_get_buffer_size(format, width, height, FRAME_RING_ALIGN);
+    size_t size;
+    int fd, ret;
+
+    memset(ring, 0, sizeof(*ring));
+    if (slotSize < 0)
+        return slotSize;
+    slotSize = FFALIGN(slotSize, FRAME_RING_ALIGN);
+    size = header_size(slotCount) + slotCount * slotSize;
+
+    snprintf(ring->name, sizeof(ring->name), "/%s", name);
+    shm_unlink(ring->name);
+    fd = shm_open(ring->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not create frame ring %s: %s\n", ring->name, strerror(errno));
+        return AVERROR(errno);
+    }
+    if (ftruncate(fd, size) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    if ((ret = map_ring(ring, fd, size)) < 0)
+        goto fail;
+    close(fd);
+
+    ring->producer = 1;
+    ring->slotData = (uint8_t *)ring->header + header_size(slotCount);
+    ring->header->slotCount = slotCount;
+    ring->header->slotSize = slotSize;
+    ring->header->width = width;
+    ring->header->height = height;
+    ring->header->format = format;
+    ring->header->timeBase = timeBase;
+    atomic_thread_fence(memory_order_release);
+    ring->header->magic = FRAME_RING_MAGIC;
+
+    av_log(NULL, AV_LOG_INFO, "Frame ring %s: %d slots of %" PRId64 " bytes\n", ring->name, slotCount, slotSize);
+    return 0;
+
+    fail:
+    close(fd);
+    shm_unlink(ring->name);
+    return ret;
+}
+
+
+/* Deadline is in av_gettime_relative() time, or INT64_MAX to wait as long as it takes. */
+int frame_ring_wait_consumers(FrameRing *ring, int count, int64_t deadline) {
+    int attached;
+
+    av_log(NULL, AV_LOG_INFO, "Waiting for %d frame ring consumers\n", count);
+
+    while ((attached = __builtin_popcountll(atomic_load(&ring->header->activeConsumers))) < count) {
+        if (av_gettime_relative() >= deadline) {
+            av_log(NULL, AV_LOG_ERROR, "Only %d of %d frame ring consumers attached in time\n", attached, count);
+            return AVERROR(ETIMEDOUT);
+        }
+        av_usleep(10000);
+        reap_consumers(ring);
+    }
+    return 0;
+}
+
+
+int frame_ring_publish(FrameRing *ring, const AVFrame *frame) {
+    FrameRingHeader *header = ring->header;
+    uint32_t sequence = atomic_load(&header->published);
+    int slot = sequence % header->slotCount;
+    FrameRingSlot *ringSlot = &header->slots[slot];
+    uint8_t *data[4];
+    int linesize[4];
+    uint64_t active;
+
+    if (frame->width != header->width || frame->height != header->height || frame->format != header->format) {
+        av_log(NULL, AV_LOG_ERROR, "Frame ring only carries %dx%d frames of one format\n", header->width, header->height);
+        return AVERROR(EINVAL);
+    }
+
+    /* Wait for every consumer to let go of the frame that was in this slot a lap ago. */
+    if (atomic_load(&ringSlot->holders))
+        ring->stalls++;
+    while (atomic_load(&ringSlot->holders)) {
+        uint32_t released = atomic_load(&header->released);
+        if (!atomic_load(&ringSlot->holders))
+            break;
+        futex_wait(&header->released, released);
+        if (atomic_load(&ringSlot->holders) && reap_consumers(ring) == 0 && !atomic_load(&header->activeConsumers))
+            break;
+    }
+
+    active = atomic_load(&header->activeConsumers);
+    if (!active) {
+        av_log(NULL, AV_LOG_ERROR, "Every frame ring consumer has gone\n");
+        return AVERROR(EPIPE);
+    }
+
+    av_image_fill_arrays(data, linesize, slot_data(ring, slot), frame->format, frame->width, frame->height, FRAME_RING_ALIGN);
+    av_image_copy(data, linesize, (const uint8_t **)frame->data, frame->linesize, frame->format, frame->width, frame->height);
+    ringSlot->sequence = sequence;
+    ringSlot->pts = frame->best_effort_timestamp;
+    ringSlot->duration = frame->duration;
+    ringSlot->keyFrame = frame->key_frame;
+    ringSlot->interlacedFrame = frame->interlaced_frame;
+    ringSlot->topFieldFirst = frame->top_field_first;
+    atomic_store(&ringSlot->holders, active);
+
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        uint32_t lag;
+        if (!(active & ((uint64_t)1 << i)))
+            continue;
+        lag = sequence + 1 - atomic_load(&header->consumers[i].position);
+        if (lag > header->consumers[i].maxLag)
+            header->consumers[i].maxLag = lag;
+    }
+
+    atomic_store(&header->published, sequence + 1);
+    futex_wake(&header->published);
+    ring->frames++;
+    return 0;
+}
+
+
+void frame_ring_finish(FrameRing *ring) {
+    atomic_store(&ring->header->finished, 1);
+    futex_wake(&ring->header->published);
+}
+
+
+int frame_ring_open(FrameRing *ring, const char *name) {
+    FrameRingHeader *header;
+    size_t size;
+    int fd, ret;
+
+    memset(ring, 0, sizeof(*ring));
+    snprintf(ring->name, sizeof(ring->name), "/%s", name);
+
+    fd = shm_open(ring->name, O_RDWR, 0600);
+    if (fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open frame ring %s: %s\n", ring->name, strerror(errno));
+        return AVERROR(errno);
+    }
+    size = lseek(fd, 0, SEEK_END);
+    ret = map_ring(ring, fd, size);
+    close(fd);
+    if (ret < 0)
+        return ret;
+
+    header = ring->header;
+    if (header->magic != FRAME_RING_MAGIC) {
+        av_log(NULL, AV_LOG_ERROR, "Frame ring %s is not initialised\n", ring->name);
+        frame_ring_close(ring);
+        return AVERROR(EINVAL);
+    }
+    ring->slotData = (uint8_t *)header + header_size(header->slotCount);
+
+    /*
+     * Claim a consumer slot. The position is read before the claim, so every frame published from there on
+     * is either held for us or was sent out before we were active, and wait_next() skips the latter.
+     */
+    ring->consumerId = -1;
+    ring->position = atomic_load(&header->published);
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS && ring->consumerId < 0; i++) {
+        uint64_t active = atomic_load(&header->activeConsumers);
+        uint64_t bit = (uint64_t)1 << i;
+        while (!(active & bit)) {
+            if (atomic_compare_exchange_weak(&header->activeConsumers, &active, active | bit)) {
+                ring->consumerId = i;
+                break;
+            }
+        }
+    }
+    if (ring->consumerId >= 0) {
+        atomic_store(&header->consumers[ring->consumerId].position, ring->position);
+        atomic_store(&header->consumers[ring->consumerId].pid, getpid());
+        header->consumers[ring->consumerId].maxLag = 0;
+    }
+    if (ring->consumerId < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Frame ring %s already has %d consumers\n", ring->name, FRAME_RING_MAX_CONSUMERS);
+        frame_ring_close(ring);
+        return AVERROR(EBUSY);
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Attached to frame ring %s as consumer %d\n", ring->name, ring->consumerId);
+    return 0;
+}
+
+
+/* Block until the next slot this consumer holds is published, skipping any published before it attached. */
+static int wait_next(FrameRing *ring, FrameRingSlot **slot) {
+    FrameRingHeader *header = ring->header;
+    uint64_t bit = (uint64_t)1 << ring->consumerId;
+
+    while (1) {
+        uint32_t published = atomic_load(&header->published);
+        FrameRingSlot *next;
+
+        if (ring->position == published) {
+            if (atomic_load(&header->finished) && atomic_load(&header->published) == published)
+                return AVERROR_EOF;
+            futex_wait(&header->published, published);
+            continue;
+        }
+
+        next = &header->slots[ring->position % header->slotCount];
+        if (next->sequence == ring->position && (atomic_load(&next->holders) & bit)) {
+            *slot = next;
+            return 0;
+        }
+        atomic_store(&header->consumers[ring->consumerId].position, ++ring->position);
+    }
+}
+
+
+int frame_ring_peek(FrameRing *ring, int64_t *pts) {
+    FrameRingSlot *slot;
+    int ret;
+
+    if ((ret = wait_next(ring, &slot)) < 0)
+        return ret;
+    *pts = slot->pts;
+    return 0;
+}
+
+
+static void release_slot(void *opaque, uint8_t *data) {
+    FrameRingReference *reference = opaque;
+
+    release_holder(reference->ring, reference->slot, (uint64_t)1 << reference->ring->consumerId);
+    av_free(reference);
+}
+
+
+int frame_ring_receive(FrameRing *ring, AVFrame *frame) {
+    FrameRingHeader *header = ring->header;
+    FrameRingReference *reference;
+    FrameRingSlot *slot;
+    int index;
+    int ret;
+
+    if ((ret = wait_next(ring, &slot)) < 0)
+        return ret;
+    index = slot - header->slots;
+
+    reference = av_malloc(sizeof(*reference));
+    if (!reference)
+        return AVERROR(ENOMEM);
+    reference->ring = ring;
+    reference->slot = index;
+
+    frame->buf[0] = av_buffer_create(slot_data(ring, index), header->slotSize, release_slot, reference, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        av_free(reference);
+        return AVERROR(ENOMEM);
+    }
+    av_image_fill_arrays(frame->data, frame->linesize, slot_data(ring, index), header->format,
+                         header->width, header->height, FRAME_RING_ALIGN);
+    frame->format = header->format;
+    frame->width = header->width;
+    frame->height = header->height;
+    frame->pts = slot->pts;
+    frame->best_effort_timestamp = slot->pts;
+    frame->duration = slot->duration;
+    frame->time_base = header->timeBase;
+    frame->key_frame = slot->keyFrame;
+    frame->interlaced_frame = slot->interlacedFrame;
+    frame->top_field_first = slot->topFieldFirst;
+
+    atomic_store(&header->consumers[ring->consumerId].position, ++ring->position);
+    ring->frames++;
+    return 0;
+}
+
+
+void frame_ring_log(const FrameRing *ring) {
+    FrameRingHeader *header = ring->header;
+    uint32_t published = atomic_load(&header->published);
+
+    if (!ring->producer) {
+        av_log(NULL, AV_LOG_INFO, "Frame ring consumer %d: %" PRId64 " frames received, %u behind, at most %u\n",
+               ring->consumerId, ring->frames, published - ring->position, header->consumers[ring->consumerId].maxLag);
+        return;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Frame ring %s: %" PRId64 " frames published, %" PRId64 " waits for a free slot\n",
+           ring->name, ring->frames, ring->stalls);
+    for (int i = 0; i < FRAME_RING_MAX_CONSUMERS; i++) {
+        if (!header->consumers[i].pid)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "  consumer %d (pid %d): %u frames behind, at most %u%s\n", i,
+               atomic_load(&header->consumers[i].pid), published - atomic_load(&header->consumers[i].position),
+               header->consumers[i].maxLag,
+               atomic_load(&header->activeConsumers) & ((uint64_t)1 << i) ? "" : ", detached");
+    }
+}
+
+
+/* Consumers must have dropped every frame they received before closing. */
+void frame_ring_close(FrameRing *ring) {
+    FrameRingHeader *header = ring->header;
+
+    if (!header)
+        return;
+
+    if (ring->producer) {
+        shm_unlink(ring->name);
+    } else if (ring->consumerId >= 0 && header->magic == FRAME_RING_MAGIC) {
+        uint64_t bit = (uint64_t)1 << ring->consumerId;
+        atomic_fetch_and(&header->activeConsumers, ~bit);
+        for (int slot = 0; slot < header->slotCount; slot++) {
+            if (atomic_load(&header->slots[slot].holders) & bit)
+                release_holder(ring, slot, bit);
+        }
+    }
+
+    munmap(header, ring->mappedSize);
+    ring->header = NULL;
+}
+
+
+/* Decode the video of the input once and publish every frame to the ring. */
+int run_frame_publisher(const char *inputFilename, const char *name, const StreamingParams *streamParameters) {
+    StreamingContext decoder = {0};
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    FrameRing ring = {0};
+    int ret;
+
+    if ((ret = open_media(&decoder.formatContext, inputFilename)) < 0)
+        return ret;
+    if (prepare_decoder(&decoder) || !decoder.videoCodecContext) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    if ((ret = frame_ring_create(&ring, name, streamParameters->frameRingSlots, decoder.videoCodecContext->width,
+                                 decoder.videoCodecContext->height, decoder.videoCodecContext->pix_fmt,
+                                 decoder.videoStream->time_base)) < 0)
+        goto end;
+    if ((ret = frame_ring_wait_consumers(&ring, streamParameters->frameRingConsumers,
+                                         streamParameters->frameRingConsumerWait > 0 ?
+                                         av_gettime_relative() + streamParameters->frameRingConsumerWait * (int64_t)1000000 :
+                                         INT64_MAX)) < 0)
+        goto end;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (1) {
+        int eof = av_read_frame(decoder.formatContext, packet) < 0;
+
+        if (!eof && packet->stream_index != decoder.videoIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = avcodec_send_packet(decoder.videoCodecContext, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while sending video packet to decoder: %s\n", av_err2str(ret));
+            goto end;
+        }
+
+        while ((ret = avcodec_receive_frame(decoder.videoCodecContext, frame)) >= 0) {
+            ret = frame_ring_publish(&ring, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            av_log(NULL, AV_LOG_ERROR, "Error while receiving video frame from decoder: %s\n", av_err2str(ret));
+            goto end;
+        }
+        if (eof)
+            break;
+    }
+    ret = 0;
+
+    end:
+    if (ring.header) {
+        frame_ring_finish(&ring);
+        frame_ring_log(&ring);
+        frame_ring_close(&ring);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder.videoCodecContext);
+    free_audio_tracks(&decoder);
+    avformat_close_input(&decoder.formatContext);
+    return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+#include "testbed.h"
+
+/*
+ * Shared-memory ring of decoded video frames.
+ *
+ * One publisher process decodes the source once and copies each frame into
+ * the next slot of a POSIX shared memory ring. Consumer processes map the same
+ * ring and get AVFrames whose planes point straight into the slot, so the
+ * encoders read the decoded picture without a copy of their own.
+ *
+ * Each slot carries a bit mask of the consumers still holding it. The
+ * publisher sets it to the consumers attached when the frame goes out, and a
+ * consumer clears its bit when the last reference to its AVFrame is dropped.
+ * The publisher only reuses a slot once its mask is empty, so the slowest
+ * consumer sets the pace. New frames and freed slots are signalled with
+ * futexes on counters in the shared header; other platforms poll.
+ *
+ * The publisher starts once StreamingParams.frameRingConsumers consumers have
+ * attached, and gives up after frameRingConsumerWait seconds without them. It
+ * tracks how far each consumer is behind, in frames, and detaches consumers
+ * whose process has died so a crashed encoder cannot stall the rest. A consumer that holds frames for longer than the ring is deep
+ * (encoder lookahead that keeps references, for example) stalls the
+ * publisher, so the ring needs more slots than any consumer keeps in flight.
+ */
+
+#define FRAME_RING_MAX_CONSUMERS 64
+#define FRAME_RING_ALIGN 64
+
+typedef struct FrameRing {
+    struct FrameRingHeader *header;
+    uint8_t *slotData;
+    size_t mappedSize;
+    char name[64];
+    int producer;
+    int consumerId;
+    uint32_t position;
+    int64_t frames;
+    int64_t stalls;
+} FrameRing;
+
+int frame_ring_create(FrameRing *ring, const char *name, int slotCount, int width, int height,
+                      enum AVPixelFormat format, AVRational timeBase);
+int frame_ring_wait_consumers(FrameRing *ring, int count, int64_t deadline);
+int frame_ring_publish(FrameRing *ring, const AVFrame *frame);
+void frame_ring_finish(FrameRing *ring);
+int frame_ring_open(FrameRing *ring, const char *name);
+int frame_ring_peek(FrameRing *ring, int64_t *pts);
+int frame_ring_receive(FrameRing *ring, AVFrame *frame);
+void frame_ring_log(const FrameRing *ring);
+void frame_ring_close(FrameRing *ring);
+int run_frame_publisher(const char *inputFilename, const char *name, const StreamingParams *streamParameters);
+
+#endif
@@ -0,0 +1,168 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "interlace.h"
+
+/* Number of places in the input the field order sample is taken from. */
+#define FIELD_ORDER_SAMPLE_POINTS 4
+
+
+int field_order_is_interlaced(enum AVFieldOrder fieldOrder) {
+    return fieldOrder == AV_FIELD_TT || fieldOrder == AV_FIELD_BB ||
+           fieldOrder == AV_FIELD_TB || fieldOrder == AV_FIELD_BT;
+}
+
+
+int field_order_is_top_first(enum AVFieldOrder fieldOrder) {
+    return fieldOrder == AV_FIELD_TT || fieldOrder == AV_FIELD_BT;
+}
+
+
+static int sample_field_flags(AVFormatContext *formatContext, AVCodecContext *decoderContext, int videoIndex,
+                              AVPacket *packet, AVFrame *frame, int maxFrames, FieldOrderInfo *info) {
+    int sampledFrames = 0;
+    int ret = 0;
+
+    while (sampledFrames < maxFrames && (ret = av_read_frame(formatContext, packet)) >= 0) {
+        if (packet->stream_index != videoIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        ret = avcodec_send_packet(decoderContext, packet);
+        av_packet_unref(packet);
+        if (ret < 0 && ret != AVERROR_INVALIDDATA)
+            return ret;
+
+        while (sampledFrames < maxFrames) {
+            ret = avcodec_receive_frame(decoderContext, frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
+            } else if (ret < 0) {
+                return ret;
+            }
+
+            info->sampledFrames++;
+            if (frame->interlaced_frame) {
+                info->interlacedFrames++;
+                if (frame->top_field_first)
+                    info->topFieldFirstFrames++;
+            }
+            av_frame_unref(frame);
+            sampledFrames++;
+        }
+    }
+
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        return ret;
+
+    return sampledFrames;
+}
+
+
+/*
+ * Samples with the job's own, already open, video decoder, then seeks back to the start and flushes it. Sampling
+ * failures and inputs that can't seek back fall back to the stream's field order; only failing to rewind after
+ * sampling is an error.
+ */
+int detect_field_order(StreamingContext *decoder, int sampleFrames, FieldOrderInfo *info) {
+    AVFormatContext *formatContext = decoder->formatContext;
+    AVCodecContext *decoderContext = decoder->videoCodecContext;
+    AVStream *videoStream = decoder->videoStream;
+    enum AVDiscard skipLoopFilter = decoderContext->skip_loop_filter;
+    enum AVDiscard skipIdct = decoderContext->skip_idct;
+    int64_t startTime = videoStream->start_time != AV_NOPTS_VALUE ? videoStream->start_time : 0;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    int framesPerPoint = FFMAX(sampleFrames / FIELD_ORDER_SAMPLE_POINTS, 1);
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    info->fieldOrder = videoStream->codecpar->field_order;
+
+    if (!formatContext->pb || !(formatContext->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        av_log(NULL, AV_LOG_INFO, "Field order: the input can't be rewound after sampling, using the stream's\n");
+        return 0;
+    }
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return AVERROR(ENOMEM);
+    }
+
+    /* The field flags don't depend on the pixels, so decode as cheaply as an open decoder allows. */
+    decoderContext->skip_loop_filter = AVDISCARD_ALL;
+    decoderContext->skip_idct = AVDISCARD_ALL;
+
+    for (int point = 0; point < FIELD_ORDER_SAMPLE_POINTS; point++) {
+        if (point > 0 && formatContext->duration > 0) {
+            int64_t pointOffset = formatContext->duration * point / FIELD_ORDER_SAMPLE_POINTS;
+
+            av_seek_frame(formatContext, decoder->videoIndex,
+                          startTime + av_rescale_q(pointOffset, AV_TIME_BASE_Q, videoStream->time_base),
+                          AVSEEK_FLAG_BACKWARD);
+            avcodec_flush_buffers(decoderContext);
+        }
+
+        if ((ret = sample_field_flags(formatContext, decoderContext, decoder->videoIndex, packet, frame, framesPerPoint, info)) < 0)
+            break;
+        if (ret < framesPerPoint && formatContext->duration <= 0)
+            break;
+    }
+
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Field order sampling failed, using the stream's: %s\n", av_err2str(ret));
+    } else if (info->sampledFrames > 0 && info->interlacedFrames * 2 > info->sampledFrames) {
+        info->fieldOrder = info->topFieldFirstFrames * 2 >= info->interlacedFrames ? AV_FIELD_TT : AV_FIELD_BB;
+    } else if (info->sampledFrames > 0) {
+        info->fieldOrder = AV_FIELD_PROGRESSIVE;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Field order: %d of %d sampled frames interlaced, %d top field first\n",
+           info->interlacedFrames, info->sampledFrames, info->topFieldFirstFrames);
+
+    decoderContext->skip_loop_filter = skipLoopFilter;
+    decoderContext->skip_idct = skipIdct;
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+
+    ret = av_seek_frame(formatContext, decoder->videoIndex, startTime, AVSEEK_FLAG_BACKWARD);
+    avcodec_flush_buffers(decoderContext);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not seek back to the start after sampling the field order\n");
+    return ret < 0 ? ret : 0;
+}
+
+
+int build_video_filter_spec(enum AVFieldOrder sourceOrder, enum AVFieldOrder outputOrder, const char *deinterlacer,
+                            char *filterSpec, int filterSpecSize) {
+    int sourceInterlaced = field_order_is_interlaced(sourceOrder);
+    int outputInterlaced = field_order_is_interlaced(outputOrder);
+
+    if (sourceInterlaced && !outputInterlaced) {
+        /* send_frame keeps the frame rate, so timestamps and GOP settings stay valid. */
+        return snprintf(filterSpec, filterSpecSize, "%s=mode=send_frame:parity=auto:deint=all",
+                        deinterlacer ? deinterlacer : "bwdif");
+    }
+
+    if (outputInterlaced) {
+        /* Any pixel format conversion has to work on each field on its own. */
+        if (sourceInterlaced && field_order_is_top_first(sourceOrder) != field_order_is_top_first(outputOrder)) {
+            return snprintf(filterSpec, filterSpecSize, "fieldorder=%s,scale=interl=1",
+                            field_order_is_top_first(outputOrder) ? "tff" : "bff");
+        }
+        if (sourceInterlaced)
+            return snprintf(filterSpec, filterSpecSize, "scale=interl=1");
+    }
+
+    return snprintf(filterSpec, filterSpecSize, "null");
+}
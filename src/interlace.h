@@ -0,0 +1,30 @@
+#ifndef INTERLACE_H
+#define INTERLACE_H
+
+#include "testbed.h"
+
+/*
+ * Field order detection and the interlace handling of the video filter graph.
+ *
+ * The source field order is voted on from the interlaced_frame/top_field_first
+ * flags of a few short runs of frames spread through the input, decoded by the
+ * job's own decoder before it starts, with the stream's field_order as
+ * fallback. The video graph then keeps fields
+ * intact (reordering them if the output order differs) for interlaced output,
+ * or runs a slice threaded deinterlacer for progressive output.
+ */
+
+typedef struct FieldOrderInfo {
+    enum AVFieldOrder fieldOrder;
+    int sampledFrames;
+    int interlacedFrames;
+    int topFieldFirstFrames;
+} FieldOrderInfo;
+
+int field_order_is_interlaced(enum AVFieldOrder fieldOrder);
+int field_order_is_top_first(enum AVFieldOrder fieldOrder);
+int detect_field_order(StreamingContext *decoder, int sampleFrames, FieldOrderInfo *info);
+int build_video_filter_spec(enum AVFieldOrder sourceOrder, enum AVFieldOrder outputOrder, const char *deinterlacer,
+                            char *filterSpec, int filterSpecSize);
+
+#endif
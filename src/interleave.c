@@ -0,0 +1,234 @@
+#include <libavformat/avformat.h>
+#include <libavutil/fifo.h>
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "libavutil/mem.h"
+
+#include "interleave.h"
+#include "membudget.h"
+#include "trace.h"
+#include "metrics.h"
+
+/* Queue room allocated per stream up front, in packets; the FIFOs grow past it. */
+#define INTERLEAVE_INITIAL_QUEUE 64
+
+
+static int64_t packet_time(const PacketInterleaver *interleaver, const AVPacket *packet) {
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+    if (ts == AV_NOPTS_VALUE)
+        return interleaver->streams[packet->stream_index].lastDts;
+    return av_rescale_q(ts, interleaver->formatContext->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+}
+
+
+int packet_interleaver_init(PacketInterleaver *interleaver, AVFormatContext *formatContext,
+                            int64_t maxDelta, size_t maxBytes) {
+    memset(interleaver, 0, sizeof(*interleaver));
+    interleaver->formatContext = formatContext;
+    interleaver->maxDelta = maxDelta;
+    interleaver->maxBytes = maxBytes;
+    interleaver->nbStreams = formatContext->nb_streams;
+
+    interleaver->streams = av_calloc(interleaver->nbStreams, sizeof(*interleaver->streams));
+    if (!interleaver->streams)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < interleaver->nbStreams; i++) {
+        interleaver->streams[i].lastDts = AV_NOPTS_VALUE;
+        interleaver->streams[i].queue = av_fifo_alloc2(INTERLEAVE_INITIAL_QUEUE, sizeof(AVPacket *),
+                                                       AV_FIFO_FLAG_AUTO_GROW);
+        if (!interleaver->streams[i].queue)
+            return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+
+static int write_queued_packet(PacketInterleaver *interleaver, int streamIndex) {
+    InterleaveStream *stream = &interleaver->streams[streamIndex];
+    AVPacket *packet;
+    int ret;
+
+    av_fifo_read(stream->queue, &packet, 1);
+    stream->queuedBytes -= packet->size;
+    interleaver->queuedBytes -= packet->size;
+    interleaver->queuedPackets--;
+    metrics_add(METRICS_INTERLEAVE_PACKETS, -1);
+    metrics_add(METRICS_INTERLEAVE_BYTES, -packet->size);
+    if (interleaver->memoryBudget)
+        memory_budget_release(interleaver->memoryBudget, MEMORY_QUEUES, packet->size);
+
+    TRACE_BEGIN("av_write_frame", "mux");
+    ret = av_write_frame(interleaver->formatContext, packet);
+    TRACE_END("av_write_frame", "mux");
+    av_packet_free(&packet);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while writing interleaved packet: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    interleaver->writtenPackets++;
+    return 0;
+}
+
+
+/* Write out queued packets in dts order for as long as the queue allows it. */
+static int drain_queue(PacketInterleaver *interleaver, int flushAll) {
+    int ret;
+
+    while (interleaver->queuedPackets > 0) {
+        int64_t oldestDts = INT64_MAX;
+        int64_t newestDts = INT64_MIN;
+        int oldestStream = -1;
+        int waiting = 0;
+
+        for (int i = 0; i < interleaver->nbStreams; i++) {
+            InterleaveStream *stream = &interleaver->streams[i];
+            AVPacket *head;
+
+            if (stream->lastDts != AV_NOPTS_VALUE)
+                newestDts = FFMAX(newestDts, stream->lastDts);
+
+            if (!av_fifo_can_read(stream->queue)) {
+                if (!stream->finished)
+                    waiting = 1;
+                continue;
+            }
+
+            av_fifo_peek(stream->queue, &head, 1, 0);
+            if (packet_time(interleaver, head) < oldestDts) {
+                oldestDts = packet_time(interleaver, head);
+                oldestStream = i;
+            }
+        }
+
+        if (waiting && !flushAll) {
+            if (interleaver->memoryBudget && memory_budget_over(interleaver->memoryBudget)) {
+                interleaver->memoryBudget->throttleEvents++;
+                interleaver->forcedWrites++;
+            } else if (newestDts - oldestDts > interleaver->maxDelta ||
+                       interleaver->queuedBytes > interleaver->maxBytes) {
+                interleaver->forcedWrites++;
+            } else {
+                break;
+            }
+        }
+
+        if ((ret = write_queued_packet(interleaver, oldestStream)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+
+int packet_interleaver_write(PacketInterleaver *interleaver, AVPacket *packet) {
+    InterleaveStream *stream;
+    AVPacket *queued;
+
+    if (packet->stream_index < 0 || packet->stream_index >= interleaver->nbStreams)
+        return AVERROR(EINVAL);
+    stream = &interleaver->streams[packet->stream_index];
+
+    queued = av_packet_alloc();
+    if (!queued)
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(queued, packet);
+
+    stream->lastDts = packet_time(interleaver, queued);
+    if (av_fifo_write(stream->queue, &queued, 1) < 0) {
+        av_packet_free(&queued);
+        return AVERROR(ENOMEM);
+    }
+
+    stream->queuedBytes += queued->size;
+    interleaver->queuedBytes += queued->size;
+    interleaver->queuedPackets++;
+    metrics_add(METRICS_INTERLEAVE_PACKETS, 1);
+    metrics_add(METRICS_INTERLEAVE_BYTES, queued->size);
+    if (interleaver->memoryBudget)
+        memory_budget_charge(interleaver->memoryBudget, MEMORY_QUEUES, queued->size);
+    interleaver->peakPackets = FFMAX(interleaver->peakPackets, interleaver->queuedPackets);
+    interleaver->peakBytes = FFMAX(interleaver->peakBytes, interleaver->queuedBytes);
+
+    return drain_queue(interleaver, 0);
+}
+
+
+int packet_interleaver_stream_ahead(const PacketInterleaver *interleaver, int streamIndex) {
+    const InterleaveStream *stream = &interleaver->streams[streamIndex];
+    int64_t slowestDts = INT64_MAX;
+
+    if (!av_fifo_can_read(stream->queue) || stream->lastDts == AV_NOPTS_VALUE)
+        return 0;
+
+    for (int i = 0; i < interleaver->nbStreams; i++) {
+        const InterleaveStream *other = &interleaver->streams[i];
+
+        if (i == streamIndex || other->finished)
+            continue;
+        /* A stream that hasn't produced anything yet (encoder lookahead) is the slowest. */
+        if (other->lastDts == AV_NOPTS_VALUE)
+            return interleaver->queuedBytes > interleaver->maxBytes / 2;
+        slowestDts = FFMIN(slowestDts, other->lastDts);
+    }
+
+    if (slowestDts == INT64_MAX)
+        return 0;
+    return stream->lastDts - slowestDts > interleaver->maxDelta / 2;
+}
+
+
+int packet_interleaver_finish_stream(PacketInterleaver *interleaver, int streamIndex) {
+    interleaver->streams[streamIndex].finished = 1;
+    return drain_queue(interleaver, 0);
+}
+
+
+int packet_interleaver_flush(PacketInterleaver *interleaver) {
+    return drain_queue(interleaver, 1);
+}
+
+
+/* Move a flushed interleaver on to a new muxer with the same streams, keeping its counters. */
+int packet_interleaver_set_output(PacketInterleaver *interleaver, AVFormatContext *formatContext) {
+    if (interleaver->queuedPackets > 0 || formatContext->nb_streams != interleaver->nbStreams)
+        return AVERROR(EINVAL);
+
+    interleaver->formatContext = formatContext;
+    for (int i = 0; i < interleaver->nbStreams; i++) {
+        interleaver->streams[i].lastDts = AV_NOPTS_VALUE;
+        interleaver->streams[i].finished = 0;
+    }
+    return 0;
+}
+
+
+void packet_interleaver_log_stats(const PacketInterleaver *interleaver) {
+    av_log(NULL, AV_LOG_INFO, "Interleaver: %" PRId64 " packets written, peak queue %d packets / %zu bytes, "
+           "%" PRId64 " written early to stay within budget\n",
+           interleaver->writtenPackets, interleaver->peakPackets, interleaver->peakBytes, interleaver->forcedWrites);
+}
+
+
+void packet_interleaver_uninit(PacketInterleaver *interleaver) {
+    AVPacket *packet;
+
+    if (!interleaver->streams)
+        return;
+
+    for (int i = 0; i < interleaver->nbStreams; i++) {
+        if (!interleaver->streams[i].queue)
+            continue;
+        while (av_fifo_read(interleaver->streams[i].queue, &packet, 1) >= 0)
+            av_packet_free(&packet);
+        av_fifo_freep2(&interleaver->streams[i].queue);
+    }
+    metrics_add(METRICS_INTERLEAVE_PACKETS, -interleaver->queuedPackets);
+    metrics_add(METRICS_INTERLEAVE_BYTES, -(int64_t)interleaver->queuedBytes);
+    av_freep(&interleaver->streams);
+}
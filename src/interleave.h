@@ -0,0 +1,56 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include <libavformat/avformat.h>
+#include <libavutil/fifo.h>
+
+/*
+ * Bounded packet interleaving in front of the muxer.
+ *
+ * Packets are queued per output stream and written in dts order with
+ * av_write_frame once every unfinished stream has something queued, so the
+ * muxer's own interleaving queue stays empty. Like max_interleave_delta, a
+ * packet is written anyway once the queue spans more than maxDelta, or once
+ * the queued packets exceed maxBytes or the job's memory budget.
+ *
+ * packet_interleaver_stream_ahead() is the backpressure signal: it reports a
+ * stream whose newest packet is more than half the delta past the slowest
+ * unfinished stream, so the caller can stop feeding that encoder until the
+ * others catch up instead of letting the queue grow to the limit.
+ */
+
+typedef struct InterleaveStream {
+    AVFifo *queue;
+    int64_t lastDts;
+    size_t queuedBytes;
+    int finished;
+} InterleaveStream;
+
+typedef struct PacketInterleaver {
+    AVFormatContext *formatContext;
+    InterleaveStream *streams;
+    int nbStreams;
+
+    int64_t maxDelta;
+    size_t maxBytes;
+    struct MemoryBudget *memoryBudget;
+
+    int queuedPackets;
+    size_t queuedBytes;
+    int peakPackets;
+    size_t peakBytes;
+    int64_t writtenPackets;
+    int64_t forcedWrites;
+} PacketInterleaver;
+
+int packet_interleaver_init(PacketInterleaver *interleaver, AVFormatContext *formatContext,
+                            int64_t maxDelta, size_t maxBytes);
+int packet_interleaver_write(PacketInterleaver *interleaver, AVPacket *packet);
+int packet_interleaver_stream_ahead(const PacketInterleaver *interleaver, int streamIndex);
+int packet_interleaver_finish_stream(PacketInterleaver *interleaver, int streamIndex);
+int packet_interleaver_flush(PacketInterleaver *interleaver);
+int packet_interleaver_set_output(PacketInterleaver *interleaver, AVFormatContext *formatContext);
+void packet_interleaver_log_stats(const PacketInterleaver *interleaver);
+void packet_interleaver_uninit(PacketInterleaver *interleaver);
+
+#endif
@@ -0,0 +1,173 @@
+#include <libavutil/avutil.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "testbed.h"
+#include "pixconvert.h"
+#include "overlay.h"
+#include "complexity.h"
+#include "checkpoint.h"
+#include "sweep.h"
+#include "distribute.h"
+#include "framering.h"
+#include "daemon.h"
+#include "progress.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Command line front end for libtestbed: the benchmark and tool modes, and
+ * otherwise one job from the input to the output named on the command line.
+ */
+
+int main(int argc, char **argv) {
+
+    StreamingParams testParameters;
+    testbed_default_params(&testParameters);
+
+    StreamingParams *pParams = &testParameters;
+
+    TestbedJob *job;
+    int ret;
+
+    /* --metrics <port> ahead of anything else: serve Prometheus metrics on localhost for as long as the rest runs. */
+    if (argc >= 3 && strcmp(argv[1], "--metrics") == 0) {
+        testParameters.metricsPort = atoi(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if (testParameters.metricsPort > 0 && metrics_start(testParameters.metricsAddress, testParameters.metricsPort) < 0) {
+        return -1;
+    }
+
+    /* --trace <file> next: record a timeline of the job, or of every daemon job, written out when it ends. */
+    if (argc >= 3 && strcmp(argv[1], "--trace") == 0) {
+        testParameters.traceFile = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (testParameters.traceFile && trace_init(testParameters.traceCapacity) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to allocate the trace buffer\n");
+        return AVERROR(ENOMEM);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--bench-convert") == 0) {
+        int width = 1920, height = 1080, iterations = 100;
+        if (argc >= 3) {
+            sscanf(argv[2], "%dx%d", &width, &height);
+        }
+        if (argc >= 4) {
+            iterations = atoi(argv[3]);
+        }
+        return benchmark_pixel_converter(width, height, iterations) ? 1 : 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--bench-overlay") == 0) {
+        int width = 1920, height = 1080, iterations = 100;
+        if (argc >= 3) {
+            sscanf(argv[2], "%dx%d", &width, &height);
+        }
+        if (argc >= 4) {
+            iterations = atoi(argv[3]);
+        }
+        return benchmark_graphics_overlay(width, height, iterations) ? 1 : 0;
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--analyse") == 0) {
+        ComplexityResult complexity;
+        if (analyse_complexity(argv[2], pParams, &complexity) < 0) {
+            return -1;
+        }
+        printf("recommended_bitrate=%" PRId64 "\nrecommended_crf=%d\n", complexity.recommendedBitRate, complexity.recommendedCrf);
+        return 0;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--compare") == 0) {
+        return compare_video_packets(argv[2], argv[3]) != 0;
+    }
+
+    /* --playlist <list file> <output>: the list holds one input per line, transcoded back to back into one output. */
+    if (argc >= 4 && strcmp(argv[1], "--playlist") == 0) {
+        testParameters.playlist = argv[2];
+        argv += 1;
+        argc -= 1;
+    }
+
+    /* --sweep <clip> [grid file, or - for the default grid] [report csv, stdout when omitted] */
+    if (argc >= 3 && strcmp(argv[1], "--sweep") == 0) {
+        const char *gridFilename = argc >= 4 && strcmp(argv[3], "-") != 0 ? argv[3] : NULL;
+        return run_sweep(argv[2], gridFilename, argc >= 5 ? argv[4] : NULL, pParams) < 0;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--coordinate") == 0) {
+        return run_coordinator(argv[0], argv[2], argv[3], pParams) < 0;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--worker") == 0) {
+        return run_worker(argv[0], argv[2], atoi(argv[3])) < 0;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--publish") == 0) {
+        return run_frame_publisher(argv[2], argv[3], pParams) < 0;
+    }
+
+    /* --daemon [socket]: serve jobs over a Unix socket until SIGINT or SIGTERM. */
+    if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+        ret = run_daemon(argc >= 3 ? argv[2] : testParameters.daemonSocket, pParams);
+        metrics_stop();
+        if (testParameters.traceFile) {
+            trace_write(testParameters.traceFile);
+            trace_uninit();
+        }
+        return ret < 0;
+    }
+
+    /* --submit <socket> <input> <output> [setting=value...]: run one job on a daemon. */
+    if (argc >= 5 && strcmp(argv[1], "--submit") == 0) {
+        return run_daemon_client(argv[2], argv[3], argv[4], argv + 5, argc - 5) != 0;
+    }
+
+    /* --progress <board>: print the jobs on a progress board, one per line. */
+    if (argc >= 3 && strcmp(argv[1], "--progress") == 0) {
+        return progress_board_print(argv[2]) < 0;
+    }
+
+    /* Take decoded video from a publisher's frame ring: the rest of the arguments are the usual input and output. */
+    if (argc >= 5 && strcmp(argv[1], "--consume") == 0) {
+        testParameters.frameRing = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    /* A single chunk for a worker: the rest of the arguments are the usual input and output. */
+    if (argc >= 6 && strcmp(argv[1], "--chunk") == 0) {
+        testParameters.chunkStart = strtoll(argv[2], NULL, 10);
+        testParameters.chunkEnd = strtoll(argv[3], NULL, 10);
+        argv += 3;
+        argc -= 3;
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+        return -1;
+    }
+
+    job = testbed_job_create(pParams, argv[1], argv[2]);
+    if (!job) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to create the job\n");
+        return AVERROR(ENOMEM);
+    }
+    ret = testbed_job_run(job);
+    testbed_job_free(&job);
+    metrics_stop();
+
+    if (testParameters.traceFile) {
+        trace_write(testParameters.traceFile);
+        trace_uninit();
+    }
+
+    return ret < 0 ? -1 : 0;
+}
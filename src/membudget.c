@@ -0,0 +1,390 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "membudget.h"
+
+/* Reference frames a decoder keeps on top of one frame per thread. */
+#define DECODER_REFERENCE_FRAMES 4
+/* Frames in flight between buffersrc, buffersink and the conversion stage. */
+#define FILTER_FRAMES 3
+/* Default AVIOContext buffer, for contexts that aren't open yet. */
+#define IO_BUFFER_SIZE 32768
+#define ADMISSION_POLL_SECONDS 1
+/* How often a waiting job says it is still waiting. */
+#define ADMISSION_LOG_SECONDS 30
+/* How often a waiting job looks at its cancel flag. */
+#define ADMISSION_CANCEL_POLL_US 100000
+
+static const char *const category_names[MEMORY_CATEGORIES] = {
+    [MEMORY_FRAMES] = "frames",
+    [MEMORY_QUEUES] = "queues",
+    [MEMORY_IO]     = "io",
+};
+
+
+void memory_budget_init(MemoryBudget *budget, int64_t limit) {
+    memset(budget, 0, sizeof(*budget));
+    budget->limit = limit;
+}
+
+
+void memory_budget_charge(MemoryBudget *budget, enum MemoryCategory category, int64_t bytes) {
+    budget->used[category] += bytes;
+    budget->total += bytes;
+    budget->peak = FFMAX(budget->peak, budget->total);
+}
+
+
+void memory_budget_release(MemoryBudget *budget, enum MemoryCategory category, int64_t bytes) {
+    budget->used[category] -= bytes;
+    budget->total -= bytes;
+}
+
+
+int memory_budget_over(const MemoryBudget *budget) {
+    return budget->limit > 0 && budget->total > budget->limit;
+}
+
+
+int64_t memory_budget_available(const MemoryBudget *budget) {
+    if (budget->limit <= 0)
+        return INT64_MAX;
+    return FFMAX(budget->limit - budget->total, 0);
+}
+
+
+void memory_budget_log(const MemoryBudget *budget) {
+    for (int i = 0; i < MEMORY_CATEGORIES; i++)
+        av_log(NULL, AV_LOG_INFO, "Memory %s: %" PRId64 " bytes\n", category_names[i], budget->used[i]);
+    av_log(NULL, AV_LOG_INFO, "Memory peak %" PRId64 " of %" PRId64 " bytes budget, %" PRId64 " throttle events\n",
+           budget->peak, budget->limit, budget->throttleEvents);
+}
+
+
+int64_t estimate_job_memory(StreamingContext *decoder, StreamingContext *encoder, const StreamingParams *streamParameters,
+                            int64_t *categories) {
+    int64_t total = 0;
+
+    memset(categories, 0, sizeof(*categories) * MEMORY_CATEGORIES);
+
+    if (decoder->videoCodecContext && encoder->videoCodecContext) {
+        AVCodecContext *decodeContext = decoder->videoCodecContext;
+        AVCodecContext *encodeContext = encoder->videoCodecContext;
+        int64_t inputFrameBytes = av_image_get_buffer_size(decodeContext->pix_fmt, decodeContext->width, decodeContext->height, 1);
+        int64_t outputFrameBytes = av_image_get_buffer_size(encodeContext->pix_fmt, encodeContext->width, encodeContext->height, 1);
+        int decodeThreads = decodeContext->thread_count > 0 ? decodeContext->thread_count : av_cpu_count();
+
+        /* delay is the encoder's own count of frames it holds back (x264 lookahead and frame threads). */
+        categories[MEMORY_FRAMES] += FFMAX(inputFrameBytes, 0) * (decodeThreads + DECODER_REFERENCE_FRAMES);
+        categories[MEMORY_FRAMES] += FFMAX(outputFrameBytes, 0) * (FILTER_FRAMES + encodeContext->delay + FFMAX(encodeContext->refs, 1));
+    }
+
+    /* A second of decoded and a second of resampled audio per track covers the filter graph and the FIFO. */
+    for (int i = 0; i < FFMIN(decoder->nbAudioStreams, encoder->nbAudioStreams); i++) {
+        AVCodecContext *decodeContext = decoder->audioTrackContexts[i];
+        AVCodecContext *encodeContext = encoder->audioTrackContexts[i];
+
+        categories[MEMORY_FRAMES] += (int64_t)decodeContext->sample_rate * decodeContext->ch_layout.nb_channels *
+                                     av_get_bytes_per_sample(decodeContext->sample_fmt);
+        categories[MEMORY_FRAMES] += (int64_t)encodeContext->sample_rate * encodeContext->ch_layout.nb_channels *
+                                     av_get_bytes_per_sample(encodeContext->sample_fmt);
+    }
+
+    categories[MEMORY_QUEUES] = streamParameters->interleaveBufferSize;
+
+    categories[MEMORY_IO] += decoder->formatContext && decoder->formatContext->pb ? decoder->formatContext->pb->buffer_size : IO_BUFFER_SIZE;
+    categories[MEMORY_IO] += encoder->formatContext && encoder->formatContext->pb ? encoder->formatContext->pb->buffer_size : IO_BUFFER_SIZE;
+
+    for (int i = 0; i < MEMORY_CATEGORIES; i++)
+        total += categories[i];
+    return total;
+}
+
+
+int64_t host_memory_available(int64_t *total) {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    int64_t memTotal = -1, memAvailable = -1;
+    char line[256];
+    long long value;
+
+    if (meminfo) {
+        while (fgets(line, sizeof(line), meminfo)) {
+            if (sscanf(line, "MemTotal: %lld kB", &value) == 1)
+                memTotal = value * 1024;
+            else if (sscanf(line, "MemAvailable: %lld kB", &value) == 1)
+                memAvailable = value * 1024;
+        }
+        fclose(meminfo);
+    }
+
+    if (memTotal < 0)
+        memTotal = (int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (memAvailable < 0)
+        memAvailable = (int64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    if (total)
+        *total = memTotal;
+    return memAvailable;
+}
+
+
+static atomic_int_fast64_t next_admission_token = 1;
+static pthread_once_t default_ledger_once = PTHREAD_ONCE_INIT;
+static char default_ledger[PATH_MAX];
+
+
+static void build_default_ledger(void) {
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+
+    if (runtimeDir && runtimeDir[0] == '/')
+        snprintf(default_ledger, sizeof(default_ledger), "%s/ffmpeg_testbed_admission", runtimeDir);
+    else
+        snprintf(default_ledger, sizeof(default_ledger), "/tmp/ffmpeg_testbed_admission-%ld", (long)geteuid());
+}
+
+
+/* The user's runtime directory, which nobody else can write to, or a /tmp name of the user's own otherwise. */
+const char *admission_default_ledger(void) {
+    pthread_once(&default_ledger_once, build_default_ledger);
+    return default_ledger;
+}
+
+
+/* Another user's file, or a link to one, at the ledger path could hold back or deny every job, so only ours will do. */
+static int open_ledger(const char *ledgerPath, int flags, FILE **ledger) {
+    struct stat ledgerStat;
+    int fd = open(ledgerPath, flags | O_RDWR | O_NOFOLLOW | O_CLOEXEC, 0600);
+    int err;
+
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &ledgerStat) < 0) {
+        err = AVERROR(errno);
+        close(fd);
+        return err;
+    }
+    if (!S_ISREG(ledgerStat.st_mode) || ledgerStat.st_uid != geteuid() || (ledgerStat.st_mode & 022)) {
+        av_log(NULL, AV_LOG_ERROR, "Admission ledger %s is not a private file of this user\n", ledgerPath);
+        close(fd);
+        return AVERROR(EPERM);
+    }
+    if (!(*ledger = fdopen(fd, "r+"))) {
+        err = AVERROR(errno);
+        close(fd);
+        return err;
+    }
+    return 0;
+}
+
+
+/*
+ * Drop entries of processes that have gone and the job's own entry from the
+ * ledger text, leaving the rest in kept and summing the reservations of those
+ * that aren't paused. Entries are "pid token bytes paused": jobs in one
+ * process share a pid, so the token tells them apart.
+ */
+static int scan_ledger(FILE *ledger, int64_t token, char **kept, int64_t *reserved, int *jobs) {
+    char line[128];
+    size_t length = 0, size = 0;
+    long pid;
+    long long entryToken, bytes;
+    int paused;
+
+    *reserved = 0;
+    *jobs = 0;
+    *kept = NULL;
+
+    rewind(ledger);
+    while (fgets(line, sizeof(line), ledger)) {
+        size_t lineLength = strlen(line);
+
+        paused = 0;
+        if (sscanf(line, "%ld %lld %lld %d", &pid, &entryToken, &bytes, &paused) < 3)
+            continue;
+        if (pid == getpid() && entryToken == token)
+            continue;
+        if (kill((pid_t)pid, 0) < 0 && errno != EPERM)
+            continue;
+
+        if (!paused) {
+            *reserved += bytes;
+            (*jobs)++;
+        }
+        if (length + lineLength + 1 > size) {
+            size_t newSize = FFMAX(2 * size, length + lineLength + 1);
+            char *grown = av_realloc(*kept, newSize);
+            if (!grown) {
+                av_freep(kept);
+                return AVERROR(ENOMEM);
+            }
+            *kept = grown;
+            size = newSize;
+        }
+        memcpy(*kept + length, line, lineLength + 1);
+        length += lineLength;
+    }
+    if (ferror(ledger)) {
+        av_freep(kept);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+
+static int rewrite_ledger(FILE *ledger, const char *kept, int64_t token, int64_t ownBytes, int paused) {
+    rewind(ledger);
+    if (kept)
+        fputs(kept, ledger);
+    if (ownBytes > 0)
+        fprintf(ledger, "%ld %" PRId64 " %" PRId64 " %d\n", (long)getpid(), token, ownBytes, paused);
+    if (fflush(ledger) != 0 || ftruncate(fileno(ledger), ftell(ledger)) < 0)
+        return AVERROR(errno);
+    return 0;
+}
+
+
+/* Waits a second at most, and returns 1 if cancelled is set by then. */
+static int admission_sleep(atomic_int *cancelled) {
+    for (int64_t slept = 0; slept < ADMISSION_POLL_SECONDS * 1000000LL; slept += ADMISSION_CANCEL_POLL_US) {
+        if (cancelled && atomic_load(cancelled))
+            return 1;
+        usleep(ADMISSION_CANCEL_POLL_US);
+    }
+    return cancelled && atomic_load(cancelled);
+}
+
+
+/* Returns AVERROR_EXIT as soon as cancelled, which may be NULL, is set while the job waits. */
+int admission_acquire(const char *ledgerPath, int64_t projectedBytes, int64_t hostLimit, int maxWaitSeconds,
+                      atomic_int *cancelled, int64_t *token) {
+    char *kept;
+    int64_t reserved, available, memTotal;
+    int waited = 0;
+    int jobs;
+    FILE *ledger;
+    int ret;
+
+    *token = atomic_fetch_add(&next_admission_token, 1);
+    if ((ret = open_ledger(ledgerPath, O_CREAT, &ledger)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open admission ledger %s: %s\n", ledgerPath, av_err2str(ret));
+        return ret;
+    }
+
+    while (1) {
+        flock(fileno(ledger), LOCK_EX);
+        if ((ret = scan_ledger(ledger, *token, &kept, &reserved, &jobs)) < 0) {
+            flock(fileno(ledger), LOCK_UN);
+            fclose(ledger);
+            av_log(NULL, AV_LOG_ERROR, "Could not read admission ledger %s: %s\n", ledgerPath, av_err2str(ret));
+            return ret;
+        }
+        available = host_memory_available(&memTotal);
+        if (hostLimit <= 0)
+            hostLimit = memTotal;
+
+        /* A job that can't fit even on an idle host still runs, alone. */
+        if (jobs == 0 || (reserved + projectedBytes <= hostLimit && projectedBytes <= available)) {
+            ret = rewrite_ledger(ledger, kept, *token, projectedBytes, 0);
+            av_free(kept);
+            flock(fileno(ledger), LOCK_UN);
+            fclose(ledger);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Could not write admission ledger %s: %s\n", ledgerPath, av_err2str(ret));
+                return ret;
+            }
+            av_log(NULL, AV_LOG_INFO, "Admitted with %" PRId64 " bytes projected alongside %d jobs reserving %" PRId64 " bytes\n",
+                   projectedBytes, jobs, reserved);
+            return 0;
+        }
+        av_free(kept);
+        flock(fileno(ledger), LOCK_UN);
+
+        if (maxWaitSeconds > 0 && waited >= maxWaitSeconds) {
+            fclose(ledger);
+            av_log(NULL, AV_LOG_ERROR, "Not admitted after %d seconds: %d jobs reserve %" PRId64 " of %" PRId64 " bytes\n",
+                   waited, jobs, reserved, hostLimit);
+            return AVERROR(EAGAIN);
+        }
+        if (waited == 0)
+            av_log(NULL, AV_LOG_INFO, "Waiting for memory: %" PRId64 " bytes projected, %d jobs reserve %" PRId64 " of %" PRId64 " bytes\n",
+                   projectedBytes, jobs, reserved, hostLimit);
+        else if (waited % ADMISSION_LOG_SECONDS == 0)
+            av_log(NULL, AV_LOG_WARNING, "Still waiting for memory after %d seconds: %d jobs reserve %" PRId64 " of %" PRId64 " bytes\n",
+                   waited, jobs, reserved, hostLimit);
+
+        if (admission_sleep(cancelled)) {
+            fclose(ledger);
+            av_log(NULL, AV_LOG_INFO, "Cancelled while waiting for memory\n");
+            return AVERROR_EXIT;
+        }
+        waited += ADMISSION_POLL_SECONDS;
+    }
+}
+
+
+/* Only this job's reservation goes; other jobs of the same process keep theirs. */
+void admission_release(const char *ledgerPath, int64_t token) {
+    char *kept;
+    int64_t reserved;
+    int jobs;
+    FILE *ledger;
+    int ret;
+
+    if (open_ledger(ledgerPath, 0, &ledger) < 0)
+        return;
+
+    flock(fileno(ledger), LOCK_EX);
+    if ((ret = scan_ledger(ledger, token, &kept, &reserved, &jobs)) >= 0)
+        ret = rewrite_ledger(ledger, kept, token, 0, 0);
+    av_free(kept);
+    flock(fileno(ledger), LOCK_UN);
+    fclose(ledger);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not release the admission reservation in %s: %s\n", ledgerPath, av_err2str(ret));
+}
+
+
+/*
+ * A paused job keeps its entry, but other jobs are admitted as if it weren't there: the job that preempted it would
+ * otherwise wait for memory that only comes back once it has finished itself. A resumed job takes its reservation
+ * back without waiting, since it holds the memory already.
+ */
+void admission_set_paused(const char *ledgerPath, int64_t token, int64_t bytes, int paused) {
+    char *kept;
+    int64_t reserved;
+    int jobs;
+    FILE *ledger;
+    int ret;
+
+    if (open_ledger(ledgerPath, 0, &ledger) < 0)
+        return;
+
+    flock(fileno(ledger), LOCK_EX);
+    if ((ret = scan_ledger(ledger, token, &kept, &reserved, &jobs)) >= 0)
+        ret = rewrite_ledger(ledger, kept, token, bytes, paused);
+    av_free(kept);
+    flock(fileno(ledger), LOCK_UN);
+    fclose(ledger);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not update the admission reservation in %s: %s\n", ledgerPath, av_err2str(ret));
+}
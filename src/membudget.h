@@ -0,0 +1,64 @@
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "testbed.h"
+
+/*
+ * Per-job memory accounting and host-level admission.
+ *
+ * A MemoryBudget tracks what a job holds in frame pools, packet queues and
+ * I/O buffers. Frame pools belong to libavcodec and libavfilter, so they are
+ * charged with the estimate from estimate_job_memory() when the job starts;
+ * the queues we own charge and release each packet as it comes and goes.
+ * Once a job is over its limit the queues stop holding packets back and
+ * write them out instead, which is counted as a throttle event.
+ *
+ * Admission works across processes through a ledger file of "pid token
+ * bytes paused" lines guarded by flock(). Each job gets its own token, so jobs
+ * that share a process reserve and release separately. A job is admitted when
+ * its projected footprint plus the reservations of every live job that isn't
+ * paused fits within the host limit and in what the kernel currently reports
+ * as available; otherwise it waits, logging as it goes, until it is cancelled
+ * or StreamingParams.admissionMaxWait runs out (ADMISSION_DEFAULT_MAX_WAIT
+ * seconds unless set; 0 waits for as long as it takes). The ledger must be a
+ * private file of the user: by default it is in $XDG_RUNTIME_DIR, or is a
+ * /tmp name with the user id in it, created 0600.
+ */
+
+#define ADMISSION_DEFAULT_MAX_WAIT 300
+
+enum MemoryCategory {
+    MEMORY_FRAMES,
+    MEMORY_QUEUES,
+    MEMORY_IO,
+    MEMORY_CATEGORIES,
+};
+
+typedef struct MemoryBudget {
+    int64_t limit;
+    int64_t used[MEMORY_CATEGORIES];
+    int64_t total;
+    int64_t peak;
+    int64_t throttleEvents;
+} MemoryBudget;
+
+void memory_budget_init(MemoryBudget *budget, int64_t limit);
+void memory_budget_charge(MemoryBudget *budget, enum MemoryCategory category, int64_t bytes);
+void memory_budget_release(MemoryBudget *budget, enum MemoryCategory category, int64_t bytes);
+int memory_budget_over(const MemoryBudget *budget);
+int64_t memory_budget_available(const MemoryBudget *budget);
+void memory_budget_log(const MemoryBudget *budget);
+
+int64_t estimate_job_memory(StreamingContext *decoder, StreamingContext *encoder, const StreamingParams *streamParameters,
+                            int64_t *categories);
+int64_t host_memory_available(int64_t *total);
+const char *admission_default_ledger(void);
+int admission_acquire(const char *ledgerPath, int64_t projectedBytes, int64_t hostLimit, int maxWaitSeconds,
+                      atomic_int *cancelled, int64_t *token);
+void admission_release(const char *ledgerPath, int64_t token);
+void admission_set_paused(const char *ledgerPath, int64_t token, int64_t bytes, int paused);
+
+#endif
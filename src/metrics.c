@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include "metrics.h"
+
+#define METRICS_POLL_MS 200
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+#define METRICS_REQUEST_SIZE 1024
+
+/* Decoded frames are counted by input stream, encoded and remuxed ones by output stream. */
+enum MetricsStreamCounter {
+    METRICS_DECODED,
+    METRICS_ENCODED,
+    METRICS_REMUXED,
+    METRICS_STREAM_COUNTERS,
+};
+
+typedef struct MetricsStream {
+    /* The media type plus one, so 0 is a stream that hasn't been seen. */
+    atomic_int inputType;
+    atomic_int outputType;
+    atomic_int_fast64_t counts[METRICS_STREAM_COUNTERS];
+} MetricsStream;
+
+typedef struct MetricsStreamDescription {
+    const char *name;
+    const char *help;
+} MetricsStreamDescription;
+
+typedef struct MetricsDescription {
+    const char *name;
+    const char *type;
+    const char *help;
+    double scale;
+} MetricsDescription;
+
+static const MetricsDescription metrics_descriptions[METRICS_VALUES] = {
+    [METRICS_MUXED_PACKETS]      = { "testbed_muxed_packets_total", "counter", "Packets handed to the muxer", 1 },
+    [METRICS_MUXED_BYTES]        = { "testbed_muxed_bytes_total", "counter", "Packet bytes handed to the muxer", 1 },
+    [METRICS_JOBS_STARTED]       = { "testbed_jobs_started_total", "counter", "Jobs started", 1 },
+    [METRICS_JOBS_RUNNING]       = { "testbed_jobs_running", "gauge", "Jobs running", 1 },
+    [METRICS_INTERLEAVE_PACKETS] = { "testbed_interleave_queue_packets", "gauge", "Packets waiting in the interleaver", 1 },
+    [METRICS_INTERLEAVE_BYTES]   = { "testbed_interleave_queue_bytes", "gauge", "Bytes waiting in the interleaver", 1 },
+    [METRICS_FILTER_QUEUED]      = { "testbed_filter_queue_tasks", "gauge", "Filter tasks queued on the worker pool", 1 },
+    [METRICS_FILTER_TASKS]       = { "testbed_filter_pool_tasks_total", "counter", "Filter tasks run by the worker pool", 1 },
+    [METRICS_FILTER_STEALS]      = { "testbed_filter_pool_steals_total", "counter", "Filter tasks stolen from another worker", 1 },
+    [METRICS_FILTER_IDLE_TIME]   = { "testbed_filter_pool_idle_seconds_total", "counter", "Time filter workers spent waiting for tasks", 1e-6 },
+};
+
+static const MetricsStreamDescription metrics_stream_descriptions[METRICS_STREAM_COUNTERS] = {
+    [METRICS_DECODED] = { "testbed_frames_decoded_total", "Frames decoded, by input stream" },
+    [METRICS_ENCODED] = { "testbed_frames_encoded_total", "Packets out of the encoders, by output stream" },
+    [METRICS_REMUXED] = { "testbed_packets_remuxed_total", "Packets copied without transcoding, by output stream" },
+};
+
+static const char *metrics_stage_names[METRICS_STAGES] = { "demux", "decode", "filter", "encode", "mux" };
+
+/* Upper bounds of the encode time buckets, in microseconds; the last is +Inf. */
+static const int64_t metrics_encode_bounds[METRICS_ENCODE_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000
+};
+
+static struct {
+    atomic_int_fast64_t values[METRICS_VALUES];
+    atomic_int_fast64_t errors[METRICS_STAGES];
+    MetricsStream streams[METRICS_MAX_STREAMS];
+    atomic_int_fast64_t encodeBuckets[METRICS_ENCODE_BUCKETS];
+    atomic_int_fast64_t encodeSum;
+    atomic_int_fast64_t encodeCount;
+} metrics;
+
+/* Only the listener thread touches these. */
+static pthread_t listener;
+static int listenFd = -1;
+static atomic_int stopping;
+static int64_t lastScrapeTime = -1;
+static int64_t lastScrapeFrames;
+
+atomic_int metrics_enabled;
+
+
+void metrics_add(enum MetricsValue value, int64_t delta) {
+    if (atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        atomic_fetch_add_explicit(&metrics.values[value], delta, memory_order_relaxed);
+}
+
+
+/* Records the stream's media type the first time it is seen, for its labels. */
+static void count_stream(int streamIndex, enum MetricsStreamCounter counter, enum AVMediaType type) {
+    MetricsStream *stream;
+    atomic_int *streamType;
+
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed) || streamIndex < 0 || streamIndex >= METRICS_MAX_STREAMS)
+        return;
+    stream = &metrics.streams[streamIndex];
+    streamType = counter == METRICS_DECODED ? &stream->inputType : &stream->outputType;
+    if (atomic_load_explicit(streamType, memory_order_relaxed) != type + 1)
+        atomic_store_explicit(streamType, type + 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stream->counts[counter], 1, memory_order_relaxed);
+}
+
+
+void metrics_frame_decoded(int streamIndex, enum AVMediaType type) {
+    count_stream(streamIndex, METRICS_DECODED, type);
+}
+
+
+void metrics_frame_encoded(int streamIndex, enum AVMediaType type) {
+    count_stream(streamIndex, METRICS_ENCODED, type);
+}
+
+
+void metrics_packet_remuxed(int streamIndex, enum AVMediaType type) {
+    count_stream(streamIndex, METRICS_REMUXED, type);
+}
+
+
+void metrics_error(enum MetricsStage stage) {
+    if (atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        atomic_fetch_add_explicit(&metrics.errors[stage], 1, memory_order_relaxed);
+}
+
+
+void metrics_encode_time(int64_t duration) {
+    int bucket = 0;
+
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        return;
+    while (bucket < METRICS_ENCODE_BUCKETS - 1 && duration > metrics_encode_bounds[bucket])
+        bucket++;
+    atomic_fetch_add_explicit(&metrics.encodeBuckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.encodeSum, duration, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.encodeCount, 1, memory_order_relaxed);
+}
+
+
+static const char *media_name(int type) {
+    const char *name = type > 0 ? av_get_media_type_string(type - 1) : NULL;
+    return name ? name : "unknown";
+}
+
+
+static void write_stream_counter(FILE *file, enum MetricsStreamCounter counter) {
+    const MetricsStreamDescription *description = &metrics_stream_descriptions[counter];
+
+    fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", description->name, description->help, description->name);
+    for (int i = 0; i < METRICS_MAX_STREAMS; i++) {
+        MetricsStream *stream = &metrics.streams[i];
+        int type = atomic_load_explicit(counter == METRICS_DECODED ? &stream->inputType : &stream->outputType,
+                                        memory_order_relaxed);
+        if (type)
+            fprintf(file, "%s{stream=\"%d\",media=\"%s\"} %" PRId64 "\n", description->name, i, media_name(type),
+                    (int64_t)atomic_load_explicit(&stream->counts[counter], memory_order_relaxed));
+    }
+}
+
+
+static void write_metrics(FILE *file) {
+    int64_t now = av_gettime_relative();
+    int64_t encodedFrames = 0;
+    int64_t cumulative = 0;
+    double encodeFps = 0;
+
+    for (int i = 0; i < METRICS_VALUES; i++) {
+        const MetricsDescription *description = &metrics_descriptions[i];
+        int64_t value = atomic_load_explicit(&metrics.values[i], memory_order_relaxed);
+
+        fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", description->name, description->help, description->name,
+                description->type);
+        if (description->scale == 1)
+            fprintf(file, "%s %" PRId64 "\n", description->name, value);
+        else
+            fprintf(file, "%s %.6f\n", description->name, value * description->scale);
+    }
+
+    for (int i = 0; i < METRICS_STREAM_COUNTERS; i++)
+        write_stream_counter(file, i);
+
+    fprintf(file, "# HELP testbed_errors_total Errors, by the stage they happened in\n# TYPE testbed_errors_total counter\n");
+    for (int i = 0; i < METRICS_STAGES; i++)
+        fprintf(file, "testbed_errors_total{stage=\"%s\"} %" PRId64 "\n", metrics_stage_names[i],
+                atomic_load_explicit(&metrics.errors[i], memory_order_relaxed));
+
+    fprintf(file, "# HELP testbed_video_encode_seconds Time in the video encoder's send and receive calls per frame\n"
+                  "# TYPE testbed_video_encode_seconds histogram\n");
+    for (int i = 0; i < METRICS_ENCODE_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&metrics.encodeBuckets[i], memory_order_relaxed);
+        if (i < METRICS_ENCODE_BUCKETS - 1)
+            fprintf(file, "testbed_video_encode_seconds_bucket{le=\"%g\"} %" PRId64 "\n",
+                    metrics_encode_bounds[i] / 1000000.0, cumulative);
+        else
+            fprintf(file, "testbed_video_encode_seconds_bucket{le=\"+Inf\"} %" PRId64 "\n", cumulative);
+    }
+    fprintf(file, "testbed_video_encode_seconds_sum %.6f\ntestbed_video_encode_seconds_count %" PRId64 "\n",
+            atomic_load_explicit(&metrics.encodeSum, memory_order_relaxed) / 1000000.0,
+            atomic_load_explicit(&metrics.encodeCount, memory_order_relaxed));
+
+    for (int i = 0; i < METRICS_MAX_STREAMS; i++) {
+        if (atomic_load_explicit(&metrics.streams[i].outputType, memory_order_relaxed) == AVMEDIA_TYPE_VIDEO + 1)
+            encodedFrames += atomic_load_explicit(&metrics.streams[i].counts[METRICS_ENCODED], memory_order_relaxed);
+    }
+    if (lastScrapeTime >= 0 && now > lastScrapeTime)
+        encodeFps = (encodedFrames - lastScrapeFrames) * 1000000.0 / (now - lastScrapeTime);
+    lastScrapeTime = now;
+    lastScrapeFrames = encodedFrames;
+    fprintf(file, "# HELP testbed_encode_fps Video frames encoded per second since the previous scrape\n"
+                  "# TYPE testbed_encode_fps gauge\ntestbed_encode_fps %.2f\n", encodeFps);
+}
+
+
+/* Milliseconds left until the deadline, for poll(). */
+static int remaining_ms(int64_t deadline) {
+    int64_t remaining = deadline - av_gettime_relative();
+    return remaining > 0 ? (int)((remaining + 999) / 1000) : 0;
+}
+
+
+static int send_all(int fd, const char *data, size_t size, int64_t deadline) {
+    struct pollfd pollFd = { .fd = fd, .events = POLLOUT };
+
+    while (size > 0) {
+        ssize_t sent;
+
+        if (poll(&pollFd, 1, remaining_ms(deadline)) <= 0)
+            return AVERROR(ETIMEDOUT);
+        sent = send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (sent <= 0)
+            return AVERROR(errno);
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+
+/*
+ * One request per connection: the request line is all that's looked at, and the connection is closed after the reply.
+ * Reading the request and sending the reply share one deadline.
+ */
+static void serve_scrape(int fd) {
+    int64_t deadline = av_gettime_relative() + METRICS_REQUEST_TIMEOUT_MS * 1000;
+    char request[METRICS_REQUEST_SIZE];
+    char header[256];
+    struct pollfd pollFd = { .fd = fd, .events = POLLIN };
+    size_t length = 0;
+    char *body = NULL;
+    size_t bodySize = 0;
+    FILE *file;
+    int found;
+
+    request[0] = '\0';
+    while (length < sizeof(request) - 1 && !strstr(request, "\r\n")) {
+        ssize_t received;
+
+        if (poll(&pollFd, 1, remaining_ms(deadline)) <= 0)
+            return;
+        received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received <= 0)
+            return;
+        length += received;
+        request[length] = '\0';
+    }
+
+    found = strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?');
+    if (found && (file = open_memstream(&body, &bodySize))) {
+        write_metrics(file);
+        fclose(file);
+    }
+    if (!body) {
+        snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                 found ? "500 Internal Server Error" : "404 Not Found");
+        send_all(fd, header, strlen(header), deadline);
+        return;
+    }
+
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodySize);
+    if (send_all(fd, header, strlen(header), deadline) == 0)
+        send_all(fd, body, bodySize, deadline);
+    free(body);
+}
+
+
+static void *listen_for_scrapes(void *opaque) {
+    struct pollfd pollFd = { .fd = listenFd, .events = POLLIN };
+
+    while (!atomic_load(&stopping)) {
+        int fd;
+
+        if (poll(&pollFd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve_scrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+static int listen_on_address(const char *address, int port) {
+    struct sockaddr_in socketAddress = {0};
+    int reuse = 1;
+    int fd;
+
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &socketAddress.sin_addr) != 1)
+        return AVERROR(EINVAL);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, (struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int err = errno;
+        close(fd);
+        return AVERROR(err);
+    }
+    return fd;
+}
+
+
+int metrics_start(const char *address, int port) {
+    if (listenFd >= 0)
+        return AVERROR(EEXIST);
+
+    listenFd = listen_on_address(address, port);
+    if (listenFd < 0) {
+        int ret = listenFd;
+        av_log(NULL, AV_LOG_ERROR, "Could not serve metrics on %s:%d: %s\n", address, port, av_err2str(ret));
+        listenFd = -1;
+        return ret;
+    }
+
+    atomic_store(&stopping, 0);
+    atomic_store(&metrics_enabled, 1);
+    if (pthread_create(&listener, NULL, listen_for_scrapes, NULL) != 0) {
+        atomic_store(&metrics_enabled, 0);
+        close(listenFd);
+        listenFd = -1;
+        return AVERROR(EAGAIN);
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Serving metrics on http://%s:%d/metrics\n", address, port);
+    return 0;
+}
+
+
+void metrics_stop(void) {
+    if (listenFd < 0)
+        return;
+    atomic_store(&stopping, 1);
+    pthread_join(listener, NULL);
+    close(listenFd);
+    listenFd = -1;
+    atomic_store(&metrics_enabled, 0);
+}
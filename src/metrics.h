@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <libavutil/avutil.h>
+
+/*
+ * Process-wide metrics, served in the Prometheus text format from an HTTP
+ * listener on a local address.
+ *
+ * Collection is off unless metrics_start() is called. The hot paths then bump
+ * plain atomic counters with relaxed increments, so no thread ever waits on
+ * another; the listener thread reads them when it is scraped. Frames decoded,
+ * encoded and remuxed are counted per stream index and media type, up to
+ * METRICS_MAX_STREAMS streams, and errors per stage. The time spent in the
+ * video encoder's avcodec_send_frame() and avcodec_receive_packet() for each
+ * frame is a histogram, and encode fps is a gauge worked out from the encoded
+ * frame count at each scrape, over the time since the one before. Queue
+ * depths are gauges the interleaver and filter scheduler raise and lower as
+ * they queue and dequeue, and the filter scheduler's pool counts its tasks,
+ * steals and idle time. A scrape has one second in all to send its request
+ * and read the reply, so a stalled client can't hold the listener.
+ *
+ * Like tracing, metrics belong to the process, so the jobs of a daemon are
+ * summed, and whoever owns the process starts and stops the listener.
+ */
+
+#define METRICS_MAX_STREAMS 16
+#define METRICS_ENCODE_BUCKETS 10
+
+enum MetricsValue {
+    METRICS_MUXED_PACKETS,
+    METRICS_MUXED_BYTES,
+    METRICS_JOBS_STARTED,
+    METRICS_JOBS_RUNNING,
+    METRICS_INTERLEAVE_PACKETS,
+    METRICS_INTERLEAVE_BYTES,
+    METRICS_FILTER_QUEUED,
+    METRICS_FILTER_TASKS,
+    METRICS_FILTER_STEALS,
+    METRICS_FILTER_IDLE_TIME,
+    METRICS_VALUES,
+};
+
+enum MetricsStage {
+    METRICS_STAGE_DEMUX,
+    METRICS_STAGE_DECODE,
+    METRICS_STAGE_FILTER,
+    METRICS_STAGE_ENCODE,
+    METRICS_STAGE_MUX,
+    METRICS_STAGES,
+};
+
+extern atomic_int metrics_enabled;
+
+int metrics_start(const char *address, int port);
+void metrics_stop(void);
+void metrics_add(enum MetricsValue value, int64_t delta);
+void metrics_frame_decoded(int streamIndex, enum AVMediaType type);
+void metrics_frame_encoded(int streamIndex, enum AVMediaType type);
+void metrics_packet_remuxed(int streamIndex, enum AVMediaType type);
+void metrics_error(enum MetricsStage stage);
+void metrics_encode_time(int64_t duration);
+
+#endif
@@ -0,0 +1,159 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+
+#include "numa.h"
+
+/* From linux/mempolicy.h, which isn't installed everywhere. */
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MAX_CPUS (16 * 64)
+
+
+int numa_node_count(void) {
+    char path[64];
+    int nodes = 0;
+
+    while (1) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nodes);
+        if (access(path, F_OK) < 0)
+            break;
+        nodes++;
+    }
+    return nodes;
+}
+
+
+/* Parse a sysfs CPU list such as "0-15,32-47" into the placement's mask. */
+static int parse_cpu_list(NumaPlacement *placement, const char *list) {
+    const char *p = list;
+    char *end;
+
+    while (*p && *p != '\n') {
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p)
+            return AVERROR_INVALIDDATA;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++) {
+            placement->cpuMask[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+            placement->cpuCount++;
+        }
+        if (*p == ',')
+            p++;
+    }
+    return 0;
+}
+
+
+int numa_bind_job(NumaPlacement *placement, int node) {
+#ifdef __linux__
+    char path[96];
+    char list[1024];
+    cpu_set_t cpus;
+    unsigned long nodeMask[4] = {0};
+    FILE *file;
+    int ret;
+
+    memset(placement, 0, sizeof(*placement));
+    placement->node = node;
+    placement->nodeCount = numa_node_count();
+
+    if (node < 0 || node >= placement->nodeCount || node >= (int)(sizeof(nodeMask) * 8)) {
+        av_log(NULL, AV_LOG_ERROR, "NUMA node %d does not exist, the host has %d\n", node, placement->nodeCount);
+        return AVERROR(EINVAL);
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(path, "r");
+    if (!file || !fgets(list, sizeof(list), file)) {
+        av_log(NULL, AV_LOG_ERROR, "Could not read the CPUs of NUMA node %d\n", node);
+        if (file)
+            fclose(file);
+        return AVERROR(EIO);
+    }
+    fclose(file);
+
+    if ((ret = parse_cpu_list(placement, list)) < 0)
+        return ret;
+
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (placement->cpuMask[cpu / 64] & (UINT64_C(1) << (cpu % 64)))
+            CPU_SET(cpu, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not pin to the CPUs of NUMA node %d: %s\n", node, av_err2str(ret));
+        return ret;
+    }
+
+    nodeMask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+    if (syscall(SYS_set_mempolicy, NUMA_MPOL_PREFERRED, nodeMask, sizeof(nodeMask) * 8 + 1) < 0) {
+        /* Pinning alone still keeps most first-touch allocations local. */
+        av_log(NULL, AV_LOG_WARNING, "Could not set the memory policy for NUMA node %d: %s\n", node, strerror(errno));
+    } else {
+        placement->memoryBound = 1;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Bound to NUMA node %d of %d: %d CPUs (%s)\n",
+           node, placement->nodeCount, placement->cpuCount, strtok(list, "\n"));
+    return 0;
+#else
+    memset(placement, 0, sizeof(*placement));
+    placement->node = -1;
+    av_log(NULL, AV_LOG_ERROR, "NUMA placement is only supported on Linux\n");
+    return AVERROR(ENOSYS);
+#endif
+}
+
+
+/* The placement's CPUs as a list like the one parse_cpu_list() reads, cut short to fit. */
+void numa_format_cpus(const NumaPlacement *placement, char *list, size_t size) {
+    size_t length = 0;
+
+    if (!size)
+        return;
+    list[0] = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+        int last = cpu;
+        int written;
+
+        if (!(placement->cpuMask[cpu / 64] & (UINT64_C(1) << (cpu % 64))))
+            continue;
+        while (last + 1 < NUMA_MAX_CPUS && placement->cpuMask[(last + 1) / 64] & (UINT64_C(1) << ((last + 1) % 64)))
+            last++;
+
+        written = last > cpu ? snprintf(list + length, size - length, "%s%d-%d", length ? "," : "", cpu, last)
+                             : snprintf(list + length, size - length, "%s%d", length ? "," : "", cpu);
+        if (written < 0 || (size_t)written >= size - length) {
+            list[length] = 0;
+            return;
+        }
+        length += written;
+        cpu = last;
+    }
+}
+
+
+void numa_log(const NumaPlacement *placement) {
+    if (placement->node < 0)
+        return;
+    av_log(NULL, AV_LOG_INFO, "NUMA node %d: %d CPUs, memory %s\n",
+           placement->node, placement->cpuCount, placement->memoryBound ? "preferred" : "not bound");
+}
@@ -0,0 +1,33 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * NUMA placement of a whole job.
+ *
+ * numa_bind_job() restricts the calling thread to the CPUs of one node and
+ * makes that node the preferred one for its allocations, for good: the job
+ * runner calls it on a thread started for the job, which ends with it. Threads
+ * inherit both on creation, so binding before any decoder, encoder or filter
+ * graph is opened covers the thread pools avcodec_open2 and libavfilter
+ * start, and frame buffers are then faulted in on the same node. The policy
+ * is preferred rather than strict so that a full node falls back to the other
+ * instead of failing allocations.
+ */
+
+typedef struct NumaPlacement {
+    int node;
+    int nodeCount;
+    int cpuCount;
+    int memoryBound;
+    uint64_t cpuMask[16];
+} NumaPlacement;
+
+int numa_node_count(void);
+int numa_bind_job(NumaPlacement *placement, int node);
+void numa_format_cpus(const NumaPlacement *placement, char *list, size_t size);
+void numa_log(const NumaPlacement *placement);
+
+#endif
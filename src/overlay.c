@@ -0,0 +1,635 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "overlay.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HAVE_NATIVE_LE16 0
+#else
+#define HAVE_NATIVE_LE16 1
+#endif
+
+
+static const enum AVPixelFormat overlay_formats[] = {
+    AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV444P,
+    AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_YUV422P10LE, AV_PIX_FMT_YUV444P10LE,
+};
+
+
+static void blend_row8_scalar(uint8_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    for (int x = 0; x < width; x++)
+        dst[x] = FFMIN(value[x] + ((dst[x] * inverse[x]) >> 8), 255);
+}
+
+
+static void blend_row10_scalar(uint16_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    for (int x = 0; x < width; x++)
+        dst[x] = FFMIN(value[x] + ((dst[x] * inverse[x]) >> 8), 1023);
+}
+
+
+#if HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void blend_row8_sse2(uint8_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(dst + x));
+        __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_loadu_si128((const __m128i *)(inverse + x)));
+        __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_loadu_si128((const __m128i *)(inverse + x + 8)));
+        low = _mm_add_epi16(_mm_srli_epi16(low, 8), _mm_loadu_si128((const __m128i *)(value + x)));
+        high = _mm_add_epi16(_mm_srli_epi16(high, 8), _mm_loadu_si128((const __m128i *)(value + x + 8)));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(low, high));
+    }
+    blend_row8_scalar(dst + x, value + x, inverse + x, width - x);
+}
+
+
+/* A 10-bit sample times a 9-bit inverse overflows 16 bits, so take the high half of (dst << 6) * (inverse << 2). */
+__attribute__((target("sse2")))
+static void blend_row10_sse2(uint16_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    const __m128i maximum = _mm_set1_epi16(1023);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i pixels = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(dst + x)), 6);
+        __m128i weights = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(inverse + x)), 2);
+        __m128i blended = _mm_add_epi16(_mm_mulhi_epu16(pixels, weights), _mm_loadu_si128((const __m128i *)(value + x)));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_min_epi16(blended, maximum));
+    }
+    blend_row10_scalar(dst + x, value + x, inverse + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void blend_row8_avx2(uint8_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(dst + x)));
+        __m256i blended = _mm256_mullo_epi16(pixels, _mm256_loadu_si256((const __m256i *)(inverse + x)));
+        blended = _mm256_add_epi16(_mm256_srli_epi16(blended, 8), _mm256_loadu_si256((const __m256i *)(value + x)));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm256_castsi256_si128(blended),
+                                                                 _mm256_extracti128_si256(blended, 1)));
+    }
+    blend_row8_sse2(dst + x, value + x, inverse + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void blend_row10_avx2(uint16_t *dst, const uint16_t *value, const uint16_t *inverse, int width) {
+    const __m256i maximum = _mm256_set1_epi16(1023);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i pixels = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i *)(dst + x)), 6);
+        __m256i weights = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i *)(inverse + x)), 2);
+        __m256i blended = _mm256_add_epi16(_mm256_mulhi_epu16(pixels, weights),
+                                           _mm256_loadu_si256((const __m256i *)(value + x)));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_min_epi16(blended, maximum));
+    }
+    blend_row10_sse2(dst + x, value + x, inverse + x, width - x);
+}
+#endif
+
+
+static int select_kernel(GraphicsOverlay *overlay, enum OverlayKernel kernel) {
+#if HAVE_X86_KERNELS
+    int cpuFlags = av_get_cpu_flags();
+
+    if (kernel == OVERLAY_KERNEL_AUTO)
+        kernel = cpuFlags & AV_CPU_FLAG_AVX2 ? OVERLAY_KERNEL_AVX2
+               : cpuFlags & AV_CPU_FLAG_SSE2 ? OVERLAY_KERNEL_SSE2 : OVERLAY_KERNEL_SCALAR;
+
+    if (kernel == OVERLAY_KERNEL_AVX2) {
+        if (!(cpuFlags & AV_CPU_FLAG_AVX2))
+            return AVERROR(ENOSYS);
+        overlay->blendRow8 = blend_row8_avx2;
+        overlay->blendRow10 = blend_row10_avx2;
+    } else if (kernel == OVERLAY_KERNEL_SSE2) {
+        if (!(cpuFlags & AV_CPU_FLAG_SSE2))
+            return AVERROR(ENOSYS);
+        overlay->blendRow8 = blend_row8_sse2;
+        overlay->blendRow10 = blend_row10_sse2;
+    }
+#else
+    if (kernel == OVERLAY_KERNEL_AUTO)
+        kernel = OVERLAY_KERNEL_SCALAR;
+    if (kernel == OVERLAY_KERNEL_AVX2 || kernel == OVERLAY_KERNEL_SSE2)
+        return AVERROR(ENOSYS);
+#endif
+
+    if (kernel == OVERLAY_KERNEL_SCALAR) {
+        overlay->blendRow8 = blend_row8_scalar;
+        overlay->blendRow10 = blend_row10_scalar;
+    }
+
+    overlay->kernel = kernel;
+    return 0;
+}
+
+
+const char *overlay_kernel_name(enum OverlayKernel kernel) {
+    switch (kernel) {
+    case OVERLAY_KERNEL_AUTO:   return "auto";
+    case OVERLAY_KERNEL_SCALAR: return "scalar";
+    case OVERLAY_KERNEL_SSE2:   return "sse2";
+    case OVERLAY_KERNEL_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+
+/* The asset is kept premultiplied, which makes the colour conversion and the chroma filtering linear. */
+int graphics_overlay_init(GraphicsOverlay *overlay, const uint8_t *rgba, int linesize, int width, int height,
+                          int premultiplied, int x, int y, enum OverlayKernel kernel) {
+    int ret;
+
+    memset(overlay, 0, sizeof(*overlay));
+    overlay->format = AV_PIX_FMT_NONE;
+    overlay->x = x;
+    overlay->y = y;
+
+    if ((ret = select_kernel(overlay, kernel)) < 0)
+        return ret;
+
+    overlay->rgba = av_malloc_array(width * height, 4);
+    if (!overlay->rgba)
+        return AVERROR(ENOMEM);
+    overlay->assetWidth = width;
+    overlay->assetHeight = height;
+
+    for (int row = 0; row < height; row++) {
+        const uint8_t *src = rgba + row * linesize;
+        uint8_t *dst = overlay->rgba + row * width * 4;
+
+        for (int column = 0; column < width; column++, src += 4, dst += 4) {
+            for (int c = 0; c < 3; c++)
+                dst[c] = premultiplied ? FFMIN(src[c], src[3]) : (src[c] * src[3] + 127) / 255;
+            dst[3] = src[3];
+        }
+    }
+    return 0;
+}
+
+
+/* Decode the first video frame of the asset file and convert it to RGBA. */
+int graphics_overlay_load(GraphicsOverlay *overlay, const char *assetFilename, int premultiplied, int x, int y) {
+    StreamingContext asset = {0};
+    struct SwsContext *swsContext = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    uint8_t *rgba[4] = {NULL};
+    int linesize[4];
+    int ret;
+
+    if ((ret = open_media(&asset.formatContext, assetFilename)) < 0)
+        return ret;
+    if (prepare_decoder(&asset) || !asset.videoCodecContext) {
+        av_log(NULL, AV_LOG_ERROR, "Overlay asset %s has no picture\n", assetFilename);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    do {
+        int eof = av_read_frame(asset.formatContext, packet) < 0;
+
+        if (!eof && packet->stream_index != asset.videoIndex) {
+            av_packet_unref(packet);
+            ret = AVERROR(EAGAIN);
+            continue;
+        }
+        ret = avcodec_send_packet(asset.videoCodecContext, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (ret < 0)
+            break;
+        ret = avcodec_receive_frame(asset.videoCodecContext, frame);
+        if (eof && ret == AVERROR(EAGAIN))
+            ret = AVERROR_EOF;
+    } while (ret == AVERROR(EAGAIN));
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not decode overlay asset %s: %s\n", assetFilename, av_err2str(ret));
+        goto end;
+    }
+
+    if (!(av_pix_fmt_desc_get(frame->format)->flags & AV_PIX_FMT_FLAG_ALPHA))
+        av_log(NULL, AV_LOG_WARNING, "Overlay asset %s has no alpha channel and will be opaque\n", assetFilename);
+
+    swsContext = sws_getContext(frame->width, frame->height, frame->format, frame->width, frame->height,
+                                AV_PIX_FMT_RGBA, SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT, NULL, NULL, NULL);
+    if (!swsContext) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    if ((ret = av_image_alloc(rgba, linesize, frame->width, frame->height, AV_PIX_FMT_RGBA, 32)) < 0)
+        goto end;
+    sws_scale(swsContext, (const uint8_t * const *) frame->data, frame->linesize, 0, frame->height, rgba, linesize);
+
+    ret = graphics_overlay_init(overlay, rgba[0], linesize[0], frame->width, frame->height, premultiplied, x, y,
+                                OVERLAY_KERNEL_AUTO);
+    if (ret >= 0)
+        av_log(NULL, AV_LOG_INFO, "Overlay %s: %dx%d at %d,%d, %s kernel\n", assetFilename, frame->width,
+               frame->height, x, y, overlay_kernel_name(overlay->kernel));
+
+    end:
+    av_freep(&rgba[0]);
+    sws_freeContext(swsContext);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&asset.videoCodecContext);
+    free_audio_tracks(&asset);
+    avformat_close_input(&asset.formatContext);
+    return ret;
+}
+
+
+static void free_planes(GraphicsOverlay *overlay) {
+    for (int plane = 0; plane < 3; plane++) {
+        av_freep(&overlay->planes[plane].value);
+        av_freep(&overlay->planes[plane].inverse);
+        av_freep(&overlay->fieldPlanes[plane].value);
+        av_freep(&overlay->fieldPlanes[plane].inverse);
+    }
+    memset(overlay->planes, 0, sizeof(overlay->planes));
+    memset(overlay->fieldPlanes, 0, sizeof(overlay->fieldPlanes));
+}
+
+
+static int alloc_plane(OverlayPlane *plane, int x, int y, int width, int height) {
+    plane->x = x;
+    plane->y = y;
+    plane->width = width;
+    plane->height = height;
+    plane->value = av_malloc_array(width * height, sizeof(*plane->value));
+    plane->inverse = av_malloc_array(width * height, sizeof(*plane->inverse));
+    return plane->value && plane->inverse ? 0 : AVERROR(ENOMEM);
+}
+
+
+/* Weighted sum of premultiplied component and alpha over the covered area; samples outside it are transparent. */
+static void accumulate(const double *yuva, int width, int height, int component, int column, int row, int weight,
+                       double *sum, double *alpha, int *total) {
+    *total += weight;
+    if (column < 0 || column >= width || row < 0 || row >= height)
+        return;
+    *sum += weight * yuva[(row * width + column) * 4 + component];
+    *alpha += weight * yuva[(row * width + column) * 4 + 3];
+}
+
+
+/*
+ * Filters one chroma component down to the frame's subsampling. Horizontally,
+ * left-sited chroma takes [1 2 1] around its luma column and centred chroma
+ * averages the pair. Vertically, 4:2:0 averages the two rows it sits between,
+ * or rows two apart in the same field when field is set.
+ */
+static void build_chroma_plane(OverlayPlane *plane, const double *yuva, int width, int height, int component,
+                               int log2ChromaW, int log2ChromaH, int cosited, int field) {
+    for (int row = 0; row < plane->height; row++) {
+        for (int column = 0; column < plane->width; column++) {
+            double sum = 0, alpha = 0;
+            int total = 0;
+
+            for (int tap = 0; tap < 2; tap++) {
+                int lumaRow = row;
+
+                if (log2ChromaH && field)
+                    lumaRow = 4 * (row >> 1) + (row & 1) + 2 * tap;
+                else if (log2ChromaH)
+                    lumaRow = 2 * row + tap;
+                else if (tap)
+                    break;
+
+                if (!log2ChromaW) {
+                    accumulate(yuva, width, height, component, column, lumaRow, 2, &sum, &alpha, &total);
+                } else if (cosited) {
+                    accumulate(yuva, width, height, component, 2 * column - 1, lumaRow, 1, &sum, &alpha, &total);
+                    accumulate(yuva, width, height, component, 2 * column, lumaRow, 2, &sum, &alpha, &total);
+                    accumulate(yuva, width, height, component, 2 * column + 1, lumaRow, 1, &sum, &alpha, &total);
+                } else {
+                    accumulate(yuva, width, height, component, 2 * column, lumaRow, 2, &sum, &alpha, &total);
+                    accumulate(yuva, width, height, component, 2 * column + 1, lumaRow, 2, &sum, &alpha, &total);
+                }
+            }
+
+            plane->value[row * plane->width + column] = lrint(sum / total);
+            plane->inverse[row * plane->width + column] = lrint(256 * (1 - alpha / total));
+        }
+    }
+}
+
+
+static int overlay_format_supported(enum AVPixelFormat format) {
+    for (int i = 0; i < FF_ARRAY_ELEMS(overlay_formats); i++) {
+        if (overlay_formats[i] == format)
+            return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_YUV422P || format == AV_PIX_FMT_YUV444P ||
+                   HAVE_NATIVE_LE16;
+    }
+    return 0;
+}
+
+
+/* Convert the asset into the frame's format, matrix and chroma siting, over the part of it inside the frame. */
+static int prepare_overlay(GraphicsOverlay *overlay, const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    double kr = 0.299, kb = 0.114, scale;
+    double *yuva = NULL;
+    int x, y, width, height, cosited;
+    int ret = 0;
+
+    free_planes(overlay);
+    overlay->format = frame->format;
+    overlay->frameWidth = frame->width;
+    overlay->frameHeight = frame->height;
+    overlay->colorspace = frame->colorspace;
+    overlay->chromaLocation = frame->chroma_location;
+    overlay->hasFieldPlanes = 0;
+
+    if (!overlay_format_supported(frame->format)) {
+        av_log(NULL, AV_LOG_ERROR, "Overlay cannot be blended into %s frames\n", av_get_pix_fmt_name(frame->format));
+        return AVERROR(ENOSYS);
+    }
+    overlay->depth = desc->comp[0].depth;
+    scale = 1 << (overlay->depth - 8);
+
+    if (frame->colorspace == AVCOL_SPC_BT709 ||
+        (frame->colorspace != AVCOL_SPC_BT470BG && frame->colorspace != AVCOL_SPC_SMPTE170M && frame->height > 576)) {
+        kr = 0.2126;
+        kb = 0.0722;
+    }
+    cosited = frame->chroma_location == AVCHROMA_LOC_UNSPECIFIED || frame->chroma_location == AVCHROMA_LOC_LEFT ||
+              frame->chroma_location == AVCHROMA_LOC_TOPLEFT;
+
+    /* Whole chroma samples across, and whole pairs of chroma rows down so both fields of 4:2:0 stay aligned. */
+    x = FFMAX(overlay->x, 0) & ~((1 << desc->log2_chroma_w) - 1);
+    y = FFMAX(overlay->y, 0) & ~((desc->log2_chroma_h ? 4 : 1) - 1);
+    width = FFMIN(overlay->assetWidth, frame->width - x);
+    height = FFMIN(overlay->assetHeight, frame->height - y);
+    if (width <= 0 || height <= 0) {
+        av_log(NULL, AV_LOG_WARNING, "Overlay at %d,%d lies outside the %dx%d frame\n",
+               overlay->x, overlay->y, frame->width, frame->height);
+        return 0;
+    }
+
+    yuva = av_malloc_array(width * height, 4 * sizeof(*yuva));
+    if (!yuva)
+        return AVERROR(ENOMEM);
+
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            const uint8_t *pixel = overlay->rgba + (row * overlay->assetWidth + column) * 4;
+            double *sample = yuva + (row * width + column) * 4;
+            double alpha = pixel[3] / 255.0;
+            double luma = (kr * pixel[0] + (1 - kr - kb) * pixel[1] + kb * pixel[2]) / 255.0;
+
+            sample[0] = (16 * alpha + 219 * luma) * scale;
+            sample[1] = (128 * alpha + 224 * (pixel[2] / 255.0 - luma) / (2 * (1 - kb))) * scale;
+            sample[2] = (128 * alpha + 224 * (pixel[0] / 255.0 - luma) / (2 * (1 - kr))) * scale;
+            sample[3] = alpha;
+        }
+    }
+
+    if ((ret = alloc_plane(&overlay->planes[0], x, y, width, height)) < 0)
+        goto end;
+    for (int i = 0; i < width * height; i++) {
+        overlay->planes[0].value[i] = lrint(yuva[i * 4]);
+        overlay->planes[0].inverse[i] = lrint(256 * (1 - yuva[i * 4 + 3]));
+    }
+
+    for (int plane = 1; plane < 3; plane++) {
+        if ((ret = alloc_plane(&overlay->planes[plane], x >> desc->log2_chroma_w, y >> desc->log2_chroma_h,
+                               AV_CEIL_RSHIFT(width, desc->log2_chroma_w),
+                               AV_CEIL_RSHIFT(height, desc->log2_chroma_h))) < 0)
+            goto end;
+        build_chroma_plane(&overlay->planes[plane], yuva, width, height, plane,
+                           desc->log2_chroma_w, desc->log2_chroma_h, cosited, 0);
+
+        if (desc->log2_chroma_h) {
+            if ((ret = alloc_plane(&overlay->fieldPlanes[plane], overlay->planes[plane].x, overlay->planes[plane].y,
+                                   overlay->planes[plane].width, overlay->planes[plane].height)) < 0)
+                goto end;
+            build_chroma_plane(&overlay->fieldPlanes[plane], yuva, width, height, plane,
+                               desc->log2_chroma_w, desc->log2_chroma_h, cosited, 1);
+            overlay->hasFieldPlanes = 1;
+        }
+    }
+
+    end:
+    av_free(yuva);
+    if (ret < 0)
+        free_planes(overlay);
+    return ret;
+}
+
+
+int graphics_overlay_apply(GraphicsOverlay *overlay, AVFrame *frame) {
+    int interlaced, ret;
+
+    if (frame->format != overlay->format || frame->width != overlay->frameWidth ||
+        frame->height != overlay->frameHeight || frame->colorspace != overlay->colorspace ||
+        frame->chroma_location != overlay->chromaLocation) {
+        if ((ret = prepare_overlay(overlay, frame)) < 0)
+            return ret;
+    }
+    if (!overlay->planes[0].width)
+        return 0;
+
+    interlaced = frame->interlaced_frame && overlay->hasFieldPlanes;
+    for (int plane = 0; plane < 3; plane++) {
+        const OverlayPlane *source = plane && interlaced ? &overlay->fieldPlanes[plane] : &overlay->planes[plane];
+
+        for (int row = 0; row < source->height; row++) {
+            uint8_t *dst = frame->data[plane] + (source->y + row) * frame->linesize[plane];
+            const uint16_t *value = source->value + row * source->width;
+            const uint16_t *inverse = source->inverse + row * source->width;
+
+            if (overlay->depth == 8)
+                overlay->blendRow8(dst + source->x, value, inverse, source->width);
+            else
+                overlay->blendRow10((uint16_t *) dst + source->x, value, inverse, source->width);
+        }
+    }
+
+    overlay->blendedFrames++;
+    return 0;
+}
+
+
+void graphics_overlay_uninit(GraphicsOverlay *overlay) {
+    free_planes(overlay);
+    av_freep(&overlay->rgba);
+}
+
+
+static AVFrame *alloc_bench_frame(int width, int height, enum AVPixelFormat format) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return NULL;
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+
+static int compare_frames(const AVFrame *a, const AVFrame *b, int *mismatchPlane, int *mismatchRow) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+    int sampleBytes = desc->comp[0].depth > 8 ? 2 : 1;
+
+    for (int plane = 0; plane < 3; plane++) {
+        int bytes = sampleBytes * (plane ? AV_CEIL_RSHIFT(a->width, desc->log2_chroma_w) : a->width);
+        int rows = plane ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+
+        for (int y = 0; y < rows; y++) {
+            if (memcmp(a->data[plane] + y * a->linesize[plane], b->data[plane] + y * b->linesize[plane], bytes)) {
+                *mismatchPlane = plane;
+                *mismatchRow = y;
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Times every kernel available on this CPU blending a third-of-the-frame logo
+ * with an alpha ramp into random frames of each supported format, progressive
+ * and interlaced, and checks each kernel is bit-exact with the scalar one.
+ * Returns the number of mismatching kernels.
+ */
+int benchmark_graphics_overlay(int width, int height, int iterations) {
+    static const enum OverlayKernel kernels[] = {
+        OVERLAY_KERNEL_SCALAR, OVERLAY_KERNEL_SSE2, OVERLAY_KERNEL_AVX2,
+    };
+    int assetWidth = FFMAX(width / 3, 1), assetHeight = FFMAX(height / 3, 1);
+    uint32_t seed = 0x2545f491;
+    uint8_t *asset;
+    int mismatches = 0;
+
+    asset = av_malloc_array(assetWidth * assetHeight, 4);
+    if (!asset)
+        return AVERROR(ENOMEM);
+    for (int y = 0; y < assetHeight; y++) {
+        for (int x = 0; x < assetWidth; x++) {
+            uint8_t *pixel = asset + (y * assetWidth + x) * 4;
+            seed = seed * 1664525 + 1013904223;
+            pixel[3] = x * 255 / FFMAX(assetWidth - 1, 1);
+            pixel[0] = (seed >> 24) * pixel[3] / 255;
+            pixel[1] = (seed >> 16 & 0xff) * pixel[3] / 255;
+            pixel[2] = (seed >> 8 & 0xff) * pixel[3] / 255;
+        }
+    }
+
+    for (int format = 0; format < FF_ARRAY_ELEMS(overlay_formats); format++) {
+        for (int interlaced = 0; interlaced < 2; interlaced++) {
+            AVFrame *src = alloc_bench_frame(width, height, overlay_formats[format]);
+            AVFrame *reference = alloc_bench_frame(width, height, overlay_formats[format]);
+            AVFrame *dst = alloc_bench_frame(width, height, overlay_formats[format]);
+            const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(overlay_formats[format]);
+
+            if (!src || !reference || !dst) {
+                av_frame_free(&src);
+                av_frame_free(&reference);
+                av_frame_free(&dst);
+                av_free(asset);
+                return AVERROR(ENOMEM);
+            }
+
+            for (int plane = 0; plane < 3; plane++) {
+                int samples = plane ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w) : width;
+                int rows = plane ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+                for (int y = 0; y < rows; y++) {
+                    for (int x = 0; x < samples; x++) {
+                        seed = seed * 1664525 + 1013904223;
+                        if (desc->comp[0].depth > 8)
+                            ((uint16_t *)(src->data[plane] + y * src->linesize[plane]))[x] = seed >> 22;
+                        else
+                            src->data[plane][y * src->linesize[plane] + x] = seed >> 24;
+                    }
+                }
+            }
+            src->interlaced_frame = interlaced;
+
+            for (int k = 0; k < FF_ARRAY_ELEMS(kernels); k++) {
+                GraphicsOverlay overlay;
+                const char *verdict = "ok";
+                int64_t start;
+                double elapsed;
+                int plane, row;
+
+                if (graphics_overlay_init(&overlay, asset, assetWidth * 4, assetWidth, assetHeight, 1,
+                                          width / 3, height / 3, kernels[k]) < 0) {
+                    printf("%-14s %-11s %-6s not available\n", av_get_pix_fmt_name(overlay_formats[format]),
+                           interlaced ? "interlaced" : "progressive", overlay_kernel_name(kernels[k]));
+                    graphics_overlay_uninit(&overlay);
+                    continue;
+                }
+
+                av_frame_copy(dst, src);
+                av_frame_copy_props(dst, src);
+                if (graphics_overlay_apply(&overlay, dst) < 0) {
+                    verdict = "FAILED";
+                    mismatches++;
+                } else if (kernels[k] == OVERLAY_KERNEL_SCALAR) {
+                    av_frame_copy(reference, dst);
+                } else if (!compare_frames(reference, dst, &plane, &row)) {
+                    verdict = "MISMATCH";
+                    mismatches++;
+                    av_log(NULL, AV_LOG_ERROR, "%s kernel differs from scalar at plane %d row %d\n",
+                           overlay_kernel_name(kernels[k]), plane, row);
+                }
+
+                start = av_gettime_relative();
+                for (int i = 0; i < iterations; i++)
+                    graphics_overlay_apply(&overlay, dst);
+                elapsed = (av_gettime_relative() - start) / 1000.0 / iterations;
+
+                printf("%-14s %-11s %-6s %8.3f ms/frame %8.1f Mpix/s  %s\n",
+                       av_get_pix_fmt_name(overlay_formats[format]), interlaced ? "interlaced" : "progressive",
+                       overlay_kernel_name(kernels[k]), elapsed,
+                       elapsed > 0 ? overlay.planes[0].width * overlay.planes[0].height / (elapsed * 1000.0) : 0,
+                       verdict);
+
+                graphics_overlay_uninit(&overlay);
+            }
+
+            av_frame_free(&src);
+            av_frame_free(&reference);
+            av_frame_free(&dst);
+        }
+    }
+
+    av_free(asset);
+    return mismatches;
+}
@@ -0,0 +1,75 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Graphics overlay (logo bug, burn-in) blended into the encoder's input frames.
+ *
+ * The asset is an RGBA image, premultiplied or straight, or any format
+ * swscale turns into RGBA, such as a YUVA still. On the first frame, and
+ * whenever the frame format, size, colour matrix or chroma siting changes, it
+ * is converted once into the frame's pixel format: per plane, a premultiplied
+ * sample value and an inverse alpha in 1/256ths, with chroma filtered down to
+ * the frame's siting. Blending is then dst = value + dst * inverse / 256 over
+ * the covered rectangle only, with scalar, SSE2 and AVX2 kernels for 8-bit and
+ * 10-bit planar YUV.
+ *
+ * 4:2:0 chroma is also prepared from rows of the same field, which is used for
+ * interlaced frames so that neither field picks up the other's chroma. The
+ * position is rounded down to whole chroma samples, and vertically to a whole
+ * field pair of chroma rows, then clipped to the frame.
+ */
+
+enum OverlayKernel {
+    OVERLAY_KERNEL_AUTO,
+    OVERLAY_KERNEL_SCALAR,
+    OVERLAY_KERNEL_SSE2,
+    OVERLAY_KERNEL_AVX2,
+};
+
+typedef void (*BlendRow8Func)(uint8_t *dst, const uint16_t *value, const uint16_t *inverse, int width);
+typedef void (*BlendRow10Func)(uint16_t *dst, const uint16_t *value, const uint16_t *inverse, int width);
+
+typedef struct OverlayPlane {
+    uint16_t *value;
+    uint16_t *inverse;
+    int x;
+    int y;
+    int width;
+    int height;
+} OverlayPlane;
+
+typedef struct GraphicsOverlay {
+    uint8_t *rgba;
+    int assetWidth;
+    int assetHeight;
+    int x;
+    int y;
+    enum AVPixelFormat format;
+    int frameWidth;
+    int frameHeight;
+    enum AVColorSpace colorspace;
+    enum AVChromaLocation chromaLocation;
+    int depth;
+    OverlayPlane planes[3];
+    OverlayPlane fieldPlanes[3];
+    int hasFieldPlanes;
+    enum OverlayKernel kernel;
+    BlendRow8Func blendRow8;
+    BlendRow10Func blendRow10;
+    int64_t blendedFrames;
+} GraphicsOverlay;
+
+int graphics_overlay_init(GraphicsOverlay *overlay, const uint8_t *rgba, int linesize, int width, int height,
+                          int premultiplied, int x, int y, enum OverlayKernel kernel);
+int graphics_overlay_load(GraphicsOverlay *overlay, const char *assetFilename, int premultiplied, int x, int y);
+int graphics_overlay_apply(GraphicsOverlay *overlay, AVFrame *frame);
+void graphics_overlay_uninit(GraphicsOverlay *overlay);
+const char *overlay_kernel_name(enum OverlayKernel kernel);
+int benchmark_graphics_overlay(int width, int height, int iterations);
+
+#endif
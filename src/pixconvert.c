@@ -0,0 +1,382 @@
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "pixconvert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HAVE_NATIVE_LE16 0
+#else
+#define HAVE_NATIVE_LE16 1
+#endif
+
+
+static const struct {
+    enum AVPixelFormat srcFormat;
+    enum AVPixelFormat dstFormat;
+} fast_pairs[] = {
+    { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P10LE },
+    { AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV420P10LE },
+    { AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV422P10LE },
+};
+
+
+static void shift_row_scalar(uint16_t *dst, const uint8_t *src, int width) {
+    for (int x = 0; x < width; x++)
+        dst[x] = src[x] << 2;
+}
+
+
+static void average_rows_scalar(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+    for (int x = 0; x < width; x++)
+        dst[x] = (src0[x] + src1[x]) << 1;
+}
+
+
+#if HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void shift_row_sse2(uint16_t *dst, const uint8_t *src, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + x));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_slli_epi16(_mm_unpacklo_epi8(pixels, zero), 2));
+        _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_slli_epi16(_mm_unpackhi_epi8(pixels, zero), 2));
+    }
+    shift_row_scalar(dst + x, src + x, width - x);
+}
+
+
+__attribute__((target("sse2")))
+static void average_rows_sse2(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i row0 = _mm_loadu_si128((const __m128i *)(src0 + x));
+        __m128i row1 = _mm_loadu_si128((const __m128i *)(src1 + x));
+        __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(row0, zero), _mm_unpacklo_epi8(row1, zero));
+        __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(row0, zero), _mm_unpackhi_epi8(row1, zero));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_slli_epi16(low, 1));
+        _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_slli_epi16(high, 1));
+    }
+    average_rows_scalar(dst + x, src0 + x, src1 + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void shift_row_avx2(uint16_t *dst, const uint8_t *src, int width) {
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i low = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x)));
+        __m256i high = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x + 16)));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_slli_epi16(low, 2));
+        _mm256_storeu_si256((__m256i *)(dst + x + 16), _mm256_slli_epi16(high, 2));
+    }
+    shift_row_scalar(dst + x, src + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void average_rows_avx2(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i low = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src0 + x))),
+                                       _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src1 + x))));
+        __m256i high = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src0 + x + 16))),
+                                        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src1 + x + 16))));
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_slli_epi16(low, 1));
+        _mm256_storeu_si256((__m256i *)(dst + x + 16), _mm256_slli_epi16(high, 1));
+    }
+    average_rows_scalar(dst + x, src0 + x, src1 + x, width - x);
+}
+#endif
+
+
+const char *pixel_convert_kernel_name(enum PixelConvertKernel kernel) {
+    switch (kernel) {
+    case PIXEL_CONVERT_KERNEL_SCALAR:  return "scalar";
+    case PIXEL_CONVERT_KERNEL_SSE2:    return "sse2";
+    case PIXEL_CONVERT_KERNEL_AVX2:    return "avx2";
+    case PIXEL_CONVERT_KERNEL_SWSCALE: return "swscale";
+    default:                           return "auto";
+    }
+}
+
+
+int pixel_converter_supported(enum AVPixelFormat srcFormat, enum AVColorRange srcRange, enum AVPixelFormat dstFormat) {
+    if (!HAVE_NATIVE_LE16 || srcRange == AVCOL_RANGE_JPEG)
+        return 0;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(fast_pairs); i++) {
+        if (fast_pairs[i].srcFormat == srcFormat && fast_pairs[i].dstFormat == dstFormat)
+            return 1;
+    }
+    return 0;
+}
+
+
+static int select_kernel(PixelConverter *converter, enum PixelConvertKernel kernel) {
+#if HAVE_X86_KERNELS
+    int cpuFlags = av_get_cpu_flags();
+
+    if (kernel == PIXEL_CONVERT_KERNEL_AUTO)
+        kernel = cpuFlags & AV_CPU_FLAG_AVX2 ? PIXEL_CONVERT_KERNEL_AVX2
+               : cpuFlags & AV_CPU_FLAG_SSE2 ? PIXEL_CONVERT_KERNEL_SSE2 : PIXEL_CONVERT_KERNEL_SCALAR;
+
+    if (kernel == PIXEL_CONVERT_KERNEL_AVX2) {
+        if (!(cpuFlags & AV_CPU_FLAG_AVX2))
+            return AVERROR(ENOSYS);
+        converter->shiftRow = shift_row_avx2;
+        converter->averageRows = average_rows_avx2;
+    } else if (kernel == PIXEL_CONVERT_KERNEL_SSE2) {
+        if (!(cpuFlags & AV_CPU_FLAG_SSE2))
+            return AVERROR(ENOSYS);
+        converter->shiftRow = shift_row_sse2;
+        converter->averageRows = average_rows_sse2;
+    }
+#else
+    if (kernel == PIXEL_CONVERT_KERNEL_AUTO)
+        kernel = PIXEL_CONVERT_KERNEL_SCALAR;
+    if (kernel == PIXEL_CONVERT_KERNEL_AVX2 || kernel == PIXEL_CONVERT_KERNEL_SSE2)
+        return AVERROR(ENOSYS);
+#endif
+
+    if (kernel == PIXEL_CONVERT_KERNEL_SCALAR) {
+        converter->shiftRow = shift_row_scalar;
+        converter->averageRows = average_rows_scalar;
+    }
+
+    converter->kernel = kernel;
+    return 0;
+}
+
+
+int pixel_converter_init(PixelConverter *converter, int width, int height, enum AVPixelFormat srcFormat,
+                         enum AVColorRange srcRange, enum AVPixelFormat dstFormat, enum PixelConvertKernel kernel) {
+    memset(converter, 0, sizeof(*converter));
+    converter->width = width;
+    converter->height = height;
+    converter->srcFormat = srcFormat;
+    converter->dstFormat = dstFormat;
+
+    if (kernel != PIXEL_CONVERT_KERNEL_SWSCALE && pixel_converter_supported(srcFormat, srcRange, dstFormat))
+        return select_kernel(converter, kernel);
+
+    converter->kernel = PIXEL_CONVERT_KERNEL_SWSCALE;
+    converter->swsContext = sws_getContext(width, height, srcFormat, width, height, dstFormat,
+                                           PIXEL_CONVERTER_SWS_FLAGS, NULL, NULL, NULL);
+    if (!converter->swsContext) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot convert %s to %s\n",
+               av_get_pix_fmt_name(srcFormat), av_get_pix_fmt_name(dstFormat));
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+
+static void shift_plane(PixelConverter *converter, uint8_t *dst, int dstLinesize,
+                        const uint8_t *src, int srcLinesize, int width, int height) {
+    for (int y = 0; y < height; y++)
+        converter->shiftRow((uint16_t *)(dst + y * dstLinesize), src + y * srcLinesize, width);
+}
+
+
+static void decimate_plane(PixelConverter *converter, uint8_t *dst, int dstLinesize,
+                           const uint8_t *src, int srcLinesize, int width, int dstHeight, int srcHeight, int interlaced) {
+    for (int y = 0; y < dstHeight; y++) {
+        int row0, row1;
+
+        if (interlaced) {
+            /* Each field keeps its own chroma: pair row n with row n + 2 of the same parity. */
+            row0 = 4 * (y >> 1) + (y & 1);
+            while (row0 >= srcHeight)
+                row0 -= 2;
+            row1 = row0 + 2 < srcHeight ? row0 + 2 : row0;
+        } else {
+            row0 = 2 * y;
+            row1 = FFMIN(row0 + 1, srcHeight - 1);
+        }
+
+        converter->averageRows((uint16_t *)(dst + y * dstLinesize),
+                               src + row0 * srcLinesize, src + row1 * srcLinesize, width);
+    }
+}
+
+
+int pixel_converter_convert(PixelConverter *converter, AVFrame *dst, const AVFrame *src) {
+    const AVPixFmtDescriptor *srcDesc, *dstDesc;
+    int ret;
+
+    if (src->width != converter->width || src->height != converter->height || src->format != converter->srcFormat) {
+        enum PixelConvertKernel kernel = converter->kernel;
+        enum AVPixelFormat dstFormat = converter->dstFormat;
+
+        pixel_converter_uninit(converter);
+        if ((ret = pixel_converter_init(converter, src->width, src->height, src->format, src->color_range, dstFormat, kernel)) < 0)
+            return ret;
+    }
+
+    if (converter->swsContext) {
+        ret = sws_scale(converter->swsContext, (const uint8_t * const *)src->data, src->linesize,
+                        0, src->height, dst->data, dst->linesize);
+        return ret < 0 ? ret : 0;
+    }
+
+    srcDesc = av_pix_fmt_desc_get(converter->srcFormat);
+    dstDesc = av_pix_fmt_desc_get(converter->dstFormat);
+
+    shift_plane(converter, dst->data[0], dst->linesize[0], src->data[0], src->linesize[0],
+                converter->width, converter->height);
+
+    for (int plane = 1; plane < 3; plane++) {
+        int chromaWidth = AV_CEIL_RSHIFT(converter->width, srcDesc->log2_chroma_w);
+        int srcHeight = AV_CEIL_RSHIFT(converter->height, srcDesc->log2_chroma_h);
+        int dstHeight = AV_CEIL_RSHIFT(converter->height, dstDesc->log2_chroma_h);
+
+        if (srcHeight == dstHeight) {
+            shift_plane(converter, dst->data[plane], dst->linesize[plane], src->data[plane], src->linesize[plane],
+                        chromaWidth, dstHeight);
+        } else {
+            decimate_plane(converter, dst->data[plane], dst->linesize[plane], src->data[plane], src->linesize[plane],
+                           chromaWidth, dstHeight, srcHeight, src->interlaced_frame);
+        }
+    }
+
+    return 0;
+}
+
+
+void pixel_converter_uninit(PixelConverter *converter) {
+    sws_freeContext(converter->swsContext);
+    converter->swsContext = NULL;
+}
+
+
+static AVFrame *alloc_bench_frame(int width, int height, enum AVPixelFormat format) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return NULL;
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+
+static int compare_frames(const AVFrame *a, const AVFrame *b, int *mismatchPlane, int *mismatchRow) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+
+    for (int plane = 0; plane < 3; plane++) {
+        int bytes = 2 * (plane ? AV_CEIL_RSHIFT(a->width, desc->log2_chroma_w) : a->width);
+        int rows = plane ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+
+        for (int y = 0; y < rows; y++) {
+            if (memcmp(a->data[plane] + y * a->linesize[plane], b->data[plane] + y * b->linesize[plane], bytes)) {
+                *mismatchPlane = plane;
+                *mismatchRow = y;
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Times every kernel available on this CPU against swscale for each fast pair,
+ * and checks the output of each kernel is bit-exact with swscale's.
+ * Returns the number of mismatching kernels.
+ */
+int benchmark_pixel_converter(int width, int height, int iterations) {
+    static const enum PixelConvertKernel kernels[] = {
+        PIXEL_CONVERT_KERNEL_SWSCALE, PIXEL_CONVERT_KERNEL_SCALAR, PIXEL_CONVERT_KERNEL_SSE2, PIXEL_CONVERT_KERNEL_AVX2,
+    };
+    uint32_t seed = 0x2545f491;
+    int mismatches = 0;
+
+    for (int pair = 0; pair < FF_ARRAY_ELEMS(fast_pairs); pair++) {
+        AVFrame *src = alloc_bench_frame(width, height, fast_pairs[pair].srcFormat);
+        AVFrame *reference = alloc_bench_frame(width, height, fast_pairs[pair].dstFormat);
+        AVFrame *dst = alloc_bench_frame(width, height, fast_pairs[pair].dstFormat);
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fast_pairs[pair].srcFormat);
+
+        if (!src || !reference || !dst) {
+            av_frame_free(&src);
+            av_frame_free(&reference);
+            av_frame_free(&dst);
+            return AVERROR(ENOMEM);
+        }
+
+        for (int plane = 0; plane < 3; plane++) {
+            int bytes = plane ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w) : width;
+            int rows = plane ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+            for (int y = 0; y < rows; y++) {
+                for (int x = 0; x < bytes; x++) {
+                    seed = seed * 1664525 + 1013904223;
+                    src->data[plane][y * src->linesize[plane] + x] = seed >> 24;
+                }
+            }
+        }
+
+        for (int k = 0; k < FF_ARRAY_ELEMS(kernels); k++) {
+            PixelConverter converter;
+            int64_t start;
+            double elapsed;
+            int plane, row;
+            const char *verdict = "reference";
+
+            if (pixel_converter_init(&converter, width, height, fast_pairs[pair].srcFormat, AVCOL_RANGE_MPEG,
+                                     fast_pairs[pair].dstFormat, kernels[k]) < 0)
+                continue;
+
+            pixel_converter_convert(&converter, kernels[k] == PIXEL_CONVERT_KERNEL_SWSCALE ? reference : dst, src);
+            if (kernels[k] != PIXEL_CONVERT_KERNEL_SWSCALE) {
+                verdict = "bit-exact";
+                if (!compare_frames(reference, dst, &plane, &row)) {
+                    verdict = "MISMATCH";
+                    mismatches++;
+                    av_log(NULL, AV_LOG_ERROR, "%s kernel differs from swscale in plane %d row %d\n",
+                           pixel_convert_kernel_name(kernels[k]), plane, row);
+                }
+            }
+
+            start = av_gettime_relative();
+            for (int i = 0; i < iterations; i++)
+                pixel_converter_convert(&converter, dst, src);
+            elapsed = (av_gettime_relative() - start) / 1000.0 / iterations;
+
+            printf("%-8s -> %-12s %-8s %8.3f ms/frame %8.1f Mpix/s  %s\n",
+                   av_get_pix_fmt_name(fast_pairs[pair].srcFormat), av_get_pix_fmt_name(fast_pairs[pair].dstFormat),
+                   pixel_convert_kernel_name(kernels[k]), elapsed,
+                   elapsed > 0 ? width * height / (elapsed * 1000.0) : 0, verdict);
+
+            pixel_converter_uninit(&converter);
+        }
+
+        av_frame_free(&src);
+        av_frame_free(&reference);
+        av_frame_free(&dst);
+    }
+
+    return mismatches;
+}
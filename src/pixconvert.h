@@ -0,0 +1,51 @@
+#ifndef PIXCONVERT_H
+#define PIXCONVERT_H
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+
+/*
+ * 8-bit to 10-bit planar YUV conversion.
+ *
+ * The few format pairs our jobs use have dedicated scalar, SSE2 and AVX2
+ * kernels: every sample is shifted left by two, and 4:2:2 chroma is decimated
+ * to 4:2:0 by summing row pairs (rows of the same field for interlaced frames),
+ * which 10 bits hold exactly. For progressive frames this matches swscale with
+ * PIXEL_CONVERTER_SWS_FLAGS bit for bit. Any other pair, and full range input,
+ * goes through swscale.
+ */
+
+#define PIXEL_CONVERTER_SWS_FLAGS (SWS_AREA | SWS_ACCURATE_RND | SWS_BITEXACT)
+
+enum PixelConvertKernel {
+    PIXEL_CONVERT_KERNEL_AUTO,
+    PIXEL_CONVERT_KERNEL_SCALAR,
+    PIXEL_CONVERT_KERNEL_SSE2,
+    PIXEL_CONVERT_KERNEL_AVX2,
+    PIXEL_CONVERT_KERNEL_SWSCALE,
+};
+
+typedef void (*ShiftRowFunc)(uint16_t *dst, const uint8_t *src, int width);
+typedef void (*AverageRowsFunc)(uint16_t *dst, const uint8_t *src0, const uint8_t *src1, int width);
+
+typedef struct PixelConverter {
+    int width;
+    int height;
+    enum AVPixelFormat srcFormat;
+    enum AVPixelFormat dstFormat;
+    enum PixelConvertKernel kernel;
+    ShiftRowFunc shiftRow;
+    AverageRowsFunc averageRows;
+    struct SwsContext *swsContext;
+} PixelConverter;
+
+int pixel_converter_supported(enum AVPixelFormat srcFormat, enum AVColorRange srcRange, enum AVPixelFormat dstFormat);
+int pixel_converter_init(PixelConverter *converter, int width, int height, enum AVPixelFormat srcFormat,
+                         enum AVColorRange srcRange, enum AVPixelFormat dstFormat, enum PixelConvertKernel kernel);
+int pixel_converter_convert(PixelConverter *converter, AVFrame *dst, const AVFrame *src);
+void pixel_converter_uninit(PixelConverter *converter);
+const char *pixel_convert_kernel_name(enum PixelConvertKernel kernel);
+int benchmark_pixel_converter(int width, int height, int iterations);
+
+#endif
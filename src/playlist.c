@@ -0,0 +1,294 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/pixdesc.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "playlist.h"
+
+
+int playlist_load(Playlist *playlist, const char *listFilename) {
+    char line[4096];
+    FILE *file;
+
+    memset(playlist, 0, sizeof(*playlist));
+
+    file = fopen(listFilename, "r");
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open playlist %s\n", listFilename);
+        return AVERROR(ENOENT);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char **items;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0] || line[0] == '#')
+            continue;
+
+        items = av_realloc_array(playlist->items, playlist->nbItems + 1, sizeof(*items));
+        if (!items) {
+            fclose(file);
+            return AVERROR(ENOMEM);
+        }
+        playlist->items = items;
+        if (!(playlist->items[playlist->nbItems++] = av_strdup(line))) {
+            fclose(file);
+            return AVERROR(ENOMEM);
+        }
+    }
+    fclose(file);
+
+    if (!playlist->nbItems) {
+        av_log(NULL, AV_LOG_ERROR, "Playlist %s is empty\n", listFilename);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+
+static void *open_next_input(void *opaque) {
+    Playlist *playlist = opaque;
+
+    playlist->nextStatus = open_media(&playlist->next, playlist->items[playlist->current + 1]);
+    return NULL;
+}
+
+
+static void prefetch_next(Playlist *playlist) {
+    if (playlist->current + 1 >= playlist->nbItems)
+        return;
+
+    if (pthread_create(&playlist->opener, NULL, open_next_input, playlist) == 0) {
+        playlist->opening = 1;
+    } else {
+        open_next_input(playlist);
+    }
+}
+
+
+/* Map the best video and audio streams of the current input onto the first input's indexes. */
+static int map_streams(Playlist *playlist, StreamingContext *decoder) {
+    int video = av_find_best_stream(playlist->input, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    int audio = av_find_best_stream(playlist->input, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+    av_freep(&playlist->streamMap);
+    playlist->nbStreamMap = playlist->input->nb_streams;
+    playlist->streamMap = av_malloc_array(playlist->nbStreamMap, sizeof(*playlist->streamMap));
+    if (!playlist->streamMap)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < playlist->nbStreamMap; i++) {
+        if (playlist->input == playlist->first)
+            playlist->streamMap[i] = i;
+        else if (i == video && decoder->videoCodecContext)
+            playlist->streamMap[i] = decoder->videoIndex;
+        else if (i == audio && decoder->audioCodecContext)
+            playlist->streamMap[i] = decoder->audioIndex;
+        else
+            playlist->streamMap[i] = -1;
+    }
+    return 0;
+}
+
+
+int playlist_start(Playlist *playlist, StreamingContext *decoder) {
+    int ret;
+
+    playlist->first = decoder->formatContext;
+    playlist->input = decoder->formatContext;
+    if ((ret = map_streams(playlist, decoder)) < 0)
+        return ret;
+
+    prefetch_next(playlist);
+    return 0;
+}
+
+
+int playlist_read_packet(Playlist *playlist, StreamingContext *decoder, AVPacket *packet) {
+    while (av_read_frame(playlist->input, packet) >= 0) {
+        int mapped = packet->stream_index < playlist->nbStreamMap ? playlist->streamMap[packet->stream_index] : -1;
+        AVStream *inputStream = playlist->input->streams[packet->stream_index];
+        AVStream *outputStream;
+        int64_t shift, end;
+
+        if (mapped < 0) {
+            av_packet_unref(packet);
+            continue;
+        }
+        outputStream = playlist->first->streams[mapped];
+
+        av_packet_rescale_ts(packet, inputStream->time_base, outputStream->time_base);
+        shift = av_rescale_q(playlist->offset, AV_TIME_BASE_Q, outputStream->time_base);
+        if (packet->pts != AV_NOPTS_VALUE)
+            packet->pts += shift;
+        if (packet->dts != AV_NOPTS_VALUE)
+            packet->dts += shift;
+        packet->stream_index = mapped;
+
+        if (packet->pts != AV_NOPTS_VALUE) {
+            end = av_rescale_q(packet->pts + packet->duration, outputStream->time_base, AV_TIME_BASE_Q);
+            if (mapped == decoder->videoIndex && end > playlist->videoEnd)
+                playlist->videoEnd = end;
+            else if (mapped == decoder->audioIndex && end > playlist->audioEnd)
+                playlist->audioEnd = end;
+        }
+        return 0;
+    }
+
+    return playlist->current + 1 < playlist->nbItems ? PLAYLIST_NEXT : AVERROR_EOF;
+}
+
+
+static int parameters_match(const AVCodecContext *context, const AVCodecParameters *parameters) {
+    if (context->codec_id != parameters->codec_id || context->extradata_size != parameters->extradata_size ||
+        (context->extradata_size && memcmp(context->extradata, parameters->extradata, context->extradata_size)))
+        return 0;
+
+    if (parameters->codec_type == AVMEDIA_TYPE_VIDEO)
+        return context->width == parameters->width && context->height == parameters->height &&
+               context->pix_fmt == parameters->format;
+
+    return context->sample_rate == parameters->sample_rate && context->sample_fmt == parameters->format &&
+           !av_channel_layout_compare(&context->ch_layout, &parameters->ch_layout);
+}
+
+
+/* Wait for the next input and work out which decoders the caller has to drain before playlist_switch(). */
+int playlist_open_next(Playlist *playlist, StreamingContext *decoder) {
+    int video, audio;
+
+    if (playlist->opening) {
+        pthread_join(playlist->opener, NULL);
+        playlist->opening = 0;
+    }
+    if (playlist->nextStatus < 0 || !playlist->next) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open playlist item %s\n", playlist->items[playlist->current + 1]);
+        return playlist->nextStatus < 0 ? playlist->nextStatus : AVERROR(EINVAL);
+    }
+
+    video = av_find_best_stream(playlist->next, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    audio = av_find_best_stream(playlist->next, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+    /* The filter graphs, the pixel converter's frame and the encoder are all set up for the first item's pictures. */
+    if (decoder->videoCodecContext && video >= 0) {
+        const AVCodecParameters *first = playlist->first->streams[decoder->videoIndex]->codecpar;
+        const AVCodecParameters *next = playlist->next->streams[video]->codecpar;
+
+        if (next->width != first->width || next->height != first->height || next->format != first->format) {
+            av_log(NULL, AV_LOG_ERROR, "Playlist item %s is %dx%d %s, but the playlist started as %dx%d %s\n",
+                   playlist->items[playlist->current + 1], next->width, next->height,
+                   av_get_pix_fmt_name(next->format) ? av_get_pix_fmt_name(next->format) : "unknown",
+                   first->width, first->height,
+                   av_get_pix_fmt_name(first->format) ? av_get_pix_fmt_name(first->format) : "unknown");
+            return AVERROR(EINVAL);
+        }
+    }
+
+    playlist->reopenVideo = decoder->videoCodecContext && video >= 0 &&
+                            !parameters_match(decoder->videoCodecContext, playlist->next->streams[video]->codecpar);
+    playlist->reopenAudio = decoder->audioCodecContext && audio >= 0 &&
+                            !parameters_match(decoder->audioCodecContext, playlist->next->streams[audio]->codecpar);
+    return 0;
+}
+
+
+/* Audio missing at the end of the current input, in AV_TIME_BASE units, for the caller to fill with silence. */
+int64_t playlist_audio_gap(const Playlist *playlist) {
+    return playlist->audioEnd > 0 && playlist->videoEnd > playlist->audioEnd ? playlist->videoEnd - playlist->audioEnd : 0;
+}
+
+
+/* Packets arrive rescaled into the first input's time base, so that is the reopened decoder's packet time base. */
+static int reopen_decoder(AVStream *inputStream, AVStream *timelineStream, AVCodec **codec, AVCodecContext **codecContext) {
+    int ret;
+
+    avcodec_free_context(codecContext);
+    *codec = (AVCodec *) avcodec_find_decoder(inputStream->codecpar->codec_id);
+    if (!*codec) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to find codec for stream #%u\n", inputStream->index);
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    *codecContext = avcodec_alloc_context3(*codec);
+    if (!*codecContext)
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_to_context(*codecContext, inputStream->codecpar)) < 0)
+        return ret;
+    (*codecContext)->pkt_timebase = timelineStream->time_base;
+
+    if ((ret = avcodec_open2(*codecContext, *codec, NULL)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Failed to open the decoder for stream #%u\n", inputStream->index);
+    return ret;
+}
+
+
+int playlist_switch(Playlist *playlist, StreamingContext *decoder) {
+    int video = av_find_best_stream(playlist->next, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    int audio = av_find_best_stream(playlist->next, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    int64_t nextStart = playlist->next->start_time != AV_NOPTS_VALUE ? playlist->next->start_time : 0;
+    int ret;
+
+    if (playlist->reopenVideo) {
+        if ((ret = reopen_decoder(playlist->next->streams[video], decoder->videoStream,
+                                  &decoder->videoCodec, &decoder->videoCodecContext)) < 0)
+            return ret;
+    }
+    if (playlist->reopenAudio) {
+        if ((ret = reopen_decoder(playlist->next->streams[audio], decoder->audioStream,
+                                  &decoder->audioCodec, &decoder->audioCodecContext)) < 0)
+            return ret;
+        decoder->audioTrackContexts[0] = decoder->audioCodecContext;
+    }
+    playlist->decodersReopened += playlist->reopenVideo + playlist->reopenAudio;
+    playlist->decodersReused += (decoder->videoCodecContext && video >= 0 && !playlist->reopenVideo) +
+                                (decoder->audioCodecContext && audio >= 0 && !playlist->reopenAudio);
+
+    if (playlist->input != playlist->first)
+        avformat_close_input(&playlist->input);
+    playlist->input = playlist->next;
+    playlist->next = NULL;
+    playlist->current++;
+    if ((ret = map_streams(playlist, decoder)) < 0)
+        return ret;
+
+    playlist->offset = FFMAX(playlist->videoEnd, playlist->audioEnd) - nextStart;
+    playlist->audioEnd = playlist->videoEnd = FFMAX(playlist->videoEnd, playlist->audioEnd);
+
+    av_log(NULL, AV_LOG_INFO, "Playlist item %d of %d: %s from %.3fs (%s video decoder, %s audio decoder)\n",
+           playlist->current + 1, playlist->nbItems, playlist->items[playlist->current],
+           playlist->videoEnd / (double)AV_TIME_BASE,
+           playlist->reopenVideo ? "reopened" : "kept", playlist->reopenAudio ? "reopened" : "kept");
+
+    prefetch_next(playlist);
+    return 0;
+}
+
+
+void playlist_uninit(Playlist *playlist) {
+    if (playlist->opening) {
+        pthread_join(playlist->opener, NULL);
+        playlist->opening = 0;
+    }
+    avformat_close_input(&playlist->next);
+    if (playlist->input != playlist->first)
+        avformat_close_input(&playlist->input);
+
+    if (playlist->nbItems > 1)
+        av_log(NULL, AV_LOG_INFO, "Playlist: %d items, %d decoders kept and %d reopened across switches\n",
+               playlist->nbItems, playlist->decodersReused, playlist->decodersReopened);
+
+    for (int i = 0; i < playlist->nbItems; i++)
+        av_freep(&playlist->items[i]);
+    av_freep(&playlist->items);
+    av_freep(&playlist->streamMap);
+    playlist->nbItems = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include "testbed.h"
+
+/*
+ * Playlist input: several files transcoded as one programme.
+ *
+ * The playlist presents the inputs as one continuous input with the stream
+ * layout and time bases of the first file. Packets from later files are
+ * mapped onto the first file's video and audio stream indexes, rescaled into
+ * its time bases and offset so each file starts where the previous one ended,
+ * so the filters, encoders and muxer run once across the whole list.
+ *
+ * The next file is opened on a background thread as soon as the current one
+ * starts. At the switch a decoder is kept when the new stream's codec
+ * parameters match the old ones, and otherwise drained and reopened. Any
+ * audio shorter than the video of a file is filled with silence before the
+ * next file starts, so audio timestamps, which count samples, stay in sync.
+ * Every item must have the first item's picture size and pixel format: the
+ * filter graphs, the pixel converter and the encoder are set up once for it,
+ * so an item that differs fails the job when it is reached.
+ */
+
+#define PLAYLIST_NEXT 1
+
+typedef struct Playlist {
+    char **items;
+    int nbItems;
+    int current;
+    AVFormatContext *first;
+    AVFormatContext *input;
+    AVFormatContext *next;
+    int nextStatus;
+    pthread_t opener;
+    int opening;
+    int *streamMap;
+    int nbStreamMap;
+    int64_t offset;
+    int64_t videoEnd;
+    int64_t audioEnd;
+    int reopenVideo;
+    int reopenAudio;
+    int decodersReused;
+    int decodersReopened;
+} Playlist;
+
+int playlist_load(Playlist *playlist, const char *listFilename);
+int playlist_start(Playlist *playlist, StreamingContext *decoder);
+int playlist_read_packet(Playlist *playlist, StreamingContext *decoder, AVPacket *packet);
+int playlist_open_next(Playlist *playlist, StreamingContext *decoder);
+int64_t playlist_audio_gap(const Playlist *playlist);
+int playlist_switch(Playlist *playlist, StreamingContext *decoder);
+void playlist_uninit(Playlist *playlist);
+
+#endif
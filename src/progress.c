@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "progress.h"
+
+#define PROGRESS_OPEN_WAIT_MS 1000
+#define PROGRESS_READ_ATTEMPTS 100
+/* Weight of the newest interval in the smoothed speed the ETA is worked out from. */
+#define PROGRESS_SMOOTHING 0.25
+
+static const char *progress_state_names[] = { "pending", "running", "finished", "failed", "cancelled" };
+
+
+static const char *state_name(int state) {
+    return state >= 0 && state < FF_ARRAY_ELEMS(progress_state_names) ? progress_state_names[state] : "unknown";
+}
+
+
+/* Whoever gets to create the segment sizes and initialises it; everyone else waits for the magic to appear. */
+static int map_board(ProgressReporter *reporter, const char *name, int slotCount) {
+    char path[64];
+    struct stat segmentStat;
+    ProgressBoardHeader *board;
+    size_t size = sizeof(ProgressBoardHeader) + (size_t)slotCount * sizeof(ProgressRecord);
+    int created = 1;
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd >= 0 && ftruncate(fd, size) < 0) {
+        ret = AVERROR(errno);
+        close(fd);
+        shm_unlink(path);
+        return ret;
+    }
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(path, O_RDWR, 0);
+    }
+    if (fd < 0)
+        return AVERROR(errno);
+
+    for (int waited = 0; !created; waited += 10) {
+        if (fstat(fd, &segmentStat) < 0 || waited >= PROGRESS_OPEN_WAIT_MS) {
+            close(fd);
+            return AVERROR(ETIMEDOUT);
+        }
+        if (segmentStat.st_size > 0) {
+            size = segmentStat.st_size;
+            break;
+        }
+        av_usleep(10000);
+    }
+
+    board = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (board == MAP_FAILED)
+        return AVERROR(errno);
+    reporter->board = board;
+    reporter->mappedSize = size;
+
+    if (created) {
+        board->version = PROGRESS_BOARD_VERSION;
+        board->slotCount = slotCount;
+        board->recordSize = sizeof(ProgressRecord);
+        atomic_store(&board->magic, PROGRESS_BOARD_MAGIC);
+        return 0;
+    }
+
+    for (int waited = 0; atomic_load(&board->magic) != PROGRESS_BOARD_MAGIC; waited += 10) {
+        if (waited >= PROGRESS_OPEN_WAIT_MS)
+            return AVERROR(ETIMEDOUT);
+        av_usleep(10000);
+    }
+    if (board->version != PROGRESS_BOARD_VERSION || board->recordSize != sizeof(ProgressRecord) ||
+        sizeof(ProgressBoardHeader) + (size_t)board->slotCount * sizeof(ProgressRecord) > size)
+        return AVERROR(EINVAL);
+    return 0;
+}
+
+
+static int read_record(const ProgressRecord *record, ProgressRecord *copy) {
+    for (int attempt = 0; attempt < PROGRESS_READ_ATTEMPTS; attempt++) {
+        unsigned sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+        if (sequence & 1)
+            continue;
+        memcpy(copy, record, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&record->sequence, memory_order_relaxed) == sequence)
+            return 0;
+    }
+    return AVERROR(EAGAIN);
+}
+
+
+/* A released record is kept for PROGRESS_RECLAIM_GRACE seconds after its job ended, so monitors see the final state. */
+static int record_reclaimable(const ProgressRecord *record, int64_t now) {
+    ProgressRecord copy;
+
+    if (read_record(record, &copy) < 0)
+        return 0;
+    if (!copy.updateTime)
+        return 1;
+    return copy.state >= TESTBED_JOB_FINISHED && now - copy.updateTime >= PROGRESS_RECLAIM_GRACE * (int64_t)1000000;
+}
+
+
+/* A record whose owner has died is taken over at once, whatever state it was left in. */
+static ProgressRecord *claim_record(ProgressBoardHeader *board, int pid) {
+    int64_t now = av_gettime();
+
+    for (int i = 0; i < board->slotCount; i++) {
+        ProgressRecord *record = &board->records[i];
+        int owner = atomic_load(&record->owner);
+
+        if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+            continue;
+        if (owner == 0 && !record_reclaimable(record, now))
+            continue;
+        if (atomic_compare_exchange_strong(&record->owner, &owner, pid))
+            return record;
+    }
+    return NULL;
+}
+
+
+static void write_record(ProgressReporter *reporter, int64_t now) {
+    ProgressRecord *record = reporter->record;
+    unsigned sequence = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&record->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    record->pid = reporter->pid;
+    record->state = reporter->state;
+    record->paused = reporter->paused;
+    record->startTime = reporter->startTime;
+    record->updateTime = now;
+    record->position = reporter->last.position;
+    record->duration = reporter->last.duration;
+    record->packets = reporter->last.packets;
+    record->frames = reporter->last.frames;
+    record->bytes = reporter->last.bytes;
+    record->fps = reporter->fps;
+    record->speed = reporter->speed;
+    record->eta = reporter->eta;
+    record->numaNode = reporter->numaNode;
+    record->numaMemoryBound = reporter->numaMemoryBound;
+    memcpy(record->cpus, reporter->cpus, sizeof(record->cpus));
+    memcpy(record->input, reporter->input, sizeof(record->input));
+
+    atomic_store_explicit(&record->sequence, sequence + 2, memory_order_release);
+}
+
+
+static void write_status_file(ProgressReporter *reporter, int64_t now) {
+    FILE *file = fopen(reporter->temporaryFilename, "w");
+
+    if (!file)
+        return;
+    fprintf(file, "state=%s\npaused=%d\ninput=%s\nstart_time_us=%" PRId64 "\nupdate_time_us=%" PRId64 "\n"
+            "position_us=%" PRId64 "\nduration_us=%" PRId64 "\npackets=%" PRId64 "\nframes=%" PRId64 "\n"
+            "bytes=%" PRId64 "\nfps=%.2f\nspeed=%.3f\neta_us=%" PRId64 "\nnuma_node=%d\nnuma_cpus=%s\nnuma_memory=%s\n",
+            state_name(reporter->state), reporter->paused, reporter->input, reporter->startTime, now,
+            reporter->last.position, reporter->last.duration, reporter->last.packets, reporter->last.frames,
+            reporter->last.bytes, reporter->fps, reporter->speed, reporter->eta,
+            reporter->numaNode, reporter->cpus, reporter->numaMemoryBound ? "preferred" : "not bound");
+    if (fclose(file) == 0)
+        rename(reporter->temporaryFilename, reporter->filename);
+}
+
+
+static void publish(ProgressReporter *reporter) {
+    int64_t now = av_gettime();
+
+    if (reporter->record)
+        write_record(reporter, now);
+    if (reporter->filename)
+        write_status_file(reporter, now);
+}
+
+
+/* A board that can't be mapped or is full only costs the job its progress, so it's a warning. */
+int progress_reporter_init(ProgressReporter *reporter, const StreamingParams *streamParameters, const char *inputFilename,
+                           const NumaPlacement *placement) {
+    int ret;
+
+    memset(reporter, 0, sizeof(*reporter));
+    reporter->pid = getpid();
+    reporter->state = TESTBED_JOB_RUNNING;
+    reporter->lastTime = -1;
+    reporter->eta = -1;
+    reporter->last.position = AV_NOPTS_VALUE;
+    reporter->last.duration = AV_NOPTS_VALUE;
+    av_strlcpy(reporter->input, inputFilename, sizeof(reporter->input));
+    reporter->numaNode = placement->node;
+    if (placement->node >= 0) {
+        reporter->numaMemoryBound = placement->memoryBound;
+        numa_format_cpus(placement, reporter->cpus, sizeof(reporter->cpus));
+    }
+
+    if (!streamParameters->progressBoard && !streamParameters->progressFile)
+        return 0;
+    reporter->enabled = 1;
+    reporter->interval = FFMAX(streamParameters->progressInterval, 1) * 1000LL;
+    reporter->startTime = av_gettime();
+
+    if (streamParameters->progressFile) {
+        reporter->filename = streamParameters->progressFile;
+        reporter->temporaryFilename = av_asprintf("%s.tmp", streamParameters->progressFile);
+        if (!reporter->temporaryFilename)
+            return AVERROR(ENOMEM);
+    }
+
+    if (streamParameters->progressBoard) {
+        ret = map_board(reporter, streamParameters->progressBoard, FFMAX(streamParameters->progressBoardSlots, 1));
+        if (ret >= 0 && !(reporter->record = claim_record(reporter->board, reporter->pid)))
+            ret = AVERROR(ENOSPC);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Not publishing progress on board %s: %s\n", streamParameters->progressBoard,
+                   av_err2str(ret));
+            if (reporter->board)
+                munmap(reporter->board, reporter->mappedSize);
+            reporter->board = NULL;
+        }
+    }
+
+    publish(reporter);
+    reporter->nextUpdate = av_gettime_relative() + reporter->interval;
+    return 0;
+}
+
+
+/* All the read loop pays between publications. */
+int progress_reporter_due(ProgressReporter *reporter) {
+    return reporter->enabled && av_gettime_relative() >= reporter->nextUpdate;
+}
+
+
+void progress_reporter_publish(ProgressReporter *reporter, const ProgressSample *sample) {
+    int64_t now = av_gettime_relative();
+
+    if (reporter->lastTime >= 0 && now > reporter->lastTime) {
+        double seconds = (now - reporter->lastTime) / 1000000.0;
+
+        reporter->fps = (sample->frames - reporter->last.frames) / seconds;
+        if (sample->position != AV_NOPTS_VALUE && reporter->last.position != AV_NOPTS_VALUE) {
+            double speed = (sample->position - reporter->last.position) / 1000000.0 / seconds;
+            reporter->speed = reporter->speed > 0 ? PROGRESS_SMOOTHING * speed + (1 - PROGRESS_SMOOTHING) * reporter->speed
+                                                  : speed;
+        }
+    }
+    if (sample->duration != AV_NOPTS_VALUE && sample->position != AV_NOPTS_VALUE && reporter->speed > 0)
+        reporter->eta = FFMAX(sample->duration - sample->position, 0) / reporter->speed;
+    else
+        reporter->eta = -1;
+
+    reporter->last = *sample;
+    reporter->lastTime = now;
+    reporter->nextUpdate = now + reporter->interval;
+    publish(reporter);
+}
+
+
+/* Published straight away, and the next interval starts at the resume so the pause doesn't count against the rates. */
+void progress_reporter_pause(ProgressReporter *reporter, int paused) {
+    if (!reporter->enabled)
+        return;
+    reporter->paused = paused;
+    if (!paused)
+        reporter->lastTime = -1;
+    publish(reporter);
+}
+
+
+void progress_reporter_finish(ProgressReporter *reporter, enum TestbedJobState state) {
+    if (!reporter->enabled)
+        return;
+    reporter->state = state;
+    reporter->paused = 0;
+    if (state == TESTBED_JOB_FINISHED)
+        reporter->eta = 0;
+    publish(reporter);
+}
+
+
+void progress_reporter_uninit(ProgressReporter *reporter) {
+    /* Only a record in a final state is ever reclaimed, so one that wasn't finished is marked failed. */
+    if (reporter->record && reporter->state < TESTBED_JOB_FINISHED)
+        progress_reporter_finish(reporter, TESTBED_JOB_FAILED);
+    if (reporter->record)
+        atomic_store(&reporter->record->owner, 0);
+    if (reporter->board)
+        munmap(reporter->board, reporter->mappedSize);
+    av_freep(&reporter->temporaryFilename);
+    memset(reporter, 0, sizeof(*reporter));
+}
+
+
+/* Print every record that has been used, one job per line, for a monitor or a person. */
+int progress_board_print(const char *name) {
+    char path[64];
+    struct stat segmentStat;
+    const ProgressBoardHeader *board;
+    int fd, ret = 0;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open progress board %s: %s\n", path, strerror(errno));
+        return AVERROR(errno);
+    }
+    if (fstat(fd, &segmentStat) < 0 || segmentStat.st_size < sizeof(ProgressBoardHeader)) {
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+    board = mmap(NULL, segmentStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (board == MAP_FAILED)
+        return AVERROR(errno);
+
+    if (atomic_load(&board->magic) != PROGRESS_BOARD_MAGIC || board->version != PROGRESS_BOARD_VERSION ||
+        board->recordSize != sizeof(ProgressRecord) ||
+        sizeof(ProgressBoardHeader) + (size_t)board->slotCount * sizeof(ProgressRecord) > segmentStat.st_size) {
+        av_log(NULL, AV_LOG_ERROR, "%s is not a progress board this build can read\n", path);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    printf("slot pid state position_s duration_s packets frames fps speed eta_s bytes numa_node cpus input\n");
+    for (int i = 0; i < board->slotCount; i++) {
+        ProgressRecord record;
+
+        if (read_record(&board->records[i], &record) < 0 || !record.updateTime)
+            continue;
+        printf("%d %d %s%s %.1f %.1f %" PRId64 " %" PRId64 " %.1f %.2f %.0f %" PRId64 " %d %s %s\n", i,
+               record.pid, state_name(record.state), record.paused ? "/paused" : "",
+               record.position == AV_NOPTS_VALUE ? -1.0 : record.position / 1000000.0,
+               record.duration == AV_NOPTS_VALUE ? -1.0 : record.duration / 1000000.0,
+               record.packets, record.frames, record.fps, record.speed,
+               record.eta < 0 ? -1.0 : record.eta / 1000000.0, record.bytes,
+               record.numaNode, record.numaNode >= 0 ? record.cpus : "-", record.input);
+    }
+
+    end:
+    munmap((void *)board, segmentStat.st_size);
+    return ret;
+}
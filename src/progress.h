@@ -0,0 +1,123 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "numa.h"
+#include "testbed.h"
+
+/*
+ * Progress board: a POSIX shared memory segment of fixed-size records, one
+ * per running job, that a monitor maps and reads without any help from the
+ * jobs.
+ *
+ * Every job given the same board name claims a free record in it, and jobs in
+ * different processes share one segment, which the first of them creates. A
+ * record holds numbers only: the job's position and duration, packets read,
+ * video frames and bytes handed to the muxer, frame rate and speed over the
+ * last interval, the time left at the smoothed speed, and the NUMA node and
+ * CPUs the job is bound to, if any. The job publishes
+ * at most once per StreamingParams.progressInterval milliseconds, and between
+ * publications the read loop only compares the clock against a deadline.
+ *
+ * Records are written under a sequence count, odd while a write is in
+ * progress, so a reader copies a record and keeps the copy only when the
+ * count was even and unchanged around it. Records are a cache line apart, so
+ * jobs don't slow each other down. A job releases its record when it ends,
+ * always in a final state, and the record keeps that state and the job's pid.
+ * Another job may claim it only PROGRESS_RECLAIM_GRACE seconds later, so a
+ * monitor polling now and then still sees how the job ended. A record whose
+ * process has died is taken over by the next job that needs one.
+ *
+ * StreamingParams.progressFile gets the same numbers as name=value lines at
+ * the same rate, written to a temporary file and renamed over the old one, so
+ * a reader never sees half an update.
+ */
+
+#define PROGRESS_BOARD_MAGIC 0x50524f47
+#define PROGRESS_BOARD_VERSION 3
+#define PROGRESS_INPUT_SIZE 128
+#define PROGRESS_CPUS_SIZE 64
+/* Seconds a finished job's record is kept before another job may claim it. */
+#define PROGRESS_RECLAIM_GRACE 60
+
+typedef struct ProgressRecord {
+    atomic_uint sequence;
+    /* The process that holds the record, or 0 once released; only claiming looks at it. */
+    atomic_int owner;
+    /* The process that ran the job, kept after the record is released. */
+    int32_t pid;
+    int32_t state;
+    int32_t paused;
+    /* Wall clock, in microseconds. */
+    int64_t startTime;
+    int64_t updateTime;
+    /* In microseconds, or AV_NOPTS_VALUE while unknown. */
+    int64_t position;
+    int64_t duration;
+    int64_t packets;
+    int64_t frames;
+    int64_t bytes;
+    double fps;
+    double speed;
+    /* Microseconds, or -1 while unknown. */
+    int64_t eta;
+    /* -1 when the job isn't bound to a node. */
+    int32_t numaNode;
+    int32_t numaMemoryBound;
+    char cpus[PROGRESS_CPUS_SIZE];
+    char input[PROGRESS_INPUT_SIZE];
+} __attribute__((aligned(64))) ProgressRecord;
+
+typedef struct ProgressBoardHeader {
+    atomic_uint magic;
+    uint32_t version;
+    int32_t slotCount;
+    int32_t recordSize;
+    ProgressRecord records[];
+} ProgressBoardHeader;
+
+typedef struct ProgressSample {
+    int64_t position;
+    int64_t duration;
+    int64_t packets;
+    int64_t frames;
+    int64_t bytes;
+} ProgressSample;
+
+typedef struct ProgressReporter {
+    int enabled;
+    int pid;
+    ProgressBoardHeader *board;
+    size_t mappedSize;
+    ProgressRecord *record;
+    const char *filename;
+    char *temporaryFilename;
+    char input[PROGRESS_INPUT_SIZE];
+    int numaNode;
+    int numaMemoryBound;
+    char cpus[PROGRESS_CPUS_SIZE];
+    int64_t interval;
+    int64_t nextUpdate;
+    int64_t startTime;
+    int state;
+    int paused;
+
+    ProgressSample last;
+    int64_t lastTime;
+    double fps;
+    double speed;
+    int64_t eta;
+} ProgressReporter;
+
+int progress_reporter_init(ProgressReporter *reporter, const StreamingParams *streamParameters, const char *inputFilename,
+                           const NumaPlacement *placement);
+int progress_reporter_due(ProgressReporter *reporter);
+void progress_reporter_publish(ProgressReporter *reporter, const ProgressSample *sample);
+void progress_reporter_pause(ProgressReporter *reporter, int paused);
+void progress_reporter_finish(ProgressReporter *reporter, enum TestbedJobState state);
+void progress_reporter_uninit(ProgressReporter *reporter);
+int progress_board_print(const char *name);
+
+#endif
@@ -0,0 +1,443 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libavutil/opt.h>
+#include "libavutil/md5.h"
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "overlay.h"
+#include "ratecontrol.h"
+
+/* Bytes read from the start, middle and end of the input to identify its content. */
+#define CONTENT_SAMPLE_SIZE (1024 * 1024)
+
+
+static void hash_int(struct AVMD5 *md5, int64_t value) {
+    av_md5_update(md5, (const uint8_t *)&value, sizeof(value));
+}
+
+
+static void hash_string(struct AVMD5 *md5, const char *value) {
+    if (!value) {
+        hash_int(md5, 0);
+        return;
+    }
+    av_md5_update(md5, (const uint8_t *)value, strlen(value) + 1);
+}
+
+
+static int hash_file_samples(struct AVMD5 *md5, const char *filename) {
+    AVIOContext *inputIO = NULL;
+    uint8_t *buffer;
+    int64_t fileSize, offsets[3];
+    int ret;
+
+    if ((ret = avio_open(&inputIO, filename, AVIO_FLAG_READ)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s to compute first pass cache key\n", filename);
+        return ret;
+    }
+
+    buffer = av_malloc(CONTENT_SAMPLE_SIZE);
+    if (!buffer) {
+        avio_closep(&inputIO);
+        return AVERROR(ENOMEM);
+    }
+
+    fileSize = avio_size(inputIO);
+    hash_int(md5, fileSize);
+
+    offsets[0] = 0;
+    offsets[1] = fileSize / 2;
+    offsets[2] = fileSize - CONTENT_SAMPLE_SIZE;
+
+    for (int i = 0; i < 3; i++) {
+        int bytesRead;
+
+        if (i > 0 && (fileSize < 0 || offsets[i] < CONTENT_SAMPLE_SIZE))
+            break;
+        if (avio_seek(inputIO, offsets[i], SEEK_SET) < 0)
+            break;
+        bytesRead = avio_read(inputIO, buffer, CONTENT_SAMPLE_SIZE);
+        if (bytesRead > 0)
+            av_md5_update(md5, buffer, bytesRead);
+    }
+
+    av_free(buffer);
+    avio_closep(&inputIO);
+    return 0;
+}
+
+
+int rate_control_cache_key(StreamingContext *decoder, const StreamingParams *streamParameters, char *key, int keySize) {
+    struct AVMD5 *md5;
+    uint8_t digest[16];
+    AVCodecParameters *videoParameters = decoder->videoStream->codecpar;
+    int ret;
+
+    if (keySize < 2 * sizeof(digest) + 1)
+        return AVERROR(EINVAL);
+
+    md5 = av_md5_alloc();
+    if (!md5)
+        return AVERROR(ENOMEM);
+    av_md5_init(md5);
+
+    if ((ret = hash_file_samples(md5, decoder->filename)) < 0) {
+        av_free(md5);
+        return ret;
+    }
+
+    hash_int(md5, decoder->formatContext->duration);
+    hash_int(md5, videoParameters->codec_id);
+    hash_int(md5, videoParameters->width);
+    hash_int(md5, videoParameters->height);
+    hash_int(md5, videoParameters->format);
+
+    /* Everything that changes the first pass statistics, but not the bitrate targets. */
+    hash_int(md5, streamParameters->videoCodec);
+    hash_int(md5, streamParameters->frameWidth);
+    hash_int(md5, streamParameters->frameHeight);
+    hash_int(md5, streamParameters->videoPixelFormat);
+    hash_int(md5, streamParameters->frameRate.num);
+    hash_int(md5, streamParameters->frameRate.den);
+    hash_string(md5, streamParameters->codecPrivKey);
+    hash_string(md5, streamParameters->codecPrivValue);
+    hash_string(md5, streamParameters->videoPreset);
+
+    /* The first pass encodes what the filters and the overlay hand the encoder, as the second does. */
+    hash_int(md5, decoder->fieldOrder);
+    hash_int(md5, streamParameters->outputFieldOrder);
+    hash_string(md5, streamParameters->deinterlacer);
+    hash_string(md5, streamParameters->overlayAsset);
+    if (streamParameters->overlayAsset) {
+        hash_int(md5, streamParameters->overlayX);
+        hash_int(md5, streamParameters->overlayY);
+        hash_int(md5, streamParameters->overlayPremultiplied);
+    }
+
+    av_md5_final(md5, digest);
+    av_free(md5);
+
+    for (int i = 0; i < sizeof(digest); i++)
+        snprintf(key + 2 * i, keySize - 2 * i, "%02x", digest[i]);
+
+    return 0;
+}
+
+
+static int stats_file_exists(const char *path) {
+    FILE *statsFile = fopen(path, "rb");
+    if (!statsFile)
+        return 0;
+    fclose(statsFile);
+    return 1;
+}
+
+
+/*
+ * A first pass leaves its statistics and, with libx264's macroblock tree, a .mbtree file beside them. Which of
+ * them it wrote is listed in a .complete file once it has finished, and the cache is only used when all are there.
+ */
+static int first_pass_cached(const char *statsPath) {
+    char path[1040];
+    char line[64];
+    FILE *completeFile;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s.complete", statsPath);
+    if (!(completeFile = fopen(path, "r")))
+        return 0;
+
+    ret = stats_file_exists(statsPath);
+    while (ret && fgets(line, sizeof(line), completeFile)) {
+        if (strcmp(line, "mbtree\n") == 0) {
+            snprintf(path, sizeof(path), "%s.mbtree", statsPath);
+            ret = stats_file_exists(path);
+        }
+    }
+    fclose(completeFile);
+    return ret;
+}
+
+
+static int mark_first_pass_complete(const char *statsPath) {
+    char path[1040], tempPath[1050];
+    FILE *completeFile;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "%s.mbtree", statsPath);
+    snprintf(tempPath, sizeof(tempPath), "%s.complete.temp", statsPath);
+    if (!(completeFile = fopen(tempPath, "w")))
+        return AVERROR(errno);
+    if (stats_file_exists(path) && fputs("mbtree\n", completeFile) < 0)
+        ret = AVERROR(EIO);
+    if (fclose(completeFile) != 0 && ret >= 0)
+        ret = AVERROR(EIO);
+
+    snprintf(path, sizeof(path), "%s.complete", statsPath);
+    if (ret >= 0 && rename(tempPath, path) != 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        remove(tempPath);
+    return ret;
+}
+
+
+/*
+ * The first pass decodes on its own, but goes through the same field order handling, filter graph, pixel
+ * conversion and overlay as the second, so both passes encode the same pictures.
+ */
+static int run_first_pass(const StreamingContext *mainDecoder, const StreamingContext *mainEncoder,
+                          StreamingParams streamParameters, const char *statsPath) {
+    StreamingContext decoder = {0};
+    StreamingContext encoder = {0};
+    int64_t blendedFrames = mainEncoder->overlay ? mainEncoder->overlay->blendedFrames : 0;
+    AVPacket *inputPacket = NULL;
+    AVFrame *inputFrame = NULL;
+    AVRational inputFramerate;
+    int ret;
+
+    decoder.filename = mainDecoder->filename;
+    decoder.fieldOrder = mainDecoder->fieldOrder;
+
+    /*
+     * The statistics should only depend on the content, so pass one runs at constant quality. It keeps the job's preset,
+     * since x264 rejects statistics made with other frame types, references or mbtree; libx264's fastfirstpass, on by
+     * default, makes it cheaper without touching any of those.
+     */
+    streamParameters.outputBitRate = 0;
+    streamParameters.bitstreamBufferSize = 0;
+    streamParameters.minBitRate = 0;
+    streamParameters.maxBitRate = 0;
+
+    if ((ret = open_media(&decoder.formatContext, decoder.filename)) < 0)
+        goto end;
+
+    if ((ret = prepare_decoder(&decoder)) < 0)
+        goto end;
+
+    for (int i = 0; i < decoder.formatContext->nb_streams; i++) {
+        if (i != decoder.videoIndex)
+            decoder.formatContext->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    if ((ret = avformat_alloc_output_context2(&encoder.formatContext, NULL, "null", NULL)) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Couldn't allocate null muxer for first pass\n");
+        goto end;
+    }
+
+    encoder.videoPass = 1;
+    encoder.fieldOrder = mainEncoder->fieldOrder;
+    encoder.overlay = mainEncoder->overlay;
+    encoder.videoStatsPath = av_strdup(statsPath);
+    if (!encoder.videoStatsPath) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    inputFramerate = av_guess_frame_rate(decoder.formatContext, decoder.videoStream, NULL);
+    if ((ret = prepare_video_encoder(&encoder, decoder.videoCodecContext, inputFramerate, streamParameters)) < 0)
+        goto end;
+
+    if ((ret = init_filters(decoder.formatContext, &decoder, &encoder, &streamParameters)) < 0)
+        goto end;
+
+    if ((ret = avformat_write_header(encoder.formatContext, NULL)) < 0)
+        goto end;
+
+    inputPacket = av_packet_alloc();
+    inputFrame = av_frame_alloc();
+    if (!inputPacket || !inputFrame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Running first pass into %s\n", statsPath);
+    while (av_read_frame(decoder.formatContext, inputPacket) >= 0) {
+        if (inputPacket->stream_index == decoder.videoIndex && transcode_video(&decoder, &encoder, inputPacket, inputFrame)) {
+            av_packet_unref(inputPacket);
+            ret = AVERROR_UNKNOWN;
+            goto end;
+        }
+        av_packet_unref(inputPacket);
+    }
+
+    if (flush_video(&decoder, &encoder, inputFrame)) {
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+
+    ret = av_write_trailer(encoder.formatContext);
+
+    end:
+    av_packet_free(&inputPacket);
+    av_frame_free(&inputFrame);
+
+    /* libx264 only writes out its statistics file when the encoder is closed. */
+    avcodec_free_context(&encoder.videoCodecContext);
+    finish_rate_control_pass(&encoder, ret < 0);
+
+    /* The overlay is the second pass's, which counts only its own frames. */
+    if (mainEncoder->overlay)
+        mainEncoder->overlay->blendedFrames = blendedFrames;
+
+    free_filters(&decoder);
+    avformat_free_context(encoder.formatContext);
+    avcodec_free_context(&decoder.videoCodecContext);
+    free_audio_tracks(&decoder);
+    avformat_close_input(&decoder.formatContext);
+
+    return ret;
+}
+
+
+int prepare_two_pass(StreamingContext *decoder, StreamingContext *encoder, StreamingParams *streamParameters) {
+    const char *cacheDir = streamParameters->statsCacheDir ? streamParameters->statsCacheDir : ".";
+    char key[33];
+    char statsPath[1024];
+    int ret;
+
+    if ((ret = rate_control_cache_key(decoder, streamParameters, key, sizeof(key))) < 0)
+        return ret;
+
+    if (mkdir(cacheDir, 0755) < 0 && errno != EEXIST) {
+        av_log(NULL, AV_LOG_ERROR, "Could not create first pass cache directory %s\n", cacheDir);
+        return AVERROR(errno);
+    }
+
+    snprintf(statsPath, sizeof(statsPath), "%s/%s.log", cacheDir, key);
+
+    if (first_pass_cached(statsPath)) {
+        av_log(NULL, AV_LOG_INFO, "Reusing cached first pass statistics %s\n", statsPath);
+    } else if ((ret = run_first_pass(decoder, encoder, *streamParameters, statsPath)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "First pass failed: %s\n", av_err2str(ret));
+        return ret;
+    } else if ((ret = mark_first_pass_complete(statsPath)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not record the first pass in the cache: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    encoder->videoPass = 2;
+    encoder->videoStatsPath = av_strdup(statsPath);
+    if (!encoder->videoStatsPath)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+
+static int read_stats_file(const char *path, char **stats) {
+    FILE *statsFile = fopen(path, "rb");
+    long statsSize;
+
+    if (!statsFile)
+        return AVERROR(errno);
+
+    fseek(statsFile, 0, SEEK_END);
+    statsSize = ftell(statsFile);
+    fseek(statsFile, 0, SEEK_SET);
+
+    *stats = av_malloc(statsSize + 1);
+    if (!*stats) {
+        fclose(statsFile);
+        return AVERROR(ENOMEM);
+    }
+
+    if (fread(*stats, 1, statsSize, statsFile) != statsSize) {
+        av_freep(stats);
+        fclose(statsFile);
+        return AVERROR(EIO);
+    }
+    (*stats)[statsSize] = '\0';
+
+    fclose(statsFile);
+    return 0;
+}
+
+
+int configure_rate_control_pass(StreamingContext *encoder) {
+    AVCodecContext *codecContext = encoder->videoCodecContext;
+    char tempPath[1040];
+    int ret;
+
+    codecContext->flags |= encoder->videoPass == 1 ? AV_CODEC_FLAG_PASS1 : AV_CODEC_FLAG_PASS2;
+
+    if (encoder->videoPass == 1 && !codecContext->bit_rate && codecContext->priv_data)
+        av_opt_set(codecContext->priv_data, "crf", "23", 0);
+
+    /* libx264 keeps its own statistics file, everything else goes through stats_out/stats_in. */
+    if (codecContext->priv_data && av_opt_set(codecContext->priv_data, "stats", encoder->videoStatsPath, 0) >= 0)
+        return 0;
+
+    if (encoder->videoPass == 1) {
+        snprintf(tempPath, sizeof(tempPath), "%s.temp", encoder->videoStatsPath);
+        encoder->videoStatsFile = fopen(tempPath, "wb");
+        if (!encoder->videoStatsFile) {
+            av_log(NULL, AV_LOG_ERROR, "Could not open first pass statistics file %s\n", tempPath);
+            return AVERROR(errno);
+        }
+        return 0;
+    }
+
+    if ((ret = read_stats_file(encoder->videoStatsPath, &encoder->videoStatsIn)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not read first pass statistics file %s\n", encoder->videoStatsPath);
+        return ret;
+    }
+    codecContext->stats_in = encoder->videoStatsIn;
+
+    return 0;
+}
+
+
+int write_first_pass_stats(StreamingContext *encoder) {
+    char *statsOut = encoder->videoCodecContext->stats_out;
+
+    if (!encoder->videoStatsFile || !statsOut || !statsOut[0])
+        return 0;
+
+    if (fputs(statsOut, encoder->videoStatsFile) < 0)
+        return AVERROR(EIO);
+
+    /* Some encoders only fill stats_out once, so don't write the same statistics twice. */
+    statsOut[0] = '\0';
+    return 0;
+}
+
+
+int finish_rate_control_pass(StreamingContext *encoder, int failed) {
+    char tempPath[1040];
+    int ret = 0;
+
+    if (encoder->videoStatsFile) {
+        if (fclose(encoder->videoStatsFile) != 0)
+            failed = 1;
+        encoder->videoStatsFile = NULL;
+
+        snprintf(tempPath, sizeof(tempPath), "%s.temp", encoder->videoStatsPath);
+        if (failed) {
+            remove(tempPath);
+        } else if (rename(tempPath, encoder->videoStatsPath) != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not move first pass statistics into %s\n", encoder->videoStatsPath);
+            ret = AVERROR(errno);
+        }
+    } else if (failed && encoder->videoPass == 1 && encoder->videoStatsPath) {
+        /* libx264 renames its statistics into place on close, even after an error. */
+        snprintf(tempPath, sizeof(tempPath), "%s.mbtree", encoder->videoStatsPath);
+        remove(encoder->videoStatsPath);
+        remove(tempPath);
+    }
+
+    av_freep(&encoder->videoStatsIn);
+    av_freep(&encoder->videoStatsPath);
+    encoder->videoPass = 0;
+
+    return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef RATECONTROL_H
+#define RATECONTROL_H
+
+#include "testbed.h"
+
+/*
+ * Two-pass rate control.
+ *
+ * The first pass encodes the video with the job's own preset, which x264
+ * lightens with its fast first pass, into the null muxer, through the same
+ * filters, pixel conversion and overlay as the second, and leaves its
+ * statistics in StreamingParams.statsCacheDir, under a key derived from the input content and the settings that shape the
+ * statistics. Bitrate targets are not part of the key, so re-running a job
+ * with a different bitrate reuses the cached first pass, once every file it
+ * wrote, .mbtree included, is there.
+ */
+
+int rate_control_cache_key(StreamingContext *decoder, const StreamingParams *streamParameters, char *key, int keySize);
+int prepare_two_pass(StreamingContext *decoder, StreamingContext *encoder, StreamingParams *streamParameters);
+int configure_rate_control_pass(StreamingContext *encoder);
+int write_first_pass_stats(StreamingContext *encoder);
+int finish_rate_control_pass(StreamingContext *encoder, int failed);
+
+#endif
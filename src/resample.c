@@ -0,0 +1,170 @@
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+#include <string.h>
+
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+#include "libavutil/mem.h"
+
+#include "resample.h"
+
+/* Output room preallocated for the first frame, in samples. */
+#define RESAMPLE_INITIAL_CAPACITY 4096
+
+
+int audio_resampler_init(AudioResampler *resampler, const AVCodecContext *encodeContext,
+                         AVRational inputTimeBase, enum ResampleQuality quality) {
+    int ret;
+
+    memset(resampler, 0, sizeof(*resampler));
+    resampler->outputFormat = encodeContext->sample_fmt;
+    resampler->outputRate = encodeContext->sample_rate;
+    resampler->inputFormat = AV_SAMPLE_FMT_NONE;
+    resampler->inputTimeBase = inputTimeBase;
+    resampler->quality = quality;
+    resampler->nextPts = AV_NOPTS_VALUE;
+
+    if ((ret = av_channel_layout_copy(&resampler->outputLayout, &encodeContext->ch_layout)) < 0)
+        return ret;
+
+    resampler->outputFrame = av_frame_alloc();
+    if (!resampler->outputFrame)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+
+static int set_quality_options(SwrContext *swrContext, enum ResampleQuality quality) {
+    switch (quality) {
+    case RESAMPLE_QUALITY_FAST:
+        av_opt_set_int(swrContext, "filter_size", 8, 0);
+        av_opt_set_int(swrContext, "phase_shift", 6, 0);
+        av_opt_set_int(swrContext, "linear_interp", 1, 0);
+        av_opt_set_double(swrContext, "cutoff", 0.9, 0);
+        break;
+    case RESAMPLE_QUALITY_HIGH:
+        av_opt_set_int(swrContext, "filter_size", 64, 0);
+        av_opt_set_int(swrContext, "phase_shift", 12, 0);
+        av_opt_set_int(swrContext, "linear_interp", 0, 0);
+        av_opt_set_int(swrContext, "exact_rational", 1, 0);
+        av_opt_set_double(swrContext, "cutoff", 0.98, 0);
+        av_opt_set(swrContext, "dither_method", "triangular_hp", 0);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+static int configure_resampler(AudioResampler *resampler, const AVFrame *input) {
+    int ret;
+
+    swr_free(&resampler->swrContext);
+    av_channel_layout_uninit(&resampler->inputLayout);
+
+    if ((ret = av_channel_layout_copy(&resampler->inputLayout, &input->ch_layout)) < 0)
+        return ret;
+    resampler->inputFormat = input->format;
+    resampler->inputRate = input->sample_rate;
+
+    ret = swr_alloc_set_opts2(&resampler->swrContext,
+                              &resampler->outputLayout, resampler->outputFormat, resampler->outputRate,
+                              &resampler->inputLayout, resampler->inputFormat, resampler->inputRate,
+                              0, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate resampler\n");
+        return ret;
+    }
+
+    set_quality_options(resampler->swrContext, resampler->quality);
+
+    if ((ret = swr_init(resampler->swrContext)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not initialise resampler: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Resampling %s %d Hz to %s %d Hz\n",
+           av_get_sample_fmt_name(resampler->inputFormat), resampler->inputRate,
+           av_get_sample_fmt_name(resampler->outputFormat), resampler->outputRate);
+    return 0;
+}
+
+
+static int ensure_output_capacity(AudioResampler *resampler, int samples) {
+    AVFrame *frame = resampler->outputFrame;
+    int ret;
+
+    if (samples > resampler->outputCapacity) {
+        av_frame_unref(frame);
+        resampler->outputCapacity = FFMAX(samples, RESAMPLE_INITIAL_CAPACITY);
+        frame->format = resampler->outputFormat;
+        frame->sample_rate = resampler->outputRate;
+        frame->nb_samples = resampler->outputCapacity;
+        if ((ret = av_channel_layout_copy(&frame->ch_layout, &resampler->outputLayout)) < 0)
+            return ret;
+        return av_frame_get_buffer(frame, 0);
+    }
+
+    /* Only reallocates if the encoder still holds a reference to the last output. */
+    frame->nb_samples = resampler->outputCapacity;
+    return av_frame_make_writable(frame);
+}
+
+
+int audio_resampler_convert(AudioResampler *resampler, const AVFrame *input, AVFrame **output) {
+    int outputSamples;
+    int ret;
+
+    *output = NULL;
+
+    if (input && (!resampler->swrContext ||
+                  input->format != resampler->inputFormat ||
+                  input->sample_rate != resampler->inputRate ||
+                  av_channel_layout_compare(&input->ch_layout, &resampler->inputLayout))) {
+        if ((ret = configure_resampler(resampler, input)) < 0)
+            return ret;
+    }
+
+    if (!resampler->swrContext)
+        return 0;
+
+    if (input && input->pts != AV_NOPTS_VALUE && resampler->nextPts == AV_NOPTS_VALUE)
+        resampler->nextPts = av_rescale_q(input->pts, resampler->inputTimeBase, (AVRational){1, resampler->outputRate});
+
+    outputSamples = swr_get_out_samples(resampler->swrContext, input ? input->nb_samples : 0);
+    if (outputSamples < 0)
+        return outputSamples;
+
+    if ((ret = ensure_output_capacity(resampler, outputSamples)) < 0)
+        return ret;
+
+    ret = swr_convert(resampler->swrContext,
+                      resampler->outputFrame->extended_data, resampler->outputCapacity,
+                      input ? (const uint8_t **)input->extended_data : NULL, input ? input->nb_samples : 0);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while resampling: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    if (ret == 0)
+        return 0;
+
+    resampler->outputFrame->nb_samples = ret;
+    resampler->outputFrame->pts = resampler->nextPts;
+    if (resampler->nextPts != AV_NOPTS_VALUE)
+        resampler->nextPts += ret;
+
+    *output = resampler->outputFrame;
+    return 0;
+}
+
+
+void audio_resampler_uninit(AudioResampler *resampler) {
+    swr_free(&resampler->swrContext);
+    av_frame_free(&resampler->outputFrame);
+    av_channel_layout_uninit(&resampler->inputLayout);
+    av_channel_layout_uninit(&resampler->outputLayout);
+}
@@ -0,0 +1,46 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+/*
+ * Per-stream resampling and sample format conversion into the audio
+ * encoder's rate, format and channel layout.
+ *
+ * The SwrContext lives as long as the stream and is only rebuilt if the input
+ * parameters change mid-stream. Output goes into one preallocated frame that
+ * is only regrown when an input frame needs more room than any before it.
+ * Output timestamps count samples in 1/sample_rate of the encoder.
+ */
+
+enum ResampleQuality {
+    RESAMPLE_QUALITY_FAST,
+    RESAMPLE_QUALITY_STANDARD,
+    RESAMPLE_QUALITY_HIGH,
+};
+
+typedef struct AudioResampler {
+    SwrContext *swrContext;
+    AVFrame *outputFrame;
+    int outputCapacity;
+
+    AVChannelLayout outputLayout;
+    enum AVSampleFormat outputFormat;
+    int outputRate;
+
+    AVChannelLayout inputLayout;
+    enum AVSampleFormat inputFormat;
+    int inputRate;
+    AVRational inputTimeBase;
+
+    enum ResampleQuality quality;
+    int64_t nextPts;
+} AudioResampler;
+
+int audio_resampler_init(AudioResampler *resampler, const AVCodecContext *encodeContext,
+                         AVRational inputTimeBase, enum ResampleQuality quality);
+int audio_resampler_convert(AudioResampler *resampler, const AVFrame *input, AVFrame **output);
+void audio_resampler_uninit(AudioResampler *resampler);
+
+#endif
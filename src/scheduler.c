@@ -0,0 +1,379 @@
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libavutil/mem.h"
+
+#include "trace.h"
+#include "scheduler.h"
+#include "metrics.h"
+
+
+/* Owner end of a worker's deque: newest task first, while its strand's graph is still warm. */
+static FilterStrand *pop_task(FilterScheduler *scheduler, FilterWorker *worker) {
+    FilterStrand *strand = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count) {
+        worker->count--;
+        strand = worker->deque[(worker->head + worker->count) % FILTER_SCHEDULER_MAX_STRANDS];
+        atomic_fetch_sub(&scheduler->queued, 1);
+        metrics_add(METRICS_FILTER_QUEUED, -1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return strand;
+}
+
+
+/* Thief end: the oldest task of the first other worker that has one. */
+static FilterStrand *steal_task(FilterScheduler *scheduler, FilterWorker *thief) {
+    for (int i = 1; i < scheduler->nbWorkers; i++) {
+        FilterWorker *victim = &scheduler->workers[(thief->index + i) % scheduler->nbWorkers];
+        FilterStrand *strand = NULL;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count) {
+            strand = victim->deque[victim->head];
+            victim->head = (victim->head + 1) % FILTER_SCHEDULER_MAX_STRANDS;
+            victim->count--;
+            atomic_fetch_sub(&scheduler->queued, 1);
+            metrics_add(METRICS_FILTER_QUEUED, -1);
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (strand)
+            return strand;
+    }
+    return NULL;
+}
+
+
+static void push_task(FilterScheduler *scheduler, int workerIndex, FilterStrand *strand) {
+    FilterWorker *worker = &scheduler->workers[workerIndex];
+
+    pthread_mutex_lock(&worker->lock);
+    worker->deque[(worker->head + worker->count) % FILTER_SCHEDULER_MAX_STRANDS] = strand;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_fetch_add(&scheduler->queued, 1);
+    metrics_add(METRICS_FILTER_QUEUED, 1);
+    pthread_cond_signal(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+/* Filter up to a batch of the strand's frames in order, then requeue it here if more are waiting. */
+static void run_strand(FilterWorker *worker, FilterStrand *strand) {
+    strand->home = worker->index;
+
+    for (int n = 0; n < FILTER_STRAND_BATCH; n++) {
+        AVFrame *frame;
+        int ret = 0;
+
+        pthread_mutex_lock(&strand->lock);
+        if (!av_fifo_can_read(strand->inputs)) {
+            strand->scheduled = 0;
+            pthread_cond_broadcast(&strand->cond);
+            pthread_mutex_unlock(&strand->lock);
+            return;
+        }
+        av_fifo_read(strand->inputs, &frame, 1);
+        pthread_cond_broadcast(&strand->cond);
+        pthread_mutex_unlock(&strand->lock);
+
+        /* After an error the rest of the input is dropped; the submitter sees the error on its next call. */
+        if (!strand->error) {
+            TRACE_BEGIN(strand->name, "filter");
+            ret = strand->filter(strand->opaque, frame, strand);
+            TRACE_END(strand->name, "filter");
+        }
+        av_frame_free(&frame);
+
+        if (ret < 0) {
+            pthread_mutex_lock(&strand->lock);
+            strand->error = ret;
+            pthread_cond_broadcast(&strand->cond);
+            pthread_mutex_unlock(&strand->lock);
+        }
+        strand->framesFiltered++;
+        worker->frames++;
+    }
+
+    pthread_mutex_lock(&strand->lock);
+    if (!av_fifo_can_read(strand->inputs)) {
+        strand->scheduled = 0;
+        pthread_cond_broadcast(&strand->cond);
+        pthread_mutex_unlock(&strand->lock);
+        return;
+    }
+    pthread_mutex_unlock(&strand->lock);
+    push_task(worker->scheduler, worker->index, strand);
+}
+
+
+static void *worker_main(void *opaque) {
+    FilterWorker *worker = opaque;
+    FilterScheduler *scheduler = worker->scheduler;
+
+    while (1) {
+        FilterStrand *strand = pop_task(scheduler, worker);
+        int64_t start, idle;
+        int stop;
+
+        if (!strand && (strand = steal_task(scheduler, worker))) {
+            worker->steals++;
+            metrics_add(METRICS_FILTER_STEALS, 1);
+        }
+
+        if (strand) {
+            start = av_gettime_relative();
+            run_strand(worker, strand);
+            worker->busyTime += av_gettime_relative() - start;
+            worker->tasks++;
+            metrics_add(METRICS_FILTER_TASKS, 1);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        start = av_gettime_relative();
+        while (!atomic_load(&scheduler->queued) && !scheduler->stopping)
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+        idle = av_gettime_relative() - start;
+        worker->idleTime += idle;
+        metrics_add(METRICS_FILTER_IDLE_TIME, idle);
+        stop = scheduler->stopping && !atomic_load(&scheduler->queued);
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+
+int filter_scheduler_init(FilterScheduler *scheduler, int nbWorkers) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->nbWorkers = av_clip(nbWorkers, 1, FILTER_SCHEDULER_MAX_WORKERS);
+    atomic_init(&scheduler->queued, 0);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    scheduler->startTime = av_gettime_relative();
+
+    /* Every deque has to be usable before the first worker starts stealing from it. */
+    for (int i = 0; i < scheduler->nbWorkers; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+        scheduler->workers[i].index = i;
+        pthread_mutex_init(&scheduler->workers[i].lock, NULL);
+    }
+
+    for (int i = 0; i < scheduler->nbWorkers; i++) {
+        if (pthread_create(&scheduler->workers[i].thread, NULL, worker_main, &scheduler->workers[i]) != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start filter worker %d\n", i);
+            filter_scheduler_uninit(scheduler);
+            return AVERROR(EAGAIN);
+        }
+        scheduler->started++;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Filter scheduler: %d workers\n", scheduler->nbWorkers);
+    return 0;
+}
+
+
+FilterStrand *filter_strand_create(FilterScheduler *scheduler, const char *name, FilterStrandFunc filter, void *opaque) {
+    FilterStrand *strand;
+
+    if (scheduler->nbStrands >= FILTER_SCHEDULER_MAX_STRANDS) {
+        av_log(NULL, AV_LOG_ERROR, "Too many filter strands, at most %d\n", FILTER_SCHEDULER_MAX_STRANDS);
+        return NULL;
+    }
+
+    strand = av_mallocz(sizeof(*strand));
+    if (!strand)
+        return NULL;
+    strand->inputs = av_fifo_alloc2(FILTER_STRAND_QUEUE, sizeof(AVFrame *), 0);
+    strand->outputs = av_fifo_alloc2(FILTER_STRAND_QUEUE, sizeof(AVFrame *), AV_FIFO_FLAG_AUTO_GROW);
+    if (!strand->inputs || !strand->outputs) {
+        av_fifo_freep2(&strand->inputs);
+        av_fifo_freep2(&strand->outputs);
+        av_free(strand);
+        return NULL;
+    }
+
+    strand->scheduler = scheduler;
+    strand->filter = filter;
+    strand->opaque = opaque;
+    strand->name = name;
+    pthread_mutex_init(&strand->lock, NULL);
+    pthread_cond_init(&strand->cond, NULL);
+
+    /* Spread the strands' home workers so that stealing is only needed when the load is uneven. */
+    strand->home = scheduler->nextHome++ % scheduler->nbWorkers;
+    scheduler->strands[scheduler->nbStrands++] = strand;
+    return strand;
+}
+
+
+/* Queue a frame, or NULL to flush, for filtering; the strand takes ownership. Blocks while the queue is full. */
+int filter_strand_submit(FilterStrand *strand, AVFrame *frame) {
+    int schedule = 0;
+    int ret;
+
+    pthread_mutex_lock(&strand->lock);
+    while (!strand->error && !av_fifo_can_write(strand->inputs))
+        pthread_cond_wait(&strand->cond, &strand->lock);
+    if ((ret = strand->error) < 0) {
+        pthread_mutex_unlock(&strand->lock);
+        av_frame_free(&frame);
+        return ret;
+    }
+    av_fifo_write(strand->inputs, &frame, 1);
+    if (!strand->scheduled) {
+        strand->scheduled = 1;
+        schedule = 1;
+    }
+    pthread_mutex_unlock(&strand->lock);
+
+    if (schedule)
+        push_task(strand->scheduler, strand->home, strand);
+    return 0;
+}
+
+
+/* Called from the strand's filter function: queue a filtered frame, taking over its reference. */
+int filter_strand_output(FilterStrand *strand, AVFrame *frame) {
+    AVFrame *output = av_frame_alloc();
+    int ret;
+
+    if (!output)
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(output, frame);
+
+    pthread_mutex_lock(&strand->lock);
+    ret = av_fifo_write(strand->outputs, &output, 1);
+    pthread_mutex_unlock(&strand->lock);
+
+    if (ret < 0)
+        av_frame_free(&output);
+    return ret;
+}
+
+
+/* Take the next filtered frame: 0 with a frame, AVERROR(EAGAIN) when there is none yet, or the strand's error. */
+int filter_strand_receive(FilterStrand *strand, AVFrame **frame) {
+    int ret;
+
+    pthread_mutex_lock(&strand->lock);
+    if (av_fifo_read(strand->outputs, frame, 1) >= 0)
+        ret = 0;
+    else
+        ret = strand->error < 0 ? strand->error : AVERROR(EAGAIN);
+    pthread_mutex_unlock(&strand->lock);
+    return ret;
+}
+
+
+/* Wait until everything submitted so far has been filtered. */
+int filter_strand_drain(FilterStrand *strand) {
+    int ret;
+
+    pthread_mutex_lock(&strand->lock);
+    while (strand->scheduled || av_fifo_can_read(strand->inputs))
+        pthread_cond_wait(&strand->cond, &strand->lock);
+    ret = strand->error;
+    pthread_mutex_unlock(&strand->lock);
+    return ret;
+}
+
+
+void filter_scheduler_log(const FilterScheduler *scheduler) {
+    double elapsed = (av_gettime_relative() - scheduler->startTime) / 1000000.0;
+    int64_t tasks = 0, steals = 0, idleTime = 0;
+
+    for (int i = 0; i < scheduler->started; i++) {
+        const FilterWorker *worker = &scheduler->workers[i];
+
+        av_log(NULL, AV_LOG_INFO, "Filter worker %d: %" PRId64 " tasks, %" PRId64 " frames, %" PRId64 " steals, "
+               "%.2fs busy, %.2fs idle\n", i, worker->tasks, worker->frames, worker->steals,
+               worker->busyTime / 1000000.0, worker->idleTime / 1000000.0);
+        tasks += worker->tasks;
+        steals += worker->steals;
+        idleTime += worker->idleTime;
+    }
+    for (int i = 0; i < scheduler->nbStrands; i++)
+        av_log(NULL, AV_LOG_INFO, "Filter strand %s: %" PRId64 " frames\n",
+               scheduler->strands[i]->name, scheduler->strands[i]->framesFiltered);
+
+    av_log(NULL, AV_LOG_INFO, "Filter scheduler: %" PRId64 " tasks, %" PRId64 " steals, workers idle %.1f%% of %.2fs\n",
+           tasks, steals, elapsed > 0 && scheduler->started ? 100.0 * idleTime / 1000000.0 / (elapsed * scheduler->started) : 0,
+           elapsed);
+}
+
+
+int filter_scheduler_write_stats(const FilterScheduler *scheduler, const char *filename) {
+    FILE *file = fopen(filename, "w");
+
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open scheduler stats file %s\n", filename);
+        return AVERROR(errno);
+    }
+
+    fprintf(file, "worker,tasks,frames,steals,busy_ms,idle_ms\n");
+    for (int i = 0; i < scheduler->started; i++) {
+        const FilterWorker *worker = &scheduler->workers[i];
+        fprintf(file, "%d,%" PRId64 ",%" PRId64 ",%" PRId64 ",%.3f,%.3f\n", i, worker->tasks, worker->frames,
+                worker->steals, worker->busyTime / 1000.0, worker->idleTime / 1000.0);
+    }
+
+    return fclose(file) ? AVERROR(errno) : 0;
+}
+
+
+/* Finish the queued tasks and stop the workers, after which their counters are stable for logging. */
+void filter_scheduler_stop(FilterScheduler *scheduler) {
+    if (scheduler->stopped)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < scheduler->started; i++)
+        pthread_join(scheduler->workers[i].thread, NULL);
+    scheduler->stopped = 1;
+}
+
+
+void filter_scheduler_uninit(FilterScheduler *scheduler) {
+    filter_scheduler_stop(scheduler);
+    for (int i = 0; i < scheduler->nbWorkers; i++)
+        pthread_mutex_destroy(&scheduler->workers[i].lock);
+    scheduler->nbWorkers = 0;
+    scheduler->started = 0;
+
+    for (int i = 0; i < scheduler->nbStrands; i++) {
+        FilterStrand *strand = scheduler->strands[i];
+        AVFrame *frame;
+
+        while (av_fifo_read(strand->inputs, &frame, 1) >= 0)
+            av_frame_free(&frame);
+        while (av_fifo_read(strand->outputs, &frame, 1) >= 0)
+            av_frame_free(&frame);
+        av_fifo_freep2(&strand->inputs);
+        av_fifo_freep2(&strand->outputs);
+        pthread_mutex_destroy(&strand->lock);
+        pthread_cond_destroy(&strand->cond);
+        av_freep(&scheduler->strands[i]);
+    }
+    scheduler->nbStrands = 0;
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->wake);
+}
@@ -0,0 +1,99 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <libavutil/fifo.h>
+#include <libavutil/frame.h>
+
+/*
+ * Work-stealing thread pool for the per-stream filter graphs.
+ *
+ * Each stream's filtering is a strand: frames submitted to it are filtered
+ * strictly in order, by at most one worker at a time, while different strands
+ * run on different workers in parallel. The video stream and every audio track
+ * transcoded, up to StreamingParams.audioStreams of them, are strands of their
+ * own. A strand with input waiting is
+ * scheduled as one task on its home worker's deque, the worker that last ran
+ * it, so its filter graph stays in that core's cache. A worker takes its own
+ * tasks newest first and, when it has none, steals the oldest task from
+ * another worker before going to sleep. A task filters at most
+ * FILTER_STRAND_BATCH frames and then requeues the strand, so one busy stream
+ * can't hold a worker while another waits.
+ *
+ * Filtered frames are queued on the strand for the submitting thread to
+ * collect and encode, so encoders and the muxer stay on one thread. The
+ * scheduler counts tasks, frames, steals and idle time per worker, which are
+ * logged, and written as CSV when a stats file is given, once it has stopped.
+ */
+
+#define FILTER_SCHEDULER_MAX_WORKERS 64
+#define FILTER_SCHEDULER_MAX_STRANDS 64
+#define FILTER_STRAND_QUEUE 16
+#define FILTER_STRAND_BATCH 4
+
+struct FilterScheduler;
+struct FilterStrand;
+
+/* Filters one frame, or flushes on NULL, and hands each result to filter_strand_output(). */
+typedef int (*FilterStrandFunc)(void *opaque, AVFrame *frame, struct FilterStrand *strand);
+
+typedef struct FilterStrand {
+    struct FilterScheduler *scheduler;
+    FilterStrandFunc filter;
+    void *opaque;
+    const char *name;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFifo *inputs;
+    AVFifo *outputs;
+    int scheduled;
+    int error;
+    int home;
+    int64_t framesFiltered;
+} FilterStrand;
+
+typedef struct FilterWorker {
+    struct FilterScheduler *scheduler;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    FilterStrand *deque[FILTER_SCHEDULER_MAX_STRANDS];
+    int head;
+    int count;
+    int64_t tasks;
+    int64_t frames;
+    int64_t steals;
+    int64_t idleTime;
+    int64_t busyTime;
+} FilterWorker;
+
+typedef struct FilterScheduler {
+    FilterWorker workers[FILTER_SCHEDULER_MAX_WORKERS];
+    int nbWorkers;
+    int started;
+    FilterStrand *strands[FILTER_SCHEDULER_MAX_STRANDS];
+    int nbStrands;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int queued;
+    int stopping;
+    int stopped;
+    int nextHome;
+    int64_t startTime;
+} FilterScheduler;
+
+int filter_scheduler_init(FilterScheduler *scheduler, int nbWorkers);
+FilterStrand *filter_strand_create(FilterScheduler *scheduler, const char *name, FilterStrandFunc filter, void *opaque);
+int filter_strand_submit(FilterStrand *strand, AVFrame *frame);
+int filter_strand_output(FilterStrand *strand, AVFrame *frame);
+int filter_strand_receive(FilterStrand *strand, AVFrame **frame);
+int filter_strand_drain(FilterStrand *strand);
+void filter_scheduler_stop(FilterScheduler *scheduler);
+void filter_scheduler_log(const FilterScheduler *scheduler);
+int filter_scheduler_write_stats(const FilterScheduler *scheduler, const char *filename);
+void filter_scheduler_uninit(FilterScheduler *scheduler);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+
+#include "speedcontrol.h"
+
+/* Shared by libx264 and libx265, fastest first. */
+static const char *speed_presets[] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow"
+};
+#define SPEED_PRESET_COUNT (sizeof(speed_presets) / sizeof(speed_presets[0]))
+
+
+int speed_controller_init(SpeedController *controller, double targetFps, const char *initialPreset, const char *metricsFilename) {
+    memset(controller, 0, sizeof(*controller));
+    controller->targetFps = targetFps;
+    controller->presetIndex = -1;
+    controller->ceiling = SPEED_PRESET_COUNT;
+
+    for (int i = 0; i < SPEED_PRESET_COUNT; i++) {
+        if (initialPreset && strcmp(initialPreset, speed_presets[i]) == 0)
+            controller->presetIndex = i;
+    }
+    if (controller->presetIndex < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Speed control needs an x264/x265 preset, not %s\n", initialPreset ? initialPreset : "(none)");
+        return AVERROR(EINVAL);
+    }
+
+    if (metricsFilename) {
+        controller->metricsFile = fopen(metricsFilename, "w");
+        if (!controller->metricsFile) {
+            av_log(NULL, AV_LOG_ERROR, "Could not open speed metrics file %s\n", metricsFilename);
+            return AVERROR(EIO);
+        }
+        fprintf(controller->metricsFile, "time,frames,fps,target_fps,preset,action\n");
+    }
+
+    controller->startTime = av_gettime_relative();
+    controller->windowStart = -1;
+    controller->lastDts = AV_NOPTS_VALUE;
+    return 0;
+}
+
+
+const char *speed_controller_preset(const SpeedController *controller) {
+    return speed_presets[controller->presetIndex];
+}
+
+
+/* The nearest preset in the given direction, up to but not including end, that hasn't been rejected, or -1. */
+static int next_preset(const SpeedController *controller, int step, int end) {
+    for (int i = controller->presetIndex + step; i != end; i += step) {
+        if (!(controller->rejected & (1u << i)))
+            return i;
+    }
+    return -1;
+}
+
+
+/* Count one encoded frame. Returns 1 when the encoder should be reopened with speed_controller_preset(). */
+int speed_controller_update(SpeedController *controller) {
+    int64_t now = av_gettime_relative();
+    const char *action = "hold";
+    const char *previous;
+    int changed = 0;
+
+    controller->totalFrames++;
+
+    /* A window starts on the first frame after a switch, so the reopen itself isn't measured. */
+    if (controller->windowStart < 0) {
+        controller->windowStart = now;
+        controller->windowFrames = 0;
+        return 0;
+    }
+    controller->windowFrames++;
+    if (now - controller->windowStart < SPEED_WINDOW_US)
+        return 0;
+
+    controller->lastFps = controller->windowFrames * 1000000.0 / (now - controller->windowStart);
+    controller->windowStart = now;
+    controller->windowFrames = 0;
+    previous = speed_presets[controller->presetIndex];
+
+    if (controller->ceilingWindows > 0 && --controller->ceilingWindows == 0)
+        controller->ceiling = SPEED_PRESET_COUNT;
+
+    if (controller->lastFps < controller->targetFps * (1.0 - SPEED_TOLERANCE)) {
+        int faster = next_preset(controller, -1, -1);
+        if (faster >= 0) {
+            controller->ceiling = controller->presetIndex;
+            controller->ceilingWindows = SPEED_CEILING_WINDOWS;
+            controller->previousIndex = controller->presetIndex;
+            controller->presetIndex = faster;
+            action = "faster";
+            changed = 1;
+        }
+    } else if (controller->lastFps > controller->targetFps * (1.0 + SPEED_HEADROOM)) {
+        int slower = next_preset(controller, 1, controller->ceiling);
+        if (slower >= 0) {
+            controller->previousIndex = controller->presetIndex;
+            controller->presetIndex = slower;
+            action = "slower";
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        controller->switches++;
+        controller->windowStart = -1;
+        av_log(NULL, AV_LOG_INFO, "Speed control: %.1f fps against %.1f, preset %s -> %s\n",
+               controller->lastFps, controller->targetFps, previous, speed_presets[controller->presetIndex]);
+    } else {
+        av_log(NULL, AV_LOG_VERBOSE, "Speed control: %.1f fps against %.1f, holding preset %s\n",
+               controller->lastFps, controller->targetFps, previous);
+    }
+
+    if (controller->metricsFile) {
+        fprintf(controller->metricsFile, "%.3f,%" PRId64 ",%.2f,%.2f,%s,%s\n",
+                (now - controller->startTime) / 1000000.0, controller->totalFrames, controller->lastFps,
+                controller->targetFps, speed_presets[controller->presetIndex], action);
+        fflush(controller->metricsFile);
+    }
+    return changed;
+}
+
+
+/* The encoder couldn't switch to the current preset without changing the stream header; go back and don't try it again. */
+void speed_controller_reject(SpeedController *controller) {
+    av_log(NULL, AV_LOG_WARNING, "Speed control: preset %s changes the stream header, staying on %s\n",
+           speed_presets[controller->presetIndex], speed_presets[controller->previousIndex]);
+    controller->rejected |= 1u << controller->presetIndex;
+    controller->presetIndex = controller->previousIndex;
+    controller->switches--;
+    if (controller->metricsFile) {
+        fprintf(controller->metricsFile, "%.3f,%" PRId64 ",%.2f,%.2f,%s,%s\n",
+                (av_gettime_relative() - controller->startTime) / 1000000.0, controller->totalFrames, controller->lastFps,
+                controller->targetFps, speed_presets[controller->presetIndex], "rejected");
+        fflush(controller->metricsFile);
+    }
+}
+
+
+/* Drop the current window, for a gap in encoding that says nothing about the preset, such as a pause. */
+void speed_controller_restart_window(SpeedController *controller) {
+    controller->windowStart = -1;
+}
+
+
+void speed_controller_log(const SpeedController *controller) {
+    av_log(NULL, AV_LOG_INFO, "Speed control: %d preset switches, finished on %s at %.1f fps (target %.1f)\n",
+           controller->switches, speed_presets[controller->presetIndex], controller->lastFps, controller->targetFps);
+}
+
+
+void speed_controller_uninit(SpeedController *controller) {
+    if (controller->metricsFile) {
+        fclose(controller->metricsFile);
+        controller->metricsFile = NULL;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef SPEEDCONTROL_H
+#define SPEEDCONTROL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Closed-loop encoder speed control.
+ *
+ * Measures the video encode rate over windows of SPEED_WINDOW_US of wall time
+ * and compares it with StreamingParams.targetFps. Falling more than
+ * SPEED_TOLERANCE behind moves one step to a faster preset; running more than
+ * SPEED_HEADROOM ahead moves one step slower to spend the spare time on
+ * quality. A preset that had to be abandoned for being too slow is not tried
+ * again for SPEED_CEILING_WINDOWS windows, so the controller settles instead of
+ * oscillating between two neighbours.
+ *
+ * Neither libx264 nor libx265 can change preset, subme or ref on an open
+ * encoder through libavcodec, so every change is a segment-level switch: the
+ * encoder is drained and reopened with the new preset. The reopened encoder
+ * keeps the profile, level and reference count of the one before, and a preset
+ * whose parameter sets still differ from the header already written is
+ * rejected: the controller goes back to the previous preset and skips the
+ * rejected one from then on. The reopened encoder's timestamps are moved later,
+ * pts and dts together, just far enough that its first dts follows the last
+ * one written. Each window's rate and decision is logged, and written as CSV
+ * when a metrics file is given.
+ */
+
+#define SPEED_WINDOW_US 2000000
+#define SPEED_TOLERANCE 0.05
+#define SPEED_HEADROOM 0.30
+#define SPEED_CEILING_WINDOWS 15
+
+typedef struct SpeedController {
+    double targetFps;
+    int presetIndex;
+    int ceiling;
+    int ceilingWindows;
+    int64_t startTime;
+    int64_t windowStart;
+    int windowFrames;
+    int64_t totalFrames;
+    double lastFps;
+    int switches;
+    int previousIndex;
+    /* Presets that would have changed the stream header, one bit per preset. */
+    unsigned rejected;
+    int64_t lastDts;
+    /* Added to pts and dts since the last reopen, in the output video stream's time base; audio gets it rescaled. */
+    int64_t timestampOffset;
+    int reopened;
+    FILE *metricsFile;
+} SpeedController;
+
+int speed_controller_init(SpeedController *controller, double targetFps, const char *initialPreset, const char *metricsFilename);
+const char *speed_controller_preset(const SpeedController *controller);
+int speed_controller_update(SpeedController *controller);
+void speed_controller_reject(SpeedController *controller);
+void speed_controller_restart_window(SpeedController *controller);
+void speed_controller_log(const SpeedController *controller);
+void speed_controller_uninit(SpeedController *controller);
+
+#endif
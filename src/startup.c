@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+
+#include "startup.h"
+
+static const char *startup_phase_names[STARTUP_PHASES] = {
+    "probe", "decoder_open", "field_order", "encoder_open", "header_write", "first_packet"
+};
+
+static int64_t link_time = -1;
+
+
+#ifdef __linux__
+/* Runs after every shared library is loaded, relocated and initialised, and before main(). */
+__attribute__((constructor)) static void measure_link_time(void) {
+    char stat[1024];
+    unsigned long long startTicks;
+    struct timespec now;
+    const char *fields;
+    long ticksPerSecond = sysconf(_SC_CLK_TCK);
+    FILE *file = fopen("/proc/self/stat", "r");
+    size_t size;
+
+    if (!file)
+        return;
+    size = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[size] = '\0';
+
+    /* The command name can hold spaces and brackets, so count fields from the last ')': starttime is the 20th after it. */
+    fields = strrchr(stat, ')');
+    if (!fields || ticksPerSecond <= 0 || clock_gettime(CLOCK_BOOTTIME, &now) < 0)
+        return;
+    if (sscanf(fields + 2, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu",
+               &startTicks) != 1)
+        return;
+
+    link_time = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - (int64_t)(startTicks * 1000000 / ticksPerSecond);
+}
+#endif
+
+
+int64_t startup_link_time(void) {
+    return link_time;
+}
+
+
+void startup_profile_init(StartupProfile *profile) {
+    memset(profile, 0, sizeof(*profile));
+    profile->origin = av_gettime_relative();
+    for (int i = 0; i < STARTUP_PHASES; i++) {
+        profile->begin[i] = -1;
+        profile->end[i] = -1;
+    }
+}
+
+
+void startup_profile_begin(StartupProfile *profile, enum StartupPhase phase) {
+    profile->begin[phase] = av_gettime_relative() - profile->origin;
+}
+
+
+void startup_profile_end(StartupProfile *profile, enum StartupPhase phase) {
+    profile->end[phase] = av_gettime_relative() - profile->origin;
+}
+
+
+/* Time to first packet runs from the start of the job, and only the first call counts. */
+void startup_profile_first_packet(StartupProfile *profile) {
+    if (profile->end[STARTUP_FIRST_PACKET] >= 0)
+        return;
+    profile->begin[STARTUP_FIRST_PACKET] = 0;
+    startup_profile_end(profile, STARTUP_FIRST_PACKET);
+}
+
+
+void startup_profile_log(const StartupProfile *profile) {
+    if (link_time >= 0)
+        av_log(NULL, AV_LOG_INFO, "Startup: link %.1fms before main\n", link_time / 1000.0);
+
+    for (int i = 0; i < STARTUP_PHASES; i++) {
+        if (profile->begin[i] < 0 || profile->end[i] < 0)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "Startup: %s %.1fms, from %.1fms to %.1fms\n", startup_phase_names[i],
+               (profile->end[i] - profile->begin[i]) / 1000.0, profile->begin[i] / 1000.0, profile->end[i] / 1000.0);
+    }
+    av_log(NULL, AV_LOG_INFO, "Startup: %s initialisation\n", profile->overlapped ? "overlapped" : "sequential");
+}
+
+
+int startup_profile_write(const StartupProfile *profile, const char *filename) {
+    FILE *file = fopen(filename, "w");
+
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open startup profile file %s\n", filename);
+        return AVERROR(errno);
+    }
+
+    fprintf(file, "phase,start_ms,end_ms,duration_ms\n");
+    if (link_time >= 0)
+        fprintf(file, "link,,,%.3f\n", link_time / 1000.0);
+    for (int i = 0; i < STARTUP_PHASES; i++) {
+        if (profile->begin[i] < 0 || profile->end[i] < 0)
+            continue;
+        fprintf(file, "%s,%.3f,%.3f,%.3f\n", startup_phase_names[i], profile->begin[i] / 1000.0,
+                profile->end[i] / 1000.0, (profile->end[i] - profile->begin[i]) / 1000.0);
+    }
+
+    return fclose(file) ? AVERROR(errno) : 0;
+}
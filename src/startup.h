@@ -0,0 +1,46 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdint.h>
+
+/*
+ * Startup profile: where the time before the first output packet goes.
+ *
+ * Each phase records when it began and ended, relative to the start of the
+ * job, so phases that run side by side in an overlapped start are visible as
+ * such. The link phase is measured once per process, from exec to the first
+ * constructor of the executable, which is when the dynamic linker has loaded
+ * and relocated every shared library. It comes from the kernel's process start
+ * time, so it is only as fine as the clock tick (10ms on most systems), and is
+ * unknown on anything but Linux.
+ *
+ * The profile is logged when the job finishes, and written as CSV when a
+ * profile file is given, with the link phase as a duration only.
+ */
+
+enum StartupPhase {
+    STARTUP_PROBE,
+    STARTUP_DECODER_OPEN,
+    STARTUP_FIELD_ORDER,
+    STARTUP_ENCODER_OPEN,
+    STARTUP_HEADER_WRITE,
+    STARTUP_FIRST_PACKET,
+    STARTUP_PHASES,
+};
+
+typedef struct StartupProfile {
+    int64_t origin;
+    int64_t begin[STARTUP_PHASES];
+    int64_t end[STARTUP_PHASES];
+    int overlapped;
+} StartupProfile;
+
+void startup_profile_init(StartupProfile *profile);
+void startup_profile_begin(StartupProfile *profile, enum StartupPhase phase);
+void startup_profile_end(StartupProfile *profile, enum StartupPhase phase);
+void startup_profile_first_packet(StartupProfile *profile);
+int64_t startup_link_time(void);
+void startup_profile_log(const StartupProfile *profile);
+int startup_profile_write(const StartupProfile *profile, const char *filename);
+
+#endif
@@ -0,0 +1,542 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "testbed.h"
+#include "sweep.h"
+
+#define SWEEP_SSIM_WINDOW 8
+#define SWEEP_SSIM_STEP 4
+
+
+typedef struct SweepClip {
+    AVFrame **frames;
+    int nbFrames;
+    int width;
+    int height;
+    AVRational frameRate;
+} SweepClip;
+
+
+static double cpu_seconds(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+
+static void default_grid(SweepGrid *grid) {
+    static const char *codecs[] = { "libx264", "libx265" };
+    static const char *presets[] = { "ultrafast", "veryfast", "medium", "slow" };
+    static const int threads[] = { 1, 0 };
+    static const int64_t bitRates[] = { 2000000, 5000000 };
+
+    if (!grid->nbCodecs)
+        for (int i = 0; i < FF_ARRAY_ELEMS(codecs); i++)
+            grid->codecs[grid->nbCodecs++] = av_strdup(codecs[i]);
+    if (!grid->nbPresets)
+        for (int i = 0; i < FF_ARRAY_ELEMS(presets); i++)
+            grid->presets[grid->nbPresets++] = av_strdup(presets[i]);
+    if (!grid->nbThreads)
+        for (int i = 0; i < FF_ARRAY_ELEMS(threads); i++)
+            grid->threads[grid->nbThreads++] = threads[i];
+    if (!grid->nbBitRates)
+        for (int i = 0; i < FF_ARRAY_ELEMS(bitRates); i++)
+            grid->bitRates[grid->nbBitRates++] = bitRates[i];
+}
+
+
+int sweep_load_grid(const char *filename, SweepGrid *grid) {
+    char line[1024];
+    FILE *file;
+
+    memset(grid, 0, sizeof(*grid));
+    if (!filename) {
+        default_grid(grid);
+        return 0;
+    }
+
+    file = fopen(filename, "r");
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open sweep grid %s\n", filename);
+        return AVERROR(ENOENT);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\r\n", &save);
+        char *value;
+
+        if (!key || key[0] == '#')
+            continue;
+
+        while ((value = strtok_r(NULL, " \t\r\n", &save))) {
+            if (strcmp(key, "codec") == 0 && grid->nbCodecs < SWEEP_MAX_VALUES) {
+                grid->codecs[grid->nbCodecs++] = av_strdup(value);
+            } else if (strcmp(key, "preset") == 0 && grid->nbPresets < SWEEP_MAX_VALUES) {
+                grid->presets[grid->nbPresets++] = av_strdup(value);
+            } else if (strcmp(key, "threads") == 0 && grid->nbThreads < SWEEP_MAX_VALUES) {
+                grid->threads[grid->nbThreads++] = atoi(value);
+            } else if (strcmp(key, "bitrate") == 0 && grid->nbBitRates < SWEEP_MAX_VALUES) {
+                grid->bitRates[grid->nbBitRates++] = strtoll(value, NULL, 10);
+            } else {
+                av_log(NULL, AV_LOG_WARNING, "Ignoring sweep grid value %s %s\n", key, value);
+            }
+        }
+    }
+    fclose(file);
+
+    default_grid(grid);
+    return 0;
+}
+
+
+void sweep_free_grid(SweepGrid *grid) {
+    for (int i = 0; i < grid->nbCodecs; i++)
+        av_freep(&grid->codecs[i]);
+    for (int i = 0; i < grid->nbPresets; i++)
+        av_freep(&grid->presets[i]);
+    grid->nbCodecs = grid->nbPresets = 0;
+}
+
+
+/* Decode the clip once, converted to the 8-bit 4:2:0 every swept encoder and the metrics take. */
+static int load_clip(const char *filename, int maxFrames, SweepClip *clip) {
+    AVFormatContext *formatContext = NULL;
+    AVCodecContext *decoderContext = NULL;
+    const AVCodec *decoderCodec = NULL;
+    struct SwsContext *scaler = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVStream *videoStream;
+    int videoIndex;
+    int eof = 0;
+    int ret;
+
+    memset(clip, 0, sizeof(*clip));
+    clip->frames = av_calloc(maxFrames, sizeof(*clip->frames));
+    if (!packet || !frame || !clip->frames) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = open_media(&formatContext, filename)) < 0)
+        goto end;
+    if ((ret = videoIndex = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &decoderCodec, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "No video stream in sweep clip %s\n", filename);
+        goto end;
+    }
+    videoStream = formatContext->streams[videoIndex];
+
+    decoderContext = avcodec_alloc_context3(decoderCodec);
+    if (!decoderContext) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(decoderContext, videoStream->codecpar)) < 0 ||
+        (ret = avcodec_open2(decoderContext, decoderCodec, NULL)) < 0)
+        goto end;
+
+    clip->frameRate = av_guess_frame_rate(formatContext, videoStream, NULL);
+    if (!clip->frameRate.num)
+        clip->frameRate = (AVRational){25, 1};
+
+    while (clip->nbFrames < maxFrames && !eof) {
+        if (av_read_frame(formatContext, packet) < 0) {
+            eof = 1;
+        } else if (packet->stream_index != videoIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        ret = avcodec_send_packet(decoderContext, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (ret < 0)
+            goto end;
+
+        while (clip->nbFrames < maxFrames && (ret = avcodec_receive_frame(decoderContext, frame)) >= 0) {
+            AVFrame *converted = av_frame_alloc();
+
+            scaler = sws_getCachedContext(scaler, frame->width, frame->height, frame->format,
+                                          frame->width, frame->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+            if (!converted || !scaler) {
+                av_frame_free(&converted);
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            converted->format = AV_PIX_FMT_YUV420P;
+            converted->width = frame->width;
+            converted->height = frame->height;
+            if ((ret = av_frame_get_buffer(converted, 0)) < 0 ||
+                (ret = sws_scale(scaler, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                                 converted->data, converted->linesize)) < 0) {
+                av_frame_free(&converted);
+                goto end;
+            }
+            converted->pts = clip->nbFrames;
+            clip->frames[clip->nbFrames++] = converted;
+            av_frame_unref(frame);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+
+    if (!clip->nbFrames) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    clip->width = clip->frames[0]->width;
+    clip->height = clip->frames[0]->height;
+    ret = 0;
+
+    end:
+    sws_freeContext(scaler);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&decoderContext);
+    avformat_close_input(&formatContext);
+    return ret;
+}
+
+
+static void free_clip(SweepClip *clip) {
+    for (int i = 0; i < clip->nbFrames; i++)
+        av_frame_free(&clip->frames[i]);
+    av_freep(&clip->frames);
+    clip->nbFrames = 0;
+}
+
+
+static int64_t plane_sse(const uint8_t *a, int aStride, const uint8_t *b, int bStride, int width, int height) {
+    int64_t sse = 0;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int d = a[y * aStride + x] - b[y * bStride + x];
+            sse += d * d;
+        }
+    }
+    return sse;
+}
+
+
+static double plane_ssim(const uint8_t *a, int aStride, const uint8_t *b, int bStride, int width, int height) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    const double n = SWEEP_SSIM_WINDOW * SWEEP_SSIM_WINDOW;
+    double total = 0;
+    int windows = 0;
+
+    for (int y = 0; y + SWEEP_SSIM_WINDOW <= height; y += SWEEP_SSIM_STEP) {
+        for (int x = 0; x + SWEEP_SSIM_WINDOW <= width; x += SWEEP_SSIM_STEP) {
+            int64_t sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+            double meanA, meanB, varA, varB, covariance;
+
+            for (int j = 0; j < SWEEP_SSIM_WINDOW; j++) {
+                for (int i = 0; i < SWEEP_SSIM_WINDOW; i++) {
+                    int pa = a[(y + j) * aStride + x + i];
+                    int pb = b[(y + j) * bStride + x + i];
+                    sumA += pa;
+                    sumB += pb;
+                    sumAA += pa * pa;
+                    sumBB += pb * pb;
+                    sumAB += pa * pb;
+                }
+            }
+            meanA = sumA / n;
+            meanB = sumB / n;
+            varA = sumAA / n - meanA * meanA;
+            varB = sumBB / n - meanB * meanB;
+            covariance = sumAB / n - meanA * meanB;
+            total += (2 * meanA * meanB + c1) * (2 * covariance + c2) /
+                     ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+            windows++;
+        }
+    }
+    return windows ? total / windows : 1.0;
+}
+
+
+static int open_sweep_encoder(AVCodecContext **encoderContext, const SweepClip *clip, SweepResult *result) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(result->codec);
+    AVCodecContext *context;
+    int ret;
+
+    if (!codec) {
+        av_log(NULL, AV_LOG_ERROR, "Encoder %s is not available\n", result->codec);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    context = *encoderContext = avcodec_alloc_context3(codec);
+    if (!context)
+        return AVERROR(ENOMEM);
+
+    context->width = clip->width;
+    context->height = clip->height;
+    context->pix_fmt = AV_PIX_FMT_YUV420P;
+    context->time_base = av_inv_q(clip->frameRate);
+    context->framerate = clip->frameRate;
+    context->bit_rate = result->bitRate;
+    context->thread_count = result->threads;
+
+    if (av_opt_set(context->priv_data, "preset", result->preset, 0) == AVERROR_OPTION_NOT_FOUND &&
+        av_opt_set(context->priv_data, "cpu-used", result->preset, 0) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s takes neither a preset nor cpu-used of %s\n", result->codec, result->preset);
+        return AVERROR(EINVAL);
+    }
+
+    if ((ret = avcodec_open2(context, codec, NULL)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s: %s\n", result->codec, av_err2str(ret));
+    return ret;
+}
+
+
+static int store_packets(AVCodecContext *encoderContext, AVFrame *frame, AVPacket ***packets, int *nbPackets,
+                         int *capacity, SweepResult *result) {
+    int ret = avcodec_send_frame(encoderContext, frame);
+
+    while (ret >= 0) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_receive_packet(encoderContext, packet);
+        if (ret < 0) {
+            av_packet_free(&packet);
+            break;
+        }
+
+        if (*nbPackets == *capacity) {
+            int newCapacity = *capacity ? *capacity * 2 : 256;
+            AVPacket **grown = av_realloc_array(*packets, newCapacity, sizeof(**packets));
+            if (!grown) {
+                av_packet_free(&packet);
+                return AVERROR(ENOMEM);
+            }
+            *packets = grown;
+            *capacity = newCapacity;
+        }
+        result->bytes += packet->size;
+        (*packets)[(*nbPackets)++] = packet;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+
+/* Decode the stored packets and score each picture against the source frame with the same pts. */
+static int measure_quality(AVCodecContext *encoderContext, AVPacket **packets, int nbPackets, const SweepClip *clip,
+                           SweepResult *result) {
+    const AVCodec *codec = avcodec_find_decoder(encoderContext->codec_id);
+    AVCodecContext *decoderContext = NULL;
+    AVCodecParameters *parameters = avcodec_parameters_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int64_t sse = 0, samples = 0;
+    double ssim = 0;
+    int scored = 0;
+    int ret;
+
+    if (!codec || !parameters || !frame || !(decoderContext = avcodec_alloc_context3(codec))) {
+        ret = codec ? AVERROR(ENOMEM) : AVERROR_DECODER_NOT_FOUND;
+        goto end;
+    }
+    if ((ret = avcodec_parameters_from_context(parameters, encoderContext)) < 0 ||
+        (ret = avcodec_parameters_to_context(decoderContext, parameters)) < 0)
+        goto end;
+    decoderContext->pkt_timebase = encoderContext->time_base;
+    if ((ret = avcodec_open2(decoderContext, codec, NULL)) < 0)
+        goto end;
+
+    for (int i = 0; i <= nbPackets; i++) {
+        if ((ret = avcodec_send_packet(decoderContext, i < nbPackets ? packets[i] : NULL)) < 0)
+            goto end;
+
+        while ((ret = avcodec_receive_frame(decoderContext, frame)) >= 0) {
+            int64_t index = frame->best_effort_timestamp;
+            const AVFrame *source;
+
+            if (index >= 0 && index < clip->nbFrames && frame->format == AV_PIX_FMT_YUV420P) {
+                source = clip->frames[index];
+                for (int plane = 0; plane < 3; plane++) {
+                    int width = plane ? AV_CEIL_RSHIFT(clip->width, 1) : clip->width;
+                    int height = plane ? AV_CEIL_RSHIFT(clip->height, 1) : clip->height;
+                    sse += plane_sse(source->data[plane], source->linesize[plane], frame->data[plane],
+                                     frame->linesize[plane], width, height);
+                    samples += (int64_t)width * height;
+                }
+                ssim += plane_ssim(source->data[0], source->linesize[0], frame->data[0], frame->linesize[0],
+                                   clip->width, clip->height);
+                scored++;
+            }
+            av_frame_unref(frame);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+
+    if (!scored) {
+        av_log(NULL, AV_LOG_ERROR, "No decoded frames of %s could be scored\n", result->codec);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    result->psnr = sse ? 10 * log10(255.0 * 255.0 * samples / sse) : 100;
+    result->ssim = ssim / scored;
+    ret = 0;
+
+    end:
+    av_frame_free(&frame);
+    avcodec_parameters_free(&parameters);
+    avcodec_free_context(&decoderContext);
+    return ret;
+}
+
+
+static int run_sweep_config(const SweepClip *clip, SweepResult *result) {
+    AVCodecContext *encoderContext = NULL;
+    AVPacket **packets = NULL;
+    int nbPackets = 0, capacity = 0;
+    int64_t wallStart;
+    double cpuStart;
+    int ret;
+
+    if ((ret = open_sweep_encoder(&encoderContext, clip, result)) < 0)
+        goto end;
+
+    /* Only the encoder calls are timed; scoring the output comes after. */
+    wallStart = av_gettime_relative();
+    cpuStart = cpu_seconds();
+    for (int i = 0; i <= clip->nbFrames; i++) {
+        if ((ret = store_packets(encoderContext, i < clip->nbFrames ? clip->frames[i] : NULL,
+                                 &packets, &nbPackets, &capacity, result)) < 0)
+            goto end;
+    }
+    result->cpuSeconds = cpu_seconds() - cpuStart;
+    result->fps = clip->nbFrames * 1000000.0 / FFMAX(av_gettime_relative() - wallStart, 1);
+    result->frames = clip->nbFrames;
+
+    ret = measure_quality(encoderContext, packets, nbPackets, clip, result);
+
+    end:
+    for (int i = 0; i < nbPackets; i++)
+        av_packet_free(&packets[i]);
+    av_free(packets);
+    avcodec_free_context(&encoderContext);
+    return ret;
+}
+
+
+/* A run is on the front when no other run is at least as fast, as small and as good, and better in one. */
+void sweep_mark_pareto(SweepResult *results, int nbResults) {
+    for (int i = 0; i < nbResults; i++) {
+        results[i].pareto = !results[i].failed;
+        for (int j = 0; j < nbResults && results[i].pareto; j++) {
+            const SweepResult *a = &results[i], *b = &results[j];
+            if (i == j || b->failed)
+                continue;
+            if (b->fps >= a->fps && b->bytes <= a->bytes && b->ssim >= a->ssim &&
+                (b->fps > a->fps || b->bytes < a->bytes || b->ssim > a->ssim))
+                results[i].pareto = 0;
+        }
+    }
+}
+
+
+static int write_report(const char *filename, const SweepResult *results, int nbResults, const SweepClip *clip) {
+    FILE *file = stdout;
+    double seconds = clip->nbFrames / av_q2d(clip->frameRate);
+
+    if (filename && !(file = fopen(filename, "w"))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open sweep report %s\n", filename);
+        return AVERROR(EIO);
+    }
+
+    fprintf(file, "codec,preset,threads,bitrate,fps,cpu_seconds,bytes,kbps,psnr,ssim,pareto\n");
+    for (int i = 0; i < nbResults; i++) {
+        const SweepResult *r = &results[i];
+        if (r->failed) {
+            fprintf(file, "%s,%s,%d,%" PRId64 ",,,,,,,failed\n", r->codec, r->preset, r->threads, r->bitRate);
+            continue;
+        }
+        fprintf(file, "%s,%s,%d,%" PRId64 ",%.2f,%.3f,%" PRId64 ",%.1f,%.3f,%.5f,%d\n",
+                r->codec, r->preset, r->threads, r->bitRate, r->fps, r->cpuSeconds, r->bytes,
+                r->bytes * 8 / seconds / 1000, r->psnr, r->ssim, r->pareto);
+    }
+
+    if (file != stdout && fclose(file) != 0)
+        return AVERROR(EIO);
+    return 0;
+}
+
+
+int run_sweep(const char *clipFilename, const char *gridFilename, const char *reportFilename,
+              const StreamingParams *streamParameters) {
+    SweepGrid grid;
+    SweepClip clip;
+    SweepResult *results = NULL;
+    int nbResults = 0, onFront = 0;
+    int ret;
+
+    if ((ret = sweep_load_grid(gridFilename, &grid)) < 0)
+        return ret;
+
+    if ((ret = load_clip(clipFilename, streamParameters->sweepFrames, &clip)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not load sweep clip %s\n", clipFilename);
+        goto end;
+    }
+    av_log(NULL, AV_LOG_INFO, "Sweeping %d configurations over %d frames of %dx%d\n",
+           grid.nbCodecs * grid.nbPresets * grid.nbThreads * grid.nbBitRates, clip.nbFrames, clip.width, clip.height);
+
+    results = av_calloc(grid.nbCodecs * grid.nbPresets * grid.nbThreads * grid.nbBitRates, sizeof(*results));
+    if (!results) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int c = 0; c < grid.nbCodecs; c++) {
+        for (int p = 0; p < grid.nbPresets; p++) {
+            for (int t = 0; t < grid.nbThreads; t++) {
+                for (int b = 0; b < grid.nbBitRates; b++) {
+                    SweepResult *result = &results[nbResults++];
+
+                    result->codec = grid.codecs[c];
+                    result->preset = grid.presets[p];
+                    result->threads = grid.threads[t];
+                    result->bitRate = grid.bitRates[b];
+                    if (run_sweep_config(&clip, result) < 0) {
+                        result->failed = 1;
+                        continue;
+                    }
+                    av_log(NULL, AV_LOG_INFO, "%s %s threads=%d bitrate=%" PRId64 ": %.1f fps, %.2f cpu s, "
+                           "%" PRId64 " bytes, psnr %.2f, ssim %.4f\n", result->codec, result->preset,
+                           result->threads, result->bitRate, result->fps, result->cpuSeconds, result->bytes,
+                           result->psnr, result->ssim);
+                }
+            }
+        }
+    }
+
+    sweep_mark_pareto(results, nbResults);
+    for (int i = 0; i < nbResults; i++)
+        onFront += results[i].pareto;
+    av_log(NULL, AV_LOG_INFO, "%d of %d configurations are on the speed/size/quality front\n", onFront, nbResults);
+
+    ret = write_report(reportFilename, results, nbResults, &clip);
+
+    end:
+    av_free(results);
+    free_clip(&clip);
+    sweep_free_grid(&grid);
+    return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+
+#include "testbed.h"
+
+/*
+ * Encoder settings sweep.
+ *
+ * Decodes up to StreamingParams.sweepFrames frames of a test clip once, as
+ * 8-bit 4:2:0, then encodes them with every combination of codec, preset,
+ * thread count and bitrate in the grid. For each run it records the encode
+ * rate, the CPU time spent in the encoder calls, the output size, and PSNR
+ * and luma SSIM of the decoded result against the source frames.
+ *
+ * A grid file has one dimension per line, a key followed by its values:
+ *
+ *   codec libx264 libx265
+ *   preset veryfast medium slow
+ *   threads 1 4 0
+ *   bitrate 2000000 5000000
+ *
+ * Missing dimensions take the defaults below. Codecs without a preset option
+ * take a numeric preset as cpu-used instead. The report is a CSV of every run,
+ * where a pareto column marks the runs that nothing else beats on all of
+ * encode rate, size and SSIM at once.
+ */
+
+#define SWEEP_MAX_VALUES 16
+
+typedef struct SweepGrid {
+    char *codecs[SWEEP_MAX_VALUES];
+    int nbCodecs;
+    char *presets[SWEEP_MAX_VALUES];
+    int nbPresets;
+    int threads[SWEEP_MAX_VALUES];
+    int nbThreads;
+    int64_t bitRates[SWEEP_MAX_VALUES];
+    int nbBitRates;
+} SweepGrid;
+
+typedef struct SweepResult {
+    const char *codec;
+    const char *preset;
+    int threads;
+    int64_t bitRate;
+    int failed;
+    int frames;
+    double fps;
+    double cpuSeconds;
+    int64_t bytes;
+    double psnr;
+    double ssim;
+    int pareto;
+} SweepResult;
+
+int sweep_load_grid(const char *filename, SweepGrid *grid);
+void sweep_free_grid(SweepGrid *grid);
+void sweep_mark_pareto(SweepResult *results, int nbResults);
+int run_sweep(const char *clipFilename, const char *gridFilename, const char *reportFilename,
+              const StreamingParams *streamParameters);
+
+#endif
@@ -14,74 +14,58 @@
 #include <libavutil/opt.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/pixdesc.h>
 #include "libavutil/md5.h"
 #include "libavutil/mem.h"
 
 #include <libswresample/swresample.h>
-//#include <string.h>
-//#include <inttypes.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 // #include "video_debugging.h"
 
-
-typedef struct StreamingParams {
-    int copyVideo;
-    int copyAudio;
-    char outputExtension;
-    char *muxerOptKey;
-    char *muxerOptValue;
-    enum AVCodecID videoCodec;
-    enum AVCodecID audioCodec;
-    int audioStreams;
-    int audioChannels;
-    int audioSampleRate;
-    enum AVSampleFormat audioSampleFormat;
-    int audioOutputBitRate;
-    AVChannelLayout audioOutputChannelLayout;
-    char *codecPrivKey;
-    char *codecPrivValue;
-    int frameHeight;
-    int frameWidth;
-    int outputBitRate;
-    int bitstreamBufferSize;
-    int minBitRate;
-    int maxBitRate;
-    AVRational pixelAspectRatio;
-    AVRational frameRate;
-    enum AVPixelFormat videoPixelFormat;
-} StreamingParams;
-
-typedef struct StreamingContext {
-    AVFormatContext *formatContext;
-    AVCodec *videoCodec;
-    AVCodec *audioCodec;
-    AVStream *videoStream;
-    AVStream *audioStream;
-    AVCodecContext *videoCodecContext;
-    AVCodecContext *audioCodecContext;
-    AVChannelLayout *audioChannelLayout;
-    int videoIndex;
-    int audioIndex;
-    int nbVideoStreams;
-    int nbAudioStreams;
-    char *filename;
-} StreamingContext;
-
-typedef struct FilteringContext {
-    AVFilterContext *buffersinkContext;
-    AVFilterContext *buffersrcContext;
-    AVFilterGraph *filterGraph;
-
-    AVPacket *encodePacket;
-    AVFrame *filteredFrame;
-} FilteringContext;
-static FilteringContext *filter_ctx;
-
-
-int open_media(AVFormatContext **inputFormatContext, const char *inputFilename) {
+#include "testbed.h"
+#include "ratecontrol.h"
+#include "complexity.h"
+#include "interlace.h"
+#include "pixconvert.h"
+#include "audiofifo.h"
+#include "interleave.h"
+#include "membudget.h"
+#include "numa.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "distribute.h"
+#include "framering.h"
+#include "speedcontrol.h"
+#include "progress.h"
+#include "metrics.h"
+#include "sweep.h"
+#include "playlist.h"
+#include "overlay.h"
+#include "scheduler.h"
+#include "avhandle.h"
+#include "startup.h"
+
+
+
+/* Input packets held back per media type while their output stream runs ahead. */
+#define MAX_DEFERRED_PACKETS 256
+
+
+/* Open the input and read its header, without probing the streams. */
+static int open_input_header(AVFormatContext **inputFormatContext, const char *inputFilename) {
     int ret;
 
     *inputFormatContext = avformat_alloc_context();
-    if (!inputFormatContext) {
+    if (!*inputFormatContext) {
         av_log(NULL, AV_LOG_FATAL, "%lu ---- Unable to allocate memory for decoder format context\n", (unsigned long)time(NULL));
         return AVERROR(ENOMEM);
     }
@@ -91,6 +75,17 @@ int open_media(AVFormatContext **inputFormatContext, const char *inputFilename)
         return ret;
     }
 
+    return 0;
+}
+
+
+int open_media(AVFormatContext **inputFormatContext, const char *inputFilename) {
+    int ret;
+
+    if ((ret = open_input_header(inputFormatContext, inputFilename)) < 0) {
+        return ret;
+    }
+
     if ((ret = avformat_find_stream_info(*inputFormatContext, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "%lu ---- Error reading input stream\n", (unsigned long)time(NULL));
         return ret;
@@ -119,6 +114,7 @@ int fill_stream_info(AVStream *inputStream, AVCodec **inputCodec, AVCodecContext
         av_log(NULL, AV_LOG_ERROR, "Failed to fill inputCodecContext for stream #%u\n", inputStream->index);
         return ret;
     }
+    (*inputCodecContext)->pkt_timebase = inputStream->time_base;
 
     if ((ret = avcodec_open2(*inputCodecContext, *inputCodec, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Failed to open the decoder for stream #%u", inputStream->index);
@@ -140,12 +136,26 @@ int prepare_decoder(StreamingContext *decoder) {
             }
 
         } else if (decoder->formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            decoder->audioStream = decoder->formatContext->streams[i];
-            decoder->audioIndex = i;
+            int track = decoder->nbAudioStreams;
+
+            if (track == TESTBED_MAX_AUDIO_TRACKS) {
+                av_log(NULL, AV_LOG_WARNING, "Skipping audio stream #%u, only %d audio tracks are transcoded\n",
+                       i, TESTBED_MAX_AUDIO_TRACKS);
+                decoder->formatContext->streams[i]->discard = AVDISCARD_ALL;
+                continue;
+            }
+            decoder->audioTracks[track] = decoder->formatContext->streams[i];
+            decoder->audioTrackIndexes[track] = i;
+            decoder->nbAudioStreams++;
 
-            if (fill_stream_info(decoder->audioStream, &decoder->audioCodec, &decoder->audioCodecContext)) {
+            if (fill_stream_info(decoder->audioTracks[track], &decoder->audioCodec, &decoder->audioTrackContexts[track])) {
                 return -1;
             }
+            if (track == 0) {
+                decoder->audioStream = decoder->audioTracks[0];
+                decoder->audioIndex = i;
+                decoder->audioCodecContext = decoder->audioTrackContexts[0];
+            }
         } else {
             av_log(NULL, AV_LOG_INFO, "Skipping stream #%u as it is not an audio or video stream\n", i);
         }
@@ -197,15 +207,25 @@ static int init_filter_graph(AVFilterGraph **graph, AVFilterContext **filterSour
 }
 */
 
-int prepare_video_encoder(StreamingContext *encoder, AVCodecContext *inputCodecContext, AVRational inputFramerate, StreamingParams streamParameters) {
-    int ret;
-
-    encoder->videoStream = avformat_new_stream(encoder->formatContext, NULL);
-    encoder->videoCodec = avcodec_find_encoder(streamParameters.videoCodec);
-    if (!encoder->videoCodec) {
-        av_log(NULL, AV_LOG_FATAL, "Failed to find necessary encoder\n");
-        return AVERROR_INVALIDDATA;
+/* Carry over the profile, level and reference count of the encoder being replaced, which the header was written for. */
+static void match_video_encoder(AVCodecContext *codecContext, const AVCodecContext *previous) {
+    static const char *options[] = { "profile", "level" };
+
+    codecContext->profile = previous->profile;
+    codecContext->level = previous->level;
+    codecContext->refs = previous->refs;
+    for (int i = 0; i < FF_ARRAY_ELEMS(options); i++) {
+        uint8_t *value = NULL;
+        if (av_opt_get(previous->priv_data, options[i], 0, &value) >= 0 && value && *value)
+            av_opt_set(codecContext->priv_data, options[i], (const char *) value, 0);
+        av_free(value);
     }
+}
+
+
+/* Opens the video encoder, matching previous when it replaces one mid-stream. */
+static int open_video_encoder(StreamingContext *encoder, const StreamingParams *streamParameters, const AVCodecContext *previous) {
+    int ret;
 
     encoder->videoCodecContext = avcodec_alloc_context3(encoder->videoCodec);
     if (!encoder->videoCodecContext) {
@@ -213,26 +233,58 @@ int prepare_video_encoder(StreamingContext *encoder, AVCodecContext *inputCodecC
         return AVERROR(ENOMEM);
     }
 
-    av_opt_set(encoder->videoCodecContext->priv_data, "preset", "fast", 0);
-    if (streamParameters.codecPrivKey && streamParameters.codecPrivValue) {
-        av_opt_set(encoder->videoCodecContext->priv_data, streamParameters.codecPrivKey, streamParameters.codecPrivValue, 0);
+    av_opt_set(encoder->videoCodecContext->priv_data, "preset", streamParameters->videoPreset ? streamParameters->videoPreset : "fast", 0);
+    if (streamParameters->codecPrivKey && streamParameters->codecPrivValue) {
+        av_opt_set(encoder->videoCodecContext->priv_data, streamParameters->codecPrivKey, streamParameters->codecPrivValue, 0);
     }
 
-    encoder->videoCodecContext->height = streamParameters.frameHeight;
-    encoder->videoCodecContext->width = streamParameters.frameWidth;
-    encoder->videoCodecContext->sample_aspect_ratio = streamParameters.pixelAspectRatio;
-    encoder->videoCodecContext->pix_fmt = streamParameters.videoPixelFormat;
-    encoder->videoCodecContext->bit_rate = streamParameters.outputBitRate;
-    encoder->videoCodecContext->rc_buffer_size = streamParameters.bitstreamBufferSize;
-    encoder->videoCodecContext->rc_max_rate = streamParameters.maxBitRate;
-    encoder->videoCodecContext->rc_min_rate = streamParameters.minBitRate;
-    encoder->videoCodecContext->time_base = av_inv_q(streamParameters.frameRate);
-    encoder->videoStream->time_base = encoder->videoCodecContext->time_base;
+    encoder->videoCodecContext->height = streamParameters->frameHeight;
+    encoder->videoCodecContext->width = streamParameters->frameWidth;
+    encoder->videoCodecContext->sample_aspect_ratio = streamParameters->pixelAspectRatio;
+    encoder->videoCodecContext->pix_fmt = streamParameters->videoPixelFormat;
+    encoder->videoCodecContext->bit_rate = streamParameters->outputBitRate;
+    if (!streamParameters->outputBitRate && streamParameters->videoCrf > 0) {
+        av_opt_set_double(encoder->videoCodecContext->priv_data, "crf", streamParameters->videoCrf, 0);
+    }
+    encoder->videoCodecContext->rc_buffer_size = streamParameters->bitstreamBufferSize;
+    encoder->videoCodecContext->rc_max_rate = streamParameters->maxBitRate;
+    encoder->videoCodecContext->rc_min_rate = streamParameters->minBitRate;
+    encoder->videoCodecContext->time_base = av_inv_q(streamParameters->frameRate);
+
+    encoder->videoCodecContext->field_order = encoder->fieldOrder;
+    if (field_order_is_interlaced(encoder->fieldOrder)) {
+        encoder->videoCodecContext->flags |= AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME;
+    }
+    if (previous) {
+        match_video_encoder(encoder->videoCodecContext, previous);
+    }
+
+    if (encoder->videoPass && (ret = configure_rate_control_pass(encoder)) < 0) {
+        return ret;
+    }
 
     if ((ret = (avcodec_open2(encoder->videoCodecContext, encoder->videoCodec, NULL))) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Could not open output codec\n");
         return ret;
     }
+    return 0;
+}
+
+
+int prepare_video_encoder(StreamingContext *encoder, AVCodecContext *inputCodecContext, AVRational inputFramerate, StreamingParams streamParameters) {
+    int ret;
+
+    encoder->videoStream = avformat_new_stream(encoder->formatContext, NULL);
+    encoder->videoCodec = avcodec_find_encoder(streamParameters.videoCodec);
+    if (!encoder->videoCodec) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to find necessary encoder\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    if ((ret = open_video_encoder(encoder, &streamParameters, NULL)) < 0) {
+        return ret;
+    }
+    encoder->videoStream->time_base = encoder->videoCodecContext->time_base;
     av_log(NULL, AV_LOG_INFO, "Copy codec parameters from codec context into video stream\n");
     avcodec_parameters_from_context(encoder->videoStream->codecpar, encoder->videoCodecContext);
 
@@ -240,30 +292,58 @@ int prepare_video_encoder(StreamingContext *encoder, AVCodecContext *inputCodecC
 }
 
 
-int prepare_audio_encoder(StreamingContext *encoder, StreamingContext *decoder, StreamingParams *streamParameters) {
+/* The track of an input stream, or -1 when it isn't an audio stream that is transcoded. */
+int audio_track(const StreamingContext *decoder, int streamIndex) {
+    for (int i = 0; i < decoder->nbAudioStreams; i++) {
+        if (decoder->audioTrackIndexes[i] == streamIndex)
+            return i;
+    }
+    return -1;
+}
 
-    encoder->audioStream = avformat_new_stream(encoder->formatContext, NULL);
 
-    encoder->audioCodec = avcodec_find_encoder(streamParameters->audioCodec);
-    if (!encoder->audioCodec) {
-        av_log(NULL, AV_LOG_FATAL, "Could not find audio encoder codec");
-        return AVERROR_ENCODER_NOT_FOUND;
+void free_audio_tracks(StreamingContext *context) {
+    for (int i = 0; i < context->nbAudioStreams; i++)
+        avcodec_free_context(&context->audioTrackContexts[i]);
+    context->audioCodecContext = NULL;
+    context->nbAudioStreams = 0;
+}
+
+
+/* Decode only as many audio tracks as the encoder has outputs for, and ignore the rest of the input's. */
+static void drop_extra_audio_tracks(StreamingContext *decoder, int nbTracks) {
+    while (decoder->nbAudioStreams > nbTracks) {
+        int track = --decoder->nbAudioStreams;
+        decoder->audioTracks[track]->discard = AVDISCARD_ALL;
+        avcodec_free_context(&decoder->audioTrackContexts[track]);
     }
+    if (!decoder->nbAudioStreams)
+        decoder->audioCodecContext = NULL;
+}
+
+
+static int open_audio_track_encoder(StreamingContext *encoder, StreamingParams *streamParameters, int track) {
+    encoder->audioStream = avformat_new_stream(encoder->formatContext, NULL);
+    if (!encoder->audioStream)
+        return AVERROR(ENOMEM);
 
     encoder->audioCodecContext = avcodec_alloc_context3(encoder->audioCodec);
     if (!encoder->audioCodecContext) {
         av_log(NULL, AV_LOG_FATAL, "Could not allocate memory for codec context");
         return AVERROR(ENOMEM);
     }
+    encoder->audioTracks[track] = encoder->audioStream;
+    encoder->audioTrackContexts[track] = encoder->audioCodecContext;
+    encoder->nbAudioStreams = track + 1;
 
-    enum AVSampleFormat inputSampleFormat = decoder->audioCodecContext->sample_fmt;
     encoder->audioCodecContext->sample_fmt = streamParameters->audioSampleFormat;
 
     encoder->audioCodecContext->ch_layout.nb_channels = streamParameters->audioChannels;
 
     encoder->audioCodecContext->ch_layout = streamParameters->audioOutputChannelLayout;
 
-    encoder->audioCodecContext->sample_rate = decoder->audioCodecContext->sample_rate;
+    /* The resampling stage converts whatever the source runs at. */
+    encoder->audioCodecContext->sample_rate = streamParameters->audioSampleRate;
 
     encoder->audioCodecContext->sample_fmt = streamParameters->audioSampleFormat;
 
@@ -273,22 +353,55 @@ int prepare_audio_encoder(StreamingContext *encoder, StreamingContext *decoder,
 
     encoder->audioCodecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
-    for (int i = 0; i < FF_ARRAY_ELEMS(decoder->audioStream); i++) {
-        encoder->audioStream->time_base = encoder->audioCodecContext->time_base;
-    }
+    encoder->audioStream->time_base = encoder->audioCodecContext->time_base;
 
     if (avcodec_open2(encoder->audioCodecContext, encoder->audioCodec, NULL) < 0) {
         av_log(NULL, AV_LOG_FATAL, "Failed to open output codec context");
         return AVERROR_UNKNOWN;
     }
 
-    av_log(NULL, AV_LOG_INFO, "5\n");
     avcodec_parameters_from_context(encoder->audioStream->codecpar, encoder->audioCodecContext);
 
     return 0;
 }
 
 
+/*
+ * One output track, with an encoder of its own, for each of the input's audio streams up to
+ * StreamingParams.audioStreams, in the input's order. Counting them needs the probed input, since formats such as
+ * MPEG-TS only add their streams while probing; a single track doesn't, which is why an overlapped start, opening the
+ * encoders while the probe still runs, is limited to one. An input without audio still gets the one track, as it
+ * always has.
+ */
+int prepare_audio_encoder(StreamingContext *encoder, StreamingContext *decoder, StreamingParams *streamParameters) {
+    int nbInputTracks = 0;
+    int nbTracks = 1;
+    int ret;
+
+    if (streamParameters->audioStreams > 1) {
+        for (int i = 0; i < decoder->formatContext->nb_streams; i++)
+            nbInputTracks += decoder->formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO;
+        nbTracks = av_clip(FFMIN(nbInputTracks, streamParameters->audioStreams), 1, TESTBED_MAX_AUDIO_TRACKS);
+    }
+
+    encoder->audioCodec = avcodec_find_encoder(streamParameters->audioCodec);
+    if (!encoder->audioCodec) {
+        av_log(NULL, AV_LOG_FATAL, "Could not find audio encoder codec");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    for (int track = 0; track < nbTracks; track++) {
+        if ((ret = open_audio_track_encoder(encoder, streamParameters, track)) < 0)
+            return ret;
+    }
+    encoder->audioStream = encoder->audioTracks[0];
+    encoder->audioCodecContext = encoder->audioTrackContexts[0];
+    if (nbTracks > 1)
+        av_log(NULL, AV_LOG_INFO, "Transcoding %d of %d audio tracks\n", nbTracks, nbInputTracks);
+    return 0;
+}
+
+
 int prepare_copy(AVFormatContext *formatContext, AVStream **avStream, AVCodecParameters *decoderParameters) {
     *avStream = avformat_new_stream(formatContext, NULL);
     avcodec_parameters_copy((*avStream)->codecpar, decoderParameters);
@@ -298,50 +411,182 @@ int prepare_copy(AVFormatContext *formatContext, AVStream **avStream, AVCodecPar
 
 int remux(AVPacket **packet, AVFormatContext **formatContext, AVRational decoderTimebase, AVRational encoderTimebase) {
     av_packet_rescale_ts(*packet, decoderTimebase, encoderTimebase);
+    metrics_packet_remuxed((*packet)->stream_index, (*formatContext)->streams[(*packet)->stream_index]->codecpar->codec_type);
+    metrics_add(METRICS_MUXED_PACKETS, 1);
+    metrics_add(METRICS_MUXED_BYTES, (*packet)->size);
     if (av_interleaved_write_frame(*formatContext, *packet) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error while copying stream packet");
+        metrics_error(METRICS_STAGE_MUX);
         return AVERROR_UNKNOWN;
     }
     return 0;
 }
 
 
+static int write_output_packet(StreamingContext *encoder, AVPacket *packet) {
+    int ret;
+
+    if (encoder->checkpoint && (ret = checkpoint_rollover(encoder->checkpoint, encoder, packet)) < 0)
+        return ret;
+
+    if (encoder->startupProfile)
+        startup_profile_first_packet(encoder->startupProfile);
+
+    /* Counted before the muxer takes the packet's data. */
+    if (packet->stream_index == encoder->videoStream->index)
+        encoder->framesWritten++;
+    encoder->bytesWritten += packet->size;
+    metrics_add(METRICS_MUXED_PACKETS, 1);
+    metrics_add(METRICS_MUXED_BYTES, packet->size);
+
+    if (encoder->interleaver) {
+        ret = packet_interleaver_write(encoder->interleaver, packet);
+    } else {
+        TRACE_BEGIN("av_interleaved_write_frame", "mux");
+        ret = av_interleaved_write_frame(encoder->formatContext, packet);
+        TRACE_END("av_interleaved_write_frame", "mux");
+    }
+    if (ret < 0)
+        metrics_error(METRICS_STAGE_MUX);
+    return ret;
+}
+
+
+/* With the parameter sets in the header, a reopened encoder must produce the same ones; in-band, each keyframe carries its own. */
+static int video_header_matches(const AVCodecContext *codecContext, const AVCodecParameters *header) {
+    if (!header->extradata_size)
+        return 1;
+    return codecContext->extradata_size == header->extradata_size &&
+           !memcmp(codecContext->extradata, header->extradata, header->extradata_size);
+}
+
+
+/*
+ * Drain the video encoder and reopen it with the preset the speed controller has moved to. A preset whose parameter
+ * sets don't match the header is rejected, and the encoder reopened with the previous one instead.
+ */
+static int switch_video_preset(StreamingContext *decoder, StreamingContext *encoder) {
+    StreamingParams streamParameters = *encoder->streamParameters;
+    const AVCodecParameters *header = encoder->videoStream->codecpar;
+    AVCodecContext *previous;
+    int ret;
+
+    if (encode_video(decoder, encoder, NULL)) {
+        return -1;
+    }
+    previous = TAKE_OWNERSHIP(encoder->videoCodecContext);
+    encoder->speedController->reopened = 1;
+
+    streamParameters.videoPreset = (char *) speed_controller_preset(encoder->speedController);
+    if ((ret = open_video_encoder(encoder, &streamParameters, previous)) >= 0 &&
+        !video_header_matches(encoder->videoCodecContext, header)) {
+        speed_controller_reject(encoder->speedController);
+        avcodec_free_context(&encoder->videoCodecContext);
+        streamParameters.videoPreset = (char *) speed_controller_preset(encoder->speedController);
+        if ((ret = open_video_encoder(encoder, &streamParameters, previous)) >= 0 &&
+            !video_header_matches(encoder->videoCodecContext, header)) {
+            av_log(NULL, AV_LOG_ERROR, "The reopened video encoder no longer matches the stream header\n");
+            ret = AVERROR(EINVAL);
+        }
+    }
+    avcodec_free_context(&previous);
+    return ret;
+}
+
+
 int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame) {
+    /* Only the encoder's own calls are timed, not preset switches or the overlay. */
+    int timing = inputFrame && atomic_load_explicit(&metrics_enabled, memory_order_relaxed);
+    int64_t encodeTime = 0;
+    int64_t callStart = 0;
+
+    if (inputFrame != NULL && encoder->speedController && speed_controller_update(encoder->speedController) &&
+        switch_video_preset(decoder, encoder) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not reopen the video encoder with preset %s\n",
+               speed_controller_preset(encoder->speedController));
+        return -1;
+    }
+
     if (inputFrame != NULL) {
         inputFrame->pict_type = AV_PICTURE_TYPE_I;
-        inputFrame->interlaced_frame = 1;
-        inputFrame->top_field_first = 1;
+        inputFrame->interlaced_frame = field_order_is_interlaced(encoder->fieldOrder);
+        inputFrame->top_field_first = field_order_is_top_first(encoder->fieldOrder);
+
+        if (encoder->overlay && (av_frame_make_writable(inputFrame) < 0 ||
+                                 graphics_overlay_apply(encoder->overlay, inputFrame) < 0)) {
+            av_log(NULL, AV_LOG_ERROR, "Could not blend the overlay into a video frame\n");
+            return -1;
+        }
     }
 
-    AVPacket *outputPacket = av_packet_alloc();
+    OWNED_PACKET AVPacket *outputPacket = av_packet_alloc();
     if (!outputPacket) {
         av_log(NULL, AV_LOG_FATAL, "Could not alloate memory for output video packet");
         return AVERROR(ENOMEM);
     }
 
+    if (timing)
+        callStart = av_gettime_relative();
+    TRACE_BEGIN("avcodec_send_frame", "video");
     int response = avcodec_send_frame(encoder->videoCodecContext, inputFrame);
+    TRACE_END("avcodec_send_frame", "video");
+    if (timing)
+        encodeTime += av_gettime_relative() - callStart;
 
     while (response >= 0) {
+        if (timing)
+            callStart = av_gettime_relative();
+        TRACE_BEGIN("avcodec_receive_packet", "video");
         response = avcodec_receive_packet(encoder->videoCodecContext, outputPacket);
+        TRACE_END("avcodec_receive_packet", "video");
+        if (timing)
+            encodeTime += av_gettime_relative() - callStart;
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
             break;
         } else if (response < 0) {
             av_log(NULL, AV_LOG_ERROR, "Error while receiving video packet from encoder: %s\n", av_err2str(response));
+            metrics_error(METRICS_STAGE_ENCODE);
             return -1;
         }
+        metrics_frame_encoded(encoder->videoStream->index, AVMEDIA_TYPE_VIDEO);
 
-        outputPacket->stream_index = decoder->videoIndex;
+        if (encoder->videoPass == 1 && write_first_pass_stats(encoder) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while writing first pass statistics\n");
+            return -1;
+        }
+
+        outputPacket->stream_index = encoder->videoStream->index;
         outputPacket->duration = encoder->videoStream->time_base.den / encoder->videoStream->time_base.num / decoder->videoStream->avg_frame_rate.num * decoder->videoStream->avg_frame_rate.den;
 
         av_packet_rescale_ts(outputPacket, decoder->videoStream->time_base, encoder->videoStream->time_base);
-        response = av_interleaved_write_frame(encoder->formatContext, outputPacket);
+
+        /*
+         * A reopened encoder starts its dts behind its first pts again. Its packets move later by as much as keeps its
+         * first dts after the last one written, pts with dts, so dts never passes pts. encode_audio moves audio by the
+         * same amount.
+         */
+        if (encoder->speedController && outputPacket->dts != AV_NOPTS_VALUE) {
+            SpeedController *controller = encoder->speedController;
+            if (controller->reopened && controller->lastDts != AV_NOPTS_VALUE &&
+                outputPacket->dts + controller->timestampOffset <= controller->lastDts) {
+                controller->timestampOffset = controller->lastDts + 1 - outputPacket->dts;
+            }
+            controller->reopened = 0;
+            outputPacket->dts += controller->timestampOffset;
+            if (outputPacket->pts != AV_NOPTS_VALUE)
+                outputPacket->pts += controller->timestampOffset;
+            controller->lastDts = outputPacket->dts;
+        }
+
+        response = write_output_packet(encoder, outputPacket);
         if (response != 0) {
             av_log(NULL, AV_LOG_ERROR, "Error %d while receiving video packet from decoder: %s", response, av_err2str(response));
             return -1;
         }
     }
-    av_packet_unref(outputPacket);
-    av_packet_free(&outputPacket);
+
+    if (timing)
+        metrics_encode_time(encodeTime);
     return 0;
 }
 
@@ -350,15 +595,20 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
 
     av_log(NULL, AV_LOG_INFO, "1\n");
     //StreamContext *stream = &stream_ctx[stream_index];
-    FilteringContext *filter = &filter_ctx[streamIndex];
-    AVFrame *filt_frame = flush ? NULL : filter->filteredFrame;
+    FilteringContext *filter = &decoder->filters[streamIndex];
+    int track = audio_track(decoder, streamIndex);
+    AVCodecContext *audioContext = encoder->audioTrackContexts[track];
+    AVStream *audioStream = encoder->audioTracks[track];
+    AVFrame *filt_frame = flush ? NULL : inputFrame;
     AVPacket *outputPacket = filter->encodePacket;
 
     int ret;
     av_log(NULL, AV_LOG_INFO, "2\n");
     av_packet_unref(outputPacket);
 
-    int response = avcodec_send_frame(encoder->audioCodecContext, filt_frame);
+    TRACE_BEGIN("avcodec_send_frame", "audio");
+    int response = avcodec_send_frame(audioContext, filt_frame);
+    TRACE_END("avcodec_send_frame", "audio");
 
     //AVPacket *outputPacket = av_packet_alloc();
     if (!outputPacket) {
@@ -369,19 +619,33 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
     av_log(NULL, AV_LOG_INFO, "3\n");
 
     while (response >= 0) {
-        response = avcodec_receive_packet(encoder->audioCodecContext, outputPacket);
+        TRACE_BEGIN("avcodec_receive_packet", "audio");
+        response = avcodec_receive_packet(audioContext, outputPacket);
+        TRACE_END("avcodec_receive_packet", "audio");
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
             break;
         } else if (response < 0) {
             av_log(NULL, AV_LOG_ERROR, "Error while receiving audio packet from encoder: %s\n", av_err2str(response));
+            metrics_error(METRICS_STAGE_ENCODE);
             return -1;
         }
+        metrics_frame_encoded(audioStream->index, AVMEDIA_TYPE_AUDIO);
         av_log(NULL, AV_LOG_INFO, "4\n");
-        outputPacket->stream_index = decoder->audioIndex;
+        outputPacket->stream_index = audioStream->index;
         av_log(NULL, AV_LOG_INFO, "5\n");
-        av_packet_rescale_ts(outputPacket, decoder->audioStream->time_base, encoder->audioStream->time_base);
+        av_packet_rescale_ts(outputPacket, audioContext->time_base, audioStream->time_base);
         av_log(NULL, AV_LOG_INFO, "6\n");
-        response = av_interleaved_write_frame(encoder->formatContext, outputPacket);
+
+        /* Video moved later on each encoder reopen; audio moves with it to stay in sync. */
+        if (encoder->speedController && encoder->speedController->timestampOffset) {
+            int64_t offset = av_rescale_q(encoder->speedController->timestampOffset,
+                                          encoder->videoStream->time_base, audioStream->time_base);
+            if (outputPacket->pts != AV_NOPTS_VALUE)
+                outputPacket->pts += offset;
+            if (outputPacket->dts != AV_NOPTS_VALUE)
+                outputPacket->dts += offset;
+        }
+        response = write_output_packet(encoder, outputPacket);
         if (response != 0) {
             av_log(NULL, AV_LOG_ERROR, "Error %d while receiving audio packet from decoder: %s", response, av_err2str(response));
             return -1;
@@ -397,25 +661,150 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
 }
 
 
+static int adapt_encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame, int streamIndex)
+{
+    FilteringContext *filter = &decoder->filters[streamIndex];
+    AVFrame *chunk;
+    int ret;
+
+    /* a NULL frame flushes out whatever is left as a final short frame */
+    if ((ret = audio_frame_adapter_send(filter->frameAdapter, inputFrame)) < 0)
+        return ret;
+
+    while ((ret = audio_frame_adapter_receive(filter->frameAdapter, &chunk)) >= 0) {
+        if ((ret = encode_audio(decoder, encoder, chunk, streamIndex, 0)) < 0)
+            return ret;
+    }
+
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        ret = 0;
+    return ret;
+}
+
+
+/* The resampler reuses its output frame, so a frame handed to another thread has to be a copy. */
+static int output_resampled_audio(FilterStrand *strand, const AVFrame *resampledFrame) {
+    OWNED_FRAME AVFrame *copy = av_frame_alloc();
+    int ret;
+
+    if (!copy)
+        return AVERROR(ENOMEM);
+    copy->format = resampledFrame->format;
+    copy->nb_samples = resampledFrame->nb_samples;
+    copy->sample_rate = resampledFrame->sample_rate;
+    if ((ret = av_channel_layout_copy(&copy->ch_layout, &resampledFrame->ch_layout)) < 0 ||
+        (ret = av_frame_get_buffer(copy, 0)) < 0 ||
+        (ret = av_frame_copy(copy, resampledFrame)) < 0 ||
+        (ret = av_frame_copy_props(copy, resampledFrame)) < 0 ||
+        (ret = filter_strand_output(strand, copy)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while queueing resampled audio frame\n");
+    }
+    return ret;
+}
+
+
+/* Runs on a filter worker: one decoded audio frame, or the flush, through the filter graph and the resampler. */
+static int filter_audio_task(void *opaque, AVFrame *inputFrame, FilterStrand *strand) {
+    FilteringContext *filter = opaque;
+    AVFrame *resampledFrame;
+    int ret;
+
+    if ((ret = av_buffersrc_add_frame_flags(filter->buffersrcContext, inputFrame, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        metrics_error(METRICS_STAGE_FILTER);
+        return ret;
+    }
+
+    while ((ret = av_buffersink_get_frame(filter->buffersinkContext, filter->filteredFrame)) >= 0) {
+        filter->filteredFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        ret = audio_resampler_convert(filter->resampler, filter->filteredFrame, &resampledFrame);
+        av_frame_unref(filter->filteredFrame);
+        if (ret < 0)
+            return ret;
+        if (resampledFrame && (ret = output_resampled_audio(strand, resampledFrame)) < 0)
+            return ret;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        return ret;
+
+    if (!inputFrame) {
+        if ((ret = audio_resampler_convert(filter->resampler, NULL, &resampledFrame)) < 0)
+            return ret;
+        if (resampledFrame)
+            return output_resampled_audio(strand, resampledFrame);
+    }
+    return 0;
+}
+
+
+/*
+ * Move a frame's reference, or the flush, to the stream's strand, as the buffer source takes it in the serial path.
+ * Flushing waits for the strand to catch up so that nothing is left behind on the workers.
+ */
+static int submit_filter_frame(FilteringContext *filter, AVFrame *inputFrame) {
+    OWNED_FRAME AVFrame *frame = NULL;
+    int ret;
+
+    if (inputFrame) {
+        if (!(frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        av_frame_move_ref(frame, inputFrame);
+    }
+    if ((ret = filter_strand_submit(filter->strand, TAKE_OWNERSHIP(frame))) < 0)
+        return ret;
+    return inputFrame ? 0 : filter_strand_drain(filter->strand);
+}
+
+
+static int scheduled_encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame, int streamIndex)
+{
+    FilteringContext *filter = &decoder->filters[streamIndex];
+    int ret;
+
+    if ((ret = submit_filter_frame(filter, inputFrame)) < 0)
+        return ret;
+
+    while (1) {
+        OWNED_FRAME AVFrame *frame = NULL;
+
+        if ((ret = filter_strand_receive(filter->strand, &frame)) < 0)
+            break;
+        if ((ret = adapt_encode_audio(decoder, encoder, frame, streamIndex)) < 0)
+            return ret;
+    }
+    if (ret != AVERROR(EAGAIN))
+        return ret;
+
+    return inputFrame ? 0 : adapt_encode_audio(decoder, encoder, NULL, streamIndex);
+}
+
+
 static int filter_encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame, int streamIndex)
 {
-    FilteringContext *filter = &filter_ctx[streamIndex];
+    FilteringContext *filter = &decoder->filters[streamIndex];
+    AVFrame *resampledFrame;
     int ret;
 
-    av_log(NULL, AV_LOG_INFO, "Pushing decoded frame to filters\n");
+    if (filter->strand)
+        return scheduled_encode_audio(decoder, encoder, inputFrame, streamIndex);
+
+    av_log(NULL, AV_LOG_DEBUG, "Pushing decoded frame to filters\n");
     /* push the decoded frame into the filtergraph */
     ret = av_buffersrc_add_frame_flags(filter->buffersrcContext,
                                        inputFrame, 0);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        metrics_error(METRICS_STAGE_FILTER);
         return ret;
     }
 
     /* pull filtered frames from the filtergraph */
     while (1) {
-        av_log(NULL, AV_LOG_INFO, "Pulling filtered frame from filters\n");
+        av_log(NULL, AV_LOG_DEBUG, "Pulling filtered frame from filters\n");
+        TRACE_BEGIN("av_buffersink_get_frame", "audio");
         ret = av_buffersink_get_frame(filter->buffersinkContext,
                                       filter->filteredFrame);
+        TRACE_END("av_buffersink_get_frame", "audio");
         if (ret < 0) {
             /* if no more frames for output - returns AVERROR(EAGAIN)
              * if flushed and no more frames for output - returns AVERROR_EOF
@@ -427,146 +816,566 @@ static int filter_encode_audio(StreamingContext *decoder, StreamingContext *enco
         }
 
         filter->filteredFrame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret = encode_audio(decoder, encoder, inputFrame, streamIndex, 0);
+        ret = audio_resampler_convert(filter->resampler, filter->filteredFrame, &resampledFrame);
         av_frame_unref(filter->filteredFrame);
         if (ret < 0)
             break;
+        if (resampledFrame && (ret = adapt_encode_audio(decoder, encoder, resampledFrame, streamIndex)) < 0)
+            break;
+    }
+
+    /* At the end of the stream drain what the resampler's filter and the FIFO still hold. */
+    if (!inputFrame && ret >= 0) {
+        ret = audio_resampler_convert(filter->resampler, NULL, &resampledFrame);
+        if (ret >= 0 && resampledFrame)
+            ret = adapt_encode_audio(decoder, encoder, resampledFrame, streamIndex);
+        if (ret >= 0)
+            ret = adapt_encode_audio(decoder, encoder, NULL, streamIndex);
     }
 
     return ret;
 }
 
 
-int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
-    av_log(NULL, AV_LOG_INFO, "Audio Transcode Func\n");
-
-    int response = avcodec_send_packet(decoder->audioCodecContext, inputPacket);
-    if (response < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while sending audio packet to decoder: %s", av_err2str(response));
-        return response;
-    }
-
-    while (response >= 0) {
-        response = avcodec_receive_frame(decoder->audioCodecContext, inputFrame);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            break;
-
-        } else if (response < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Error while receiving audio frame from decoder: %s", av_err2str(response));
-            return response;
-        }
+/* The converter writes into a frame of its own for each output, as the encoder may still hold the previous one. */
+static int output_converted_video(FilteringContext *filter, FilterStrand *strand) {
+    OWNED_FRAME AVFrame *converted = av_frame_alloc();
+    int ret;
 
-        if (response >= 0) {
-            if (filter_encode_audio(decoder, encoder, inputFrame, inputPacket->stream_index)) {
-                return -1;
-            }
-        }
-        av_frame_unref(inputFrame);
+    if (!converted)
+        return AVERROR(ENOMEM);
+    converted->width = filter->convertedFrame->width;
+    converted->height = filter->convertedFrame->height;
+    converted->format = filter->convertedFrame->format;
+    if ((ret = av_frame_get_buffer(converted, 0)) < 0 ||
+        (ret = pixel_converter_convert(filter->pixelConverter, converted, filter->filteredFrame)) < 0 ||
+        (ret = av_frame_copy_props(converted, filter->filteredFrame)) < 0 ||
+        (ret = filter_strand_output(strand, converted)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while converting filtered video frame\n");
     }
-    return 0;
+    return ret;
 }
 
 
-int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
-    int response = avcodec_send_packet(decoder->videoCodecContext, inputPacket);
-    if (response < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while sending video packet to decoder: %s", av_err2str(response));
-        return response;
-    }
+/* Runs on a filter worker: one decoded video frame, or the flush, through the filter graph and the pixel converter. */
+static int filter_video_task(void *opaque, AVFrame *inputFrame, FilterStrand *strand) {
+    FilteringContext *filter = opaque;
+    int ret;
 
-    while (response >= 0) {
-        response = avcodec_receive_frame(decoder->videoCodecContext, inputFrame);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            break;
-        } else if (response < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Error while receiving video frame from decoder: %s", av_err2str(response));
-            return response;
-        }
+    if ((ret = av_buffersrc_add_frame_flags(filter->buffersrcContext, inputFrame, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the video filtergraph\n");
+        metrics_error(METRICS_STAGE_FILTER);
+        return ret;
+    }
 
-        if (response >= 0) {
-            if (encode_video(decoder, encoder, inputFrame)) {
-                return -1;
-            }
-        }
-        av_frame_unref(inputFrame);
+    while ((ret = av_buffersink_get_frame(filter->buffersinkContext, filter->filteredFrame)) >= 0) {
+        filter->filteredFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        if (filter->pixelConverter)
+            ret = output_converted_video(filter, strand);
+        else
+            ret = filter_strand_output(strand, filter->filteredFrame);
+        av_frame_unref(filter->filteredFrame);
+        if (ret < 0)
+            return ret;
     }
-    return 0;
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
 }
 
 
-int init_filter(FilteringContext* filterContext, AVCodecContext *decodeContext,
-                AVCodecContext *encodeContext, const char *filterSpec)
+static int scheduled_encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame)
+{
+    FilteringContext *filter = &decoder->filters[decoder->videoIndex];
+    int ret;
+
+    if ((ret = submit_filter_frame(filter, inputFrame)) < 0)
+        return ret;
+
+    while (1) {
+        OWNED_FRAME AVFrame *frame = NULL;
+
+        if ((ret = filter_strand_receive(filter->strand, &frame)) < 0)
+            break;
+        if ((ret = encode_video(decoder, encoder, frame)) < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+
+static int filter_encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame)
+{
+    FilteringContext *filter = &decoder->filters[decoder->videoIndex];
+    int ret;
+
+    if (filter->strand)
+        return scheduled_encode_video(decoder, encoder, inputFrame);
+
+    /* push the decoded frame into the filtergraph, a NULL frame flushes it */
+    ret = av_buffersrc_add_frame_flags(filter->buffersrcContext,
+                                       inputFrame, 0);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the video filtergraph\n");
+        metrics_error(METRICS_STAGE_FILTER);
+        return ret;
+    }
+
+    /* pull filtered frames from the filtergraph */
+    while (1) {
+        TRACE_BEGIN("av_buffersink_get_frame", "video");
+        ret = av_buffersink_get_frame(filter->buffersinkContext,
+                                      filter->filteredFrame);
+        TRACE_END("av_buffersink_get_frame", "video");
+        if (ret < 0) {
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                ret = 0;
+            break;
+        }
+
+        filter->filteredFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        if (filter->pixelConverter) {
+            if ((ret = av_frame_make_writable(filter->convertedFrame)) < 0 ||
+                (ret = pixel_converter_convert(filter->pixelConverter, filter->convertedFrame, filter->filteredFrame)) < 0 ||
+                (ret = av_frame_copy_props(filter->convertedFrame, filter->filteredFrame)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Error while converting filtered video frame\n");
+                av_frame_unref(filter->filteredFrame);
+                break;
+            }
+            ret = encode_video(decoder, encoder, filter->convertedFrame);
+        } else {
+            ret = encode_video(decoder, encoder, filter->filteredFrame);
+        }
+        av_frame_unref(filter->filteredFrame);
+        if (ret < 0)
+            break;
+    }
+
+    return ret;
+}
+
+
+static int transcode_audio_track(StreamingContext *decoder, StreamingContext *encoder, int track,
+                                 AVPacket *inputPacket, AVFrame *inputFrame) {
+    AVCodecContext *audioContext = decoder->audioTrackContexts[track];
+    AVStream *audioStream = decoder->audioTracks[track];
+    int streamIndex = decoder->audioTrackIndexes[track];
+
+    av_log(NULL, AV_LOG_DEBUG, "Audio Transcode Func\n");
+
+    TRACE_BEGIN("avcodec_send_packet", "audio");
+    int response = avcodec_send_packet(audioContext, inputPacket);
+    TRACE_END("avcodec_send_packet", "audio");
+    if (response < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while sending audio packet to decoder: %s", av_err2str(response));
+        metrics_error(METRICS_STAGE_DECODE);
+        return response;
+    }
+
+    while (response >= 0) {
+        TRACE_BEGIN("avcodec_receive_frame", "audio");
+        response = avcodec_receive_frame(audioContext, inputFrame);
+        TRACE_END("avcodec_receive_frame", "audio");
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            break;
+
+        } else if (response < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while receiving audio frame from decoder: %s", av_err2str(response));
+            metrics_error(METRICS_STAGE_DECODE);
+            return response;
+        }
+        metrics_frame_decoded(streamIndex, AVMEDIA_TYPE_AUDIO);
+
+        /* When resuming, audio that ends before the checkpoint is already in the previous segments. */
+        if (decoder->resuming && inputFrame->pts != AV_NOPTS_VALUE &&
+            av_rescale_q(inputFrame->pts, audioStream->time_base, AV_TIME_BASE_Q) +
+            av_rescale(inputFrame->nb_samples, AV_TIME_BASE, inputFrame->sample_rate) <= decoder->skipBefore) {
+            av_frame_unref(inputFrame);
+            continue;
+        }
+
+        /* A chunk stops at its end time; the next chunk covers the rest. */
+        if (decoder->ranged && inputFrame->pts != AV_NOPTS_VALUE &&
+            av_rescale_q(inputFrame->pts, audioStream->time_base, AV_TIME_BASE_Q) >= decoder->rangeEnd) {
+            av_frame_unref(inputFrame);
+            continue;
+        }
+
+        if (response >= 0) {
+            if (filter_encode_audio(decoder, encoder, inputFrame, streamIndex)) {
+                return -1;
+            }
+        }
+        av_frame_unref(inputFrame);
+    }
+    return 0;
+}
+
+
+/* A packet goes to the decoder of its track, and the flush, a NULL packet, to every track's. */
+int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
+    int track;
+
+    if (inputPacket) {
+        /* Audio streams past StreamingParams.audioStreams aren't transcoded. */
+        if ((track = audio_track(decoder, inputPacket->stream_index)) < 0)
+            return 0;
+        return transcode_audio_track(decoder, encoder, track, inputPacket, inputFrame);
+    }
+
+    for (track = 0; track < decoder->nbAudioStreams; track++) {
+        int ret = transcode_audio_track(decoder, encoder, track, NULL, inputFrame);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+
+static int encode_decoded_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame) {
+    if (decoder->resuming && inputFrame->best_effort_timestamp != AV_NOPTS_VALUE &&
+        av_rescale_q(inputFrame->best_effort_timestamp, decoder->videoStream->time_base, AV_TIME_BASE_Q) < decoder->skipBefore) {
+        return 0;
+    }
+
+    if (decoder->ranged && inputFrame->best_effort_timestamp != AV_NOPTS_VALUE &&
+        av_rescale_q(inputFrame->best_effort_timestamp, decoder->videoStream->time_base, AV_TIME_BASE_Q) >= decoder->rangeEnd) {
+        return 0;
+    }
+
+    if (decoder->filters && decoder->filters[decoder->videoIndex].filterGraph) {
+        return filter_encode_video(decoder, encoder, inputFrame);
+    }
+    return encode_video(decoder, encoder, inputFrame);
+}
+
+
+/*
+ * With a frame ring the video is decoded by another process. Take the frames up to this packet's
+ * decode time from the ring instead, so video keeps pace with the audio read alongside it.
+ */
+static int consume_ring_frames(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
+    int64_t limit = INT64_MAX;
+    int64_t pts;
+    int ret;
+
+    if (inputPacket) {
+        limit = inputPacket->dts != AV_NOPTS_VALUE ? inputPacket->dts : inputPacket->pts;
+        if (limit == AV_NOPTS_VALUE)
+            return 0;
+    }
+
+    while ((ret = frame_ring_peek(decoder->frameRing, &pts)) >= 0 && (pts == AV_NOPTS_VALUE || pts <= limit)) {
+        if ((ret = frame_ring_receive(decoder->frameRing, inputFrame)) < 0)
+            break;
+        ret = encode_decoded_video(decoder, encoder, inputFrame);
+        av_frame_unref(inputFrame);
+        if (ret)
+            return -1;
+    }
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+
+int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
+    if (decoder->frameRing) {
+        return consume_ring_frames(decoder, encoder, inputPacket, inputFrame);
+    }
+
+    TRACE_BEGIN("avcodec_send_packet", "video");
+    int response = avcodec_send_packet(decoder->videoCodecContext, inputPacket);
+    TRACE_END("avcodec_send_packet", "video");
+    if (response < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while sending video packet to decoder: %s", av_err2str(response));
+        metrics_error(METRICS_STAGE_DECODE);
+        return response;
+    }
+
+    while (response >= 0) {
+        TRACE_BEGIN("avcodec_receive_frame", "video");
+        response = avcodec_receive_frame(decoder->videoCodecContext, inputFrame);
+        TRACE_END("avcodec_receive_frame", "video");
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            break;
+        } else if (response < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while receiving video frame from decoder: %s", av_err2str(response));
+            metrics_error(METRICS_STAGE_DECODE);
+            return response;
+        }
+        metrics_frame_decoded(decoder->videoIndex, AVMEDIA_TYPE_VIDEO);
+
+        if (encode_decoded_video(decoder, encoder, inputFrame)) {
+            return -1;
+        }
+        av_frame_unref(inputFrame);
+    }
+    return 0;
+}
+
+
+/* Drain the video decoder, then the filter graph and the encoder, at the end of the input. */
+int flush_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame) {
+    if (transcode_video(decoder, encoder, NULL, inputFrame))
+        return -1;
+    if (decoder->filters && decoder->filters[decoder->videoIndex].filterGraph && filter_encode_video(decoder, encoder, NULL))
+        return -1;
+    return encode_video(decoder, encoder, NULL) ? -1 : 0;
+}
+
+
+static int transcode_packet(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame) {
+    int ret = 0;
+
+    if (decoder->formatContext->streams[inputPacket->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        av_log(NULL, AV_LOG_DEBUG, "Video\n");
+        ret = transcode_video(decoder, encoder, inputPacket, inputFrame);
+    } else if (decoder->formatContext->streams[inputPacket->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        av_log(NULL, AV_LOG_DEBUG, "Audio\n");
+        ret = transcode_audio(decoder, encoder, inputPacket, inputFrame);
+    } else {
+        av_log(NULL, AV_LOG_DEBUG, "Ignoring non audio or video packet\n");
+    }
+    av_packet_unref(inputPacket);
+    return ret;
+}
+
+
+static int deferred_slot(StreamingContext *decoder, int inputIndex) {
+    enum AVMediaType type = decoder->formatContext->streams[inputIndex]->codecpar->codec_type;
+    /* Every audio track shares a queue, so packets still reach the decoders in the order they were read. */
+    return type == AVMEDIA_TYPE_VIDEO ? 0 : audio_track(decoder, inputIndex) >= 0 ? 1 : -1;
+}
+
+
+/* Whether the output a packet of this input stream ends up in is ahead; every audio track has its own. */
+static int output_running_ahead(StreamingContext *decoder, StreamingContext *encoder, int inputIndex) {
+    int track = audio_track(decoder, inputIndex);
+    AVStream *outputStream = inputIndex == decoder->videoIndex ? encoder->videoStream :
+                             track >= 0 && track < encoder->nbAudioStreams ? encoder->audioTracks[track] : NULL;
+    return outputStream && packet_interleaver_stream_ahead(encoder->interleaver, outputStream->index);
+}
+
+
+/* Feed held back packets to streams that have fallen back within budget, or all of them when forced. */
+static int drain_deferred_packets(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame,
+                                  AVFifo **deferred, int force) {
+    int ret;
+
+    for (int slot = 0; slot < 2; slot++) {
+        while (av_fifo_can_read(deferred[slot])) {
+            OWNED_PACKET AVPacket *packet = NULL;
+
+            av_fifo_peek(deferred[slot], &packet, 1, 0);
+            if (!force && av_fifo_can_read(deferred[slot]) < MAX_DEFERRED_PACKETS &&
+                output_running_ahead(decoder, encoder, packet->stream_index)) {
+                packet = NULL;
+                break;
+            }
+
+            av_fifo_read(deferred[slot], &packet, 1);
+            if (encoder->memoryBudget)
+                memory_budget_release(encoder->memoryBudget, MEMORY_QUEUES, packet->size);
+            if ((ret = transcode_packet(decoder, encoder, packet, inputFrame)))
+                return ret;
+        }
+    }
+    return 0;
+}
+
+
+static int process_input_packet(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket,
+                                AVFrame *inputFrame, AVFifo **deferred) {
+    int slot = deferred_slot(decoder, inputPacket->stream_index);
+    int hold;
+    int ret;
+
+    /*
+     * Don't feed an encoder whose output the interleaver is already waiting on others for. Holding a packet back costs
+     * memory, so one that would take the job over its budget is fed through instead, and counted as a throttle event:
+     * the budget bounds what the job queues, it doesn't slow the input down.
+     */
+    hold = slot >= 0 && encoder->interleaver && av_fifo_can_read(deferred[slot]) < MAX_DEFERRED_PACKETS &&
+           (av_fifo_can_read(deferred[slot]) || output_running_ahead(decoder, encoder, inputPacket->stream_index));
+    if (hold && encoder->memoryBudget && memory_budget_available(encoder->memoryBudget) < inputPacket->size) {
+        encoder->memoryBudget->throttleEvents++;
+        hold = 0;
+    }
+
+    if (hold) {
+        OWNED_PACKET AVPacket *held = av_packet_alloc();
+        if (!held)
+            return AVERROR(ENOMEM);
+        av_packet_move_ref(held, inputPacket);
+        if ((ret = av_fifo_write(deferred[slot], &held, 1)) < 0)
+            return ret;
+        if (encoder->memoryBudget)
+            memory_budget_charge(encoder->memoryBudget, MEMORY_QUEUES, held->size);
+        /* The queue owns it now. */
+        held = NULL;
+    } else if ((ret = transcode_packet(decoder, encoder, inputPacket, inputFrame))) {
+        return ret;
+    }
+
+    return drain_deferred_packets(decoder, encoder, inputFrame, deferred, 0);
+}
+
+
+/* Feed silence over a stretch of the timeline with no audio, so sample-counted audio timestamps stay level with video. */
+static int fill_audio_gap(StreamingContext *decoder, StreamingContext *encoder, int64_t start, int64_t duration) {
+    AVCodecContext *audioContext = decoder->audioCodecContext;
+    int64_t remaining = av_rescale(duration, audioContext->sample_rate, AV_TIME_BASE);
+    int64_t pts = av_rescale_q(start, AV_TIME_BASE_Q, decoder->audioStream->time_base);
+    OWNED_FRAME AVFrame *silence = av_frame_alloc();
+    int ret = 0;
+
+    if (!silence) {
+        return AVERROR(ENOMEM);
+    }
+
+    while (remaining > 0) {
+        silence->nb_samples = FFMIN(remaining, 1024);
+        silence->format = audioContext->sample_fmt;
+        silence->sample_rate = audioContext->sample_rate;
+        if ((ret = av_channel_layout_copy(&silence->ch_layout, &audioContext->ch_layout)) < 0 ||
+            (ret = av_frame_get_buffer(silence, 0)) < 0) {
+            break;
+        }
+        av_samples_set_silence(silence->extended_data, 0, silence->nb_samples,
+                               silence->ch_layout.nb_channels, silence->format);
+        silence->pts = pts;
+
+        remaining -= silence->nb_samples;
+        pts += av_rescale_q(silence->nb_samples, (AVRational){1, audioContext->sample_rate}, decoder->audioStream->time_base);
+        if ((ret = filter_encode_audio(decoder, encoder, silence, decoder->audioIndex))) {
+            break;
+        }
+        av_frame_unref(silence);
+    }
+    return ret;
+}
+
+
+/* Hand everything read from the current playlist item to the decoders that are about to change, then switch inputs. */
+static int advance_playlist(StreamingContext *decoder, StreamingContext *encoder, Playlist *playlist,
+                            AVFrame *inputFrame, AVFifo **deferred) {
+    int64_t gap;
+
+    if (playlist_open_next(playlist, decoder) < 0) {
+        return -1;
+    }
+
+    if (drain_deferred_packets(decoder, encoder, inputFrame, deferred, 1)) {
+        return -1;
+    }
+    if (playlist->reopenVideo && transcode_video(decoder, encoder, NULL, inputFrame)) {
+        return -1;
+    }
+    if (playlist->reopenAudio && transcode_audio(decoder, encoder, NULL, inputFrame)) {
+        return -1;
+    }
+
+    if (decoder->audioCodecContext && (gap = playlist_audio_gap(playlist)) > 0 &&
+        fill_audio_gap(decoder, encoder, playlist->audioEnd, gap)) {
+        return -1;
+    }
+
+    return playlist_switch(playlist, decoder) < 0 ? -1 : 0;
+}
+
+
+int init_filter(FilteringContext* filterContext, AVCodecContext *decodeContext,
+                AVCodecContext *encodeContext, const char *filterSpec, int nbThreads)
 {
     char args[512];
     int ret = 0;
+    int useConverter = 0;
+    enum AVPixelFormat sinkFormat;
     const AVFilter *buffersrc = NULL;
     const AVFilter *buffersink = NULL;
     AVFilterContext *buffersrcContext = NULL;
     AVFilterContext *buffersinkContext = NULL;
-    AVFilterInOut *filterOutputs = avfilter_inout_alloc();
-    AVFilterInOut *filterInputs  = avfilter_inout_alloc();
-    AVFilterGraph *filterGraph = avfilter_graph_alloc();
+    OWNED_FILTER_INOUT AVFilterInOut *filterOutputs = avfilter_inout_alloc();
+    OWNED_FILTER_INOUT AVFilterInOut *filterInputs  = avfilter_inout_alloc();
+    OWNED_FILTER_GRAPH AVFilterGraph *filterGraph = avfilter_graph_alloc();
 
     if (!filterOutputs || !filterInputs || !filterGraph) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    if (decodeContext->codec_type == AVMEDIA_TYPE_AUDIO) {
-        char buf[64];
-        buffersrc = avfilter_get_by_name("abuffer");
-        buffersink = avfilter_get_by_name("abuffersink");
+    /* Slice threaded filters (bwdif, yadif, scale) split each frame across these threads. */
+    filterGraph->thread_type = AVFILTER_THREAD_SLICE;
+    filterGraph->nb_threads = nbThreads;
+
+    if (decodeContext->codec_type == AVMEDIA_TYPE_VIDEO) {
+        buffersrc = avfilter_get_by_name("buffer");
+        buffersink = avfilter_get_by_name("buffersink");
         if (!buffersrc || !buffersink) {
             av_log(NULL, AV_LOG_ERROR, "filtering source or sink element not found\n");
             ret = AVERROR_UNKNOWN;
             goto end;
         }
 
-        if (decodeContext->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
-            av_channel_layout_default(&decodeContext->ch_layout, decodeContext->ch_layout.nb_channels);
-        av_channel_layout_describe(&decodeContext->ch_layout, buf, sizeof(buf));
         snprintf(args, sizeof(args),
-                 "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
-                 decodeContext->time_base.num, decodeContext->time_base.den, decodeContext->sample_rate,
-                 av_get_sample_fmt_name(decodeContext->sample_fmt),
-                 buf);
+                 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                 decodeContext->width, decodeContext->height, decodeContext->pix_fmt,
+                 decodeContext->pkt_timebase.num, decodeContext->pkt_timebase.den,
+                 decodeContext->sample_aspect_ratio.num, FFMAX(decodeContext->sample_aspect_ratio.den, 1));
         ret = avfilter_graph_create_filter(&buffersrcContext, buffersrc, "in",
                                            args, NULL, filterGraph);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
             goto end;
         }
 
         ret = avfilter_graph_create_filter(&buffersinkContext, buffersink, "out",
                                            NULL, NULL, filterGraph);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer sink\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
             goto end;
         }
 
-        ret = av_opt_set_bin(buffersinkContext, "sample_fmts",
-                             (uint8_t*)&encodeContext->sample_fmt, sizeof(encodeContext->sample_fmt),
+        /* Pairs the conversion stage handles leave the graph in the decoder's format. */
+        useConverter = pixel_converter_supported(decodeContext->pix_fmt, decodeContext->color_range, encodeContext->pix_fmt);
+        sinkFormat = useConverter ? decodeContext->pix_fmt : encodeContext->pix_fmt;
+        ret = av_opt_set_bin(buffersinkContext, "pix_fmts",
+                             (uint8_t*)&sinkFormat, sizeof(sinkFormat),
                              AV_OPT_SEARCH_CHILDREN);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output sample format\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+            goto end;
+        }
+    } else if (decodeContext->codec_type == AVMEDIA_TYPE_AUDIO) {
+        char buf[64];
+        buffersrc = avfilter_get_by_name("abuffer");
+        buffersink = avfilter_get_by_name("abuffersink");
+        if (!buffersrc || !buffersink) {
+            av_log(NULL, AV_LOG_ERROR, "filtering source or sink element not found\n");
+            ret = AVERROR_UNKNOWN;
             goto end;
         }
 
-        av_channel_layout_describe(&encodeContext->ch_layout, buf, sizeof(buf));
-        ret = av_opt_set(buffersinkContext, "ch_layouts",
-                         buf, AV_OPT_SEARCH_CHILDREN);
+        if (decodeContext->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+            av_channel_layout_default(&decodeContext->ch_layout, decodeContext->ch_layout.nb_channels);
+        av_channel_layout_describe(&decodeContext->ch_layout, buf, sizeof(buf));
+        snprintf(args, sizeof(args),
+                 "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+                 decodeContext->pkt_timebase.num, decodeContext->pkt_timebase.den, decodeContext->sample_rate,
+                 av_get_sample_fmt_name(decodeContext->sample_fmt),
+                 buf);
+        ret = avfilter_graph_create_filter(&buffersrcContext, buffersrc, "in",
+                                           args, NULL, filterGraph);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output channel layout\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
             goto end;
         }
 
-        ret = av_opt_set_bin(buffersinkContext, "sample_rates",
-                             (uint8_t*)&encodeContext->sample_rate, sizeof(encodeContext->sample_rate),
-                             AV_OPT_SEARCH_CHILDREN);
+        ret = avfilter_graph_create_filter(&buffersinkContext, buffersink, "out",
+                                           NULL, NULL, filterGraph);
         if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output sample rate\n");
+            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer sink\n");
             goto end;
         }
+
+        /* The sink is left unconstrained; rate, format and layout conversion happen in the resampling stage. */
     } else {
         ret = AVERROR_UNKNOWN;
         goto end;
@@ -595,111 +1404,550 @@ int init_filter(FilteringContext* filterContext, AVCodecContext *decodeContext,
     if ((ret = avfilter_graph_config(filterGraph, NULL)) < 0)
         goto end;
 
+    if (useConverter) {
+        filterContext->pixelConverter = av_mallocz(sizeof(*filterContext->pixelConverter));
+        filterContext->convertedFrame = av_frame_alloc();
+        if (!filterContext->pixelConverter || !filterContext->convertedFrame) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+
+        if ((ret = pixel_converter_init(filterContext->pixelConverter, decodeContext->width, decodeContext->height,
+                                        decodeContext->pix_fmt, decodeContext->color_range, encodeContext->pix_fmt,
+                                        PIXEL_CONVERT_KERNEL_AUTO)) < 0)
+            goto end;
+
+        filterContext->convertedFrame->width = decodeContext->width;
+        filterContext->convertedFrame->height = decodeContext->height;
+        filterContext->convertedFrame->format = encodeContext->pix_fmt;
+        if ((ret = av_frame_get_buffer(filterContext->convertedFrame, 0)) < 0)
+            goto end;
+
+        av_log(NULL, AV_LOG_INFO, "Converting %s to %s with the %s kernel\n",
+               av_get_pix_fmt_name(decodeContext->pix_fmt), av_get_pix_fmt_name(encodeContext->pix_fmt),
+               pixel_convert_kernel_name(filterContext->pixelConverter->kernel));
+    }
+
     /* Fill FilteringContext */
     filterContext->buffersrcContext = buffersrcContext;
     filterContext->buffersinkContext = buffersinkContext;
-    filterContext->filterGraph = filterGraph;
+    filterContext->filterGraph = TAKE_OWNERSHIP(filterGraph);
 
     end:
-    avfilter_inout_free(&filterInputs);
-    avfilter_inout_free(&filterOutputs);
-
     return ret;
 }
 
-int init_filters(AVFormatContext *inputFormatContext, StreamingContext *decoder, StreamingContext *encoder) {
+int init_filters(AVFormatContext *inputFormatContext, StreamingContext *decoder, StreamingContext *encoder, StreamingParams *streamParameters) {
+    char videoFilterSpec[256];
     const char *filter_spec;
     unsigned int i;
+    int track;
     int ret;
-    filter_ctx = av_malloc_array(inputFormatContext->nb_streams, sizeof(*filter_ctx));
-    if (!filter_ctx)
+    decoder->filters = av_calloc(inputFormatContext->nb_streams, sizeof(*decoder->filters));
+    if (!decoder->filters)
         return AVERROR(ENOMEM);
+    decoder->nbFilters = inputFormatContext->nb_streams;
 
     for (i = 0; i < inputFormatContext->nb_streams; i++) {
-        filter_ctx[i].buffersrcContext  = NULL;
-        filter_ctx[i].buffersinkContext = NULL;
-        filter_ctx[i].filterGraph   = NULL;
+        decoder->filters[i].buffersrcContext  = NULL;
+        decoder->filters[i].buffersinkContext = NULL;
+        decoder->filters[i].filterGraph   = NULL;
+        decoder->filters[i].pixelConverter = NULL;
+        decoder->filters[i].convertedFrame = NULL;
+        decoder->filters[i].resampler = NULL;
+        decoder->filters[i].frameAdapter = NULL;
+        decoder->filters[i].strand = NULL;
         if (!(inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO
               || inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO))
             continue;
+        /* Audio streams past the encoder's tracks aren't transcoded, and the first pass of a two pass encode has none. */
+        track = audio_track(decoder, i);
+        if (inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
+            (track < 0 || track >= encoder->nbAudioStreams))
+            continue;
 
 
-        if (inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-            av_log(NULL, AV_LOG_INFO, "One\n");
-        filter_spec = "anull"; /* passthrough (dummy) filter for audio */
-        av_log(NULL, AV_LOG_INFO, "Two\n");
-        ret = init_filter(&filter_ctx[i], decoder->audioCodecContext,
-                          encoder->audioCodecContext, filter_spec);
+        if (inputFormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (i != decoder->videoIndex)
+                continue;
+            build_video_filter_spec(decoder->fieldOrder, encoder->fieldOrder, streamParameters->deinterlacer,
+                                    videoFilterSpec, sizeof(videoFilterSpec));
+            av_log(NULL, AV_LOG_INFO, "Video filter for stream #%u: %s\n", i, videoFilterSpec);
+            ret = init_filter(&decoder->filters[i], decoder->videoCodecContext,
+                              encoder->videoCodecContext, videoFilterSpec, streamParameters->filterThreads);
+        } else {
+            filter_spec = "anull"; /* passthrough (dummy) filter for audio */
+            ret = init_filter(&decoder->filters[i], decoder->audioTrackContexts[track],
+                              encoder->audioTrackContexts[track], filter_spec, streamParameters->filterThreads);
+            if (ret)
+                return ret;
+
+            decoder->filters[i].resampler = av_mallocz(sizeof(*decoder->filters[i].resampler));
+            if (!decoder->filters[i].resampler)
+                return AVERROR(ENOMEM);
+            ret = audio_resampler_init(decoder->filters[i].resampler, encoder->audioTrackContexts[track],
+                                       decoder->audioTrackContexts[track]->pkt_timebase, streamParameters->resampleQuality);
+            if (ret)
+                return ret;
+
+            decoder->filters[i].frameAdapter = av_mallocz(sizeof(*decoder->filters[i].frameAdapter));
+            if (!decoder->filters[i].frameAdapter)
+                return AVERROR(ENOMEM);
+            ret = audio_frame_adapter_init(decoder->filters[i].frameAdapter, encoder->audioTrackContexts[track]);
+        }
         if (ret)
             return ret;
 
-        filter_ctx[i].encodePacket = av_packet_alloc();
-        if (!filter_ctx[i].encodePacket)
+        decoder->filters[i].encodePacket = av_packet_alloc();
+        if (!decoder->filters[i].encodePacket)
             return AVERROR(ENOMEM);
 
-        filter_ctx[i].filteredFrame = av_frame_alloc();
-        if (!filter_ctx[i].filteredFrame)
+        decoder->filters[i].filteredFrame = av_frame_alloc();
+        if (!decoder->filters[i].filteredFrame)
             return AVERROR(ENOMEM);
     }
     return 0;
 }
 
 
-int main(int argc, char **argv) {
-
-    StreamingParams testParameters = {0};
-
-    testParameters.copyAudio = 0;
-    testParameters.copyVideo = 0;
-    testParameters.videoCodec = AV_CODEC_ID_H264;
-    testParameters.audioCodec = AV_CODEC_ID_PCM_S16LE;
-    testParameters.audioStreams = 1;
-    testParameters.audioChannels = 8;
-    testParameters.audioSampleRate = 48000;
-    testParameters.audioOutputBitRate = 160000;
-    testParameters.audioOutputChannelLayout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO_DOWNMIX;
-    testParameters.audioSampleFormat = AV_SAMPLE_FMT_S16;
-    testParameters.frameWidth = 1440;
-    testParameters.frameHeight = 1080;
-    testParameters.pixelAspectRatio = (AVRational){3, 4};
-    testParameters.frameRate = (AVRational){25, 1};
-    testParameters.outputBitRate = 50000000;
-    testParameters.bitstreamBufferSize = 80000000;
-    testParameters.minBitRate = 40000000;
-    testParameters.maxBitRate = 60000000;
-    testParameters.videoPixelFormat = AV_PIX_FMT_YUV420P10LE;
-    testParameters.codecPrivKey = "x264-params";
-    testParameters.codecPrivValue = "avcintra-class=50:colorprim=bt709:transfer=bt709:colormatrix=bt709:interlaced=1:force-cfr=1:keyint=1:min-keyint=1:scenecut=0";
+/* Give every stream's filter graph its own strand on the scheduler, so different streams filter in parallel. */
+static int schedule_filters(FilterScheduler *scheduler, AVFormatContext *inputFormatContext, StreamingContext *decoder) {
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        if (!decoder->filters[i].filterGraph)
+            continue;
+
+        if (i == decoder->videoIndex)
+            decoder->filters[i].strand = filter_strand_create(scheduler, "filter_video", filter_video_task, &decoder->filters[i]);
+        else
+            decoder->filters[i].strand = filter_strand_create(scheduler, "filter_audio", filter_audio_task, &decoder->filters[i]);
+        if (!decoder->filters[i].strand)
+            return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+
+/* Free every stream's filter graph and the converters and buffers hanging off it. */
+void free_filters(StreamingContext *decoder) {
+    for (int i = 0; i < decoder->nbFilters; i++) {
+        FilteringContext *filter = &decoder->filters[i];
+        avfilter_graph_free(&filter->filterGraph);
+        av_packet_free(&filter->encodePacket);
+        av_frame_free(&filter->filteredFrame);
+        av_frame_free(&filter->convertedFrame);
+        if (filter->pixelConverter) {
+            pixel_converter_uninit(filter->pixelConverter);
+            av_freep(&filter->pixelConverter);
+        }
+        if (filter->resampler) {
+            audio_resampler_uninit(filter->resampler);
+            av_freep(&filter->resampler);
+        }
+        if (filter->frameAdapter) {
+            audio_frame_adapter_uninit(filter->frameAdapter);
+            av_freep(&filter->frameAdapter);
+        }
+    }
+    av_freep(&decoder->filters);
+    decoder->nbFilters = 0;
+}
+
+
+void testbed_default_params(StreamingParams *params) {
+    memset(params, 0, sizeof(*params));
+
+    params->copyAudio = 0;
+    params->copyVideo = 0;
+    params->videoCodec = AV_CODEC_ID_H264;
+    params->audioCodec = AV_CODEC_ID_PCM_S16LE;
+    params->audioStreams = 1;
+    params->audioChannels = 8;
+    params->audioSampleRate = 48000;
+    params->audioOutputBitRate = 160000;
+    params->audioOutputChannelLayout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO_DOWNMIX;
+    params->audioSampleFormat = AV_SAMPLE_FMT_S16;
+    params->frameWidth = 1440;
+    params->frameHeight = 1080;
+    params->pixelAspectRatio = (AVRational){3, 4};
+    params->frameRate = (AVRational){25, 1};
+    params->outputBitRate = 50000000;
+    params->videoCrf = 0;
+    params->bitstreamBufferSize = 80000000;
+    params->minBitRate = 40000000;
+    params->maxBitRate = 60000000;
+    params->videoPixelFormat = AV_PIX_FMT_YUV420P10LE;
+    params->codecPrivKey = "x264-params";
+    params->codecPrivValue = "avcintra-class=50:colorprim=bt709:transfer=bt709:colormatrix=bt709:interlaced=1:force-cfr=1:keyint=1:min-keyint=1:scenecut=0";
+    params->videoPreset = "fast";
+    params->twoPass = 0;
+    params->statsCacheDir = "first_pass_cache";
+    params->perTitleBitrate = 0;
+    params->complexitySegments = 8;
+    params->complexitySegmentFrames = 12;
+    params->outputFieldOrder = AV_FIELD_UNKNOWN;
+    params->deinterlacer = "bwdif";
+    params->filterThreads = 0;
+    params->fieldOrderSampleFrames = 32;
+    params->resampleQuality = RESAMPLE_QUALITY_STANDARD;
+    params->maxInterleaveDelta = 10000000;
+    params->interleaveBufferSize = 64 * 1024 * 1024;
+    params->jobMemoryLimit = 0;
+    params->hostMemoryLimit = 0;
+    params->admissionLedger = (char *) admission_default_ledger();
+    params->admissionMaxWait = ADMISSION_DEFAULT_MAX_WAIT;
+    params->numaNode = -1;
+    params->traceFile = NULL;
+    params->traceCapacity = 1 << 20;
+    params->checkpointInterval = 0;
+    params->coordinatorAddress = "127.0.0.1";
+    params->coordinatorPort = 9870;
+    params->chunkSeconds = 60;
+    params->localWorkers = 2;
+    params->chunkRetries = 3;
+    params->chunkStart = AV_NOPTS_VALUE;
+    params->chunkEnd = AV_NOPTS_VALUE;
+    params->frameRing = NULL;
+    params->frameRingSlots = 32;
+    params->frameRingConsumers = 1;
+    params->frameRingConsumerWait = 60;
+    params->targetFps = 0;
+    params->speedMetricsFile = NULL;
+    params->sweepFrames = 300;
+    params->playlist = NULL;
+    params->overlayAsset = NULL;
+    params->overlayX = 64;
+    params->overlayY = 64;
+    params->overlayPremultiplied = 1;
+    params->filterWorkers = 0;
+    params->schedulerStatsFile = NULL;
+    params->overlapStartup = 0;
+    params->startupProfileFile = NULL;
+    params->daemonSocket = "/tmp/ffmpeg_testbed.sock";
+    params->daemonWorkers = 4;
+    params->daemonProgressInterval = 1000;
+    params->jobPriority = TESTBED_PRIORITY_NORMAL;
+    params->daemonJobSlots = 2;
+    params->progressBoard = NULL;
+    params->progressBoardSlots = 256;
+    params->progressFile = NULL;
+    params->progressInterval = 500;
+    params->metricsAddress = "127.0.0.1";
+    params->metricsPort = 0;
+}
+
+
+struct TestbedJob {
+    StreamingParams params;
+    char *inputFilename;
+    char *outputFilename;
+    pthread_t thread;
+    int threaded;
+    atomic_int state;
+    atomic_int cancelled;
+    int result;
+    atomic_int_fast64_t packetsRead;
+    atomic_int_fast64_t position;
+    atomic_int_fast64_t duration;
+    atomic_int_fast64_t startTime;
+    atomic_int_fast64_t endTime;
+    pthread_mutex_t pauseLock;
+    pthread_cond_t pauseCond;
+    atomic_int paused;
+    atomic_int_fast64_t pausedTime;
+};
+
+
+/*
+ * Hold the job at a packet boundary for as long as it is paused, with its codecs and filters left open. Its admission
+ * reservation, when it has one, is marked paused meanwhile, so the job that preempted it can be admitted.
+ */
+static int wait_while_paused(TestbedJob *job, const char *ledgerPath, int64_t admissionToken, int64_t reservedBytes) {
+    int64_t start;
+
+    if (!atomic_load(&job->paused))
+        return 0;
+
+    start = av_gettime_relative();
+    av_log(NULL, AV_LOG_INFO, "Job paused after %" PRId64 " packets\n", atomic_load(&job->packetsRead));
+    if (ledgerPath)
+        admission_set_paused(ledgerPath, admissionToken, reservedBytes, 1);
+    pthread_mutex_lock(&job->pauseLock);
+    while (atomic_load(&job->paused) && !atomic_load(&job->cancelled))
+        pthread_cond_wait(&job->pauseCond, &job->pauseLock);
+    pthread_mutex_unlock(&job->pauseLock);
+    if (ledgerPath)
+        admission_set_paused(ledgerPath, admissionToken, reservedBytes, 0);
+    atomic_fetch_add(&job->pausedTime, av_gettime_relative() - start);
+    return 1;
+}
+
+
+/* Stream probing on its own thread, so an overlapped start can open the encoders while it reads ahead. */
+typedef struct StreamProbe {
+    AVFormatContext *formatContext;
+    StartupProfile *profile;
+    pthread_t thread;
+    int ret;
+} StreamProbe;
+
+static void *probe_streams(void *opaque) {
+    StreamProbe *probe = opaque;
+
+    probe->ret = avformat_find_stream_info(probe->formatContext, NULL);
+    startup_profile_end(probe->profile, STARTUP_PROBE);
+    return NULL;
+}
+
+
+/* The encoders can only open before the probe finishes when nothing they are configured from comes from the input. */
+static int can_overlap_startup(const StreamingParams *streamParameters) {
+    const char *reason = NULL;
+
+    if (streamParameters->playlist)
+        reason = "playlists";
+    else if (streamParameters->checkpointInterval > 0)
+        reason = "checkpointing";
+    else if (streamParameters->twoPass)
+        reason = "two pass encodes";
+    else if (streamParameters->perTitleBitrate)
+        reason = "per-title bitrates";
+    else if (streamParameters->audioStreams > 1)
+        reason = "more than one audio track, which are only known once the input is probed";
+    else if (streamParameters->outputFieldOrder == AV_FIELD_UNKNOWN)
+        reason = "an output field order that follows the input";
+
+    if (reason)
+        av_log(NULL, AV_LOG_WARNING, "Overlapped startup is off for %s\n", reason);
+    return !reason;
+}
 
-    StreamingParams *pParams = &testParameters;
 
+static int write_output_header(StreamingContext *encoder, StartupProfile *profile) {
     int ret;
 
-    StreamingContext *decoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
-    decoder->filename = argv[1];
+    startup_profile_begin(profile, STARTUP_HEADER_WRITE);
+    if ((ret = avformat_write_header(encoder->formatContext, NULL)) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "An error occurred while opening output file\n");
+        return ret;
+    }
+    startup_profile_end(profile, STARTUP_HEADER_WRITE);
+    return 0;
+}
+
+
+/* Transcode one input to one output. Everything the job allocates hangs off its locals, so jobs can run side by side. */
+static int run_job(TestbedJob *job) {
+    StreamingParams testParameters = job->params;
+    StreamingParams *pParams = &testParameters;
+    StreamingContext *decoder = NULL;
+    StreamingContext *encoder = NULL;
+    NumaPlacement numaPlacement = { .node = -1 };
+    Playlist playlist = {0};
+    FrameRing frameRing;
+    Checkpoint checkpoint;
+    SpeedController speedController;
+    GraphicsOverlay overlay;
+    MemoryBudget memoryBudget;
+    int64_t memoryEstimate[MEMORY_CATEGORIES];
+    int64_t projectedMemory;
+    int admitted = 0;
+    int64_t admissionToken = 0;
+    AVDictionary *muxerOps = NULL;
+    int headerWritten = 0;
+    /* An overlapped start's header, written before the job was admitted. */
+    int provisionalOutput = 0;
+    FilterScheduler filterScheduler;
+    int scheduling = 0;
+    PacketInterleaver interleaver = {0};
+    AVFifo *deferredPackets[2] = { NULL, NULL };
+    OWNED_FRAME AVFrame *inputFrame = NULL;
+    OWNED_PACKET AVPacket *inputPacket = NULL;
+    AVRational input_framerate;
+    FieldOrderInfo fieldOrderInfo;
+    StartupProfile startupProfile;
+    StreamProbe probe = {0};
+    int probing = 0;
+    ProgressReporter progress;
+    ProgressSample progressSample;
+    int ret;
+
+    /* Before anything opens a codec, so every thread the job starts inherits the placement. The thread is the job's own. */
+    if (testParameters.numaNode >= 0 && numa_bind_job(&numaPlacement, testParameters.numaNode) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to bind the job to NUMA node %d\n", testParameters.numaNode);
+        return -1;
+    }
+
+    metrics_add(METRICS_JOBS_STARTED, 1);
+    metrics_add(METRICS_JOBS_RUNNING, 1);
+
+    if ((ret = progress_reporter_init(&progress, pParams, job->inputFilename, &numaPlacement)) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to start progress reporting\n");
+        goto end;
+    }
+
+    decoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
+    encoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
+    if (!decoder || !encoder) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    decoder->filename = job->inputFilename;
+    encoder->filename = job->outputFilename;
 
-    StreamingContext *encoder = (StreamingContext*) calloc(1, sizeof(StreamingContext));
-    encoder->filename = argv[2];
+    if (testParameters.playlist) {
+        if (playlist_load(&playlist, testParameters.playlist) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to load playlist %s\n", testParameters.playlist);
+            ret = -1;
+            goto end;
+        }
+        decoder->filename = playlist.items[0];
+        if (testParameters.checkpointInterval > 0) {
+            av_log(NULL, AV_LOG_WARNING, "Checkpointing is off for playlists, which can't be resumed by seeking\n");
+            testParameters.checkpointInterval = 0;
+        }
+        if (testParameters.audioStreams > 1) {
+            av_log(NULL, AV_LOG_WARNING, "Playlists carry one audio track, from each item's best audio stream\n");
+            testParameters.audioStreams = 1;
+        }
+    }
 
-    if (testParameters.outputExtension) {
-        strcat(encoder->filename, &testParameters.outputExtension);
+    /* The second pass reads its stats from the start, and a resumed job would start mid-stream. */
+    if (testParameters.twoPass && testParameters.checkpointInterval > 0) {
+        av_log(NULL, AV_LOG_WARNING, "Checkpointing is off for two-pass jobs, which can't be resumed part way\n");
+        testParameters.checkpointInterval = 0;
+    }
+    if (testParameters.twoPass && testParameters.chunkStart != AV_NOPTS_VALUE) {
+        av_log(NULL, AV_LOG_FATAL, "Two-pass encodes can't run as chunks: pass 1 covers the whole input\n");
+        ret = -1;
+        goto end;
     }
 
-    open_media(&decoder->formatContext, decoder->filename);
+    startup_profile_init(&startupProfile);
+    startupProfile.overlapped = testParameters.overlapStartup && can_overlap_startup(pParams);
+
+    startup_profile_begin(&startupProfile, STARTUP_PROBE);
+    if (startupProfile.overlapped) {
+        if ((ret = open_input_header(&decoder->formatContext, decoder->filename)) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to open %s\n", decoder->filename);
+            goto end;
+        }
+        probe.formatContext = decoder->formatContext;
+        probe.profile = &startupProfile;
+        if (pthread_create(&probe.thread, NULL, probe_streams, &probe) != 0) {
+            av_log(NULL, AV_LOG_FATAL, "Could not start the stream probe\n");
+            ret = AVERROR(EAGAIN);
+            goto end;
+        }
+        probing = 1;
+    } else {
+        if ((ret = open_media(&decoder->formatContext, decoder->filename)) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to open %s\n", decoder->filename);
+            goto end;
+        }
+        startup_profile_end(&startupProfile, STARTUP_PROBE);
+        if (decoder->formatContext->duration != AV_NOPTS_VALUE)
+            atomic_store(&job->duration, decoder->formatContext->duration);
+
+        startup_profile_begin(&startupProfile, STARTUP_DECODER_OPEN);
+        if ((ret = prepare_decoder(decoder)) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to prepare the decoders\n");
+            goto end;
+        }
+        startup_profile_end(&startupProfile, STARTUP_DECODER_OPEN);
+    }
 
-    prepare_decoder(decoder);
+    if (testParameters.frameRing) {
+        if (frame_ring_open(&frameRing, testParameters.frameRing) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to attach to frame ring %s\n", testParameters.frameRing);
+            ret = -1;
+            goto end;
+        }
+        decoder->frameRing = &frameRing;
+    }
 
-    avformat_alloc_output_context2(&encoder->formatContext, NULL, NULL, encoder->filename);
+    if (testParameters.checkpointInterval > 0) {
+        char segmentName[1100];
+        if (checkpoint_init(&checkpoint, decoder, pParams, encoder->filename) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to set up checkpointing\n");
+            ret = -1;
+            goto end;
+        }
+        checkpoint_segment_name(&checkpoint, checkpoint.segmentIndex, segmentName, sizeof(segmentName));
+        avformat_alloc_output_context2(&encoder->formatContext, NULL, CHECKPOINT_SEGMENT_FORMAT, segmentName);
+        encoder->checkpoint = &checkpoint;
+    } else {
+        avformat_alloc_output_context2(&encoder->formatContext, NULL, NULL, encoder->filename);
+    }
     if (!encoder->formatContext) {
         av_log(NULL, AV_LOG_FATAL, "Couldn't allocate memory for output format context\n");
-        return AVERROR(ENOMEM);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* An overlapped start only opens encoders that don't depend on the input: the output field order is fixed. */
+    if (startupProfile.overlapped) {
+        input_framerate = testParameters.frameRate;
+        encoder->fieldOrder = testParameters.outputFieldOrder;
+    } else {
+        input_framerate = av_guess_frame_rate(decoder->formatContext, decoder->videoStream, NULL);
+        startup_profile_begin(&startupProfile, STARTUP_FIELD_ORDER);
+        if ((ret = detect_field_order(decoder, testParameters.fieldOrderSampleFrames, &fieldOrderInfo)) < 0) {
+            goto end;
+        }
+        startup_profile_end(&startupProfile, STARTUP_FIELD_ORDER);
+        decoder->fieldOrder = fieldOrderInfo.fieldOrder;
+        encoder->fieldOrder = testParameters.outputFieldOrder != AV_FIELD_UNKNOWN ? testParameters.outputFieldOrder : decoder->fieldOrder;
     }
 
-    AVRational input_framerate = av_guess_frame_rate(decoder->formatContext, decoder->videoStream, NULL);
+    if (testParameters.perTitleBitrate) {
+        ComplexityResult complexity;
+        if (analyse_complexity(decoder->filename, pParams, &complexity) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Complexity analysis failed\n");
+            ret = -1;
+            goto end;
+        }
+        apply_complexity_result(pParams, &complexity);
+    }
+    /* Before the first pass, which blends it in as well. */
+    if (testParameters.overlayAsset) {
+        if (graphics_overlay_load(&overlay, testParameters.overlayAsset, testParameters.overlayPremultiplied,
+                                  testParameters.overlayX, testParameters.overlayY) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to load overlay %s\n", testParameters.overlayAsset);
+            ret = -1;
+            goto end;
+        }
+        encoder->overlay = &overlay;
+    }
+    if (testParameters.twoPass && prepare_two_pass(decoder, encoder, pParams) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to prepare two pass encoding\n");
+        ret = -1;
+        goto end;
+    }
     av_log(NULL, AV_LOG_INFO, "Preparing video encoder\n");
-    prepare_video_encoder(encoder, decoder->videoCodecContext, input_framerate, testParameters);
+    startup_profile_begin(&startupProfile, STARTUP_ENCODER_OPEN);
+    if ((ret = prepare_video_encoder(encoder, decoder->videoCodecContext, input_framerate, testParameters)) < 0) {
+        goto end;
+    }
+    encoder->streamParameters = pParams;
+
+    if (testParameters.targetFps > 0) {
+        if (encoder->videoPass) {
+            av_log(NULL, AV_LOG_WARNING, "Speed control is off for two pass encodes, the passes need the same preset\n");
+        } else if (speed_controller_init(&speedController, testParameters.targetFps, testParameters.videoPreset,
+                                         testParameters.speedMetricsFile) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to set up speed control\n");
+            ret = -1;
+            goto end;
+        } else {
+            encoder->speedController = &speedController;
+        }
+    }
+
     av_log(NULL, AV_LOG_INFO, "Preparing audio encoder\n");
-    prepare_audio_encoder(encoder, decoder, pParams);
+    if ((ret = prepare_audio_encoder(encoder, decoder, pParams)) < 0) {
+        goto end;
+    }
+    startup_profile_end(&startupProfile, STARTUP_ENCODER_OPEN);
     av_log(NULL, AV_LOG_INFO, "Preparing flags and header");
     if (encoder->formatContext->oformat->flags & AVFMT_GLOBALHEADER) {
         encoder->formatContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
@@ -708,92 +1956,550 @@ int main(int argc, char **argv) {
     }
     av_log(NULL, AV_LOG_INFO, "Preparing more flag shit\n");
     if (!(encoder->formatContext->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&encoder->formatContext->pb, encoder->filename, AVIO_FLAG_WRITE) < 0) {
+        if (avio_open(&encoder->formatContext->pb, encoder->formatContext->url, AVIO_FLAG_WRITE) < 0) {
             av_log(NULL, AV_LOG_FATAL, "Could not open output file\n");
-            return -1;
+            ret = -1;
+            goto end;
         }
     }
 
-    AVDictionary *muxerOps = NULL;
+    /*
+     * The header goes out while the probe is still reading. Field order detection samples with the decoder, so it
+     * waits for the probe, and so does admission, since the estimate needs the decoders. Until the job is admitted
+     * the output is provisional, and removed if the job ends there.
+     */
+    if (startupProfile.overlapped) {
+        if ((ret = write_output_header(encoder, &startupProfile)) < 0) {
+            goto end;
+        }
+        headerWritten = 1;
+        provisionalOutput = !(encoder->formatContext->oformat->flags & AVFMT_NOFILE);
+
+        pthread_join(probe.thread, NULL);
+        probing = 0;
+        if ((ret = probe.ret) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Error reading input stream %s\n", decoder->filename);
+            goto end;
+        }
+        if (decoder->formatContext->duration != AV_NOPTS_VALUE)
+            atomic_store(&job->duration, decoder->formatContext->duration);
+
+        startup_profile_begin(&startupProfile, STARTUP_DECODER_OPEN);
+        if ((ret = prepare_decoder(decoder)) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to prepare the decoders\n");
+            goto end;
+        }
+        startup_profile_end(&startupProfile, STARTUP_DECODER_OPEN);
+
+        startup_profile_begin(&startupProfile, STARTUP_FIELD_ORDER);
+        if ((ret = detect_field_order(decoder, testParameters.fieldOrderSampleFrames, &fieldOrderInfo)) < 0) {
+            goto end;
+        }
+        startup_profile_end(&startupProfile, STARTUP_FIELD_ORDER);
+        decoder->fieldOrder = fieldOrderInfo.fieldOrder;
+    }
+
+    drop_extra_audio_tracks(decoder, encoder->nbAudioStreams);
+
+    projectedMemory = estimate_job_memory(decoder, encoder, pParams, memoryEstimate);
+    if (testParameters.admissionLedger) {
+        if ((ret = admission_acquire(testParameters.admissionLedger, projectedMemory, testParameters.hostMemoryLimit,
+                              testParameters.admissionMaxWait, &job->cancelled, &admissionToken)) < 0) {
+            if (ret != AVERROR_EXIT) {
+                av_log(NULL, AV_LOG_FATAL, "Job was not admitted\n");
+                ret = -1;
+            }
+            goto end;
+        }
+        admitted = 1;
+    }
+    provisionalOutput = 0;
+    memory_budget_init(&memoryBudget, testParameters.jobMemoryLimit);
+    memory_budget_charge(&memoryBudget, MEMORY_FRAMES, memoryEstimate[MEMORY_FRAMES]);
+    memory_budget_charge(&memoryBudget, MEMORY_IO, memoryEstimate[MEMORY_IO]);
+    encoder->memoryBudget = &memoryBudget;
+
     if (testParameters.muxerOptKey && testParameters.muxerOptValue) {
         av_dict_set(&muxerOps, testParameters.muxerOptKey, testParameters.muxerOptValue, 0);
     }
 
-    if (avformat_write_header(encoder->formatContext, NULL) < 0) {
-        av_log(NULL, AV_LOG_FATAL, "An error occurred while opening output file\n");
-        return -1;
+    if (!startupProfile.overlapped) {
+        if ((ret = write_output_header(encoder, &startupProfile)) < 0) {
+            goto end;
+        }
+        headerWritten = 1;
     }
+    encoder->startupProfile = &startupProfile;
 
-    AVFrame *inputFrame = av_frame_alloc();
+    inputFrame = av_frame_alloc();
     if (!inputFrame) {
         av_log(NULL, AV_LOG_FATAL, "Failed to allocate memory for AVFrame\n");
-        return AVERROR(ENOMEM);
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
 
-    ret = init_filters(decoder->formatContext, decoder, encoder);
+    ret = init_filters(decoder->formatContext, decoder, encoder, pParams);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to initialise filters: %s\n", av_err2str(ret));
+        goto end;
+    }
 
-    AVPacket *inputPacket = av_packet_alloc();
+    if (testParameters.filterWorkers > 0) {
+        if (filter_scheduler_init(&filterScheduler, testParameters.filterWorkers) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to set up the filter scheduler\n");
+            ret = -1;
+            goto end;
+        }
+        scheduling = 1;
+        if (schedule_filters(&filterScheduler, decoder->formatContext, decoder) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to set up the filter scheduler\n");
+            ret = -1;
+            goto end;
+        }
+    }
+
+    if (encoder->checkpoint && checkpoint_seek_input(encoder->checkpoint, decoder) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to resume from checkpoint\n");
+        ret = -1;
+        goto end;
+    }
+
+    if (testParameters.chunkStart != AV_NOPTS_VALUE) {
+        ret = av_seek_frame(decoder->formatContext, -1, testParameters.chunkStart, AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to seek to the chunk start: %s\n", av_err2str(ret));
+            goto end;
+        }
+        decoder->resuming = 1;
+        decoder->skipBefore = testParameters.chunkStart;
+    }
+    if (testParameters.chunkEnd != AV_NOPTS_VALUE && testParameters.chunkEnd != INT64_MAX) {
+        decoder->ranged = 1;
+        decoder->rangeEnd = testParameters.chunkEnd;
+    }
+
+    inputPacket = av_packet_alloc();
     if (!inputPacket) {
         av_log(NULL, AV_LOG_FATAL, "Failed to allocate memory for AVPacket\n");
-        return AVERROR(ENOMEM);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (packet_interleaver_init(&interleaver, encoder->formatContext, testParameters.maxInterleaveDelta,
+                                testParameters.interleaveBufferSize) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to initialise the packet interleaver\n");
+        ret = -1;
+        goto end;
+    }
+    interleaver.memoryBudget = &memoryBudget;
+    encoder->interleaver = &interleaver;
+
+    deferredPackets[0] = av_fifo_alloc2(MAX_DEFERRED_PACKETS, sizeof(AVPacket *), 0);
+    deferredPackets[1] = av_fifo_alloc2(MAX_DEFERRED_PACKETS, sizeof(AVPacket *), 0);
+    if (!deferredPackets[0] || !deferredPackets[1]) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to allocate memory for deferred packets\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
 
+    if (testParameters.playlist && playlist_start(&playlist, decoder) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to start the playlist\n");
+        ret = -1;
+        goto end;
+    }
 
+    while (1) {
+        /* Time spent paused isn't encoding time, so the speed controller starts a new window. */
+        if (atomic_load(&job->paused)) {
+            progress_reporter_pause(&progress, 1);
+            if (wait_while_paused(job, admitted ? testParameters.admissionLedger : NULL, admissionToken, projectedMemory) &&
+                encoder->speedController) {
+                speed_controller_restart_window(encoder->speedController);
+            }
+            progress_reporter_pause(&progress, 0);
+        }
+        if (atomic_load(&job->cancelled)) {
+            av_log(NULL, AV_LOG_WARNING, "Job cancelled after %" PRId64 " packets\n", atomic_load(&job->packetsRead));
+            ret = AVERROR_EXIT;
+            goto end;
+        }
 
-    while (av_read_frame(decoder->formatContext, inputPacket) >= 0) {
+        if (testParameters.playlist) {
+            ret = playlist_read_packet(&playlist, decoder, inputPacket);
+            if (ret == PLAYLIST_NEXT) {
+                if (advance_playlist(decoder, encoder, &playlist, inputFrame, deferredPackets)) {
+                    av_log(NULL, AV_LOG_FATAL, "Failed to move on to the next playlist item\n");
+                    ret = -1;
+                    goto end;
+                }
+                continue;
+            }
+        } else {
+            ret = av_read_frame(decoder->formatContext, inputPacket);
+        }
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                metrics_error(METRICS_STAGE_DEMUX);
+            break;
+        }
 
-        if (decoder->formatContext->streams[inputPacket->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            av_log(NULL, AV_LOG_INFO, "Video\n");
-            if (transcode_video(decoder, encoder, inputPacket, inputFrame)) { return -1; }
+        /* Chunks are cut at keyframes, so the next one here is where the following chunk starts. */
+        if (decoder->ranged && inputPacket->stream_index == decoder->videoIndex &&
+            (inputPacket->flags & AV_PKT_FLAG_KEY) && inputPacket->pts != AV_NOPTS_VALUE &&
+            av_rescale_q(inputPacket->pts, decoder->videoStream->time_base, AV_TIME_BASE_Q) >= decoder->rangeEnd) {
             av_packet_unref(inputPacket);
-            av_log(NULL, AV_LOG_INFO, "Success\n");
-        } else if (decoder->formatContext->streams[inputPacket->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            av_log(NULL, AV_LOG_INFO, "Audio\n");
-            if (transcode_audio(decoder, encoder, inputPacket, inputFrame)) { return -1; }
-            av_packet_unref(inputPacket);
-            av_log(NULL, AV_LOG_INFO, "Success\n");
-        } else {
-            av_log(NULL, AV_LOG_INFO, "Ignoring non audio or video packet\n");
+            break;
+        }
+
+        atomic_fetch_add(&job->packetsRead, 1);
+        if (inputPacket->stream_index == decoder->videoIndex && inputPacket->pts != AV_NOPTS_VALUE)
+            atomic_store(&job->position, av_rescale_q(inputPacket->pts, decoder->videoStream->time_base, AV_TIME_BASE_Q));
+
+        if (progress_reporter_due(&progress)) {
+            progressSample.position = atomic_load(&job->position);
+            progressSample.duration = atomic_load(&job->duration);
+            progressSample.packets = atomic_load(&job->packetsRead);
+            progressSample.frames = encoder->framesWritten;
+            progressSample.bytes = encoder->bytesWritten;
+            progress_reporter_publish(&progress, &progressSample);
+        }
+
+        if (process_input_packet(decoder, encoder, inputPacket, inputFrame, deferredPackets)) {
+            ret = -1;
+            goto end;
         }
         av_packet_unref(inputPacket);
     }
+    ret = -1;
 
-    if (encode_video(decoder, encoder, NULL)) {
-        return -1;
+    if (drain_deferred_packets(decoder, encoder, inputFrame, deferredPackets, 1)) {
+        goto end;
+    }
+
+    if (flush_video(decoder, encoder, inputFrame)) {
+        goto end;
+    }
+
+    if (encoder->speedController) {
+        speed_controller_log(encoder->speedController);
+    }
+
+    if (encoder->overlay) {
+        av_log(NULL, AV_LOG_INFO, "Overlay blended into %" PRId64 " frames\n", encoder->overlay->blendedFrames);
+    }
+
+    if (packet_interleaver_finish_stream(&interleaver, encoder->videoStream->index) < 0) {
+        goto end;
+    }
+
+    if (transcode_audio(decoder, encoder, NULL, inputFrame)) {
+        goto end;
+    }
+    for (int track = 0; track < decoder->nbAudioStreams; track++) {
+        int streamIndex = decoder->audioTrackIndexes[track];
+
+        if (decoder->filters[streamIndex].filterGraph &&
+            filter_encode_audio(decoder, encoder, NULL, streamIndex)) {
+            goto end;
+        }
+
+        if (encode_audio(decoder, encoder, NULL, streamIndex, 1)) {
+            goto end;
+        }
+    }
+
+    if (scheduling) {
+        filter_scheduler_stop(&filterScheduler);
+        filter_scheduler_log(&filterScheduler);
+        if (testParameters.schedulerStatsFile) {
+            filter_scheduler_write_stats(&filterScheduler, testParameters.schedulerStatsFile);
+        }
+    }
+
+    if (packet_interleaver_flush(&interleaver) < 0) {
+        goto end;
+    }
+    packet_interleaver_log_stats(&interleaver);
+
+    memory_budget_log(&memoryBudget);
+    numa_log(&numaPlacement);
+    startup_profile_log(&startupProfile);
+    if (testParameters.startupProfileFile) {
+        startup_profile_write(&startupProfile, testParameters.startupProfileFile);
     }
 
     av_write_trailer(encoder->formatContext);
+    headerWritten = 0;
+
+    if (encoder->checkpoint) {
+        avio_closep(&encoder->formatContext->pb);
+        if (checkpoint_finish(encoder->checkpoint) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to join the checkpoint segments into %s\n", encoder->filename);
+            goto end;
+        }
+        encoder->checkpoint = NULL;
+    }
+    ret = 0;
+
+    end:
+    if (probing) {
+        pthread_join(probe.thread, NULL);
+    }
+    if (scheduling) {
+        filter_scheduler_uninit(&filterScheduler);
+    }
+    if (encoder && encoder->speedController) {
+        speed_controller_uninit(encoder->speedController);
+        encoder->speedController = NULL;
+    }
+    if (encoder && encoder->overlay) {
+        graphics_overlay_uninit(encoder->overlay);
+        encoder->overlay = NULL;
+    }
+    packet_interleaver_uninit(&interleaver);
+    for (int i = 0; i < 2; i++) {
+        AVPacket *deferred;
+        while (deferredPackets[i] && av_fifo_read(deferredPackets[i], &deferred, 1) >= 0)
+            av_packet_free(&deferred);
+        av_fifo_freep2(&deferredPackets[i]);
+    }
+    if (admitted) {
+        admission_release(testParameters.admissionLedger, admissionToken);
+    }
 
     if (muxerOps != NULL) {
         av_dict_free(&muxerOps);
         muxerOps = NULL;
     }
 
-    if (inputFrame != NULL) {
-        av_frame_free(&inputFrame);
-        inputFrame = NULL;
+    if (decoder) {
+        free_filters(decoder);
+        avformat_close_input(&decoder->formatContext);
+        avcodec_free_context(&decoder->videoCodecContext);
+        free_audio_tracks(decoder);
     }
-
-    if (inputPacket != NULL) {
-        av_packet_free(&inputPacket);
-        inputPacket = NULL;
+    if (encoder) {
+        /* A failed job still closes its output, but only a finished one gets a trailer. */
+        if (headerWritten)
+            av_log(NULL, AV_LOG_WARNING, "Output %s is incomplete\n", encoder->filename);
+        free_output_context(&encoder->formatContext);
+        /* Nothing but the header was written, so a job refused or failed before admission leaves no output behind. */
+        if (provisionalOutput) {
+            if (unlink(encoder->filename) == 0)
+                av_log(NULL, AV_LOG_WARNING, "Removed %s, written before the job was admitted\n", encoder->filename);
+            else
+                av_log(NULL, AV_LOG_WARNING, "Could not remove %s: %s\n", encoder->filename, strerror(errno));
+        }
+        avcodec_free_context(&encoder->videoCodecContext);
+        free_audio_tracks(encoder);
+        finish_rate_control_pass(encoder, ret < 0);
     }
 
-    avformat_close_input(&decoder->formatContext);
+    playlist_uninit(&playlist);
 
-    avformat_free_context(decoder->formatContext);
-    decoder->formatContext = NULL;
-    avformat_free_context(encoder->formatContext);
-    encoder->formatContext = NULL;
+    /* Only once the encoder and filters have dropped every frame that points into the ring. */
+    if (decoder && decoder->frameRing) {
+        frame_ring_log(decoder->frameRing);
+        frame_ring_close(decoder->frameRing);
+    }
 
-    avcodec_free_context(&decoder->videoCodecContext);
-    decoder->videoCodecContext = NULL;
-    avcodec_free_context(&decoder->audioCodecContext);
-    decoder->audioCodecContext = NULL;
+    if (encoder) {
+        progressSample.position = atomic_load(&job->position);
+        progressSample.duration = atomic_load(&job->duration);
+        progressSample.packets = atomic_load(&job->packetsRead);
+        progressSample.frames = encoder->framesWritten;
+        progressSample.bytes = encoder->bytesWritten;
+        progress_reporter_publish(&progress, &progressSample);
+    }
+    progress_reporter_finish(&progress, ret >= 0 ? TESTBED_JOB_FINISHED :
+                                        ret == AVERROR_EXIT ? TESTBED_JOB_CANCELLED : TESTBED_JOB_FAILED);
+    progress_reporter_uninit(&progress);
+    metrics_add(METRICS_JOBS_RUNNING, -1);
 
     free(decoder);
-    decoder = NULL;
-    free(encoder); encoder = NULL;
+    free(encoder);
 
+    return ret;
+}
+
+
+TestbedJob *testbed_job_create(const StreamingParams *params, const char *inputFilename, const char *outputFilename) {
+    TestbedJob *job = av_mallocz(sizeof(*job));
+    if (!job)
+        return NULL;
+    pthread_mutex_init(&job->pauseLock, NULL);
+    pthread_cond_init(&job->pauseCond, NULL);
+
+    job->params = *params;
+    job->inputFilename = av_strdup(inputFilename);
+    if (params->outputExtension)
+        job->outputFilename = av_asprintf("%s%c", outputFilename, params->outputExtension);
+    else
+        job->outputFilename = av_strdup(outputFilename);
+    if (!job->inputFilename || !job->outputFilename) {
+        testbed_job_free(&job);
+        return NULL;
+    }
+
+    atomic_init(&job->state, TESTBED_JOB_PENDING);
+    atomic_init(&job->cancelled, 0);
+    atomic_init(&job->packetsRead, 0);
+    atomic_init(&job->position, AV_NOPTS_VALUE);
+    atomic_init(&job->duration, AV_NOPTS_VALUE);
+    atomic_init(&job->startTime, 0);
+    atomic_init(&job->endTime, 0);
+    atomic_init(&job->paused, 0);
+    atomic_init(&job->pausedTime, 0);
+    return job;
+}
+
+
+#ifdef __linux__
+/* Nice value added for each priority class. Going below the daemon's own needs CAP_SYS_NICE, so high is best effort. */
+static const int job_priority_nice[TESTBED_PRIORITIES] = { 10, 0, -5 };
+#endif
+
+static void *placed_job_thread(void *opaque) {
+    TestbedJob *job = opaque;
+#ifdef __linux__
+    pid_t thread = syscall(SYS_gettid);
+    int nice = getpriority(PRIO_PROCESS, thread) + job_priority_nice[job->params.jobPriority];
+
+    if (job_priority_nice[job->params.jobPriority] && setpriority(PRIO_PROCESS, thread, nice) < 0)
+        av_log(NULL, AV_LOG_VERBOSE, "Could not set nice %d for job %s\n", nice, job->inputFilename);
+#endif
+    job->result = run_job(job);
+    return NULL;
+}
+
+
+/*
+ * On Linux a thread's nice value, CPU affinity and memory policy are its own and are inherited by the threads it
+ * starts, so a job at another priority or bound to a NUMA node runs on a thread of its own: its codec, filter and
+ * probe threads get the same share of the CPU and the same placement, and the caller's thread, which can't have
+ * its nice value lowered again without privilege, keeps its own once the job is done.
+ */
+static int run_job_at_priority(TestbedJob *job) {
+    pthread_t thread;
+    int ownThread = job->params.numaNode >= 0;
+
+    job->params.jobPriority = av_clip(job->params.jobPriority, 0, TESTBED_PRIORITIES - 1);
+#ifdef __linux__
+    ownThread |= job_priority_nice[job->params.jobPriority] != 0;
+#endif
+    if (!ownThread)
+        return run_job(job);
+
+    if (pthread_create(&thread, NULL, placed_job_thread, job) != 0) {
+        /* Binding the caller would leave it on the node after the job, so only the nice value is best effort. */
+        if (job->params.numaNode >= 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start a thread for job %s on NUMA node %d\n",
+                   job->inputFilename, job->params.numaNode);
+            return AVERROR(EAGAIN);
+        }
+        return run_job(job);
+    }
+    pthread_join(thread, NULL);
+    return job->result;
+}
+
+
+int testbed_job_run(TestbedJob *job) {
+    int expected = TESTBED_JOB_PENDING;
+    int ret;
+
+    if (!atomic_compare_exchange_strong(&job->state, &expected, TESTBED_JOB_RUNNING))
+        return AVERROR(EINVAL);
+    atomic_store(&job->startTime, av_gettime_relative());
+
+    ret = atomic_load(&job->cancelled) ? AVERROR_EXIT : run_job_at_priority(job);
+
+    job->result = ret;
+    atomic_store(&job->endTime, av_gettime_relative());
+    if (ret == AVERROR_EXIT && atomic_load(&job->cancelled))
+        atomic_store(&job->state, TESTBED_JOB_CANCELLED);
+    else
+        atomic_store(&job->state, ret < 0 ? TESTBED_JOB_FAILED : TESTBED_JOB_FINISHED);
+    return ret;
+}
+
+
+static void *job_thread(void *opaque) {
+    testbed_job_run(opaque);
+    return NULL;
+}
+
+
+int testbed_job_start(TestbedJob *job) {
+    if (job->threaded || atomic_load(&job->state) != TESTBED_JOB_PENDING)
+        return AVERROR(EINVAL);
+    if (pthread_create(&job->thread, NULL, job_thread, job) != 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not start a thread for job %s\n", job->inputFilename);
+        return AVERROR(EAGAIN);
+    }
+    job->threaded = 1;
     return 0;
-}
\ No newline at end of file
+}
+
+
+void testbed_job_cancel(TestbedJob *job) {
+    pthread_mutex_lock(&job->pauseLock);
+    atomic_store(&job->cancelled, 1);
+    pthread_cond_broadcast(&job->pauseCond);
+    pthread_mutex_unlock(&job->pauseLock);
+}
+
+
+void testbed_job_pause(TestbedJob *job) {
+    atomic_store(&job->paused, 1);
+}
+
+
+void testbed_job_resume(TestbedJob *job) {
+    pthread_mutex_lock(&job->pauseLock);
+    atomic_store(&job->paused, 0);
+    pthread_cond_broadcast(&job->pauseCond);
+    pthread_mutex_unlock(&job->pauseLock);
+}
+
+
+void testbed_job_poll(TestbedJob *job, TestbedJobStatus *status) {
+    int64_t startTime = atomic_load(&job->startTime);
+    int64_t endTime = atomic_load(&job->endTime);
+
+    status->state = atomic_load(&job->state);
+    status->result = status->state >= TESTBED_JOB_FINISHED ? job->result : 0;
+    status->packetsRead = atomic_load(&job->packetsRead);
+    status->position = atomic_load(&job->position);
+    status->duration = atomic_load(&job->duration);
+    status->paused = atomic_load(&job->paused) && status->state == TESTBED_JOB_RUNNING;
+    status->pausedTime = atomic_load(&job->pausedTime);
+    if (!startTime)
+        status->elapsed = 0;
+    else
+        status->elapsed = (endTime ? endTime : av_gettime_relative()) - startTime;
+}
+
+
+int testbed_job_wait(TestbedJob *job) {
+    if (job->threaded) {
+        pthread_join(job->thread, NULL);
+        job->threaded = 0;
+    }
+    return atomic_load(&job->state) >= TESTBED_JOB_FINISHED ? job->result : AVERROR(EINVAL);
+}
+
+
+void testbed_job_free(TestbedJob **job) {
+    if (!*job)
+        return;
+    if ((*job)->threaded) {
+        testbed_job_cancel(*job);
+        testbed_job_wait(*job);
+    }
+    av_freep(&(*job)->inputFilename);
+    av_freep(&(*job)->outputFilename);
+    pthread_mutex_destroy(&(*job)->pauseLock);
+    pthread_cond_destroy(&(*job)->pauseCond);
+    av_freep(job);
+}
@@ -0,0 +1,247 @@
+#ifndef TESTBED_H
+#define TESTBED_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <libavfilter/avfilter.h>
+
+#include <stdio.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+#include "resample.h"
+
+
+enum TestbedPriority {
+    TESTBED_PRIORITY_LOW,
+    TESTBED_PRIORITY_NORMAL,
+    TESTBED_PRIORITY_HIGH,
+    TESTBED_PRIORITIES,
+};
+
+typedef struct StreamingParams {
+    int copyVideo;
+    int copyAudio;
+    char outputExtension;
+    char *muxerOptKey;
+    char *muxerOptValue;
+    enum AVCodecID videoCodec;
+    enum AVCodecID audioCodec;
+    /* Audio tracks transcoded, in the input's order, each with its own decoder, filters and encoder. */
+    int audioStreams;
+    int audioChannels;
+    int audioSampleRate;
+    enum AVSampleFormat audioSampleFormat;
+    int audioOutputBitRate;
+    AVChannelLayout audioOutputChannelLayout;
+    char *codecPrivKey;
+    char *codecPrivValue;
+    char *videoPreset;
+    int frameHeight;
+    int frameWidth;
+    /* 0 for constant quality, at videoCrf or the encoder's default. */
+    int outputBitRate;
+    int videoCrf;
+    int bitstreamBufferSize;
+    int minBitRate;
+    int maxBitRate;
+    AVRational pixelAspectRatio;
+    AVRational frameRate;
+    enum AVPixelFormat videoPixelFormat;
+    int twoPass;
+    char *statsCacheDir;
+    int perTitleBitrate;
+    int complexitySegments;
+    int complexitySegmentFrames;
+    enum AVFieldOrder outputFieldOrder;
+    char *deinterlacer;
+    int filterThreads;
+    int fieldOrderSampleFrames;
+    enum ResampleQuality resampleQuality;
+    int64_t maxInterleaveDelta;
+    int64_t interleaveBufferSize;
+    int64_t jobMemoryLimit;
+    int64_t hostMemoryLimit;
+    char *admissionLedger;
+    int admissionMaxWait;
+    int numaNode;
+    char *traceFile;
+    int traceCapacity;
+    int checkpointInterval;
+    char *coordinatorAddress;
+    int coordinatorPort;
+    int chunkSeconds;
+    int localWorkers;
+    int chunkRetries;
+    int64_t chunkStart;
+    int64_t chunkEnd;
+    char *frameRing;
+    int frameRingSlots;
+    int frameRingConsumers;
+    /* Seconds the publisher waits for its consumers, 0 for as long as it takes. */
+    int frameRingConsumerWait;
+    double targetFps;
+    char *speedMetricsFile;
+    int sweepFrames;
+    char *playlist;
+    char *overlayAsset;
+    int overlayX;
+    int overlayY;
+    int overlayPremultiplied;
+    int filterWorkers;
+    char *schedulerStatsFile;
+    int overlapStartup;
+    char *startupProfileFile;
+    char *daemonSocket;
+    int daemonWorkers;
+    int daemonProgressInterval;
+    int jobPriority;
+    int daemonJobSlots;
+    char *progressBoard;
+    int progressBoardSlots;
+    char *progressFile;
+    int progressInterval;
+    char *metricsAddress;
+    int metricsPort;
+} StreamingParams;
+
+/* Audio tracks transcoded at most, whatever StreamingParams.audioStreams asks for. */
+#define TESTBED_MAX_AUDIO_TRACKS 32
+
+typedef struct StreamingContext {
+    AVFormatContext *formatContext;
+    AVCodec *videoCodec;
+    AVCodec *audioCodec;
+    AVStream *videoStream;
+    AVStream *audioStream;
+    AVCodecContext *videoCodecContext;
+    AVCodecContext *audioCodecContext;
+    AVChannelLayout *audioChannelLayout;
+    int videoIndex;
+    int audioIndex;
+    int nbVideoStreams;
+    int nbAudioStreams;
+    /*
+     * Every audio track, each with its own decoder or encoder and filter graph: the input's audio streams in
+     * order, or the output streams made for them. audioStream, audioCodecContext and audioIndex are the first.
+     */
+    AVStream *audioTracks[TESTBED_MAX_AUDIO_TRACKS];
+    AVCodecContext *audioTrackContexts[TESTBED_MAX_AUDIO_TRACKS];
+    int audioTrackIndexes[TESTBED_MAX_AUDIO_TRACKS];
+    char *filename;
+    int videoPass;
+    char *videoStatsPath;
+    char *videoStatsIn;
+    FILE *videoStatsFile;
+    enum AVFieldOrder fieldOrder;
+    struct PacketInterleaver *interleaver;
+    struct MemoryBudget *memoryBudget;
+    struct Checkpoint *checkpoint;
+    int resuming;
+    int64_t skipBefore;
+    int ranged;
+    int64_t rangeEnd;
+    struct FrameRing *frameRing;
+    struct SpeedController *speedController;
+    struct GraphicsOverlay *overlay;
+    struct FilteringContext *filters;
+    struct StartupProfile *startupProfile;
+    int64_t framesWritten;
+    int64_t bytesWritten;
+    int nbFilters;
+    const StreamingParams *streamParameters;
+} StreamingContext;
+
+typedef struct FilteringContext {
+    AVFilterContext *buffersinkContext;
+    AVFilterContext *buffersrcContext;
+    AVFilterGraph *filterGraph;
+
+    AVPacket *encodePacket;
+    AVFrame *filteredFrame;
+
+    struct PixelConverter *pixelConverter;
+    AVFrame *convertedFrame;
+
+    struct AudioResampler *resampler;
+    struct AudioFrameAdapter *frameAdapter;
+
+    struct FilterStrand *strand;
+} FilteringContext;
+
+
+int open_media(AVFormatContext **inputFormatContext, const char *inputFilename);
+int fill_stream_info(AVStream *inputStream, AVCodec **inputCodec, AVCodecContext **inputCodecContext);
+int prepare_decoder(StreamingContext *decoder);
+int audio_track(const StreamingContext *decoder, int streamIndex);
+void free_audio_tracks(StreamingContext *context);
+int prepare_video_encoder(StreamingContext *encoder, AVCodecContext *inputCodecContext, AVRational inputFramerate, StreamingParams streamParameters);
+int prepare_audio_encoder(StreamingContext *encoder, StreamingContext *decoder, StreamingParams *streamParameters);
+int prepare_copy(AVFormatContext *formatContext, AVStream **avStream, AVCodecParameters *decoderParameters);
+int remux(AVPacket **packet, AVFormatContext **formatContext, AVRational decoderTimebase, AVRational encoderTimebase);
+int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame);
+int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame, int streamIndex, int flush);
+int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame);
+int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *inputPacket, AVFrame *inputFrame);
+int flush_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *inputFrame);
+int init_filter(FilteringContext* filterContext, AVCodecContext *decodeContext,
+                AVCodecContext *encodeContext, const char *filterSpec, int nbThreads);
+int init_filters(AVFormatContext *inputFormatContext, StreamingContext *decoder, StreamingContext *encoder, StreamingParams *streamParameters);
+void free_filters(StreamingContext *decoder);
+
+/*
+ * Jobs: one transcode with all of its state behind a handle, so a long-lived
+ * process can run several at once. testbed_job_create() copies the parameters
+ * and filenames, but the strings the parameters point to are borrowed and must
+ * outlive the job. testbed_job_run() runs the job on the calling thread and
+ * testbed_job_start() on a new one, to be collected with testbed_job_wait().
+ * testbed_job_cancel() is safe from any thread: the job stops at the next
+ * packet, with AVERROR_EXIT, and leaves an incomplete output behind.
+ * testbed_job_pause() holds a running job at the next packet with all of its
+ * state kept, until testbed_job_resume(). testbed_job_poll() can be called at
+ * any time for progress.
+ *
+ * StreamingParams.jobPriority is the job's class. On Linux, low priority jobs
+ * run niced, and their codec and filter threads with them, so they get less
+ * CPU than normal and high priority jobs on the same host.
+ *
+ * Tracing is process wide, so it is started and written by whoever owns the
+ * process rather than by a job.
+ */
+typedef struct TestbedJob TestbedJob;
+
+enum TestbedJobState {
+    TESTBED_JOB_PENDING,
+    TESTBED_JOB_RUNNING,
+    TESTBED_JOB_FINISHED,
+    TESTBED_JOB_FAILED,
+    TESTBED_JOB_CANCELLED,
+};
+
+typedef struct TestbedJobStatus {
+    enum TestbedJobState state;
+    int result;
+    int64_t packetsRead;
+    /* Input position and duration in AV_TIME_BASE units, AV_NOPTS_VALUE until known. */
+    int64_t position;
+    int64_t duration;
+    /* Microseconds since the job started running, and how much of that it spent paused. */
+    int64_t elapsed;
+    int paused;
+    int64_t pausedTime;
+} TestbedJobStatus;
+
+void testbed_default_params(StreamingParams *params);
+TestbedJob *testbed_job_create(const StreamingParams *params, const char *inputFilename, const char *outputFilename);
+int testbed_job_run(TestbedJob *job);
+int testbed_job_start(TestbedJob *job);
+void testbed_job_cancel(TestbedJob *job);
+void testbed_job_pause(TestbedJob *job);
+void testbed_job_resume(TestbedJob *job);
+void testbed_job_poll(TestbedJob *job, TestbedJobStatus *status);
+int testbed_job_wait(TestbedJob *job);
+void testbed_job_free(TestbedJob **job);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include "libavutil/mem.h"
+
+#include "trace.h"
+
+atomic_int trace_enabled;
+
+static TraceEvent *trace_events;
+static int trace_capacity;
+static atomic_uint_fast64_t trace_next;
+static atomic_int trace_next_thread;
+static _Thread_local int trace_thread_id;
+static int64_t trace_start;
+
+
+int trace_init(int capacity) {
+    trace_events = av_calloc(capacity, sizeof(*trace_events));
+    if (!trace_events)
+        return AVERROR(ENOMEM);
+
+    trace_capacity = capacity;
+    atomic_store(&trace_next, 0);
+    trace_start = av_gettime_relative();
+    atomic_store(&trace_enabled, 1);
+    return 0;
+}
+
+
+void trace_event(const char *name, const char *category, char phase) {
+    uint64_t slot = atomic_fetch_add_explicit(&trace_next, 1, memory_order_relaxed);
+    TraceEvent *event = &trace_events[slot % trace_capacity];
+
+    /* Small sequential ids read better in the viewer than OS thread ids. */
+    if (!trace_thread_id)
+        trace_thread_id = atomic_fetch_add_explicit(&trace_next_thread, 1, memory_order_relaxed) + 1;
+
+    event->name = name;
+    event->category = category;
+    event->timestamp = av_gettime_relative() - trace_start;
+    event->threadId = trace_thread_id;
+    event->phase = phase;
+}
+
+
+int trace_write(const char *filename) {
+    uint64_t total = atomic_load(&trace_next);
+    uint64_t first = total > (uint64_t)trace_capacity ? total - trace_capacity : 0;
+    FILE *file;
+
+    if (!trace_events)
+        return 0;
+
+    file = fopen(filename, "w");
+    if (!file) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open trace file %s\n", filename);
+        return AVERROR(EIO);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (uint64_t i = first; i < total; i++) {
+        const TraceEvent *event = &trace_events[i % trace_capacity];
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d}",
+                i == first ? "" : ",\n", event->name, event->category, event->phase,
+                event->timestamp, (int)getpid(), event->threadId);
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0)
+        return AVERROR(EIO);
+
+    av_log(NULL, AV_LOG_INFO, "Wrote %" PRIu64 " trace events to %s (%" PRIu64 " overwritten)\n",
+           total - first, filename, first);
+    return 0;
+}
+
+
+void trace_uninit(void) {
+    atomic_store(&trace_enabled, 0);
+    av_freep(&trace_events);
+    trace_capacity = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Timeline of transcode stages in Chrome trace JSON, for chrome://tracing
+ * and ui.perfetto.dev.
+ *
+ * Recording is off unless trace_init() is called, which the command line does
+ * for --trace <file>, ahead of any mode, the daemon's included. Each TRACE_BEGIN/TRACE_END
+ * claims a slot in a preallocated ring with one atomic increment and fills it
+ * in, so threads never wait on each other and nothing is allocated while the
+ * job runs. Once the ring wraps the oldest events are overwritten, which keeps
+ * the most recent window of a long job. trace_write() must only be called
+ * after the threads being traced have stopped.
+ */
+
+typedef struct TraceEvent {
+    const char *name;
+    const char *category;
+    int64_t timestamp;
+    int threadId;
+    char phase;
+} TraceEvent;
+
+extern atomic_int trace_enabled;
+
+int trace_init(int capacity);
+void trace_event(const char *name, const char *category, char phase);
+int trace_write(const char *filename);
+void trace_uninit(void);
+
+#define TRACE_BEGIN(name, category) \
+    do { if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) trace_event(name, category, 'B'); } while (0)
+#define TRACE_END(name, category) \
+    do { if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) trace_event(name, category, 'E'); } while (0)
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Checks every pixel converter kernel this CPU supports against a reference:
+ * swscale for progressive frames, and a plain same-field row sum for
+ * interlaced frames, which swscale has no equivalent of. Sizes include odd
+ * widths so the SIMD tails and odd chroma widths are covered.
+ * Exits non-zero on any mismatch.
+ */
+
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pixconvert.h"
+
+
+static const struct {
+    enum AVPixelFormat srcFormat;
+    enum AVPixelFormat dstFormat;
+} pairs[] = {
+    { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P10LE },
+    { AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV420P10LE },
+    { AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV422P10LE },
+};
+
+static const struct {
+    int width;
+    int height;
+} sizes[] = {
+    { 1920, 1080 },
+    { 1918, 1080 },
+    { 720, 576 },
+    { 35, 18 },
+    { 17, 6 },
+};
+
+static const enum PixelConvertKernel kernels[] = {
+    PIXEL_CONVERT_KERNEL_SCALAR, PIXEL_CONVERT_KERNEL_SSE2, PIXEL_CONVERT_KERNEL_AVX2,
+};
+
+
+static AVFrame *alloc_frame(int width, int height, enum AVPixelFormat format) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return NULL;
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+
+static void fill_frame(AVFrame *frame, uint32_t *seed) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+        int rows = plane ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < width; x++) {
+                *seed = *seed * 1664525 + 1013904223;
+                frame->data[plane][y * frame->linesize[plane] + x] = *seed >> 24;
+            }
+        }
+    }
+}
+
+
+/*
+ * Interlaced reference: chroma row y of the output sums rows 2 * (y / 2) and
+ * 2 * (y / 2) + 1 of its field, clamped to the field's last row.
+ */
+static void convert_interlaced_reference(AVFrame *dst, const AVFrame *src) {
+    const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(src->format);
+    const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(dst->format);
+
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane ? AV_CEIL_RSHIFT(src->width, srcDesc->log2_chroma_w) : src->width;
+        int srcRows = plane ? AV_CEIL_RSHIFT(src->height, srcDesc->log2_chroma_h) : src->height;
+        int dstRows = plane ? AV_CEIL_RSHIFT(dst->height, dstDesc->log2_chroma_h) : dst->height;
+
+        for (int y = 0; y < dstRows; y++) {
+            uint16_t *out = (uint16_t *)(dst->data[plane] + y * dst->linesize[plane]);
+            const uint8_t *in0, *in1;
+
+            if (srcRows == dstRows) {
+                in0 = in1 = src->data[plane] + y * src->linesize[plane];
+            } else {
+                int field = y & 1;
+                int fieldRows = (srcRows - field + 1) / 2;
+                int first = FFMIN(2 * (y >> 1), fieldRows - 1);
+                int second = FFMIN(first + 1, fieldRows - 1);
+
+                in0 = src->data[plane] + (field + 2 * first) * src->linesize[plane];
+                in1 = src->data[plane] + (field + 2 * second) * src->linesize[plane];
+            }
+
+            for (int x = 0; x < width; x++)
+                out[x] = (in0[x] + in1[x]) << 1;
+        }
+    }
+}
+
+
+static int compare_frames(const AVFrame *a, const AVFrame *b, int *mismatchPlane, int *mismatchRow) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+
+    for (int plane = 0; plane < 3; plane++) {
+        int bytes = 2 * (plane ? AV_CEIL_RSHIFT(a->width, desc->log2_chroma_w) : a->width);
+        int rows = plane ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+
+        for (int y = 0; y < rows; y++) {
+            if (memcmp(a->data[plane] + y * a->linesize[plane], b->data[plane] + y * b->linesize[plane], bytes)) {
+                *mismatchPlane = plane;
+                *mismatchRow = y;
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static int make_reference(AVFrame *reference, const AVFrame *src) {
+    PixelConverter converter;
+    int ret;
+
+    if (src->interlaced_frame) {
+        convert_interlaced_reference(reference, src);
+        return 0;
+    }
+
+    if ((ret = pixel_converter_init(&converter, src->width, src->height, src->format, AVCOL_RANGE_MPEG,
+                                    reference->format, PIXEL_CONVERT_KERNEL_SWSCALE)) < 0)
+        return ret;
+    ret = pixel_converter_convert(&converter, reference, src);
+    pixel_converter_uninit(&converter);
+    return ret;
+}
+
+
+static int run_case(int width, int height, int pair, int interlaced, uint32_t *seed) {
+    AVFrame *src = alloc_frame(width, height, pairs[pair].srcFormat);
+    AVFrame *reference = alloc_frame(width, height, pairs[pair].dstFormat);
+    AVFrame *dst = alloc_frame(width, height, pairs[pair].dstFormat);
+    int failures = 0;
+
+    if (!src || !reference || !dst) {
+        fprintf(stderr, "Cannot allocate %dx%d frames\n", width, height);
+        failures = 1;
+        goto end;
+    }
+
+    fill_frame(src, seed);
+    src->interlaced_frame = interlaced;
+    if (make_reference(reference, src) < 0) {
+        fprintf(stderr, "Cannot build the reference for %dx%d\n", width, height);
+        failures = 1;
+        goto end;
+    }
+
+    for (int k = 0; k < FF_ARRAY_ELEMS(kernels); k++) {
+        PixelConverter converter;
+        int plane, row;
+
+        if (pixel_converter_init(&converter, width, height, pairs[pair].srcFormat, AVCOL_RANGE_MPEG,
+                                 pairs[pair].dstFormat, kernels[k]) < 0)
+            continue;
+
+        if (pixel_converter_convert(&converter, dst, src) < 0 || !compare_frames(reference, dst, &plane, &row)) {
+            fprintf(stderr, "FAIL %s -> %s %dx%d %s %s: plane %d row %d\n",
+                    av_get_pix_fmt_name(pairs[pair].srcFormat), av_get_pix_fmt_name(pairs[pair].dstFormat),
+                    width, height, interlaced ? "interlaced" : "progressive",
+                    pixel_convert_kernel_name(kernels[k]), plane, row);
+            failures++;
+        }
+        pixel_converter_uninit(&converter);
+    }
+
+end:
+    av_frame_free(&src);
+    av_frame_free(&reference);
+    av_frame_free(&dst);
+    return failures;
+}
+
+
+int main(void) {
+    uint32_t seed = 0x2545f491;
+    int failures = 0;
+
+    for (int k = 0; k < FF_ARRAY_ELEMS(kernels); k++) {
+        PixelConverter converter;
+
+        if (pixel_converter_init(&converter, 16, 16, AV_PIX_FMT_YUV420P, AVCOL_RANGE_MPEG,
+                                 AV_PIX_FMT_YUV420P10LE, kernels[k]) < 0) {
+            printf("%s kernel not supported on this CPU, skipped\n", pixel_convert_kernel_name(kernels[k]));
+            continue;
+        }
+        pixel_converter_uninit(&converter);
+    }
+
+    for (int s = 0; s < FF_ARRAY_ELEMS(sizes); s++) {
+        for (int pair = 0; pair < FF_ARRAY_ELEMS(pairs); pair++) {
+            failures += run_case(sizes[s].width, sizes[s].height, pair, 0, &seed);
+            failures += run_case(sizes[s].width, sizes[s].height, pair, 1, &seed);
+        }
+    }
+
+    printf("%d mismatches\n", failures);
+    return failures ? 1 : 0;
+}